@@ -17,23 +17,36 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include <cassert>
+#include <cerrno>
+#include <cinttypes>
 #include <climits>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <dirent.h>
 #include <getopt.h>
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
 
 // libmbcommon
 #include <mbcommon/common.h>
+#include <mbcommon/file.h>
+#include <mbcommon/file/filename.h>
 #include <mbcommon/libc/stdio.h>
 
 // libmbbootimg
@@ -119,6 +132,7 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "Available commands:\n" \
     "  unpack         Unpack a boot image\n" \
     "  pack           Assemble boot image from unpacked files\n" \
+    "  batch          Inspect, unpack, or repack many boot images in parallel\n" \
     "\n" \
     "Pass -h/--help as a argument to a command to see it's available options.\n"
 
@@ -227,6 +241,66 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "        bootimgtool pack boot.img -i /tmp/android --input-kernel /tmp/newkernel\n" \
     "\n"
 
+#define HELP_BATCH_USAGE \
+    "Usage: bootimgtool batch <manifest file | directory> [<option>...]\n" \
+    "\n" \
+    "Options:\n" \
+    "  -j, --jobs <jobs>\n" \
+    "                  Number of images to process in parallel\n" \
+    "                  (number of CPUs if unspecified)\n" \
+    "  -m, --mode <mode>\n" \
+    "                  Action to perform on each image (info if unspecified)\n" \
+    "                  (one of: info, unpack, repack)\n" \
+    "  -o, --output <output directory>\n" \
+    "                  Output directory (required for unpack and repack)\n" \
+    "  -t, --type <type>\n" \
+    "                  Input type of the boot images (autodetect if unspecified)\n" \
+    "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "  --output-type <type>\n" \
+    "                  Output type for repack (input type if unspecified)\n" \
+    "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
+    "\n" \
+    "The input is either a directory, in which case every regular file in it is\n" \
+    "processed, or a manifest file containing one boot image path per line. Empty\n" \
+    "lines and lines that begin with '#' are ignored.\n" \
+    "\n" \
+    "Modes:\n" \
+    "\n" \
+    "  info    Read every image and entry without writing anything\n" \
+    "  unpack  Unpack each image to <output directory>/<image name>/, using the\n" \
+    "          same file layout as the unpack command with no prefix\n" \
+    "  repack  Repack (or convert with --output-type) each image to\n" \
+    "          <output directory>/<image name>\n" \
+    "\n" \
+    "Output:\n" \
+    "\n" \
+    "One JSON object is written to stdout per image, on a single line, as soon as\n" \
+    "the image is processed. The order of the lines is not guaranteed to match the\n" \
+    "input order. Each object contains the following keys:\n" \
+    "\n" \
+    "  path     Input path\n" \
+    "  status   \"ok\" or \"error\"\n" \
+    "  error    Error message (only if status is \"error\")\n" \
+    "  format   Detected boot image format\n" \
+    "  size     Size of the input file\n" \
+    "  header   Header fields (addresses are absolute)\n" \
+    "  entries  List of {type, offset, size, sha1} objects for each entry in the\n" \
+    "           input file. For repack, entries are listed in output order.\n" \
+    "  output   Output path (only for unpack and repack)\n" \
+    "\n" \
+    "The command exits with a failure status if any image fails to process.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Print metadata for every boot image in a directory using 8 threads\n" \
+    "\n" \
+    "        bootimgtool batch images/ -j 8 > metadata.jsonl\n" \
+    "\n" \
+    "2. Convert the images listed in a manifest to plain Android boot images\n" \
+    "\n" \
+    "        bootimgtool batch list.txt -m repack -o out --output-type android\n" \
+    "\n"
+
 template <typename F>
 class Finally {
 public:
@@ -1212,6 +1286,870 @@ bool pack_main(int argc, char *argv[])
     return true;
 }
 
+struct BatchOptions
+{
+    std::string mode;
+    std::string output_dir;
+    const char *input_type;
+    const char *output_type;
+};
+
+struct BatchEntryInfo
+{
+    int type;
+    uint64_t offset;
+    uint64_t size;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+};
+
+static const char * entry_type_name(int type)
+{
+    switch (type) {
+    case MB_BI_ENTRY_KERNEL:             return IMAGE_KERNEL;
+    case MB_BI_ENTRY_RAMDISK:            return IMAGE_RAMDISK;
+    case MB_BI_ENTRY_SECONDBOOT:         return IMAGE_SECOND;
+    case MB_BI_ENTRY_DEVICE_TREE:        return IMAGE_DT;
+    case MB_BI_ENTRY_ABOOT:              return IMAGE_ABOOT;
+    case MB_BI_ENTRY_MTK_KERNEL_HEADER:  return IMAGE_KERNEL_MTKHDR;
+    case MB_BI_ENTRY_MTK_RAMDISK_HEADER: return IMAGE_RAMDISK_MTKHDR;
+    case MB_BI_ENTRY_SONY_IPL:           return IMAGE_IPL;
+    case MB_BI_ENTRY_SONY_RPM:           return IMAGE_RPM;
+    case MB_BI_ENTRY_SONY_APPSBL:        return IMAGE_APPSBL;
+    default:                             return nullptr;
+    }
+}
+
+static std::string json_string(const char *str)
+{
+    std::string result("\"");
+
+    for (const char *p = str; *p; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+
+        switch (c) {
+        case '"':  result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\b': result += "\\b";  break;
+        case '\f': result += "\\f";  break;
+        case '\n': result += "\\n";  break;
+        case '\r': result += "\\r";  break;
+        case '\t': result += "\\t";  break;
+        default:
+            if (c < 0x20) {
+                char buf[7];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                result += buf;
+            } else {
+                result += static_cast<char>(c);
+            }
+            break;
+        }
+    }
+
+    result += '"';
+    return result;
+}
+
+static std::string json_string(const std::string &str)
+{
+    return json_string(str.c_str());
+}
+
+static std::string json_uint(uint64_t value)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%" PRIu64, value);
+    return buf;
+}
+
+static std::string hex_digest(const unsigned char *digest, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+
+    result.reserve(size * 2);
+    for (size_t i = 0; i < size; ++i) {
+        result += digits[(digest[i] >> 4) & 0xf];
+        result += digits[digest[i] & 0xf];
+    }
+
+    return result;
+}
+
+static std::string header_to_json(MbBiHeader *header)
+{
+    std::string json("{");
+    bool first = true;
+
+    auto add = [&](const char *key, const std::string &value) {
+        if (!first) {
+            json += ',';
+        }
+        first = false;
+        json += json_string(key);
+        json += ':';
+        json += value;
+    };
+
+    const char *cmdline = mb_bi_header_kernel_cmdline(header);
+    const char *board_name = mb_bi_header_board_name(header);
+
+    if (cmdline) {
+        add(FIELD_CMDLINE, json_string(cmdline));
+    }
+    if (board_name) {
+        add(FIELD_BOARD, json_string(board_name));
+    }
+    if (mb_bi_header_page_size_is_set(header)) {
+        add(FIELD_PAGE_SIZE, json_uint(mb_bi_header_page_size(header)));
+    }
+    if (mb_bi_header_kernel_address_is_set(header)) {
+        add("kernel_address", json_uint(
+                mb_bi_header_kernel_address(header)));
+    }
+    if (mb_bi_header_ramdisk_address_is_set(header)) {
+        add("ramdisk_address", json_uint(
+                mb_bi_header_ramdisk_address(header)));
+    }
+    if (mb_bi_header_secondboot_address_is_set(header)) {
+        add("second_address", json_uint(
+                mb_bi_header_secondboot_address(header)));
+    }
+    if (mb_bi_header_kernel_tags_address_is_set(header)) {
+        add("tags_address", json_uint(
+                mb_bi_header_kernel_tags_address(header)));
+    }
+    if (mb_bi_header_sony_ipl_address_is_set(header)) {
+        add(FIELD_IPL_ADDRESS, json_uint(
+                mb_bi_header_sony_ipl_address(header)));
+    }
+    if (mb_bi_header_sony_rpm_address_is_set(header)) {
+        add(FIELD_RPM_ADDRESS, json_uint(
+                mb_bi_header_sony_rpm_address(header)));
+    }
+    if (mb_bi_header_sony_appsbl_address_is_set(header)) {
+        add(FIELD_APPSBL_ADDRESS, json_uint(
+                mb_bi_header_sony_appsbl_address(header)));
+    }
+    if (mb_bi_header_entrypoint_address_is_set(header)) {
+        add(FIELD_ENTRYPOINT, json_uint(
+                mb_bi_header_entrypoint_address(header)));
+    }
+
+    json += '}';
+    return json;
+}
+
+static bool copy_header(MbBiHeader *src, MbBiHeader *dest, std::string &error)
+{
+    int ret = MB_BI_OK;
+
+    // Fields that the output format does not support are silently dropped
+    auto check = [&](const char *field) {
+        if (ret < 0 && ret != MB_BI_UNSUPPORTED) {
+            error = "Failed to set field: ";
+            error += field;
+            return false;
+        }
+        ret = MB_BI_OK;
+        return true;
+    };
+
+    const char *cmdline = mb_bi_header_kernel_cmdline(src);
+    const char *board_name = mb_bi_header_board_name(src);
+
+    if (cmdline) {
+        ret = mb_bi_header_set_kernel_cmdline(dest, cmdline);
+    }
+    if (!check(FIELD_CMDLINE)) return false;
+    if (board_name) {
+        ret = mb_bi_header_set_board_name(dest, board_name);
+    }
+    if (!check(FIELD_BOARD)) return false;
+    if (mb_bi_header_page_size_is_set(src)) {
+        ret = mb_bi_header_set_page_size(
+                dest, mb_bi_header_page_size(src));
+    }
+    if (!check(FIELD_PAGE_SIZE)) return false;
+    if (mb_bi_header_kernel_address_is_set(src)) {
+        ret = mb_bi_header_set_kernel_address(
+                dest, mb_bi_header_kernel_address(src));
+    }
+    if (!check(FIELD_KERNEL_OFFSET)) return false;
+    if (mb_bi_header_ramdisk_address_is_set(src)) {
+        ret = mb_bi_header_set_ramdisk_address(
+                dest, mb_bi_header_ramdisk_address(src));
+    }
+    if (!check(FIELD_RAMDISK_OFFSET)) return false;
+    if (mb_bi_header_secondboot_address_is_set(src)) {
+        ret = mb_bi_header_set_secondboot_address(
+                dest, mb_bi_header_secondboot_address(src));
+    }
+    if (!check(FIELD_SECOND_OFFSET)) return false;
+    if (mb_bi_header_kernel_tags_address_is_set(src)) {
+        ret = mb_bi_header_set_kernel_tags_address(
+                dest, mb_bi_header_kernel_tags_address(src));
+    }
+    if (!check(FIELD_TAGS_OFFSET)) return false;
+    if (mb_bi_header_sony_ipl_address_is_set(src)) {
+        ret = mb_bi_header_set_sony_ipl_address(
+                dest, mb_bi_header_sony_ipl_address(src));
+    }
+    if (!check(FIELD_IPL_ADDRESS)) return false;
+    if (mb_bi_header_sony_rpm_address_is_set(src)) {
+        ret = mb_bi_header_set_sony_rpm_address(
+                dest, mb_bi_header_sony_rpm_address(src));
+    }
+    if (!check(FIELD_RPM_ADDRESS)) return false;
+    if (mb_bi_header_sony_appsbl_address_is_set(src)) {
+        ret = mb_bi_header_set_sony_appsbl_address(
+                dest, mb_bi_header_sony_appsbl_address(src));
+    }
+    if (!check(FIELD_APPSBL_ADDRESS)) return false;
+    if (mb_bi_header_entrypoint_address_is_set(src)) {
+        ret = mb_bi_header_set_entrypoint_address(
+                dest, mb_bi_header_entrypoint_address(src));
+    }
+    if (!check(FIELD_ENTRYPOINT)) return false;
+
+    return true;
+}
+
+/*!
+ * \brief Read the current entry's data, hashing it and optionally copying it
+ *
+ * \param bir Reader positioned at the entry to read
+ * \param file File offset of the entry data is determined from this handle
+ * \param fp If not null, the data is written to this file
+ * \param biw If not null, the data is written to this writer
+ * \param buf Scratch buffer
+ * \param info Entry info to fill in
+ * \param error Error message if the function fails
+ */
+static bool batch_copy_entry_data(MbBiReader *bir, MbFile *file, FILE *fp,
+                                  MbBiWriter *biw, std::vector<char> &buf,
+                                  BatchEntryInfo &info, std::string &error)
+{
+    SHA_CTX sha_ctx;
+    size_t n;
+    int ret;
+
+    if (mb_file_seek(file, 0, SEEK_CUR, &info.offset) != MB_FILE_OK) {
+        error = "Failed to get entry offset: ";
+        error += mb_file_error_string(file);
+        return false;
+    }
+
+    info.size = 0;
+    SHA1_Init(&sha_ctx);
+
+    while ((ret = mb_bi_reader_read_data(bir, buf.data(), buf.size(), &n))
+            == MB_BI_OK) {
+        SHA1_Update(&sha_ctx, buf.data(), n);
+        info.size += n;
+
+        if (fp && fwrite(buf.data(), 1, n, fp) != n) {
+            error = "Failed to write data: ";
+            error += strerror(errno);
+            return false;
+        }
+
+        if (biw) {
+            size_t bytes_written;
+
+            if (mb_bi_writer_write_data(biw, buf.data(), n, &bytes_written)
+                    != MB_BI_OK || bytes_written != n) {
+                error = "Failed to write entry data: ";
+                error += mb_bi_writer_error_string(biw);
+                return false;
+            }
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        error = "Failed to read entry data: ";
+        error += mb_bi_reader_error_string(bir);
+        return false;
+    }
+
+    SHA1_Final(info.digest, &sha_ctx);
+
+    return true;
+}
+
+static bool batch_unpack_entries(const BatchOptions &opts, MbBiReader *bir,
+                                 MbFile *file, MbBiHeader *header,
+                                 const std::string &input_file,
+                                 std::vector<BatchEntryInfo> &entries,
+                                 std::string &output, std::string &error)
+{
+    std::vector<char> buf(1024 * 1024);
+    Paths paths;
+    MbBiEntry *entry;
+    int ret;
+
+    if (opts.mode == "unpack") {
+        output = io::pathJoin({opts.output_dir, io::baseName(input_file)});
+
+        if (!io::createDirectories(output)) {
+            error = "Failed to create directory: ";
+            error += io::lastErrorString();
+            return false;
+        }
+
+        prepend_if_empty(paths, output, std::string());
+
+        if (!write_header(paths.header, header)) {
+            error = "Failed to write header";
+            return false;
+        }
+    }
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        BatchEntryInfo info;
+        ScopedFILE fp(nullptr, fclose);
+
+        info.type = mb_bi_entry_type(entry);
+
+        if (opts.mode == "unpack") {
+            const char *name = entry_type_name(info.type);
+            if (!name) {
+                error = "Unknown entry type: " + json_uint(info.type);
+                return false;
+            }
+
+            std::string path = io::pathJoin({output, name});
+
+            fp.reset(fopen(path.c_str(), "wb"));
+            if (!fp) {
+                error = path + ": Failed to open for writing: ";
+                error += strerror(errno);
+                return false;
+            }
+        }
+
+        if (!batch_copy_entry_data(bir, file, fp.get(), nullptr, buf, info,
+                                   error)) {
+            return false;
+        }
+
+        if (fp && fclose(fp.release()) < 0) {
+            error = "Failed to close file: ";
+            error += strerror(errno);
+            return false;
+        }
+
+        entries.push_back(info);
+    }
+
+    if (ret != MB_BI_EOF) {
+        error = "Failed to read entry: ";
+        error += mb_bi_reader_error_string(bir);
+        return false;
+    }
+
+    return true;
+}
+
+// Opening the writer truncates the output, so it must never be the input
+static bool batch_is_same_file(const std::string &a, const std::string &b)
+{
+    struct stat sb_a;
+    struct stat sb_b;
+
+    if (stat(a.c_str(), &sb_a) == 0 && stat(b.c_str(), &sb_b) == 0
+            && sb_a.st_dev == sb_b.st_dev && sb_a.st_ino == sb_b.st_ino) {
+        return true;
+    }
+
+    char *real_a = realpath(a.c_str(), nullptr);
+    char *real_b = realpath(b.c_str(), nullptr);
+    bool same = real_a && real_b && strcmp(real_a, real_b) == 0;
+
+    free(real_a);
+    free(real_b);
+
+    return same;
+}
+
+static bool batch_repack_entries(const BatchOptions &opts, MbBiReader *bir,
+                                 MbFile *file, MbBiHeader *header,
+                                 const std::string &input_file,
+                                 std::vector<BatchEntryInfo> &entries,
+                                 std::string &output, std::string &error)
+{
+    std::vector<char> buf(1024 * 1024);
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *out_header;
+    MbBiEntry *out_entry;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        error = "Failed to allocate writer: ";
+        error += strerror(errno);
+        return false;
+    }
+
+    const char *type = opts.output_type
+            ? opts.output_type : mb_bi_reader_format_name(bir);
+
+    ret = mb_bi_writer_set_format_by_name(biw.get(), type);
+    if (ret != MB_BI_OK) {
+        error = "Invalid boot image type: ";
+        error += type;
+        return false;
+    }
+
+    output = io::pathJoin({opts.output_dir, io::baseName(input_file)});
+
+    if (batch_is_same_file(input_file, output)) {
+        error = "Output would overwrite the input: " + output;
+        return false;
+    }
+
+    ret = mb_bi_writer_open_filename(biw.get(), output.c_str());
+    if (ret != MB_BI_OK) {
+        error = "Failed to open for writing: ";
+        error += mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    ret = mb_bi_writer_get_header(biw.get(), &out_header);
+    if (ret != MB_BI_OK) {
+        error = "Failed to get header instance: ";
+        error += mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    if (!copy_header(header, out_header, error)) {
+        return false;
+    }
+
+    ret = mb_bi_writer_write_header(biw.get(), out_header);
+    if (ret != MB_BI_OK) {
+        error = "Failed to write header: ";
+        error += mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    // The output format decides the order of the entries, so seek to each one
+    // in the input instead of reading them sequentially
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &out_entry)) == MB_BI_OK) {
+        BatchEntryInfo info;
+
+        info.type = mb_bi_entry_type(out_entry);
+
+        ret = mb_bi_writer_write_entry(biw.get(), out_entry);
+        if (ret != MB_BI_OK) {
+            error = "Failed to write entry: ";
+            error += mb_bi_writer_error_string(biw.get());
+            return false;
+        }
+
+        ret = mb_bi_reader_go_to_entry(bir, &entry, info.type);
+        if (ret == MB_BI_EOF) {
+            // Entries are optional
+            continue;
+        } else if (ret != MB_BI_OK) {
+            error = "Failed to seek to entry: ";
+            error += mb_bi_reader_error_string(bir);
+            return false;
+        }
+
+        if (!batch_copy_entry_data(bir, file, nullptr, biw.get(), buf, info,
+                                   error)) {
+            return false;
+        }
+
+        entries.push_back(info);
+    }
+
+    if (ret != MB_BI_EOF) {
+        error = "Failed to get next entry: ";
+        error += mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    ret = mb_bi_writer_close(biw.get());
+    if (ret != MB_BI_OK) {
+        error = "Failed to close boot image: ";
+        error += mb_bi_writer_error_string(biw.get());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Process a single image in batch mode
+ *
+ * \param[in] opts Batch options
+ * \param[in] input_file Path to boot image
+ * \param[out] json JSON object (without trailing newline) describing the
+ *                  result, regardless of whether processing succeeded
+ *
+ * \return Whether the image was successfully processed
+ */
+static bool batch_process_image(const BatchOptions &opts,
+                                const std::string &input_file,
+                                std::string &json)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    MbFile *file = nullptr;
+    MbBiHeader *header = nullptr;
+    std::vector<BatchEntryInfo> entries;
+    std::string output;
+    std::string error;
+    uint64_t file_size = 0;
+    bool ok = false;
+    int ret;
+
+    auto result = [&]() {
+        json = "{";
+        json += "\"path\":" + json_string(input_file);
+        json += ",\"status\":";
+        json += ok ? "\"ok\"" : "\"error\"";
+        if (!ok) {
+            json += ",\"error\":" + json_string(error);
+        }
+        if (header) {
+            json += ",\"format\":" + json_string(
+                    mb_bi_reader_format_name(bir.get()));
+            json += ",\"size\":" + json_uint(file_size);
+            json += ",\"header\":" + header_to_json(header);
+            json += ",\"entries\":[";
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it != entries.begin()) {
+                    json += ',';
+                }
+                const char *name = entry_type_name(it->type);
+                json += "{\"type\":" + json_string(name ? name : "unknown");
+                json += ",\"offset\":" + json_uint(it->offset);
+                json += ",\"size\":" + json_uint(it->size);
+                json += ",\"sha1\":\"" + hex_digest(
+                        it->digest, sizeof(it->digest)) + "\"}";
+            }
+            json += ']';
+        }
+        if (ok && !output.empty()) {
+            json += ",\"output\":" + json_string(output);
+        }
+        json += '}';
+        return ok;
+    };
+
+    if (!bir) {
+        error = "Failed to allocate reader: ";
+        error += strerror(errno);
+        return result();
+    }
+
+    if (opts.input_type) {
+        ret = mb_bi_reader_enable_format_by_name(bir.get(), opts.input_type);
+    } else {
+        ret = mb_bi_reader_enable_format_all(bir.get());
+    }
+    if (ret != MB_BI_OK) {
+        error = "Failed to enable formats: ";
+        error += mb_bi_reader_error_string(bir.get());
+        return result();
+    }
+
+    file = mb_file_new();
+    if (!file) {
+        error = "Failed to allocate file: ";
+        error += strerror(errno);
+        return result();
+    }
+
+    ret = mb_file_open_filename(file, input_file.c_str(),
+                                MB_FILE_OPEN_READ_ONLY);
+    if (ret == MB_FILE_OK) {
+        ret = mb_file_seek(file, 0, SEEK_END, &file_size);
+    }
+    if (ret != MB_FILE_OK) {
+        error = "Failed to open for reading: ";
+        error += mb_file_error_string(file);
+        mb_file_free(file);
+        return result();
+    }
+
+    // The reader takes ownership of the file, even on failure
+    ret = mb_bi_reader_open(bir.get(), file, true);
+    if (ret != MB_BI_OK) {
+        error = "Failed to open for reading: ";
+        error += mb_bi_reader_error_string(bir.get());
+        return result();
+    }
+
+    ret = mb_bi_reader_read_header(bir.get(), &header);
+    if (ret != MB_BI_OK) {
+        header = nullptr;
+        error = "Failed to read header: ";
+        error += mb_bi_reader_error_string(bir.get());
+        return result();
+    }
+
+    if (opts.mode == "repack") {
+        ok = batch_repack_entries(opts, bir.get(), file, header, input_file,
+                                  entries, output, error);
+    } else {
+        ok = batch_unpack_entries(opts, bir.get(), file, header, input_file,
+                                  entries, output, error);
+    }
+
+    return result();
+}
+
+static bool batch_load_manifest(const std::string &path,
+                                std::vector<std::string> &inputs)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    auto free_line = finally([&]{
+        free(line);
+    });
+
+    while ((read = mb_getline(&line, &len, fp.get())) >= 0) {
+        // Strip newline
+        while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+            line[--read] = '\0';
+        }
+
+        char *ptr = line;
+
+        // Skip leading whitespace
+        while (*ptr && isspace(*ptr)) {
+            ++ptr;
+        }
+
+        // Skip empty and commented lines
+        if (*ptr == '\0' || *ptr == '#') {
+            continue;
+        }
+
+        inputs.push_back(ptr);
+    }
+
+    if (ferror(fp.get())) {
+        fprintf(stderr, "%s: Failed to read file: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool batch_load_directory(const std::string &path,
+                                 std::vector<std::string> &inputs)
+{
+    DIR *dp = opendir(path.c_str());
+    if (!dp) {
+        fprintf(stderr, "%s: Failed to open directory: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_dp = finally([&]{
+        closedir(dp);
+    });
+
+    struct dirent *ent;
+    struct stat sb;
+
+    while ((errno = 0, ent = readdir(dp))) {
+        std::string file_path = io::pathJoin({path, ent->d_name});
+
+        if (stat(file_path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+            inputs.push_back(std::move(file_path));
+        }
+    }
+
+    if (errno != 0) {
+        fprintf(stderr, "%s: Failed to read directory: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Keep the output order stable between runs
+    std::sort(inputs.begin(), inputs.end());
+
+    return true;
+}
+
+// Unpacked and repacked images are named after the input file, so two inputs
+// with the same file name would be written to the same path
+static bool batch_check_output_names(const std::vector<std::string> &inputs)
+{
+    std::unordered_map<std::string, const std::string *> names;
+    bool ret = true;
+
+    for (auto const &input : inputs) {
+        auto result = names.emplace(io::baseName(input), &input);
+        if (!result.second) {
+            fprintf(stderr, "%s: Output name conflicts with %s\n",
+                    input.c_str(), result.first->second->c_str());
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+bool batch_main(int argc, char *argv[])
+{
+    int opt;
+    unsigned long jobs = std::thread::hardware_concurrency();
+    std::string input;
+    BatchOptions opts;
+
+    opts.mode = "info";
+    opts.input_type = nullptr;
+    opts.output_type = nullptr;
+
+    // Arguments with no short options
+    enum batch_options : int
+    {
+        OPT_OUTPUT_TYPE = 10000 + 1,
+    };
+
+    static const char short_options[] = "j:m:o:t:" "h";
+
+    static struct option long_options[] = {
+        // Arguments with short versions
+        {"jobs",        required_argument, 0, 'j'},
+        {"mode",        required_argument, 0, 'm'},
+        {"output",      required_argument, 0, 'o'},
+        {"type",        required_argument, 0, 't'},
+        // Arguments without short versions
+        {"output-type", required_argument, 0, OPT_OUTPUT_TYPE},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'j':
+            if (!str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'm':             opts.mode = optarg;              break;
+        case 'o':             opts.output_dir = optarg;        break;
+        case 't':             opts.input_type = optarg;        break;
+        case OPT_OUTPUT_TYPE: opts.output_type = optarg;       break;
+
+        case 'h':
+            fputs(HELP_BATCH_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_BATCH_USAGE, stderr);
+            return false;
+        }
+    }
+
+    // There should be one other argument
+    if (argc - optind != 1) {
+        fputs(HELP_BATCH_USAGE, stderr);
+        return false;
+    }
+
+    input = argv[optind];
+
+    if (opts.mode != "info" && opts.mode != "unpack"
+            && opts.mode != "repack") {
+        fprintf(stderr, "Invalid mode: %s\n", opts.mode.c_str());
+        return false;
+    }
+
+    if (opts.mode != "info") {
+        if (opts.output_dir.empty()) {
+            fprintf(stderr, "An output directory is required for mode: %s\n",
+                    opts.mode.c_str());
+            return false;
+        }
+
+        if (!io::createDirectories(opts.output_dir)) {
+            fprintf(stderr, "%s: Failed to create directory: %s\n",
+                    opts.output_dir.c_str(), io::lastErrorString().c_str());
+            return false;
+        }
+    }
+
+    std::vector<std::string> inputs;
+    struct stat sb;
+
+    if (stat(input.c_str(), &sb) < 0) {
+        fprintf(stderr, "%s: Failed to stat: %s\n",
+                input.c_str(), strerror(errno));
+        return false;
+    } else if (S_ISDIR(sb.st_mode)) {
+        if (!batch_load_directory(input, inputs)) {
+            return false;
+        }
+    } else if (!batch_load_manifest(input, inputs)) {
+        return false;
+    }
+
+    if (opts.mode != "info" && !batch_check_output_names(inputs)) {
+        return false;
+    }
+
+    // Each worker pulls the next image from the list and has its own reader
+    // and writer. Only the output is shared.
+    std::atomic<size_t> next(0);
+    std::atomic<bool> all_ok(true);
+    std::mutex output_lock;
+    std::vector<std::thread> workers;
+
+    auto worker = [&]() {
+        size_t i;
+
+        while ((i = next++) < inputs.size()) {
+            std::string json;
+
+            if (!batch_process_image(opts, inputs[i], json)) {
+                all_ok = false;
+            }
+            json += '\n';
+
+            std::lock_guard<std::mutex> guard(output_lock);
+            fputs(json.c_str(), stdout);
+            fflush(stdout);
+        }
+    };
+
+    jobs = std::min<unsigned long>(std::max<unsigned long>(jobs, 1),
+                                   std::max<size_t>(inputs.size(), 1));
+
+    for (unsigned long i = 1; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    return all_ok;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -1226,6 +2164,8 @@ int main(int argc, char *argv[])
         ret = unpack_main(--argc, ++argv);
     } else if (command == "pack") {
         ret = pack_main(--argc, ++argv);
+    } else if (command == "batch") {
+        ret = batch_main(--argc, ++argv);
     } else {
         fputs(HELP_MAIN_USAGE, stderr);
         return EXIT_FAILURE;
@@ -26,6 +26,7 @@
 #include <jansson.h>
 #include <yaml-cpp/yaml.h>
 
+#include "mbdevice/db.h"
 #include "mbdevice/json.h"
 #include "mbdevice/validate.h"
 
@@ -201,6 +202,62 @@ static bool validate(const char *path, const char *json, bool is_array)
     return true;
 }
 
+static bool write_db(const char *path, json_t *json_root)
+{
+    MbDeviceJsonError error;
+    void *data;
+    size_t size;
+    bool ret = true;
+
+    char *json = json_dumps(json_root, JSON_COMPACT);
+    Device **devices = mb_device_new_list_from_json(json, &error);
+    free(json);
+
+    if (!devices) {
+        print_json_error(path, &error);
+        return false;
+    }
+
+    if (mb_device_db_write(devices, &data, &size) != MB_DEVICE_OK) {
+        fprintf(stderr, "%s: Failed to build device database: %s\n",
+                path, strerror(errno));
+        ret = false;
+    }
+
+    for (Device **iter = devices; *iter; ++iter) {
+        mb_device_free(*iter);
+    }
+    free(devices);
+
+    if (!ret) {
+        return false;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open file: %s\n",
+                path, strerror(errno));
+        free(data);
+        return false;
+    }
+
+    if (fwrite(data, 1, size, fp) != size) {
+        fprintf(stderr, "%s: Failed to write device database: %s\n",
+                path, strerror(errno));
+        ret = false;
+    }
+
+    free(data);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                path, strerror(errno));
+        ret = false;
+    }
+
+    return ret;
+}
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
@@ -209,6 +266,7 @@ static void usage(FILE *stream)
             "Options:\n"
             "  -o, --output <file>\n"
             "                   Output file (outputs to stdout if omitted)\n"
+            "  -d, --db <file>  Also write binary device database to file\n"
             "  -h, --help       Display this help message\n"
             "  --styled         Output in human-readable format\n");
 }
@@ -221,11 +279,12 @@ int main(int argc, char *argv[])
         OPT_STYLED             = 1000,
     };
 
-    static const char short_options[] = "o:h";
+    static const char short_options[] = "o:d:h";
 
     static struct option long_options[] = {
         {"styled", no_argument, 0, OPT_STYLED},
         {"output", required_argument, 0, 'o'},
+        {"db", required_argument, 0, 'd'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -233,6 +292,7 @@ int main(int argc, char *argv[])
     int long_index = 0;
 
     const char *output_file = nullptr;
+    const char *db_file = nullptr;
     bool styled = false;
 
     while ((opt = getopt_long(argc, argv, short_options,
@@ -246,6 +306,10 @@ int main(int argc, char *argv[])
             output_file = optarg;
             break;
 
+        case 'd':
+            db_file = optarg;
+            break;
+
         case 'h':
             usage(stdout);
             return EXIT_SUCCESS;
@@ -291,6 +355,10 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (db_file && !write_db(db_file, json_root)) {
+        return EXIT_FAILURE;
+    }
+
     FILE *fp = stdout;
 
     if (output_file) {
@@ -22,6 +22,7 @@
 
 #include <cassert>
 
+#include <mbdevice/db.h>
 #include <mbdevice/json.h>
 #include <mbdevice/validate.h>
 #include <mbp/errors.h>
@@ -426,6 +427,37 @@ void MainWindow::populateDevices()
     Q_D(MainWindow);
 
     // TODO: This shouldn't be done in the GUI thread
+    auto addDevice = [d](Device *device) {
+        if (mb_device_validate(device) == 0) {
+            d->deviceSel->addItem(QStringLiteral("%1 - %2")
+                    .arg(QString::fromUtf8(mb_device_id(device)))
+                    .arg(QString::fromUtf8(mb_device_name(device))));
+            d->devices.emplace_back(device, mb_device_free);
+        } else {
+            // Clean up unusable devices
+            mb_device_free(device);
+        }
+    };
+
+    // Prefer the binary database if it exists
+    QString dbPath(QString::fromStdString(d->pc->dataDirectory())
+            % QStringLiteral("/devices.db"));
+    MbDeviceDb *db = mb_device_db_open(QFile::encodeName(dbPath).constData());
+
+    if (db) {
+        for (size_t i = 0; i < mb_device_db_count(db); ++i) {
+            Device *device = mb_device_db_get(db, i);
+            if (device) {
+                addDevice(device);
+            } else {
+                qWarning("%s: Failed to load device %zu",
+                         dbPath.toUtf8().data(), i);
+            }
+        }
+        mb_device_db_free(db);
+        return;
+    }
+
     QString path(QString::fromStdString(d->pc->dataDirectory())
             % QStringLiteral("/devices.json"));
     QFile file(path);
@@ -440,15 +472,7 @@ void MainWindow::populateDevices()
 
         if (devices) {
             for (Device **iter = devices; *iter; ++iter) {
-                if (mb_device_validate(*iter) == 0) {
-                    d->deviceSel->addItem(QStringLiteral("%1 - %2")
-                            .arg(QString::fromUtf8(mb_device_id(*iter)))
-                            .arg(QString::fromUtf8(mb_device_name(*iter))));
-                    d->devices.emplace_back(*iter, mb_device_free);
-                } else {
-                    // Clean up unusable devices
-                    mb_device_free(*iter);
-                }
+                addDevice(*iter);
             }
             // No need for array anymore
             free(devices);
@@ -666,6 +690,8 @@ static QString errorToString(const mbp::ErrorCode &error) {
         return QObject::tr("Failed to read archive data for file");
     case mbp::ErrorCode::ArchiveReadHeaderError:
         return QObject::tr("Failed to read archive entry header");
+    case mbp::ErrorCode::ArchiveChecksumError:
+        return QObject::tr("Archive checksum does not match");
     case mbp::ErrorCode::ArchiveWriteOpenError:
         return QObject::tr("Failed to open archive for writing");
     case mbp::ErrorCode::ArchiveWriteDataError:
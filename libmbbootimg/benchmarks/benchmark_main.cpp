@@ -0,0 +1,1131 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks for the libmbbootimg readers and writers.
+//
+// Synthetic boot images are generated for every format and every requested
+// payload size and page size. Each operation is then timed against both an
+// in-memory MbFile and a file descriptor-backed MbFile. All MbFile operations
+// go through a counting wrapper, so for the "file" backing, the reported
+// read/write/seek/truncate counts are the number of I/O syscalls issued by the
+// library. Note that file-backed images will normally be served from the page
+// cache.
+//
+// The results are written as JSON with a fixed key order so that the output
+// of two runs can be diffed directly.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <mbcommon/common.h>
+#include <mbcommon/endian.h>
+#include <mbcommon/file.h>
+#include <mbcommon/file/callbacks.h>
+#include <mbcommon/file/fd.h>
+#include <mbcommon/file/memory.h>
+#include <mbcommon/version.h>
+
+#include <mbbootimg/defs.h>
+#include <mbbootimg/entry.h>
+#include <mbbootimg/format/mtk_defs.h>
+#include <mbbootimg/header.h>
+#include <mbbootimg/reader.h>
+#include <mbbootimg/writer.h>
+
+#define BENCHMARK_SCHEMA_VERSION    1
+
+#define MIB                         (1024 * 1024)
+#define COPY_BUFFER_SIZE            (1 * MIB)
+
+// Synthetic aboot image for the Loki writer. The Loki patcher only needs the
+// base address at offset 12 and one of the known signature checking function
+// patterns at an offset that maps to a supported target.
+#define ABOOT_SIZE                  0x2000
+#define ABOOT_PATTERN_OFFSET        0x100
+#define ABOOT_PATTERN               "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7"
+#define ABOOT_PATTERN_SIZE          8
+#define ABOOT_CHECK_SIGS            0x88e0ff98
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+
+// Allocation counting. The benchmark interposes the C allocator so that
+// allocations made inside libmbbootimg and libmbcommon are counted as well.
+// This is only supported with glibc.
+
+static std::atomic<uint64_t> _alloc_count(0);
+static std::atomic<uint64_t> _alloc_bytes(0);
+
+#ifdef __GLIBC__
+#  define HAVE_ALLOC_COUNTING 1
+
+extern "C" {
+
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t nmemb, size_t size);
+void * __libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void * malloc(size_t size)
+{
+    ++_alloc_count;
+    _alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    ++_alloc_count;
+    _alloc_bytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void *ptr, size_t size)
+{
+    ++_alloc_count;
+    _alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+}
+#else
+#  define HAVE_ALLOC_COUNTING 0
+#endif
+
+
+// Counting MbFile wrapper
+
+struct IoCounters
+{
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t seeks;
+    uint64_t truncates;
+};
+
+struct CountingFile
+{
+    MbFile *inner;
+    IoCounters *counters;
+};
+
+static int _counting_read_cb(MbFile *file, void *userdata,
+                             void *buf, size_t size, size_t *bytes_read)
+{
+    CountingFile *cf = static_cast<CountingFile *>(userdata);
+
+    ++cf->counters->reads;
+
+    int ret = mb_file_read(cf->inner, buf, size, bytes_read);
+    if (ret != MB_FILE_OK) {
+        mb_file_set_error(file, mb_file_error(cf->inner), "%s",
+                          mb_file_error_string(cf->inner));
+    }
+    return ret;
+}
+
+static int _counting_write_cb(MbFile *file, void *userdata,
+                              const void *buf, size_t size,
+                              size_t *bytes_written)
+{
+    CountingFile *cf = static_cast<CountingFile *>(userdata);
+
+    ++cf->counters->writes;
+
+    int ret = mb_file_write(cf->inner, buf, size, bytes_written);
+    if (ret != MB_FILE_OK) {
+        mb_file_set_error(file, mb_file_error(cf->inner), "%s",
+                          mb_file_error_string(cf->inner));
+    }
+    return ret;
+}
+
+static int _counting_seek_cb(MbFile *file, void *userdata,
+                             int64_t offset, int whence, uint64_t *new_offset)
+{
+    CountingFile *cf = static_cast<CountingFile *>(userdata);
+
+    ++cf->counters->seeks;
+
+    int ret = mb_file_seek(cf->inner, offset, whence, new_offset);
+    if (ret != MB_FILE_OK) {
+        mb_file_set_error(file, mb_file_error(cf->inner), "%s",
+                          mb_file_error_string(cf->inner));
+    }
+    return ret;
+}
+
+static int _counting_truncate_cb(MbFile *file, void *userdata, uint64_t size)
+{
+    CountingFile *cf = static_cast<CountingFile *>(userdata);
+
+    ++cf->counters->truncates;
+
+    int ret = mb_file_truncate(cf->inner, size);
+    if (ret != MB_FILE_OK) {
+        mb_file_set_error(file, mb_file_error(cf->inner), "%s",
+                          mb_file_error_string(cf->inner));
+    }
+    return ret;
+}
+
+static bool open_counting_file(MbFile *file, CountingFile *cf)
+{
+    return mb_file_open_callbacks(file, nullptr, nullptr,
+                                  &_counting_read_cb, &_counting_write_cb,
+                                  &_counting_seek_cb, &_counting_truncate_cb,
+                                  cf) == MB_FILE_OK;
+}
+
+
+// Synthetic images
+
+enum class Backing
+{
+    MEMORY,
+    FILE,
+};
+
+struct SyntheticEntry
+{
+    int type;
+    std::vector<unsigned char> data;
+};
+
+struct SyntheticImage
+{
+    const char *format;
+    uint32_t page_size;
+    uint64_t payload_size;
+    std::vector<SyntheticEntry> entries;
+
+    // Generated image
+    std::vector<unsigned char> data;
+    std::string path;
+};
+
+static void fill_random(std::vector<unsigned char> &buf, uint64_t seed)
+{
+    // xorshift64 so the images are identical across runs and platforms
+    uint64_t x = seed ? seed : 0x9e3779b97f4a7c15ull;
+
+    for (size_t i = 0; i < buf.size(); ++i) {
+        if (i % 8 == 0) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+        }
+        buf[i] = static_cast<unsigned char>(x >> ((i % 8) * 8));
+    }
+}
+
+static void add_entry(SyntheticImage &image, int type, size_t size)
+{
+    SyntheticEntry entry;
+    entry.type = type;
+    entry.data.resize(size);
+    fill_random(entry.data, (static_cast<uint64_t>(type) << 32) ^ size);
+    image.entries.push_back(std::move(entry));
+}
+
+static void add_mtk_header_entry(SyntheticImage &image, int type,
+                                 const char *name)
+{
+    SyntheticEntry entry;
+    entry.type = type;
+    entry.data.assign(MTK_MAGIC_SIZE + 4 + MTK_TYPE_SIZE + MTK_UNUSED_SIZE,
+                      0xff);
+
+    // The size field is filled in by the writer
+    memcpy(entry.data.data(), MTK_MAGIC, MTK_MAGIC_SIZE);
+    memset(entry.data.data() + MTK_MAGIC_SIZE, 0, 4 + MTK_TYPE_SIZE);
+    memcpy(entry.data.data() + MTK_MAGIC_SIZE + 4, name, strlen(name));
+
+    image.entries.push_back(std::move(entry));
+}
+
+static void add_aboot_entry(SyntheticImage &image)
+{
+    SyntheticEntry entry;
+    entry.type = MB_BI_ENTRY_ABOOT;
+    entry.data.assign(ABOOT_SIZE, 0);
+
+    uint32_t base = mb_htole32(ABOOT_CHECK_SIGS - ABOOT_PATTERN_OFFSET + 0x28);
+    memcpy(entry.data.data() + 12, &base, sizeof(base));
+    memcpy(entry.data.data() + ABOOT_PATTERN_OFFSET, ABOOT_PATTERN,
+           ABOOT_PATTERN_SIZE);
+
+    image.entries.push_back(std::move(entry));
+}
+
+/*!
+ * \brief Create the entries for a synthetic image
+ *
+ * The payload is split between the kernel (1/4), the ramdisk (1/2), and the
+ * remaining format-specific entries (1/4).
+ */
+static void build_entries(SyntheticImage &image)
+{
+    size_t kernel_size = image.payload_size / 4;
+    size_t ramdisk_size = image.payload_size / 2;
+    size_t extra_size = image.payload_size - kernel_size - ramdisk_size;
+
+    if (strcmp(image.format, MB_BI_FORMAT_NAME_MTK) == 0) {
+        add_mtk_header_entry(image, MB_BI_ENTRY_MTK_KERNEL_HEADER, "KERNEL");
+        add_entry(image, MB_BI_ENTRY_KERNEL, kernel_size);
+        add_mtk_header_entry(image, MB_BI_ENTRY_MTK_RAMDISK_HEADER, "ROOTFS");
+        add_entry(image, MB_BI_ENTRY_RAMDISK, ramdisk_size);
+        add_entry(image, MB_BI_ENTRY_DEVICE_TREE, extra_size);
+    } else if (strcmp(image.format, MB_BI_FORMAT_NAME_SONY_ELF) == 0) {
+        add_entry(image, MB_BI_ENTRY_KERNEL, kernel_size);
+        add_entry(image, MB_BI_ENTRY_RAMDISK, ramdisk_size);
+        add_entry(image, MB_BI_ENTRY_SONY_IPL, extra_size / 3);
+        add_entry(image, MB_BI_ENTRY_SONY_RPM, extra_size / 3);
+        add_entry(image, MB_BI_ENTRY_SONY_APPSBL,
+                  extra_size - 2 * (extra_size / 3));
+    } else {
+        add_entry(image, MB_BI_ENTRY_KERNEL, kernel_size);
+        add_entry(image, MB_BI_ENTRY_RAMDISK, ramdisk_size);
+        add_entry(image, MB_BI_ENTRY_DEVICE_TREE, extra_size);
+
+        if (strcmp(image.format, MB_BI_FORMAT_NAME_LOKI) == 0) {
+            add_aboot_entry(image);
+        }
+    }
+}
+
+static bool set_header_fields(MbBiHeader *header, const SyntheticImage &image)
+{
+    uint64_t fields = mb_bi_header_supported_fields(header);
+
+    if ((fields & MB_BI_HEADER_FIELD_BOARD_NAME)
+            && mb_bi_header_set_board_name(header, "benchmark") != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_KERNEL_CMDLINE)
+            && mb_bi_header_set_kernel_cmdline(
+                    header, "console=null androidboot.hardware=qcom")
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_PAGE_SIZE)
+            && mb_bi_header_set_page_size(header, image.page_size)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_KERNEL_ADDRESS)
+            && mb_bi_header_set_kernel_address(header, 0x10008000)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_RAMDISK_ADDRESS)
+            && mb_bi_header_set_ramdisk_address(header, 0x11000000)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_SECONDBOOT_ADDRESS)
+            && mb_bi_header_set_secondboot_address(header, 0x10f00000)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_KERNEL_TAGS_ADDRESS)
+            && mb_bi_header_set_kernel_tags_address(header, 0x10000100)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_SONY_IPL_ADDRESS)
+            && mb_bi_header_set_sony_ipl_address(header, 0x00020000)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_SONY_RPM_ADDRESS)
+            && mb_bi_header_set_sony_rpm_address(header, 0x00200000)
+                    != MB_BI_OK) {
+        return false;
+    }
+    if ((fields & MB_BI_HEADER_FIELD_SONY_APPSBL_ADDRESS)
+            && mb_bi_header_set_sony_appsbl_address(header, 0x0f800000)
+                    != MB_BI_OK) {
+        return false;
+    }
+
+    return true;
+}
+
+static const SyntheticEntry * find_entry(const SyntheticImage &image, int type)
+{
+    for (const SyntheticEntry &entry : image.entries) {
+        if (entry.type == type) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+static bool write_image(const SyntheticImage &image, MbFile *file)
+{
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        fprintf(stderr, "Failed to allocate writer\n");
+        return false;
+    }
+
+    if (mb_bi_writer_set_format_by_name(biw.get(), image.format) != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), file, false) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK
+            || !set_header_fields(header, image)
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        goto error;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        const SyntheticEntry *se = find_entry(image, mb_bi_entry_type(entry));
+        size_t n;
+
+        if (se && mb_bi_entry_set_size(entry, se->data.size()) != MB_BI_OK) {
+            goto error;
+        }
+
+        if (mb_bi_writer_write_entry(biw.get(), entry) != MB_BI_OK) {
+            goto error;
+        }
+
+        if (se && !se->data.empty()
+                && (mb_bi_writer_write_data(biw.get(), se->data.data(),
+                                            se->data.size(), &n) != MB_BI_OK
+                || n != se->data.size())) {
+            goto error;
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        goto error;
+    }
+
+    return true;
+
+error:
+    fprintf(stderr, "%s: Failed to write synthetic image: %s\n",
+            image.format, mb_bi_writer_error_string(biw.get()));
+    return false;
+}
+
+static bool generate_image(SyntheticImage &image, const std::string &tmpdir)
+{
+    ScopedFile file(mb_file_new(), &mb_file_free);
+    void *buf = nullptr;
+    size_t size = 0;
+
+    build_entries(image);
+
+    if (!file || mb_file_open_memory_dynamic(file.get(), &buf, &size)
+            != MB_FILE_OK) {
+        fprintf(stderr, "Failed to open memory file\n");
+        return false;
+    }
+
+    bool ok = write_image(image, file.get());
+    file.reset();
+
+    if (ok) {
+        image.data.assign(static_cast<unsigned char *>(buf),
+                          static_cast<unsigned char *>(buf) + size);
+    }
+    free(buf);
+
+    if (!ok) {
+        return false;
+    }
+
+    // Drop the payloads now that they're in the image. The aboot image is
+    // kept because the Loki reader does not return it and repacking needs it.
+    for (SyntheticEntry &entry : image.entries) {
+        if (entry.type != MB_BI_ENTRY_ABOOT) {
+            std::vector<unsigned char>().swap(entry.data);
+        }
+    }
+
+    image.path = tmpdir + "/mbbootimg_benchmark_" + image.format + "_"
+            + std::to_string(image.payload_size) + "_"
+            + std::to_string(image.page_size) + ".img";
+
+    FILE *fp = fopen(image.path.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                image.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    ok = fwrite(image.data.data(), 1, image.data.size(), fp)
+            == image.data.size();
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: Failed to write: %s\n",
+                image.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+// Operations
+
+enum class Operation
+{
+    READ_HEADER,
+    READ_ENTRY,
+    UNPACK,
+    REPACK,
+};
+
+static const char * operation_name(Operation op)
+{
+    switch (op) {
+    case Operation::READ_HEADER: return "read_header";
+    case Operation::READ_ENTRY:  return "read_entry";
+    case Operation::UNPACK:      return "unpack";
+    case Operation::REPACK:      return "repack";
+    default:                     return nullptr;
+    }
+}
+
+struct Context
+{
+    const SyntheticImage *image;
+    Backing backing;
+    std::string repack_path;
+    std::vector<unsigned char> buf;
+
+    // Bytes of entry data processed during the last run
+    uint64_t bytes;
+};
+
+static bool open_input(Context &ctx, MbFile *file)
+{
+    if (ctx.backing == Backing::MEMORY) {
+        return mb_file_open_memory_static(file, ctx.image->data.data(),
+                                          ctx.image->data.size())
+                == MB_FILE_OK;
+    } else {
+        return mb_file_open_fd_filename(file, ctx.image->path.c_str(),
+                                        MB_FILE_OPEN_READ_ONLY) == MB_FILE_OK;
+    }
+}
+
+static bool open_reader(MbBiReader *bir, MbFile *file)
+{
+    if (mb_bi_reader_enable_format_all(bir) != MB_BI_OK
+            || mb_bi_reader_open(bir, file, false) != MB_BI_OK) {
+        fprintf(stderr, "Failed to open reader: %s\n",
+                mb_bi_reader_error_string(bir));
+        return false;
+    }
+    return true;
+}
+
+static bool run_read(Context &ctx, Operation op, IoCounters &counters)
+{
+    ScopedFile inner(mb_file_new(), &mb_file_free);
+    ScopedFile file(mb_file_new(), &mb_file_free);
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    CountingFile cf{inner.get(), &counters};
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!inner || !file || !bir || !open_input(ctx, inner.get())
+            || !open_counting_file(file.get(), &cf)
+            || !open_reader(bir.get(), file.get())) {
+        return false;
+    }
+
+    if (mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK) {
+        fprintf(stderr, "Failed to read header: %s\n",
+                mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    if (op == Operation::READ_HEADER) {
+        return true;
+    }
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        if (op != Operation::UNPACK) {
+            continue;
+        }
+
+        size_t n;
+        while ((ret = mb_bi_reader_read_data(bir.get(), ctx.buf.data(),
+                                             ctx.buf.size(), &n)) == MB_BI_OK) {
+            ctx.bytes += n;
+        }
+
+        if (ret != MB_BI_EOF) {
+            fprintf(stderr, "Failed to read entry data: %s\n",
+                    mb_bi_reader_error_string(bir.get()));
+            return false;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "Failed to read entry: %s\n",
+                mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    return true;
+}
+
+static bool run_repack(Context &ctx, IoCounters &counters)
+{
+    ScopedFile in_inner(mb_file_new(), &mb_file_free);
+    ScopedFile in_file(mb_file_new(), &mb_file_free);
+    ScopedFile out_inner(mb_file_new(), &mb_file_free);
+    ScopedFile out_file(mb_file_new(), &mb_file_free);
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    CountingFile in_cf{in_inner.get(), &counters};
+    CountingFile out_cf{out_inner.get(), &counters};
+    void *out_buf = nullptr;
+    size_t out_size = 0;
+    MbBiHeader *in_header;
+    MbBiHeader *out_header;
+    MbBiEntry *in_entry;
+    MbBiEntry *out_entry;
+    bool ok = false;
+    int ret;
+
+    if (!in_inner || !in_file || !out_inner || !out_file || !bir || !biw) {
+        return false;
+    }
+
+    if (ctx.backing == Backing::MEMORY) {
+        ret = mb_file_open_memory_dynamic(out_inner.get(), &out_buf, &out_size);
+    } else {
+        ret = mb_file_open_fd_filename(out_inner.get(),
+                                       ctx.repack_path.c_str(),
+                                       MB_FILE_OPEN_READ_WRITE_TRUNC);
+    }
+
+    if (ret != MB_FILE_OK || !open_input(ctx, in_inner.get())
+            || !open_counting_file(in_file.get(), &in_cf)
+            || !open_counting_file(out_file.get(), &out_cf)
+            || !open_reader(bir.get(), in_file.get())) {
+        goto done;
+    }
+
+    if (mb_bi_reader_read_header(bir.get(), &in_header) != MB_BI_OK
+            || mb_bi_writer_set_format_by_name(biw.get(), ctx.image->format)
+                    != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), out_file.get(), false) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &out_header) != MB_BI_OK) {
+        fprintf(stderr, "Failed to set up repack: %s%s\n",
+                mb_bi_reader_error_string(bir.get()),
+                mb_bi_writer_error_string(biw.get()));
+        goto done;
+    }
+
+    // The input was generated with the same header values
+    if (!set_header_fields(out_header, *ctx.image)
+            || mb_bi_writer_write_header(biw.get(), out_header) != MB_BI_OK) {
+        fprintf(stderr, "Failed to write header: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        goto done;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &out_entry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(out_entry);
+
+        if (mb_bi_writer_write_entry(biw.get(), out_entry) != MB_BI_OK) {
+            fprintf(stderr, "Failed to write entry: %s\n",
+                    mb_bi_writer_error_string(biw.get()));
+            goto done;
+        }
+
+        ret = mb_bi_reader_go_to_entry(bir.get(), &in_entry, type);
+        if (ret == MB_BI_EOF) {
+            const SyntheticEntry *se = find_entry(*ctx.image, type);
+            size_t n_written;
+
+            if (se && !se->data.empty()
+                    && (mb_bi_writer_write_data(biw.get(), se->data.data(),
+                                                se->data.size(), &n_written)
+                            != MB_BI_OK
+                    || n_written != se->data.size())) {
+                fprintf(stderr, "Failed to write entry data: %s\n",
+                        mb_bi_writer_error_string(biw.get()));
+                goto done;
+            }
+            continue;
+        } else if (ret != MB_BI_OK) {
+            fprintf(stderr, "Failed to seek to entry: %s\n",
+                    mb_bi_reader_error_string(bir.get()));
+            goto done;
+        }
+
+        size_t n;
+        size_t n_written;
+        while ((ret = mb_bi_reader_read_data(bir.get(), ctx.buf.data(),
+                                             ctx.buf.size(), &n)) == MB_BI_OK) {
+            if (mb_bi_writer_write_data(biw.get(), ctx.buf.data(), n,
+                                        &n_written) != MB_BI_OK
+                    || n_written != n) {
+                fprintf(stderr, "Failed to write entry data: %s\n",
+                        mb_bi_writer_error_string(biw.get()));
+                goto done;
+            }
+            ctx.bytes += n;
+        }
+
+        if (ret != MB_BI_EOF) {
+            fprintf(stderr, "Failed to read entry data: %s\n",
+                    mb_bi_reader_error_string(bir.get()));
+            goto done;
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        fprintf(stderr, "Failed to finish repack: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        goto done;
+    }
+
+    ok = true;
+
+done:
+    biw.reset();
+    out_file.reset();
+    out_inner.reset();
+    free(out_buf);
+    return ok;
+}
+
+
+// Measurement
+
+struct Result
+{
+    const char *format;
+    uint32_t page_size;
+    uint64_t payload_size;
+    uint64_t image_size;
+    const char *backing;
+    const char *operation;
+    unsigned int iterations;
+    uint64_t bytes;
+    uint64_t min_ns;
+    uint64_t median_ns;
+    uint64_t mean_ns;
+    double throughput_mib_s;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    IoCounters io;
+};
+
+static bool measure(Context &ctx, Operation op, unsigned int iterations,
+                    Result &result)
+{
+    std::vector<uint64_t> times;
+
+    result.iterations = iterations;
+    result.allocations = UINT64_MAX;
+    result.allocated_bytes = UINT64_MAX;
+    result.io = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+
+    // One untimed warm-up run
+    for (unsigned int i = 0; i <= iterations; ++i) {
+        IoCounters counters = {};
+
+        ctx.bytes = 0;
+
+        uint64_t allocs_before = _alloc_count;
+        uint64_t alloc_bytes_before = _alloc_bytes;
+        auto start = std::chrono::steady_clock::now();
+
+        bool ok = op == Operation::REPACK
+                ? run_repack(ctx, counters)
+                : run_read(ctx, op, counters);
+
+        auto stop = std::chrono::steady_clock::now();
+        uint64_t allocs = _alloc_count - allocs_before;
+        uint64_t alloc_bytes = _alloc_bytes - alloc_bytes_before;
+
+        if (!ok) {
+            return false;
+        }
+
+        if (i == 0) {
+            continue;
+        }
+
+        times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                stop - start).count());
+
+        // Counts are deterministic, but take the minimum in case something
+        // outside of the library (eg. stdio) allocated during the run
+        result.allocations = std::min(result.allocations, allocs);
+        result.allocated_bytes = std::min(result.allocated_bytes, alloc_bytes);
+        result.io.reads = std::min(result.io.reads, counters.reads);
+        result.io.writes = std::min(result.io.writes, counters.writes);
+        result.io.seeks = std::min(result.io.seeks, counters.seeks);
+        result.io.truncates = std::min(result.io.truncates,
+                                       counters.truncates);
+    }
+
+    std::sort(times.begin(), times.end());
+
+    uint64_t total = 0;
+    for (uint64_t t : times) {
+        total += t;
+    }
+
+    result.bytes = ctx.bytes;
+    result.min_ns = times.front();
+    result.median_ns = times[times.size() / 2];
+    result.mean_ns = total / times.size();
+    result.throughput_mib_s = result.median_ns == 0 ? 0.0
+            : (static_cast<double>(result.bytes) / MIB)
+                    / (static_cast<double>(result.median_ns) / 1e9);
+
+    return true;
+}
+
+static void print_result(FILE *fp, const Result &r, bool last)
+{
+    fprintf(fp, "    {\"format\": \"%s\", \"page_size\": %" PRIu32
+            ", \"payload_size\": %" PRIu64 ", \"image_size\": %" PRIu64
+            ", \"backing\": \"%s\", \"operation\": \"%s\""
+            ", \"iterations\": %u, \"bytes\": %" PRIu64
+            ", \"min_ns\": %" PRIu64 ", \"median_ns\": %" PRIu64
+            ", \"mean_ns\": %" PRIu64 ", \"throughput_mib_s\": %.2f",
+            r.format, r.page_size, r.payload_size, r.image_size,
+            r.backing, r.operation, r.iterations, r.bytes,
+            r.min_ns, r.median_ns, r.mean_ns, r.throughput_mib_s);
+
+    if (HAVE_ALLOC_COUNTING) {
+        fprintf(fp, ", \"allocations\": %" PRIu64
+                ", \"allocated_bytes\": %" PRIu64,
+                r.allocations, r.allocated_bytes);
+    } else {
+        fprintf(fp, ", \"allocations\": null, \"allocated_bytes\": null");
+    }
+
+    fprintf(fp, ", \"read_calls\": %" PRIu64 ", \"write_calls\": %" PRIu64
+            ", \"seek_calls\": %" PRIu64 ", \"truncate_calls\": %" PRIu64
+            "}%s\n",
+            r.io.reads, r.io.writes, r.io.seeks, r.io.truncates,
+            last ? "" : ",");
+}
+
+
+// Command line
+
+static const char *all_formats[] = {
+    MB_BI_FORMAT_NAME_ANDROID,
+    MB_BI_FORMAT_NAME_BUMP,
+    MB_BI_FORMAT_NAME_LOKI,
+    MB_BI_FORMAT_NAME_MTK,
+    MB_BI_FORMAT_NAME_SONY_ELF,
+};
+
+static std::vector<std::string> split(const std::string &str)
+{
+    std::vector<std::string> result;
+    size_t begin = 0;
+
+    while (begin <= str.size()) {
+        size_t end = str.find(',', begin);
+        if (end == std::string::npos) {
+            end = str.size();
+        }
+        if (end > begin) {
+            result.push_back(str.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+
+    return result;
+}
+
+static bool parse_uint_list(const char *str, std::vector<uint64_t> &out)
+{
+    out.clear();
+
+    for (const std::string &item : split(str)) {
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(item.c_str(), &end, 0);
+        if (errno != 0 || *end != '\0' || value == 0) {
+            return false;
+        }
+        out.push_back(value);
+    }
+
+    return !out.empty();
+}
+
+static void benchmark_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: mbbootimg_benchmarks [OPTION...]\n"
+            "\n"
+            "Options:\n"
+            "  -f, --formats <list>     Formats to benchmark (default: all)\n"
+            "  -s, --sizes <list>       Payload sizes in MiB (default: 8,32,64)\n"
+            "  -p, --page-sizes <list>  Page sizes (default: 2048,4096)\n"
+            "  -b, --backing <list>     memory, file, or both (default: both)\n"
+            "  -i, --iterations <n>     Timed iterations per case (default: 5)\n"
+            "  -d, --tmpdir <dir>       Directory for file-backed images\n"
+            "  -o, --output <file>      Write JSON results to file\n"
+            "  -h, --help               Display this help message\n"
+            "\n"
+            "Page sizes are ignored for the sony_elf format.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> formats(std::begin(all_formats),
+                                     std::end(all_formats));
+    std::vector<uint64_t> sizes{8, 32, 64};
+    std::vector<uint64_t> page_sizes{2048, 4096};
+    std::vector<Backing> backings{Backing::MEMORY, Backing::FILE};
+    unsigned int iterations = 5;
+    std::string tmpdir;
+    const char *output = nullptr;
+
+    const char *env_tmpdir = getenv("TMPDIR");
+    tmpdir = env_tmpdir && *env_tmpdir ? env_tmpdir : "/tmp";
+
+    int opt;
+
+    static const char *short_options = "f:s:p:b:i:d:o:h";
+
+    static struct option long_options[] = {
+        {"formats",    required_argument, 0, 'f'},
+        {"sizes",      required_argument, 0, 's'},
+        {"page-sizes", required_argument, 0, 'p'},
+        {"backing",    required_argument, 0, 'b'},
+        {"iterations", required_argument, 0, 'i'},
+        {"tmpdir",     required_argument, 0, 'd'},
+        {"output",     required_argument, 0, 'o'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'f':
+            formats = split(optarg);
+            for (const std::string &f : formats) {
+                if (std::find_if(std::begin(all_formats), std::end(all_formats),
+                        [&](const char *name) { return f == name; })
+                        == std::end(all_formats)) {
+                    fprintf(stderr, "Invalid format: %s\n", f.c_str());
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+
+        case 's':
+            if (!parse_uint_list(optarg, sizes)) {
+                fprintf(stderr, "Invalid size list: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'p':
+            if (!parse_uint_list(optarg, page_sizes)) {
+                fprintf(stderr, "Invalid page size list: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'b':
+            if (strcmp(optarg, "memory") == 0) {
+                backings = {Backing::MEMORY};
+            } else if (strcmp(optarg, "file") == 0) {
+                backings = {Backing::FILE};
+            } else if (strcmp(optarg, "both") == 0) {
+                backings = {Backing::MEMORY, Backing::FILE};
+            } else {
+                fprintf(stderr, "Invalid backing: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'i': {
+            char *end;
+            unsigned long value = strtoul(optarg, &end, 10);
+            if (*end != '\0' || value == 0 || value > 10000) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            iterations = value;
+            break;
+        }
+
+        case 'd':
+            tmpdir = optarg;
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'h':
+            benchmark_usage(stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            benchmark_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc) {
+        benchmark_usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results;
+    std::string repack_path = tmpdir + "/mbbootimg_benchmark_repack.img";
+    bool ok = true;
+
+    for (const std::string &format : formats) {
+        bool has_page_size = format != MB_BI_FORMAT_NAME_SONY_ELF;
+
+        for (uint64_t size : sizes) {
+            for (size_t p = 0; p < page_sizes.size(); ++p) {
+                if (!has_page_size && p > 0) {
+                    break;
+                }
+
+                SyntheticImage image;
+                image.format = *std::find_if(
+                        std::begin(all_formats), std::end(all_formats),
+                        [&](const char *name) { return format == name; });
+                image.page_size = has_page_size ? page_sizes[p] : 0;
+                image.payload_size = size * MIB;
+
+                fprintf(stderr, "Generating %s image (%" PRIu64 " MiB, "
+                        "page size %" PRIu32 ")\n",
+                        image.format, size, image.page_size);
+
+                if (!generate_image(image, tmpdir)) {
+                    ok = false;
+                    continue;
+                }
+
+                for (Backing backing : backings) {
+                    Context ctx;
+                    ctx.image = &image;
+                    ctx.backing = backing;
+                    ctx.repack_path = repack_path;
+                    ctx.buf.resize(COPY_BUFFER_SIZE);
+
+                    for (Operation op : {Operation::READ_HEADER,
+                                         Operation::READ_ENTRY,
+                                         Operation::UNPACK,
+                                         Operation::REPACK}) {
+                        Result r;
+                        r.format = image.format;
+                        r.page_size = image.page_size;
+                        r.payload_size = image.payload_size;
+                        r.image_size = image.data.size();
+                        r.backing = backing == Backing::MEMORY
+                                ? "memory" : "file";
+                        r.operation = operation_name(op);
+
+                        if (!measure(ctx, op, iterations, r)) {
+                            fprintf(stderr, "%s: %s (%s) failed\n",
+                                    image.format, r.operation, r.backing);
+                            ok = false;
+                            continue;
+                        }
+
+                        results.push_back(r);
+                    }
+                }
+
+                unlink(image.path.c_str());
+            }
+        }
+    }
+
+    unlink(repack_path.c_str());
+
+    FILE *fp = stdout;
+    if (output) {
+        fp = fopen(output, "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open: %s\n",
+                    output, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schema_version\": %d,\n", BENCHMARK_SCHEMA_VERSION);
+    fprintf(fp, "  \"version\": \"%s\",\n", mb::version());
+    fprintf(fp, "  \"git_version\": \"%s\",\n", mb::git_version());
+    fprintf(fp, "  \"iterations\": %u,\n", iterations);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        print_result(fp, results[i], i == results.size() - 1);
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fp != stdout && fclose(fp) != 0) {
+        fprintf(stderr, "%s: Failed to close: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
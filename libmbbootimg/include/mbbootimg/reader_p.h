@@ -23,8 +23,10 @@
 
 #ifdef __cplusplus
 #  include <cstddef>
+#  include <cstdint>
 #else
 #  include <stddef.h>
+#  include <stdint.h>
 #endif
 
 #include "mbcommon/common.h"
@@ -58,6 +60,12 @@
 
 #define MAX_FORMATS     10
 
+// Probe cache used while bidding
+#define PROBE_HEAD_SIZE         0x1000
+#define PROBE_TAIL_SIZE         0x1000
+#define PROBE_BLOCK_SIZE        0x200
+#define PROBE_MAX_RANGES        8
+
 MB_BEGIN_C_DECLS
 
 struct MbBiReader;
@@ -96,6 +104,22 @@ struct FormatReader
     void *userdata;
 };
 
+struct ReaderProbeRange
+{
+    uint64_t offset;
+    size_t size;
+    unsigned char *data;
+};
+
+struct ReaderProbe
+{
+    bool active;
+    uint64_t file_size;
+
+    struct ReaderProbeRange ranges[PROBE_MAX_RANGES];
+    size_t ranges_len;
+};
+
 enum ReaderState : unsigned short
 {
     NEW             = 1U << 1,
@@ -126,6 +150,8 @@ struct MbBiReader
     size_t formats_len;
     struct FormatReader *format;
 
+    struct ReaderProbe probe;
+
     struct MbBiHeader *header;
     struct MbBiEntry *entry;
 };
@@ -145,4 +171,11 @@ int _mb_bi_reader_register_format(struct MbBiReader *bir,
 int _mb_bi_reader_free_format(struct MbBiReader *bir,
                               struct FormatReader *format);
 
+int _mb_bi_reader_probe_begin(struct MbBiReader *bir);
+void _mb_bi_reader_probe_end(struct MbBiReader *bir);
+
+int _mb_bi_reader_read_range(struct MbBiReader *bir, struct MbFile *file,
+                             uint64_t offset, void *buf, size_t size,
+                             size_t *bytes_read);
+
 MB_END_C_DECLS
@@ -70,15 +70,8 @@ int find_loki_header(MbBiReader *bir, MbFile *file,
     size_t n;
     int ret;
 
-    ret = mb_file_seek(file, LOKI_MAGIC_OFFSET, SEEK_SET, nullptr);
-    if (ret < 0) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Loki magic not found: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_WARN;
-    }
-
-    ret = mb_file_read_fully(file, &header, sizeof(header), &n);
+    ret = _mb_bi_reader_read_range(bir, file, LOKI_MAGIC_OFFSET,
+                                   &header, sizeof(header), &n);
     if (ret < 0) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
                                "Failed to read header: %s",
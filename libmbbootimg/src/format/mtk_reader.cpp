@@ -68,22 +68,15 @@ int read_mtk_header(MbBiReader *bir, MbFile *file,
     size_t n;
     int ret;
 
-    ret = mb_file_seek(file, offset, SEEK_SET, nullptr);
+    ret = _mb_bi_reader_read_range(bir, file, offset,
+                                   &mtkhdr, sizeof(mtkhdr), &n);
     if (ret < 0) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Failed to seek to MTK header at %" PRIu64 ": %s",
+                               "Failed to read MTK header at %" PRIu64 ": %s",
                                offset, mb_file_error_string(file));
         return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
     }
 
-    ret = mb_file_read_fully(file, &mtkhdr, sizeof(mtkhdr), &n);
-    if (ret < 0) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Failed to read MTK header: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
     if (n != sizeof(MtkHeader)
             || memcmp(mtkhdr.magic, MTK_MAGIC, MTK_MAGIC_SIZE) != 0) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
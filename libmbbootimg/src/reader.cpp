@@ -19,6 +19,8 @@
 
 #include "mbbootimg/reader.h"
 
+#include <algorithm>
+
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -26,6 +28,7 @@
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/filename.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 
 #include "mbbootimg/entry.h"
@@ -54,8 +57,10 @@
  *
  * Place a bid based on the confidence in which the format reader can parse the
  * boot image. The bid is usually the number of bits the reader is confident
- * that conform to the file format (eg. magic string). The file position will be
- * set to the beginning of the file before this function is called.
+ * that conform to the file format (eg. magic string). The file position is
+ * undefined when this function is called. Bidders should read the file with
+ * _mb_bi_reader_read_range(), which serves the data from the probe cache that
+ * is shared between all of the bidders.
  *
  * \param bir MbBiReader
  * \param userdata User callback data
@@ -342,6 +347,291 @@ int _mb_bi_reader_free_format(MbBiReader *bir, FormatReader *format)
     return ret;
 }
 
+/*!
+ * \brief Find the next cached probe range that overlaps or touches a region
+ *
+ * \return Index of the matching range or #PROBE_MAX_RANGES if none match
+ */
+static size_t _probe_find_touching(MbBiReader *bir, size_t start,
+                                   uint64_t begin, uint64_t end)
+{
+    for (size_t i = start; i < bir->probe.ranges_len; ++i) {
+        const ReaderProbeRange &range = bir->probe.ranges[i];
+
+        if (range.offset <= end && range.offset + range.size >= begin) {
+            return i;
+        }
+    }
+
+    return PROBE_MAX_RANGES;
+}
+
+/*!
+ * \brief Make sure that a region of the file is present in the probe cache
+ *
+ * The region is expanded to #PROBE_BLOCK_SIZE boundaries and merged with any
+ * cached ranges that it overlaps or touches. Only the bytes that are not
+ * already cached are read from the file.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] begin Start of region (must be less than the file size)
+ * \param[in] end End of region (must not exceed the file size)
+ * \param[out] index_out Pointer to store index of the cached range containing
+ *                       the region or #PROBE_MAX_RANGES if the region could not
+ *                       be cached (the caller should read the file directly)
+ *
+ * \return
+ *   * #MB_FILE_OK if the region is cached or could not be cached
+ *   * \<= #MB_FILE_WARN if a file operation fails
+ */
+static int _probe_fetch(MbBiReader *bir, uint64_t begin, uint64_t end,
+                        size_t *index_out)
+{
+    ReaderProbe *probe = &bir->probe;
+    unsigned char *data;
+    uint64_t pos;
+    size_t n;
+    int ret;
+
+    begin -= begin % PROBE_BLOCK_SIZE;
+    if (end % PROBE_BLOCK_SIZE != 0) {
+        end += PROBE_BLOCK_SIZE - end % PROBE_BLOCK_SIZE;
+    }
+    end = std::min(end, probe->file_size);
+
+    // Extend the window to cover every range that it touches
+    for (size_t i = _probe_find_touching(bir, 0, begin, end);
+            i < probe->ranges_len;
+            i = _probe_find_touching(bir, i + 1, begin, end)) {
+        begin = std::min(begin, probe->ranges[i].offset);
+        end = std::max(end, probe->ranges[i].offset + probe->ranges[i].size);
+    }
+
+    // Fast path: already cached as a single range
+    for (size_t i = 0; i < probe->ranges_len; ++i) {
+        if (probe->ranges[i].offset == begin
+                && probe->ranges[i].size == end - begin) {
+            *index_out = i;
+            return MB_FILE_OK;
+        }
+    }
+
+    data = static_cast<unsigned char *>(malloc(end - begin));
+    if (!data) {
+        *index_out = PROBE_MAX_RANGES;
+        return MB_FILE_OK;
+    }
+
+    // Fill from cached ranges and read the gaps between them
+    for (pos = begin; pos < end;) {
+        uint64_t gap_end = end;
+        bool cached = false;
+
+        for (size_t i = 0; i < probe->ranges_len; ++i) {
+            const ReaderProbeRange &range = probe->ranges[i];
+
+            if (pos >= range.offset && pos < range.offset + range.size) {
+                n = range.offset + range.size - pos;
+                memcpy(data + (pos - begin), range.data + (pos - range.offset),
+                       n);
+                pos += n;
+                cached = true;
+                break;
+            } else if (range.offset > pos) {
+                gap_end = std::min(gap_end, range.offset);
+            }
+        }
+
+        if (cached) {
+            continue;
+        }
+
+        ret = mb_file_seek(bir->file, pos, SEEK_SET, nullptr);
+        if (ret == MB_FILE_OK) {
+            ret = mb_file_read_fully(bir->file, data + (pos - begin),
+                                     gap_end - pos, &n);
+        }
+        if (ret != MB_FILE_OK) {
+            free(data);
+            return ret;
+        } else if (n != gap_end - pos) {
+            // File was truncated from under us. Don't cache anything.
+            free(data);
+            *index_out = PROBE_MAX_RANGES;
+            return MB_FILE_OK;
+        }
+
+        pos = gap_end;
+    }
+
+    // Drop the ranges that were merged into the new one
+    size_t kept = 0;
+    for (size_t i = 0; i < probe->ranges_len; ++i) {
+        ReaderProbeRange &range = probe->ranges[i];
+
+        if (range.offset >= begin && range.offset + range.size <= end) {
+            free(range.data);
+        } else {
+            probe->ranges[kept++] = range;
+        }
+    }
+    probe->ranges_len = kept;
+
+    if (probe->ranges_len == PROBE_MAX_RANGES) {
+        free(data);
+        *index_out = PROBE_MAX_RANGES;
+        return MB_FILE_OK;
+    }
+
+    probe->ranges[probe->ranges_len].offset = begin;
+    probe->ranges[probe->ranges_len].size = end - begin;
+    probe->ranges[probe->ranges_len].data = data;
+    *index_out = probe->ranges_len;
+    ++probe->ranges_len;
+
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Start caching reads for format bidding
+ *
+ * Determine the file size and read the head and tail windows of the file (up to
+ * #PROBE_HEAD_SIZE and #PROBE_TAIL_SIZE bytes, respectively) in as few reads as
+ * possible. Until _mb_bi_reader_probe_end() is called, reads done through
+ * _mb_bi_reader_read_range() will be served from memory. Regions that aren't
+ * already cached are read on demand and coalesced with neighboring regions.
+ *
+ * If the file size cannot be determined (eg. the file is not seekable), the
+ * probe cache is left disabled and _mb_bi_reader_read_range() will read from
+ * the file directly.
+ *
+ * \param bir MbBiReader
+ *
+ * \return
+ *   * #MB_FILE_OK if the probe cache is successfully initialized or is disabled
+ *   * \<= #MB_FILE_WARN if a file operation fails
+ */
+int _mb_bi_reader_probe_begin(MbBiReader *bir)
+{
+    ReaderProbe *probe = &bir->probe;
+    size_t index;
+    int ret;
+
+    _mb_bi_reader_probe_end(bir);
+
+    ret = mb_file_seek(bir->file, 0, SEEK_END, &probe->file_size);
+    if (ret != MB_FILE_OK) {
+        return ret == MB_FILE_FATAL ? ret : MB_FILE_OK;
+    }
+
+    probe->active = true;
+
+    if (probe->file_size == 0) {
+        return MB_FILE_OK;
+    }
+
+    ret = _probe_fetch(bir, 0, std::min<uint64_t>(
+            PROBE_HEAD_SIZE, probe->file_size), &index);
+    if (ret != MB_FILE_OK) {
+        _mb_bi_reader_probe_end(bir);
+        return ret;
+    }
+
+    if (probe->file_size > PROBE_HEAD_SIZE) {
+        ret = _probe_fetch(bir, probe->file_size - std::min<uint64_t>(
+                PROBE_TAIL_SIZE, probe->file_size - PROBE_HEAD_SIZE),
+                probe->file_size, &index);
+        if (ret != MB_FILE_OK) {
+            _mb_bi_reader_probe_end(bir);
+            return ret;
+        }
+    }
+
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Stop caching reads and free the probe cache
+ *
+ * \param bir MbBiReader
+ */
+void _mb_bi_reader_probe_end(MbBiReader *bir)
+{
+    ReaderProbe *probe = &bir->probe;
+
+    for (size_t i = 0; i < probe->ranges_len; ++i) {
+        free(probe->ranges[i].data);
+    }
+
+    probe->ranges_len = 0;
+    probe->file_size = 0;
+    probe->active = false;
+}
+
+/*!
+ * \brief Read a region of a file, using the probe cache if possible
+ *
+ * Format readers should use this function instead of calling mb_file_seek() and
+ * mb_file_read_fully() directly in their bidder callbacks and in any functions
+ * called from them. If \p file is the reader's file and the probe cache is
+ * active, the data is served from memory. Otherwise, the data is read from
+ * \p file.
+ *
+ * \note Like mb_file_read_fully(), fewer than \p size bytes will only be read
+ *       if the end of the file is reached.
+ *
+ * \post If the data was read from the file, the file position is undefined.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] file MbFile handle
+ * \param[in] offset Offset to read from
+ * \param[out] buf Output buffer
+ * \param[in] size Number of bytes to read
+ * \param[out] bytes_read Pointer to store number of bytes read
+ *
+ * \return
+ *   * #MB_FILE_OK if the data is successfully read
+ *   * \<= #MB_FILE_WARN if a file operation fails. The error will be set on
+ *     \p file.
+ */
+int _mb_bi_reader_read_range(MbBiReader *bir, MbFile *file,
+                             uint64_t offset, void *buf, size_t size,
+                             size_t *bytes_read)
+{
+    ReaderProbe *probe = &bir->probe;
+    int ret;
+
+    if (probe->active && file == bir->file) {
+        size_t index;
+
+        if (offset >= probe->file_size || size == 0) {
+            *bytes_read = 0;
+            return MB_FILE_OK;
+        }
+
+        size = std::min<uint64_t>(size, probe->file_size - offset);
+
+        ret = _probe_fetch(bir, offset, offset + size, &index);
+        if (ret != MB_FILE_OK) {
+            return ret;
+        }
+
+        if (index != PROBE_MAX_RANGES) {
+            const ReaderProbeRange &range = probe->ranges[index];
+            memcpy(buf, range.data + (offset - range.offset), size);
+            *bytes_read = size;
+            return MB_FILE_OK;
+        }
+    }
+
+    ret = mb_file_seek(file, offset, SEEK_SET, nullptr);
+    if (ret != MB_FILE_OK) {
+        return ret;
+    }
+
+    return mb_file_read_fully(file, buf, size, bytes_read);
+}
+
 /*!
  * \brief Allocate new MbBiReader.
  *
@@ -518,19 +808,20 @@ int mb_bi_reader_open(MbBiReader *bir, MbFile *file, bool owned)
     if (!bir->format) {
         FormatReader *format = nullptr, *cur;
 
+        // Read the head and tail of the file once for all of the bidders
+        ret = _mb_bi_reader_probe_begin(bir);
+        if (ret < 0) {
+            mb_bi_reader_set_error(bir, mb_file_error(bir->file),
+                                   "Failed to read file: %s",
+                                   mb_file_error_string(bir->file));
+            ret = ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
+            goto done;
+        }
+
         for (size_t i = 0; i < bir->formats_len; ++i) {
             cur = &bir->formats[i];
 
             if (cur->bidder_cb) {
-                // Seek to beginning
-                ret = mb_file_seek(bir->file, 0, SEEK_SET, nullptr);
-                if (ret < 0) {
-                    mb_bi_reader_set_error(bir, mb_file_error(bir->file),
-                                           "Failed to seek file: %s",
-                                           mb_file_error_string(bir->file));
-                    goto done;
-                }
-
                 // Call bidder
                 ret = cur->bidder_cb(bir, cur->userdata, best_bid);
                 if (ret > best_bid) {
@@ -559,6 +850,8 @@ int mb_bi_reader_open(MbBiReader *bir, MbFile *file, bool owned)
     ret = MB_BI_OK;
 
 done:
+    _mb_bi_reader_probe_end(bir);
+
     if (ret != MB_BI_OK) {
         if (owned) {
             mb_file_free(file);
@@ -19,13 +19,69 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <memory>
+#include <vector>
 
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/callbacks.h"
+
+#include "mbbootimg/format/android_p.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
 
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
+struct CountingFileData
+{
+    std::vector<unsigned char> buf;
+    uint64_t pos;
+    unsigned int reads;
+};
+
+static int _counting_read_cb(MbFile *file, void *userdata,
+                             void *buf, size_t size, size_t *bytes_read)
+{
+    (void) file;
+    CountingFileData *data = static_cast<CountingFileData *>(userdata);
+
+    size_t n = 0;
+    if (data->pos < data->buf.size()) {
+        n = std::min<uint64_t>(size, data->buf.size() - data->pos);
+        memcpy(buf, data->buf.data() + data->pos, n);
+        data->pos += n;
+    }
+
+    ++data->reads;
+    *bytes_read = n;
+    return MB_FILE_OK;
+}
+
+static int _counting_seek_cb(MbFile *file, void *userdata,
+                             int64_t offset, int whence, uint64_t *new_offset)
+{
+    (void) file;
+    CountingFileData *data = static_cast<CountingFileData *>(userdata);
+
+    switch (whence) {
+    case SEEK_SET:
+        data->pos = offset;
+        break;
+    case SEEK_CUR:
+        data->pos += offset;
+        break;
+    case SEEK_END:
+        data->pos = data->buf.size() + offset;
+        break;
+    }
+
+    *new_offset = data->pos;
+    return MB_FILE_OK;
+}
+
 
 TEST(BootImgReaderTest, CheckInitialValues)
 {
@@ -51,3 +107,48 @@ TEST(BootImgReaderTest, CheckInitialValues)
     ASSERT_NE(bir->header, nullptr);
     ASSERT_NE(bir->entry, nullptr);
 }
+
+TEST(BootImgReaderTest, ProbeCacheShouldBeInactiveInitially)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    ASSERT_FALSE(bir->probe.active);
+    ASSERT_EQ(bir->probe.ranges_len, 0);
+}
+
+TEST(BootImgReaderTest, BiddingShouldShareProbeReads)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader ahdr = {};
+    memcpy(ahdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    ahdr.kernel_size = 1024 * 1024;
+    ahdr.ramdisk_size = 512 * 1024;
+    ahdr.page_size = 2048;
+
+    CountingFileData data = {};
+    data.buf.resize(2048 + ahdr.kernel_size + ahdr.ramdisk_size);
+    memcpy(data.buf.data(), &ahdr, sizeof(ahdr));
+
+    ASSERT_EQ(mb_file_open_callbacks(file.get(), nullptr, nullptr,
+                                     &_counting_read_cb, nullptr,
+                                     &_counting_seek_cb, nullptr, &data),
+              MB_FILE_OK);
+
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), file.get(), false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_ANDROID);
+
+    // Head and tail windows, plus the MTK headers after the Android header and
+    // after the kernel. Without the probe cache, every bidder reads the
+    // regions it needs separately.
+    ASSERT_LE(data.reads, 4u);
+
+    // Probe cache should be released after bidding
+    ASSERT_FALSE(bir->probe.active);
+    ASSERT_EQ(bir->probe.ranges_len, 0);
+}
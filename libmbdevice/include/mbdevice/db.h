@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "mbdevice/device.h"
+
+#define MB_DEVICE_DB_MAGIC              "MBDEVDB\0"
+#define MB_DEVICE_DB_MAGIC_SIZE         8
+#define MB_DEVICE_DB_VERSION            1
+
+struct MbDeviceDb;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MB_EXPORT struct MbDeviceDb * mb_device_db_open(const char *path);
+MB_EXPORT struct MbDeviceDb * mb_device_db_new_from_data(const void *data,
+                                                         size_t size);
+
+MB_EXPORT void mb_device_db_free(struct MbDeviceDb *db);
+
+MB_EXPORT size_t mb_device_db_count(const struct MbDeviceDb *db);
+
+MB_EXPORT struct Device * mb_device_db_get(const struct MbDeviceDb *db,
+                                           size_t index);
+
+MB_EXPORT struct Device * mb_device_db_find_by_codename(const struct MbDeviceDb *db,
+                                                        const char *codename);
+
+MB_EXPORT int mb_device_db_write(struct Device * const *devices,
+                                 void **data_out, size_t *size_out);
+
+#ifdef __cplusplus
+}
+#endif
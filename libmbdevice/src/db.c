@@ -0,0 +1,1145 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbdevice/db.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/endian.h"
+
+/*
+ * Binary device database format
+ *
+ * All integers are little-endian 32-bit values. Offsets in the header are
+ * relative to the beginning of the file.
+ *
+ * +-------------------+
+ * | Header            |
+ * +-------------------+
+ * | Device records    | device_count * struct DbRecord
+ * +-------------------+
+ * | Hash displacement | hash_size * int32
+ * +-------------------+
+ * | Hash slots        | hash_size * struct DbSlot
+ * +-------------------+
+ * | String lists      | [count, string, string, ...] ...
+ * +-------------------+
+ * | String table      | NULL-terminated strings
+ * +-------------------+
+ *
+ * Strings are referenced by their offset in the string table and string lists
+ * are referenced by their offset in the string list section. DB_NULL is used
+ * for unset fields.
+ *
+ * Codenames are looked up with a minimal perfect hash (hash and displace). A
+ * codename is hashed with seed 0 to select an entry in the displacement table.
+ * If the entry is negative, the codename's slot is (-entry - 1). Otherwise,
+ * the codename is hashed again with the entry as the seed to compute the slot.
+ * Every slot holds exactly one codename, which must be compared with the one
+ * being looked up because unknown codenames also map to some slot.
+ */
+
+#define DB_NULL                         0xffffffffu
+
+// Give up if no displacement works for a bucket
+#define DB_MAX_DISPLACEMENT             (1u << 24)
+
+struct DbHeader
+{
+    unsigned char magic[MB_DEVICE_DB_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t device_count;
+    uint32_t records_offset;
+    uint32_t hash_size;
+    uint32_t displacements_offset;
+    uint32_t slots_offset;
+    uint32_t lists_offset;
+    uint32_t lists_size;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+};
+
+struct DbRecord
+{
+    uint32_t id;
+    uint32_t codenames;
+    uint32_t name;
+    uint32_t architecture;
+    uint32_t flags_lo;
+    uint32_t flags_hi;
+    uint32_t base_dirs;
+    uint32_t system_devs;
+    uint32_t cache_devs;
+    uint32_t data_devs;
+    uint32_t boot_devs;
+    uint32_t recovery_devs;
+    uint32_t extra_devs;
+    uint32_t tw_supported;
+    uint32_t tw_flags_lo;
+    uint32_t tw_flags_hi;
+    uint32_t tw_pixel_format;
+    uint32_t tw_force_pixel_format;
+    uint32_t tw_overscan_percent;
+    uint32_t tw_default_x_offset;
+    uint32_t tw_default_y_offset;
+    uint32_t tw_brightness_path;
+    uint32_t tw_secondary_brightness_path;
+    uint32_t tw_max_brightness;
+    uint32_t tw_default_brightness;
+    uint32_t tw_battery_path;
+    uint32_t tw_cpu_temp_path;
+    uint32_t tw_input_blacklist;
+    uint32_t tw_input_whitelist;
+    uint32_t tw_graphics_backends;
+    uint32_t tw_theme;
+};
+
+struct DbSlot
+{
+    uint32_t codename;
+    uint32_t device;
+};
+
+struct MbDeviceDb
+{
+    const unsigned char *data;
+    size_t size;
+    bool mapped;
+
+    struct DbHeader header;
+};
+
+static uint32_t db_hash(uint32_t seed, const char *str)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u ^ seed;
+    for (; *str; ++str) {
+        h ^= (unsigned char) *str;
+        h *= 16777619u;
+    }
+
+    // Final mixing step from MurmurHash3 so that nearby seeds produce
+    // unrelated hashes
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static uint32_t read_le32(const unsigned char *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static bool range_valid(size_t total, uint32_t offset, uint64_t size)
+{
+    return offset <= total && size <= total - offset;
+}
+
+// Reader
+
+static bool db_load_header(struct MbDeviceDb *db)
+{
+    struct DbHeader *h = &db->header;
+
+    if (db->size < sizeof(struct DbHeader)
+            || memcmp(db->data, MB_DEVICE_DB_MAGIC,
+                      MB_DEVICE_DB_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    memcpy(h->magic, db->data, sizeof(h->magic));
+
+    uint32_t *fields = &h->version;
+    size_t n_fields = (sizeof(struct DbHeader) - sizeof(h->magic))
+            / sizeof(uint32_t);
+
+    for (size_t i = 0; i < n_fields; ++i) {
+        fields[i] = read_le32(db->data + sizeof(h->magic)
+                + i * sizeof(uint32_t));
+    }
+
+    if (h->version != MB_DEVICE_DB_VERSION) {
+        return false;
+    }
+
+    if (!range_valid(db->size, h->records_offset,
+                     (uint64_t) h->device_count * sizeof(struct DbRecord))
+            || !range_valid(db->size, h->displacements_offset,
+                            (uint64_t) h->hash_size * sizeof(uint32_t))
+            || !range_valid(db->size, h->slots_offset,
+                            (uint64_t) h->hash_size * sizeof(struct DbSlot))
+            || !range_valid(db->size, h->lists_offset, h->lists_size)
+            || !range_valid(db->size, h->strings_offset, h->strings_size)) {
+        return false;
+    }
+
+    // Every string must be NULL-terminated within the string table
+    if (h->strings_size > 0
+            && db->data[h->strings_offset + h->strings_size - 1] != '\0') {
+        return false;
+    }
+
+    return true;
+}
+
+static bool db_get_string(const struct MbDeviceDb *db, uint32_t offset,
+                          const char **str)
+{
+    if (offset == DB_NULL) {
+        *str = NULL;
+        return true;
+    } else if (offset >= db->header.strings_size) {
+        return false;
+    }
+
+    *str = (const char *) db->data + db->header.strings_offset + offset;
+    return true;
+}
+
+static bool db_get_string_list(const struct MbDeviceDb *db, uint32_t offset,
+                               const char ***list)
+{
+    const unsigned char *base = db->data + db->header.lists_offset;
+    uint32_t count;
+
+    if (offset == DB_NULL) {
+        *list = NULL;
+        return true;
+    } else if (offset % sizeof(uint32_t) != 0
+            || !range_valid(db->header.lists_size, offset, sizeof(uint32_t))) {
+        errno = EINVAL;
+        return false;
+    }
+
+    count = read_le32(base + offset);
+
+    if (!range_valid(db->header.lists_size, offset + sizeof(uint32_t),
+                     (uint64_t) count * sizeof(uint32_t))) {
+        errno = EINVAL;
+        return false;
+    }
+
+    *list = (const char **) malloc((count + 1) * sizeof(const char *));
+    if (!*list) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t str_offset = read_le32(
+                base + offset + (i + 1) * sizeof(uint32_t));
+        if (!db_get_string(db, str_offset, &(*list)[i]) || !(*list)[i]) {
+            free(*list);
+            errno = EINVAL;
+            return false;
+        }
+    }
+    (*list)[count] = NULL;
+
+    return true;
+}
+
+static void db_read_record(const struct MbDeviceDb *db, size_t index,
+                           struct DbRecord *record)
+{
+    const unsigned char *ptr = db->data + db->header.records_offset
+            + index * sizeof(struct DbRecord);
+    uint32_t *fields = (uint32_t *) record;
+
+    for (size_t i = 0; i < sizeof(struct DbRecord) / sizeof(uint32_t); ++i) {
+        fields[i] = read_le32(ptr + i * sizeof(uint32_t));
+    }
+}
+
+static struct Device * db_decode_device(const struct MbDeviceDb *db,
+                                        size_t index)
+{
+    struct DbRecord r;
+    struct Device *device;
+    const char *str;
+    const char **list;
+
+    db_read_record(db, index, &r);
+
+    device = mb_device_new();
+    if (!device) {
+        return NULL;
+    }
+
+#define CHECK_SET(EXPR) \
+    do { \
+        int ret = (EXPR); \
+        if (ret == MB_DEVICE_ERROR_INVALID_VALUE) { \
+            errno = EINVAL; \
+        } \
+        if (ret != MB_DEVICE_OK) { \
+            goto error; \
+        } \
+    } while (0)
+
+#define SET_STRING(FIELD, SETTER) \
+    do { \
+        if (!db_get_string(db, (FIELD), &str)) { \
+            errno = EINVAL; \
+            goto error; \
+        } \
+        CHECK_SET(SETTER(device, str)); \
+    } while (0)
+
+#define SET_STRING_LIST(FIELD, SETTER) \
+    do { \
+        int list_ret; \
+        if (!db_get_string_list(db, (FIELD), &list)) { \
+            goto error; \
+        } \
+        list_ret = SETTER(device, list); \
+        free(list); \
+        CHECK_SET(list_ret); \
+    } while (0)
+
+#define SET_VALUE(VALUE, SETTER) \
+    CHECK_SET(SETTER(device, (VALUE)))
+
+    SET_STRING(r.id, mb_device_set_id);
+    SET_STRING_LIST(r.codenames, mb_device_set_codenames);
+    SET_STRING(r.name, mb_device_set_name);
+    SET_STRING(r.architecture, mb_device_set_architecture);
+    SET_VALUE(((uint64_t) r.flags_hi << 32) | r.flags_lo,
+              mb_device_set_flags);
+
+    SET_STRING_LIST(r.base_dirs, mb_device_set_block_dev_base_dirs);
+    SET_STRING_LIST(r.system_devs, mb_device_set_system_block_devs);
+    SET_STRING_LIST(r.cache_devs, mb_device_set_cache_block_devs);
+    SET_STRING_LIST(r.data_devs, mb_device_set_data_block_devs);
+    SET_STRING_LIST(r.boot_devs, mb_device_set_boot_block_devs);
+    SET_STRING_LIST(r.recovery_devs, mb_device_set_recovery_block_devs);
+    SET_STRING_LIST(r.extra_devs, mb_device_set_extra_block_devs);
+
+    SET_VALUE(!!r.tw_supported, mb_device_set_tw_supported);
+    SET_VALUE(((uint64_t) r.tw_flags_hi << 32) | r.tw_flags_lo,
+              mb_device_set_tw_flags);
+    SET_VALUE((enum TwPixelFormat) r.tw_pixel_format,
+              mb_device_set_tw_pixel_format);
+    SET_VALUE((enum TwForcePixelFormat) r.tw_force_pixel_format,
+              mb_device_set_tw_force_pixel_format);
+    SET_VALUE((int32_t) r.tw_overscan_percent,
+              mb_device_set_tw_overscan_percent);
+    SET_VALUE((int32_t) r.tw_default_x_offset,
+              mb_device_set_tw_default_x_offset);
+    SET_VALUE((int32_t) r.tw_default_y_offset,
+              mb_device_set_tw_default_y_offset);
+    SET_STRING(r.tw_brightness_path, mb_device_set_tw_brightness_path);
+    SET_STRING(r.tw_secondary_brightness_path,
+               mb_device_set_tw_secondary_brightness_path);
+    SET_VALUE((int32_t) r.tw_max_brightness,
+              mb_device_set_tw_max_brightness);
+    SET_VALUE((int32_t) r.tw_default_brightness,
+              mb_device_set_tw_default_brightness);
+    SET_STRING(r.tw_battery_path, mb_device_set_tw_battery_path);
+    SET_STRING(r.tw_cpu_temp_path, mb_device_set_tw_cpu_temp_path);
+    SET_STRING(r.tw_input_blacklist, mb_device_set_tw_input_blacklist);
+    SET_STRING(r.tw_input_whitelist, mb_device_set_tw_input_whitelist);
+    SET_STRING_LIST(r.tw_graphics_backends,
+                    mb_device_set_tw_graphics_backends);
+    SET_STRING(r.tw_theme, mb_device_set_tw_theme);
+
+#undef CHECK_SET
+#undef SET_STRING
+#undef SET_STRING_LIST
+#undef SET_VALUE
+
+    return device;
+
+error:
+    mb_device_free(device);
+    return NULL;
+}
+
+/*!
+ * \brief Open binary device database
+ *
+ * The file is memory mapped and only the parts needed for a lookup are read.
+ *
+ * \param path Path to database file
+ *
+ * \return Database object or NULL if an error occurs. \p errno is set to
+ *         EINVAL if the file is not a valid device database.
+ */
+struct MbDeviceDb * mb_device_db_open(const char *path)
+{
+#ifdef _WIN32
+    FILE *fp = NULL;
+    void *buf = NULL;
+    long size;
+    struct MbDeviceDb *db = NULL;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        goto done;
+    }
+
+    if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0
+            || fseek(fp, 0, SEEK_SET) < 0) {
+        goto done;
+    }
+
+    buf = malloc(size > 0 ? (size_t) size : 1);
+    if (!buf) {
+        goto done;
+    }
+
+    if (fread(buf, 1, (size_t) size, fp) != (size_t) size) {
+        errno = EIO;
+        goto done;
+    }
+
+    db = mb_device_db_new_from_data(buf, (size_t) size);
+
+done:
+    free(buf);
+    if (fp) {
+        fclose(fp);
+    }
+    return db;
+#else
+    struct MbDeviceDb *db = NULL;
+    struct stat sb;
+    void *map = MAP_FAILED;
+    int fd;
+    int saved_errno;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        goto error;
+    }
+
+    if ((size_t) sb.st_size < sizeof(struct DbHeader)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    map = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        goto error;
+    }
+
+    db = (struct MbDeviceDb *) calloc(1, sizeof(struct MbDeviceDb));
+    if (!db) {
+        goto error;
+    }
+
+    db->data = (const unsigned char *) map;
+    db->size = (size_t) sb.st_size;
+    db->mapped = true;
+
+    if (!db_load_header(db)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    close(fd);
+    return db;
+
+error:
+    saved_errno = errno;
+    free(db);
+    if (map != MAP_FAILED) {
+        munmap(map, (size_t) sb.st_size);
+    }
+    close(fd);
+    errno = saved_errno;
+    return NULL;
+#endif
+}
+
+/*!
+ * \brief Load binary device database from memory
+ *
+ * \param data Database contents (will be copied)
+ * \param size Size of \p data
+ *
+ * \return Database object or NULL if an error occurs. \p errno is set to
+ *         EINVAL if \p data is not a valid device database.
+ */
+struct MbDeviceDb * mb_device_db_new_from_data(const void *data, size_t size)
+{
+    struct MbDeviceDb *db;
+    unsigned char *copy;
+
+    db = (struct MbDeviceDb *) calloc(1, sizeof(struct MbDeviceDb));
+    if (!db) {
+        return NULL;
+    }
+
+    copy = (unsigned char *) malloc(size > 0 ? size : 1);
+    if (!copy) {
+        free(db);
+        return NULL;
+    }
+    memcpy(copy, data, size);
+
+    db->data = copy;
+    db->size = size;
+    db->mapped = false;
+
+    if (!db_load_header(db)) {
+        mb_device_db_free(db);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return db;
+}
+
+/*!
+ * \brief Free binary device database
+ *
+ * \note Devices returned by mb_device_db_get() and
+ *       mb_device_db_find_by_codename() remain valid.
+ *
+ * \param db Object to free (can be NULL)
+ */
+void mb_device_db_free(struct MbDeviceDb *db)
+{
+    if (db) {
+#ifndef _WIN32
+        if (db->mapped) {
+            munmap((void *) db->data, db->size);
+        } else
+#endif
+        {
+            free((void *) db->data);
+        }
+        free(db);
+    }
+}
+
+/*!
+ * \brief Get number of devices in the database
+ */
+size_t mb_device_db_count(const struct MbDeviceDb *db)
+{
+    return db->header.device_count;
+}
+
+/*!
+ * \brief Get device at the specified index
+ *
+ * \param db Database object
+ * \param index Index of device (less than mb_device_db_count())
+ *
+ * \return New device definition object that must be freed with
+ *         mb_device_free() or NULL if an error occurs
+ */
+struct Device * mb_device_db_get(const struct MbDeviceDb *db, size_t index)
+{
+    if (index >= db->header.device_count) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return db_decode_device(db, index);
+}
+
+/*!
+ * \brief Find device with the specified codename
+ *
+ * This does not depend on the number of devices in the database. Only the
+ * matching device record is decoded.
+ *
+ * \param db Database object
+ * \param codename Device codename (eg. from `ro.product.device`)
+ *
+ * \return New device definition object that must be freed with
+ *         mb_device_free() or NULL if an error occurs. \p errno is set to
+ *         ENOENT if no device has the codename.
+ */
+struct Device * mb_device_db_find_by_codename(const struct MbDeviceDb *db,
+                                              const char *codename)
+{
+    const struct DbHeader *h = &db->header;
+    uint32_t bucket;
+    int32_t displacement;
+    uint32_t slot;
+    const unsigned char *slot_ptr;
+    uint32_t codename_offset;
+    uint32_t device_index;
+    const char *str;
+
+    if (h->hash_size == 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    bucket = db_hash(0, codename) % h->hash_size;
+    displacement = (int32_t) read_le32(
+            db->data + h->displacements_offset + bucket * sizeof(uint32_t));
+
+    if (displacement < 0) {
+        slot = (uint32_t) (-(int64_t) displacement - 1);
+    } else {
+        slot = db_hash((uint32_t) displacement, codename) % h->hash_size;
+    }
+
+    if (slot >= h->hash_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    slot_ptr = db->data + h->slots_offset + slot * sizeof(struct DbSlot);
+    codename_offset = read_le32(slot_ptr);
+    device_index = read_le32(slot_ptr + sizeof(uint32_t));
+
+    if (!db_get_string(db, codename_offset, &str) || !str
+            || device_index >= h->device_count) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (strcmp(str, codename) != 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return db_decode_device(db, device_index);
+}
+
+// Writer
+
+struct DbBuffer
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+};
+
+struct DbStringTable
+{
+    struct DbBuffer buf;
+    // Open addressing table of string offsets + 1 (0 means empty)
+    uint32_t *entries;
+    size_t entries_size;
+    size_t count;
+};
+
+static bool buffer_append(struct DbBuffer *buf, const void *data, size_t size)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    if (size > buf->capacity - buf->size) {
+        size_t new_capacity = buf->capacity ? buf->capacity : 4096;
+        while (new_capacity - buf->size < size) {
+            new_capacity *= 2;
+        }
+
+        unsigned char *new_data =
+                (unsigned char *) realloc(buf->data, new_capacity);
+        if (!new_data) {
+            return false;
+        }
+
+        buf->data = new_data;
+        buf->capacity = new_capacity;
+    }
+
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return true;
+}
+
+static bool buffer_append_le32(struct DbBuffer *buf, uint32_t value)
+{
+    value = mb_htole32(value);
+    return buffer_append(buf, &value, sizeof(value));
+}
+
+static bool string_table_grow(struct DbStringTable *table)
+{
+    size_t new_size = table->entries_size ? table->entries_size * 2 : 256;
+    uint32_t *new_entries = (uint32_t *) calloc(new_size, sizeof(uint32_t));
+    if (!new_entries) {
+        return false;
+    }
+
+    for (size_t i = 0; i < table->entries_size; ++i) {
+        uint32_t entry = table->entries[i];
+        if (!entry) {
+            continue;
+        }
+
+        const char *str = (const char *) table->buf.data + entry - 1;
+        size_t j = db_hash(0, str) & (new_size - 1);
+        while (new_entries[j]) {
+            j = (j + 1) & (new_size - 1);
+        }
+        new_entries[j] = entry;
+    }
+
+    free(table->entries);
+    table->entries = new_entries;
+    table->entries_size = new_size;
+    return true;
+}
+
+static bool string_table_add(struct DbStringTable *table, const char *str,
+                             uint32_t *offset)
+{
+    if (!str) {
+        *offset = DB_NULL;
+        return true;
+    }
+
+    if (table->count * 2 >= table->entries_size && !string_table_grow(table)) {
+        return false;
+    }
+
+    size_t i = db_hash(0, str) & (table->entries_size - 1);
+    while (table->entries[i]) {
+        uint32_t existing = table->entries[i] - 1;
+        if (strcmp((const char *) table->buf.data + existing, str) == 0) {
+            *offset = existing;
+            return true;
+        }
+        i = (i + 1) & (table->entries_size - 1);
+    }
+
+    if (table->buf.size >= DB_NULL - 1) {
+        errno = EFBIG;
+        return false;
+    }
+
+    *offset = (uint32_t) table->buf.size;
+    if (!buffer_append(&table->buf, str, strlen(str) + 1)) {
+        return false;
+    }
+
+    table->entries[i] = *offset + 1;
+    ++table->count;
+    return true;
+}
+
+static bool string_list_add(struct DbBuffer *lists,
+                            struct DbStringTable *strings,
+                            char const * const *list, uint32_t *offset)
+{
+    uint32_t count = 0;
+
+    if (!list) {
+        *offset = DB_NULL;
+        return true;
+    }
+
+    for (char const * const *it = list; *it; ++it) {
+        ++count;
+    }
+
+    *offset = (uint32_t) lists->size;
+
+    if (!buffer_append_le32(lists, count)) {
+        return false;
+    }
+
+    for (char const * const *it = list; *it; ++it) {
+        uint32_t str_offset;
+        if (!string_table_add(strings, *it, &str_offset)
+                || !buffer_append_le32(lists, str_offset)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct DbKey
+{
+    const char *codename;
+    uint32_t codename_offset;
+    uint32_t device;
+    uint32_t bucket;
+};
+
+/*!
+ * \brief Build perfect hash table for the codenames
+ *
+ * \param keys Codenames (must be unique)
+ * \param n Number of codenames
+ * \param displacements Output displacement table (\p n entries)
+ * \param slots Output slots (\p n entries)
+ */
+static bool build_perfect_hash(struct DbKey *keys, uint32_t n,
+                               int32_t *displacements, struct DbSlot *slots)
+{
+    uint32_t *bucket_sizes = NULL;
+    uint32_t *bucket_slots = NULL;
+    bool *used = NULL;
+    uint32_t max_bucket_size = 0;
+    uint32_t next_free = 0;
+    bool ret = false;
+
+    bucket_sizes = (uint32_t *) calloc(n, sizeof(uint32_t));
+    used = (bool *) calloc(n, sizeof(bool));
+    if (!bucket_sizes || !used) {
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        keys[i].bucket = db_hash(0, keys[i].codename) % n;
+        if (++bucket_sizes[keys[i].bucket] > max_bucket_size) {
+            max_bucket_size = bucket_sizes[keys[i].bucket];
+        }
+        displacements[i] = 0;
+    }
+
+    bucket_slots = (uint32_t *) malloc(max_bucket_size * sizeof(uint32_t));
+    if (!bucket_slots) {
+        goto done;
+    }
+
+    // Place the largest buckets first while most slots are still free
+    for (uint32_t size = max_bucket_size; size > 1; --size) {
+        for (uint32_t b = 0; b < n; ++b) {
+            if (bucket_sizes[b] != size) {
+                continue;
+            }
+
+            uint32_t d;
+
+            for (d = 1; d < DB_MAX_DISPLACEMENT; ++d) {
+                uint32_t placed = 0;
+
+                for (uint32_t i = 0; i < n && placed < size; ++i) {
+                    if (keys[i].bucket != b) {
+                        continue;
+                    }
+
+                    uint32_t slot = db_hash(d, keys[i].codename) % n;
+                    bool conflict = used[slot];
+                    for (uint32_t j = 0; j < placed && !conflict; ++j) {
+                        conflict = bucket_slots[j] == slot;
+                    }
+                    if (conflict) {
+                        break;
+                    }
+
+                    bucket_slots[placed++] = slot;
+                }
+
+                if (placed == size) {
+                    break;
+                }
+            }
+
+            if (d == DB_MAX_DISPLACEMENT) {
+                errno = EINVAL;
+                goto done;
+            }
+
+            displacements[b] = (int32_t) d;
+
+            for (uint32_t i = 0, placed = 0; i < n && placed < size; ++i) {
+                if (keys[i].bucket == b) {
+                    uint32_t slot = bucket_slots[placed++];
+                    used[slot] = true;
+                    slots[slot].codename = keys[i].codename_offset;
+                    slots[slot].device = keys[i].device;
+                }
+            }
+        }
+    }
+
+    // Buckets with one key go directly into the remaining slots
+    for (uint32_t i = 0; i < n; ++i) {
+        if (bucket_sizes[keys[i].bucket] != 1) {
+            continue;
+        }
+
+        while (used[next_free]) {
+            ++next_free;
+        }
+
+        used[next_free] = true;
+        slots[next_free].codename = keys[i].codename_offset;
+        slots[next_free].device = keys[i].device;
+        displacements[keys[i].bucket] = -(int32_t) next_free - 1;
+    }
+
+    ret = true;
+
+done:
+    free(bucket_sizes);
+    free(bucket_slots);
+    free(used);
+    return ret;
+}
+
+static bool db_encode_device(struct Device *device, struct DbBuffer *records,
+                             struct DbBuffer *lists,
+                             struct DbStringTable *strings)
+{
+    struct DbRecord r;
+    uint64_t flags = mb_device_flags(device);
+    uint64_t tw_flags = mb_device_tw_flags(device);
+
+    if (!string_table_add(strings, mb_device_id(device), &r.id)
+            || !string_list_add(lists, strings,
+                                mb_device_codenames(device), &r.codenames)
+            || !string_table_add(strings, mb_device_name(device), &r.name)
+            || !string_table_add(strings, mb_device_architecture(device),
+                                 &r.architecture)
+            || !string_list_add(lists, strings,
+                                mb_device_block_dev_base_dirs(device),
+                                &r.base_dirs)
+            || !string_list_add(lists, strings,
+                                mb_device_system_block_devs(device),
+                                &r.system_devs)
+            || !string_list_add(lists, strings,
+                                mb_device_cache_block_devs(device),
+                                &r.cache_devs)
+            || !string_list_add(lists, strings,
+                                mb_device_data_block_devs(device),
+                                &r.data_devs)
+            || !string_list_add(lists, strings,
+                                mb_device_boot_block_devs(device),
+                                &r.boot_devs)
+            || !string_list_add(lists, strings,
+                                mb_device_recovery_block_devs(device),
+                                &r.recovery_devs)
+            || !string_list_add(lists, strings,
+                                mb_device_extra_block_devs(device),
+                                &r.extra_devs)
+            || !string_table_add(strings, mb_device_tw_brightness_path(device),
+                                 &r.tw_brightness_path)
+            || !string_table_add(strings,
+                                 mb_device_tw_secondary_brightness_path(device),
+                                 &r.tw_secondary_brightness_path)
+            || !string_table_add(strings, mb_device_tw_battery_path(device),
+                                 &r.tw_battery_path)
+            || !string_table_add(strings, mb_device_tw_cpu_temp_path(device),
+                                 &r.tw_cpu_temp_path)
+            || !string_table_add(strings, mb_device_tw_input_blacklist(device),
+                                 &r.tw_input_blacklist)
+            || !string_table_add(strings, mb_device_tw_input_whitelist(device),
+                                 &r.tw_input_whitelist)
+            || !string_list_add(lists, strings,
+                                mb_device_tw_graphics_backends(device),
+                                &r.tw_graphics_backends)
+            || !string_table_add(strings, mb_device_tw_theme(device),
+                                 &r.tw_theme)) {
+        return false;
+    }
+
+    r.flags_lo = (uint32_t) flags;
+    r.flags_hi = (uint32_t) (flags >> 32);
+    r.tw_supported = mb_device_tw_supported(device);
+    r.tw_flags_lo = (uint32_t) tw_flags;
+    r.tw_flags_hi = (uint32_t) (tw_flags >> 32);
+    r.tw_pixel_format = (uint32_t) mb_device_tw_pixel_format(device);
+    r.tw_force_pixel_format =
+            (uint32_t) mb_device_tw_force_pixel_format(device);
+    r.tw_overscan_percent = (uint32_t) mb_device_tw_overscan_percent(device);
+    r.tw_default_x_offset = (uint32_t) mb_device_tw_default_x_offset(device);
+    r.tw_default_y_offset = (uint32_t) mb_device_tw_default_y_offset(device);
+    r.tw_max_brightness = (uint32_t) mb_device_tw_max_brightness(device);
+    r.tw_default_brightness =
+            (uint32_t) mb_device_tw_default_brightness(device);
+
+    uint32_t *fields = (uint32_t *) &r;
+    for (size_t i = 0; i < sizeof(struct DbRecord) / sizeof(uint32_t); ++i) {
+        if (!buffer_append_le32(records, fields[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Serialize devices into the binary device database format
+ *
+ * If multiple devices have the same codename, lookups for that codename will
+ * return the first device.
+ *
+ * \param[in] devices NULL-terminated list of devices
+ * \param[out] data_out Pointer to store database contents. Must be freed with
+ *                      `free()`.
+ * \param[out] size_out Pointer to store size of database
+ *
+ * \return MB_DEVICE_OK if successful or MB_DEVICE_ERROR_ERRNO if an error
+ *         occurs
+ */
+int mb_device_db_write(struct Device * const *devices,
+                       void **data_out, size_t *size_out)
+{
+    struct DbBuffer records = { NULL, 0, 0 };
+    struct DbBuffer lists = { NULL, 0, 0 };
+    struct DbBuffer out = { NULL, 0, 0 };
+    struct DbStringTable strings = { { NULL, 0, 0 }, NULL, 0, 0 };
+    struct DbKey *keys = NULL;
+    int32_t *displacements = NULL;
+    struct DbSlot *slots = NULL;
+    uint32_t n_devices = 0;
+    uint32_t n_keys = 0;
+    size_t max_keys = 0;
+    struct DbHeader h;
+    int ret = MB_DEVICE_ERROR_ERRNO;
+
+    for (struct Device * const *it = devices; *it; ++it) {
+        char const * const *codenames = mb_device_codenames(*it);
+        if (codenames) {
+            for (; *codenames; ++codenames) {
+                ++max_keys;
+            }
+        }
+        ++n_devices;
+    }
+
+    keys = (struct DbKey *) malloc((max_keys + 1) * sizeof(struct DbKey));
+    if (!keys) {
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < n_devices; ++i) {
+        if (!db_encode_device(devices[i], &records, &lists, &strings)) {
+            goto done;
+        }
+
+        char const * const *codenames = mb_device_codenames(devices[i]);
+        if (!codenames) {
+            continue;
+        }
+
+        for (; *codenames; ++codenames) {
+            bool duplicate = false;
+            for (uint32_t j = 0; j < n_keys && !duplicate; ++j) {
+                duplicate = strcmp(keys[j].codename, *codenames) == 0;
+            }
+            if (duplicate) {
+                continue;
+            }
+
+            keys[n_keys].codename = *codenames;
+            keys[n_keys].device = i;
+            if (!string_table_add(&strings, *codenames,
+                                  &keys[n_keys].codename_offset)) {
+                goto done;
+            }
+            ++n_keys;
+        }
+    }
+
+    displacements = (int32_t *) malloc((n_keys + 1) * sizeof(int32_t));
+    slots = (struct DbSlot *) malloc((n_keys + 1) * sizeof(struct DbSlot));
+    if (!displacements || !slots) {
+        goto done;
+    }
+
+    if (n_keys > 0 && !build_perfect_hash(keys, n_keys, displacements, slots)) {
+        goto done;
+    }
+
+    // Keep the string lists 4-byte aligned
+    while (lists.size % sizeof(uint32_t) != 0) {
+        if (!buffer_append(&lists, "", 1)) {
+            goto done;
+        }
+    }
+
+    memcpy(h.magic, MB_DEVICE_DB_MAGIC, sizeof(h.magic));
+    h.version = MB_DEVICE_DB_VERSION;
+    h.device_count = n_devices;
+    h.records_offset = sizeof(struct DbHeader);
+    h.hash_size = n_keys;
+    h.displacements_offset = h.records_offset + (uint32_t) records.size;
+    h.slots_offset = h.displacements_offset + n_keys * sizeof(uint32_t);
+    h.lists_offset = h.slots_offset + n_keys * sizeof(struct DbSlot);
+    h.lists_size = (uint32_t) lists.size;
+    h.strings_offset = h.lists_offset + h.lists_size;
+    h.strings_size = (uint32_t) strings.buf.size;
+
+    if (!buffer_append(&out, h.magic, sizeof(h.magic))) {
+        goto done;
+    }
+
+    uint32_t *fields = &h.version;
+    for (size_t i = 0; i < (sizeof(struct DbHeader) - sizeof(h.magic))
+            / sizeof(uint32_t); ++i) {
+        if (!buffer_append_le32(&out, fields[i])) {
+            goto done;
+        }
+    }
+
+    if (!buffer_append(&out, records.data, records.size)) {
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < n_keys; ++i) {
+        if (!buffer_append_le32(&out, (uint32_t) displacements[i])) {
+            goto done;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_keys; ++i) {
+        if (!buffer_append_le32(&out, slots[i].codename)
+                || !buffer_append_le32(&out, slots[i].device)) {
+            goto done;
+        }
+    }
+
+    if (!buffer_append(&out, lists.data, lists.size)
+            || !buffer_append(&out, strings.buf.data, strings.buf.size)) {
+        goto done;
+    }
+
+    *data_out = out.data;
+    *size_out = out.size;
+    out.data = NULL;
+    ret = MB_DEVICE_OK;
+
+done:
+    free(records.data);
+    free(lists.data);
+    free(out.data);
+    free(strings.buf.data);
+    free(strings.entries);
+    free(keys);
+    free(displacements);
+    free(slots);
+    return ret;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "mbdevice/db.h"
+
+struct DeviceDbTest : testing::Test
+{
+    std::vector<Device *> _devices;
+    void *_data = nullptr;
+    size_t _size = 0;
+
+    virtual ~DeviceDbTest()
+    {
+        for (Device *device : _devices) {
+            mb_device_free(device);
+        }
+        free(_data);
+    }
+
+    Device * add_device(const char *id, std::vector<const char *> codenames)
+    {
+        Device *device = mb_device_new();
+        codenames.push_back(nullptr);
+
+        EXPECT_EQ(mb_device_set_id(device, id), MB_DEVICE_OK);
+        EXPECT_EQ(mb_device_set_codenames(device, codenames.data()),
+                  MB_DEVICE_OK);
+        EXPECT_EQ(mb_device_set_name(device, id), MB_DEVICE_OK);
+        EXPECT_EQ(mb_device_set_architecture(device, "arm64-v8a"),
+                  MB_DEVICE_OK);
+
+        _devices.push_back(device);
+        return device;
+    }
+
+    void write_db()
+    {
+        std::vector<Device *> devices(_devices);
+        devices.push_back(nullptr);
+
+        ASSERT_EQ(mb_device_db_write(devices.data(), &_data, &_size),
+                  MB_DEVICE_OK);
+    }
+};
+
+TEST_F(DeviceDbTest, RoundTripAllFields)
+{
+    Device *device = add_device("test", { "test1", "test2" });
+
+    const char *base_dirs[] = { "/dev/block/bootdevice/by-name", nullptr };
+    const char *system_devs[] = { "/dev/block/sda1", "/dev/block/sda2",
+                                  nullptr };
+    const char *cache_devs[] = { "/dev/block/sda3", nullptr };
+    const char *data_devs[] = { "/dev/block/sda4", nullptr };
+    const char *boot_devs[] = { "/dev/block/sda5", nullptr };
+    const char *recovery_devs[] = { "/dev/block/sda6", nullptr };
+    const char *extra_devs[] = { "/dev/block/sda7", nullptr };
+    const char *backends[] = { "overlay_msm_old", "fbdev", nullptr };
+
+    ASSERT_EQ(mb_device_set_flags(device, FLAG_FSTAB_SKIP_SDCARD0),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_block_dev_base_dirs(device, base_dirs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_system_block_devs(device, system_devs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_cache_block_devs(device, cache_devs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_data_block_devs(device, data_devs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_boot_block_devs(device, boot_devs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_recovery_block_devs(device, recovery_devs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_extra_block_devs(device, extra_devs),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_supported(device, true), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_flags(device, FLAG_TW_ROUND_SCREEN),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_pixel_format(device,
+                                            TW_PIXEL_FORMAT_RGBA_8888),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_force_pixel_format(
+            device, TW_FORCE_PIXEL_FORMAT_RGB_565), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_overscan_percent(device, 10), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_default_x_offset(device, -20), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_default_y_offset(device, 30), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_brightness_path(device, "/brightness"),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_secondary_brightness_path(
+            device, "/brightness2"), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_max_brightness(device, 255), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_default_brightness(device, 100),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_battery_path(device, "/battery"),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_cpu_temp_path(device, "/temp"), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_input_blacklist(device, "foo"), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_input_whitelist(device, "bar"), MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_graphics_backends(device, backends),
+              MB_DEVICE_OK);
+    ASSERT_EQ(mb_device_set_tw_theme(device, "portrait_hdpi"), MB_DEVICE_OK);
+
+    write_db();
+
+    MbDeviceDb *db = mb_device_db_new_from_data(_data, _size);
+    ASSERT_NE(db, nullptr);
+    ASSERT_EQ(mb_device_db_count(db), 1u);
+
+    Device *found = mb_device_db_find_by_codename(db, "test2");
+    ASSERT_NE(found, nullptr);
+    ASSERT_TRUE(mb_device_equals(device, found));
+
+    mb_device_free(found);
+    mb_device_db_free(db);
+}
+
+TEST_F(DeviceDbTest, FindAllCodenames)
+{
+    std::vector<std::string> codenames;
+
+    for (int i = 0; i < 500; ++i) {
+        codenames.push_back("device" + std::to_string(i) + "a");
+        codenames.push_back("device" + std::to_string(i) + "b");
+    }
+
+    for (int i = 0; i < 500; ++i) {
+        add_device(("id" + std::to_string(i)).c_str(), {
+            codenames[2 * i].c_str(),
+            codenames[2 * i + 1].c_str(),
+        });
+    }
+
+    write_db();
+
+    MbDeviceDb *db = mb_device_db_new_from_data(_data, _size);
+    ASSERT_NE(db, nullptr);
+    ASSERT_EQ(mb_device_db_count(db), 500u);
+
+    for (size_t i = 0; i < codenames.size(); ++i) {
+        Device *found = mb_device_db_find_by_codename(
+                db, codenames[i].c_str());
+        ASSERT_NE(found, nullptr) << codenames[i];
+        ASSERT_EQ(std::string(mb_device_id(found)),
+                  "id" + std::to_string(i / 2));
+        mb_device_free(found);
+    }
+
+    for (size_t i = 0; i < 500; ++i) {
+        Device *device = mb_device_db_get(db, i);
+        ASSERT_NE(device, nullptr);
+        ASSERT_TRUE(mb_device_equals(device, _devices[i]));
+        mb_device_free(device);
+    }
+
+    mb_device_db_free(db);
+}
+
+TEST_F(DeviceDbTest, UnknownCodename)
+{
+    add_device("test", { "test" });
+    write_db();
+
+    MbDeviceDb *db = mb_device_db_new_from_data(_data, _size);
+    ASSERT_NE(db, nullptr);
+
+    errno = 0;
+    ASSERT_EQ(mb_device_db_find_by_codename(db, "unknown"), nullptr);
+    ASSERT_EQ(errno, ENOENT);
+
+    mb_device_db_free(db);
+}
+
+TEST_F(DeviceDbTest, DuplicateCodenameUsesFirstDevice)
+{
+    add_device("first", { "shared" });
+    add_device("second", { "shared", "other" });
+    write_db();
+
+    MbDeviceDb *db = mb_device_db_new_from_data(_data, _size);
+    ASSERT_NE(db, nullptr);
+
+    Device *found = mb_device_db_find_by_codename(db, "shared");
+    ASSERT_NE(found, nullptr);
+    ASSERT_STREQ(mb_device_id(found), "first");
+    mb_device_free(found);
+
+    found = mb_device_db_find_by_codename(db, "other");
+    ASSERT_NE(found, nullptr);
+    ASSERT_STREQ(mb_device_id(found), "second");
+    mb_device_free(found);
+
+    mb_device_db_free(db);
+}
+
+TEST_F(DeviceDbTest, EmptyDatabase)
+{
+    write_db();
+
+    MbDeviceDb *db = mb_device_db_new_from_data(_data, _size);
+    ASSERT_NE(db, nullptr);
+    ASSERT_EQ(mb_device_db_count(db), 0u);
+
+    errno = 0;
+    ASSERT_EQ(mb_device_db_find_by_codename(db, "test"), nullptr);
+    ASSERT_EQ(errno, ENOENT);
+
+    mb_device_db_free(db);
+}
+
+TEST_F(DeviceDbTest, RejectInvalidData)
+{
+    add_device("test", { "test" });
+    write_db();
+
+    // Bad magic
+    {
+        std::vector<unsigned char> data(
+                static_cast<unsigned char *>(_data),
+                static_cast<unsigned char *>(_data) + _size);
+        data[0] = 'X';
+
+        errno = 0;
+        ASSERT_EQ(mb_device_db_new_from_data(data.data(), data.size()),
+                  nullptr);
+        ASSERT_EQ(errno, EINVAL);
+    }
+
+    // Truncated
+    for (size_t size : { size_t(0), size_t(16), _size - 1 }) {
+        errno = 0;
+        ASSERT_EQ(mb_device_db_new_from_data(_data, size), nullptr);
+        ASSERT_EQ(errno, EINVAL);
+    }
+}
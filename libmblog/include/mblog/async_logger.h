@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <memory>
+
+#include <cstddef>
+#include <cstdint>
+
+// Maximum length of a formatted message (including the NULL terminator)
+#define ASYNC_LOG_MSG_SIZE          512
+// Default number of messages that can be queued per thread
+#define ASYNC_LOG_DEFAULT_SLOTS     256
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Logger that moves the writes of another logger to a separate thread
+ *
+ * Each logging thread formats its messages into its own fixed-size ring
+ * buffer, which does not require any locks. A background thread periodically
+ * drains all of the ring buffers and passes the messages, in the order they
+ * were logged, to the wrapped logger.
+ *
+ * If a thread's ring buffer is full, new messages from that thread are dropped
+ * instead of blocking the caller. The number of dropped messages is reported
+ * through the wrapped logger the next time the buffers are drained.
+ *
+ * Messages are written out when:
+ *
+ * - the background thread wakes up (at least every 100ms)
+ * - flush() or mb::log::log_flush() is called
+ * - the logger is destroyed (including during normal process exit)
+ * - the process receives a fatal signal (if a \p crash_fd is given). The
+ *   messages are then written directly to that file descriptor.
+ *
+ * After a fork(), the child process has no background thread, so messages
+ * logged in the child are written synchronously.
+ */
+class MB_EXPORT AsyncLogger : public BaseLogger
+{
+public:
+    AsyncLogger(std::shared_ptr<BaseLogger> logger,
+                std::size_t slots = ASYNC_LOG_DEFAULT_SLOTS,
+                int crash_fd = -1);
+
+    virtual ~AsyncLogger();
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+
+    virtual void flush() override;
+
+    uint64_t logged() const;
+    uint64_t dropped() const;
+
+    AsyncLogger(const AsyncLogger &) = delete;
+    AsyncLogger & operator=(const AsyncLogger &) = delete;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+}
+}
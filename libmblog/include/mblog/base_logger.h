@@ -32,7 +32,16 @@ namespace log
 class MB_EXPORT BaseLogger
 {
 public:
+    virtual ~BaseLogger() {}
+
     virtual void log(LogLevel prio, const char *fmt, va_list ap) = 0;
+
+    /*!
+     * \brief Write out any messages that have not been written yet
+     *
+     * Loggers that write messages immediately do not need to override this.
+     */
+    virtual void flush() {}
 };
 
 }
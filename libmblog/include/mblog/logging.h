@@ -50,6 +50,7 @@ MB_EXPORT void log_set_logger(std::shared_ptr<BaseLogger> logger);
 MB_PRINTF(2, 3)
 MB_EXPORT void log(LogLevel prio, const char *fmt, ...);
 MB_EXPORT void logv(LogLevel prio, const char *fmt, va_list ap);
+MB_EXPORT void log_flush();
 
 }
 }
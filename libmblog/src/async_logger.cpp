@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/async_logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define FLUSH_INTERVAL_MS           100
+
+namespace mb
+{
+namespace log
+{
+
+struct Slot
+{
+    LogLevel prio;
+    uint64_t seq;
+    // Length of the message, which is followed by a newline instead of a NULL
+    // terminator so that the crash handler can write it as-is
+    std::size_t len;
+    char msg[ASYNC_LOG_MSG_SIZE];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds
+// AsyncLogger::Impl::write_mutex) ring buffer
+struct Ring
+{
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    std::atomic<std::size_t> head;
+    std::atomic<std::size_t> tail;
+    std::atomic<uint64_t> dropped;
+    // Cleared when the owning thread exits so that the ring can be reused by
+    // another thread
+    std::atomic<bool> in_use;
+    // Next ring in AsyncLogger::Impl::rings. Rings are never removed from the
+    // list while the logger exists, so the crash handler can walk it without
+    // locking.
+    std::atomic<Ring *> next;
+    // Read position of the crash handler
+    std::size_t crash_pos;
+
+    explicit Ring(std::size_t capacity)
+        : slots(new Slot[capacity]), mask(capacity - 1), head(0), tail(0),
+          dropped(0), in_use(true), next(nullptr), crash_pos(0)
+    {
+    }
+};
+
+struct PendingMessage
+{
+    uint64_t seq;
+    const Slot *slot;
+};
+
+// Incremented in child processes after fork()
+static std::atomic<unsigned int> fork_generation(0);
+
+static const int crash_signals[] = {
+    SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV,
+};
+
+#define CRASH_SIGNALS_COUNT \
+    (sizeof(crash_signals) / sizeof(crash_signals[0]))
+
+class AsyncLogger::Impl
+{
+public:
+    std::shared_ptr<BaseLogger> logger;
+    std::size_t capacity;
+    int crash_fd;
+    bool flush_on_crash;
+    unsigned int generation;
+
+    // Per-thread rings. The thread-specific value is the thread's Ring.
+    pthread_key_t key;
+    std::atomic<Ring *> rings;
+
+    // Held while draining and while writing to the wrapped logger
+    std::mutex write_mutex;
+
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> logged;
+    std::atomic<uint64_t> dropped;
+
+    // Flusher thread
+    pthread_t thread;
+    bool thread_started;
+    std::mutex thread_mutex;
+    std::condition_variable thread_cv;
+    bool stop;
+    std::atomic<bool> waiting;
+
+    // Logger that writes out queued messages on fatal signals
+    static std::atomic<Impl *> crash_logger;
+    static struct sigaction old_crash_actions[CRASH_SIGNALS_COUNT];
+
+    Ring * get_ring();
+    void write_sync(LogLevel prio, const char *fmt, ...);
+    void drain();
+    void write_crash();
+
+    static void * flusher_thread(void *userdata);
+    static void ring_key_destructor(void *ptr);
+    static void crash_handler(int sig);
+    static void fork_child_handler();
+};
+
+std::atomic<AsyncLogger::Impl *> AsyncLogger::Impl::crash_logger(nullptr);
+struct sigaction AsyncLogger::Impl::old_crash_actions[CRASH_SIGNALS_COUNT];
+
+/*!
+ * \brief Get the calling thread's ring, assigning one if needed
+ *
+ * Rings left behind by threads that have exited are reused before new ones are
+ * allocated, so the number of rings is bounded by the number of threads that
+ * log concurrently.
+ */
+Ring * AsyncLogger::Impl::get_ring()
+{
+    Ring *ring = static_cast<Ring *>(pthread_getspecific(key));
+    if (ring) {
+        return ring;
+    }
+
+    for (ring = rings.load(std::memory_order_acquire); ring;
+            ring = ring->next.load(std::memory_order_acquire)) {
+        bool expected = false;
+        if (ring->in_use.compare_exchange_strong(
+                expected, true, std::memory_order_acq_rel)) {
+            break;
+        }
+    }
+
+    if (!ring) {
+        try {
+            ring = new Ring(capacity);
+        } catch (const std::bad_alloc &) {
+            return nullptr;
+        }
+
+        Ring *first = rings.load(std::memory_order_relaxed);
+        do {
+            ring->next.store(first, std::memory_order_relaxed);
+        } while (!rings.compare_exchange_weak(
+                first, ring, std::memory_order_release,
+                std::memory_order_relaxed));
+    }
+
+    if (pthread_setspecific(key, ring) != 0) {
+        ring->in_use.store(false, std::memory_order_release);
+        return nullptr;
+    }
+
+    return ring;
+}
+
+void AsyncLogger::Impl::write_sync(LogLevel prio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    logger->log(prio, fmt, ap);
+    va_end(ap);
+}
+
+/*!
+ * \brief Write all queued messages to the wrapped logger
+ */
+void AsyncLogger::Impl::drain()
+{
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+
+    std::vector<std::pair<Ring *, std::size_t>> heads;
+    std::vector<PendingMessage> pending;
+    uint64_t new_drops = 0;
+
+    for (Ring *ring = rings.load(std::memory_order_acquire); ring;
+            ring = ring->next.load(std::memory_order_acquire)) {
+        std::size_t tail = ring->tail.load(std::memory_order_relaxed);
+        std::size_t head = ring->head.load(std::memory_order_acquire);
+
+        for (std::size_t j = tail; j != head; ++j) {
+            const Slot *slot = &ring->slots[j & ring->mask];
+            pending.push_back({ slot->seq, slot });
+        }
+
+        heads.emplace_back(ring, head);
+        new_drops += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    // Each ring is already ordered, but interleave messages from different
+    // threads in the order they were logged
+    std::sort(pending.begin(), pending.end(),
+              [](const PendingMessage &a, const PendingMessage &b) {
+        return a.seq < b.seq;
+    });
+
+    for (const PendingMessage &msg : pending) {
+        write_sync(msg.slot->prio, "%.*s",
+                   static_cast<int>(msg.slot->len), msg.slot->msg);
+    }
+
+    if (new_drops > 0) {
+        dropped.fetch_add(new_drops, std::memory_order_relaxed);
+        write_sync(LogLevel::Warning,
+                   "[%llu log messages dropped because the buffer was full]",
+                   static_cast<unsigned long long>(new_drops));
+    }
+
+    logger->flush();
+
+    // Release the slots back to the producers
+    for (auto const &item : heads) {
+        item.first->tail.store(item.second, std::memory_order_release);
+    }
+}
+
+/*!
+ * \brief Write queued messages to the crash file descriptor
+ *
+ * This runs in a fatal signal handler, so it only reads the preallocated rings
+ * and calls write(2). It does not lock, allocate, or call the wrapped logger.
+ * Messages from different threads are merged in the order they were logged. If
+ * the flusher thread is writing out messages at the same time, some of them
+ * may be written twice.
+ */
+void AsyncLogger::Impl::write_crash()
+{
+    Ring *first = rings.load(std::memory_order_acquire);
+
+    for (Ring *ring = first; ring;
+            ring = ring->next.load(std::memory_order_acquire)) {
+        ring->crash_pos = ring->tail.load(std::memory_order_acquire);
+    }
+
+    while (true) {
+        Ring *next_ring = nullptr;
+        const Slot *next_slot = nullptr;
+
+        for (Ring *ring = first; ring;
+                ring = ring->next.load(std::memory_order_acquire)) {
+            if (ring->crash_pos == ring->head.load(std::memory_order_acquire)) {
+                continue;
+            }
+
+            const Slot *slot = &ring->slots[ring->crash_pos & ring->mask];
+            if (!next_slot || slot->seq < next_slot->seq) {
+                next_ring = ring;
+                next_slot = slot;
+            }
+        }
+
+        if (!next_slot) {
+            break;
+        }
+
+        // Include the trailing newline
+        std::size_t len = std::min<std::size_t>(next_slot->len + 1,
+                                                sizeof(next_slot->msg));
+        const char *ptr = next_slot->msg;
+
+        while (len > 0) {
+            ssize_t n = write(crash_fd, ptr, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                return;
+            }
+            ptr += n;
+            len -= n;
+        }
+
+        ++next_ring->crash_pos;
+    }
+}
+
+void * AsyncLogger::Impl::flusher_thread(void *userdata)
+{
+    Impl *impl = static_cast<Impl *>(userdata);
+
+    // Fatal signals should be handled by the thread that caused them
+    sigset_t set;
+    sigfillset(&set);
+    for (int sig : crash_signals) {
+        sigdelset(&set, sig);
+    }
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    std::unique_lock<std::mutex> lock(impl->thread_mutex);
+
+    while (!impl->stop) {
+        impl->waiting.store(true, std::memory_order_relaxed);
+        impl->thread_cv.wait_for(
+                lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+        impl->waiting.store(false, std::memory_order_relaxed);
+
+        lock.unlock();
+        impl->drain();
+        lock.lock();
+    }
+
+    return nullptr;
+}
+
+void AsyncLogger::Impl::ring_key_destructor(void *ptr)
+{
+    // Any queued messages are still written out by the next drain
+    static_cast<Ring *>(ptr)->in_use.store(false, std::memory_order_release);
+}
+
+void AsyncLogger::Impl::crash_handler(int sig)
+{
+    // Only the first thread to crash writes out the messages
+    Impl *impl = crash_logger.exchange(nullptr);
+    if (impl && impl->generation == fork_generation.load()) {
+        int saved_errno = errno;
+        impl->write_crash();
+        errno = saved_errno;
+    }
+
+    // Restore the previous handler and let it deal with the signal
+    for (std::size_t i = 0; i < CRASH_SIGNALS_COUNT; ++i) {
+        if (crash_signals[i] == sig) {
+            sigaction(sig, &old_crash_actions[i], nullptr);
+            break;
+        }
+    }
+
+    raise(sig);
+}
+
+void AsyncLogger::Impl::fork_child_handler()
+{
+    fork_generation.fetch_add(1);
+}
+
+/*!
+ * \brief Construct new AsyncLogger
+ *
+ * \param logger Logger to write the messages to. It will only be called from
+ *               one thread at a time.
+ * \param slots Number of messages that can be queued per thread (rounded up to
+ *              a power of 2)
+ * \param crash_fd If not -1, install handlers for fatal signals that write the
+ *                 queued messages to this file descriptor, one per line, before
+ *                 the process dies. The wrapped logger is not used since it is
+ *                 not safe to call from a signal handler. The file descriptor
+ *                 must remain open for the lifetime of the logger. Only one
+ *                 AsyncLogger can have this enabled.
+ */
+AsyncLogger::AsyncLogger(std::shared_ptr<BaseLogger> logger,
+                         std::size_t slots, int crash_fd)
+    : _impl(new Impl())
+{
+    static std::once_flag fork_once;
+    std::call_once(fork_once, []{
+        pthread_atfork(nullptr, nullptr, &Impl::fork_child_handler);
+    });
+
+    std::size_t capacity = 1;
+    while (capacity < slots) {
+        capacity <<= 1;
+    }
+
+    _impl->logger = std::move(logger);
+    _impl->capacity = capacity;
+    _impl->crash_fd = crash_fd;
+    _impl->flush_on_crash = false;
+    _impl->rings = nullptr;
+    _impl->generation = fork_generation.load();
+    _impl->seq = 0;
+    _impl->logged = 0;
+    _impl->dropped = 0;
+    _impl->thread_started = false;
+    _impl->stop = false;
+    _impl->waiting = false;
+
+    if (pthread_key_create(&_impl->key, &Impl::ring_key_destructor) != 0) {
+        // Without per-thread rings, every message is written synchronously
+        return;
+    }
+
+    _impl->thread_started = pthread_create(
+            &_impl->thread, nullptr, &Impl::flusher_thread, _impl.get()) == 0;
+
+    if (_impl->thread_started && crash_fd >= 0) {
+        Impl *expected = nullptr;
+        if (Impl::crash_logger.compare_exchange_strong(
+                expected, _impl.get())) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = &Impl::crash_handler;
+            sigemptyset(&sa.sa_mask);
+
+            for (std::size_t i = 0; i < CRASH_SIGNALS_COUNT; ++i) {
+                sigaction(crash_signals[i], &sa,
+                          &Impl::old_crash_actions[i]);
+            }
+
+            _impl->flush_on_crash = true;
+        }
+    }
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    if (_impl->flush_on_crash) {
+        for (std::size_t i = 0; i < CRASH_SIGNALS_COUNT; ++i) {
+            sigaction(crash_signals[i], &Impl::old_crash_actions[i], nullptr);
+        }
+        Impl::crash_logger.store(nullptr);
+    }
+
+    // The flusher thread does not exist in a forked child and the queued
+    // messages belong to the parent
+    if (_impl->generation != fork_generation.load()) {
+        return;
+    }
+
+    if (_impl->thread_started) {
+        {
+            std::lock_guard<std::mutex> lock(_impl->thread_mutex);
+            _impl->stop = true;
+        }
+        _impl->thread_cv.notify_one();
+        pthread_join(_impl->thread, nullptr);
+
+        _impl->drain();
+
+        // Destructors do not run for keys that are deleted, but the
+        // thread-specific values are only pointers into the ring list
+        pthread_key_delete(_impl->key);
+    }
+
+    for (Ring *ring = _impl->rings.load(); ring;) {
+        Ring *next = ring->next.load();
+        delete ring;
+        ring = next;
+    }
+}
+
+void AsyncLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    _impl->logged.fetch_add(1, std::memory_order_relaxed);
+
+    Ring *ring = nullptr;
+    bool forked = _impl->generation != fork_generation.load(
+            std::memory_order_relaxed);
+
+    if (_impl->thread_started && !forked) {
+        ring = _impl->get_ring();
+    }
+
+    if (!ring) {
+        // Single-threaded after a fork, so the lock may be in an undefined
+        // state. Don't touch it.
+        if (forked) {
+            _impl->logger->log(prio, fmt, ap);
+        } else {
+            std::lock_guard<std::mutex> lock(_impl->write_mutex);
+            _impl->logger->log(prio, fmt, ap);
+        }
+        return;
+    }
+
+    std::size_t head = ring->head.load(std::memory_order_relaxed);
+    std::size_t tail = ring->tail.load(std::memory_order_acquire);
+
+    if (head - tail > ring->mask) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Slot &slot = ring->slots[head & ring->mask];
+    slot.prio = prio;
+    slot.seq = _impl->seq.fetch_add(1, std::memory_order_relaxed);
+
+    int len = vsnprintf(slot.msg, sizeof(slot.msg), fmt, ap);
+    if (len < 0) {
+        slot.len = 0;
+    } else if (static_cast<std::size_t>(len) >= sizeof(slot.msg)) {
+        // Make user aware of any truncation
+        static const char trunc[] = " [trunc...]";
+        memcpy(slot.msg + sizeof(slot.msg) - sizeof(trunc),
+               trunc, sizeof(trunc));
+        slot.len = sizeof(slot.msg) - 1;
+    } else {
+        slot.len = len;
+    }
+    slot.msg[slot.len] = '\n';
+
+    ring->head.store(head + 1, std::memory_order_release);
+
+    // Wake up the flusher if the ring is getting full
+    if (head - tail >= ring->mask / 2
+            && _impl->waiting.load(std::memory_order_relaxed)) {
+        _impl->thread_cv.notify_one();
+    }
+}
+
+/*!
+ * \brief Synchronously write all queued messages
+ *
+ * When this function returns, every message logged by the calling thread
+ * before the call has been passed to the wrapped logger.
+ */
+void AsyncLogger::flush()
+{
+    if (!_impl->thread_started
+            || _impl->generation != fork_generation.load()) {
+        return;
+    }
+
+    _impl->drain();
+}
+
+/*!
+ * \brief Number of messages passed to log()
+ */
+uint64_t AsyncLogger::logged() const
+{
+    return _impl->logged.load(std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Number of messages that were dropped and reported
+ *
+ * Messages that were dropped, but not yet reported by the flusher are not
+ * included.
+ */
+uint64_t AsyncLogger::dropped() const
+{
+    return _impl->dropped.load(std::memory_order_relaxed);
+}
+
+}
+}
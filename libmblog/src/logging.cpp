@@ -19,9 +19,11 @@
 
 #include "mblog/logging.h"
 
+#include <mutex>
 #include <string>
 
 #include <cerrno>
+#include <cstdlib>
 
 #include "mblog/stdio_logger.h"
 
@@ -43,8 +45,20 @@ void set_log_tag(const char *tag)
     log_tag = tag;
 }
 
+static void log_flush_at_exit()
+{
+    log_flush();
+}
+
 void log_set_logger(std::shared_ptr<BaseLogger> logger_local)
 {
+    static std::once_flag once;
+
+    // Buffered messages should be written out on a normal exit
+    std::call_once(once, []{
+        atexit(&log_flush_at_exit);
+    });
+
     logger = std::move(logger_local);
 }
 
@@ -71,5 +85,22 @@ void logv(LogLevel prio, const char *fmt, va_list ap)
     errno = saved_errno;
 }
 
+/*!
+ * \brief Write out any messages buffered by the current logger
+ *
+ * This should be called before the process is replaced or the device is
+ * rebooted, since buffered messages will otherwise be lost.
+ */
+void log_flush()
+{
+    int saved_errno = errno;
+
+    if (logger) {
+        logger->flush();
+    }
+
+    errno = saved_errno;
+}
+
 }
 }
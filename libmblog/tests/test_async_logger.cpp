@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mblog/async_logger.h"
+
+using namespace mb::log;
+
+class RecordingLogger : public BaseLogger
+{
+public:
+    std::mutex mutex;
+    std::vector<std::string> messages;
+    unsigned int flushes = 0;
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override
+    {
+        (void) prio;
+
+        char buf[1024];
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        messages.push_back(buf);
+    }
+
+    virtual void flush() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++flushes;
+    }
+};
+
+static void log_to(BaseLogger &logger, LogLevel prio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    logger.log(prio, fmt, ap);
+    va_end(ap);
+}
+
+TEST(AsyncLoggerTest, FlushWritesInOrder)
+{
+    auto inner = std::make_shared<RecordingLogger>();
+    AsyncLogger logger(inner);
+
+    for (int i = 0; i < 100; ++i) {
+        log_to(logger, LogLevel::Info, "message %d", i);
+    }
+
+    logger.flush();
+
+    ASSERT_EQ(inner->messages.size(), 100u);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(inner->messages[i], "message " + std::to_string(i));
+    }
+    ASSERT_GE(inner->flushes, 1u);
+    ASSERT_EQ(logger.logged(), 100u);
+    ASSERT_EQ(logger.dropped(), 0u);
+}
+
+TEST(AsyncLoggerTest, DestructorWritesQueuedMessages)
+{
+    auto inner = std::make_shared<RecordingLogger>();
+
+    {
+        AsyncLogger logger(inner);
+        log_to(logger, LogLevel::Info, "before destruction");
+    }
+
+    ASSERT_EQ(inner->messages.size(), 1u);
+    ASSERT_EQ(inner->messages[0], "before destruction");
+}
+
+TEST(AsyncLoggerTest, FullBufferDropsAndReports)
+{
+    auto inner = std::make_shared<RecordingLogger>();
+    AsyncLogger logger(inner, 4);
+
+    // Hold the inner logger's lock so the flusher cannot make progress
+    {
+        std::lock_guard<std::mutex> lock(inner->mutex);
+
+        for (int i = 0; i < 10; ++i) {
+            log_to(logger, LogLevel::Info, "message %d", i);
+        }
+    }
+
+    logger.flush();
+
+    ASSERT_EQ(logger.logged(), 10u);
+
+    // The flusher may have drained some messages while the loop was running,
+    // but every message is either written or counted as dropped
+    std::size_t written = 0;
+    for (auto const &msg : inner->messages) {
+        if (msg.find("dropped") == std::string::npos) {
+            ++written;
+        }
+    }
+    ASSERT_EQ(written + logger.dropped(), 10u);
+    ASSERT_GE(written, 4u);
+}
+
+TEST(AsyncLoggerTest, LongMessageIsTruncated)
+{
+    auto inner = std::make_shared<RecordingLogger>();
+    AsyncLogger logger(inner);
+
+    std::string long_msg(ASYNC_LOG_MSG_SIZE * 2, 'x');
+    log_to(logger, LogLevel::Info, "%s", long_msg.c_str());
+    logger.flush();
+
+    ASSERT_EQ(inner->messages.size(), 1u);
+    ASSERT_EQ(inner->messages[0].size(), ASYNC_LOG_MSG_SIZE - 1);
+    ASSERT_NE(inner->messages[0].find("[trunc...]"), std::string::npos);
+}
+
+TEST(AsyncLoggerTest, MultipleThreadsKeepPerThreadOrder)
+{
+    static const int threads_count = 4;
+    static const int messages_count = 50;
+
+    auto inner = std::make_shared<RecordingLogger>();
+    AsyncLogger logger(inner, 1024);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_count; ++t) {
+        threads.emplace_back([&logger, t]{
+            for (int i = 0; i < messages_count; ++i) {
+                log_to(logger, LogLevel::Debug, "%d %d", t, i);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    logger.flush();
+
+    ASSERT_EQ(inner->messages.size(),
+              static_cast<std::size_t>(threads_count * messages_count));
+
+    int next[threads_count] = {};
+    for (auto const &msg : inner->messages) {
+        int t, i;
+        ASSERT_EQ(sscanf(msg.c_str(), "%d %d", &t, &i), 2);
+        ASSERT_EQ(i, next[t]);
+        ++next[t];
+    }
+}
+
+TEST(AsyncLoggerTest, ExitedThreadsMessagesAreWritten)
+{
+    auto inner = std::make_shared<RecordingLogger>();
+    AsyncLogger logger(inner);
+
+    // Each thread exits before the next one starts, so the later threads reuse
+    // the rings of the earlier ones
+    for (int t = 0; t < 8; ++t) {
+        std::thread([&logger, t]{
+            log_to(logger, LogLevel::Info, "thread %d", t);
+        }).join();
+    }
+
+    logger.flush();
+
+    ASSERT_EQ(inner->messages.size(), 8u);
+    for (int t = 0; t < 8; ++t) {
+        ASSERT_EQ(inner->messages[t], "thread " + std::to_string(t));
+    }
+}
+
+TEST(AsyncLoggerTest, CrashWritesQueuedMessagesToFd)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        close(fds[0]);
+
+        auto inner = std::make_shared<RecordingLogger>();
+        AsyncLogger logger(inner, ASYNC_LOG_DEFAULT_SLOTS, fds[1]);
+
+        // Keep the flusher from writing anything out before the crash
+        std::lock_guard<std::mutex> lock(inner->mutex);
+
+        log_to(logger, LogLevel::Info, "first");
+        std::thread([&logger]{
+            log_to(logger, LogLevel::Info, "second");
+        }).join();
+        log_to(logger, LogLevel::Info, "third");
+
+        raise(SIGSEGV);
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    std::string output;
+    char buf[256];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+        output.append(buf, n);
+    }
+    close(fds[0]);
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFSIGNALED(status));
+    ASSERT_EQ(WTERMSIG(status), SIGSEGV);
+    ASSERT_EQ(output, "first\nsecond\nthird\n");
+}
@@ -0,0 +1,1166 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// End-to-end benchmarks for the libmbp patchers.
+//
+// A synthetic flashable zip (with an updater-script containing many mount,
+// unmount, and format calls and a boot image built with libmbbootimg) and a
+// synthetic Odin tar.md5 (with a nested CSC tar.md5) are generated in a
+// temporary directory along with a fake data directory. Each patcher is then
+// run through the public PatcherConfig/Patcher API.
+//
+// Per-phase times are derived from the patcher callbacks:
+//
+// - setup:         patchFile() was called, but nothing was reported yet
+// - input:         entries from the input archive are being processed
+// - support_files: files from the data directory and generated files are
+//                  being added
+// - finalize:      after the last callback until patchFile() returns
+//
+// Patchers that do not report progress (RamdiskUpdater) will have all of their
+// time attributed to the setup phase.
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <openssl/md5.h>
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+#include "mbcommon/version.h"
+#include "mbdevice/device.h"
+#include "mblog/logging.h"
+#include "mbp/patcherconfig.h"
+#include "mbp/patcherinterface.h"
+#include "mbpio/delete.h"
+#include "mbpio/directory.h"
+
+#include "minizip/zip.h"
+
+#define BENCHMARK_SCHEMA_VERSION    1
+
+#define MIB                         (1024 * 1024)
+#define CHUNK_SIZE                  (1 * MIB)
+
+#define DEVICE_ARCH                 "armeabi-v7a"
+#define BLOCK_DEV_BASE              "/dev/block/platform/msm_sdcc.1/by-name"
+#define SYSTEM_BLOCK_DEV            BLOCK_DEV_BASE "/system"
+#define CACHE_BLOCK_DEV             BLOCK_DEV_BASE "/cache"
+#define DATA_BLOCK_DEV              BLOCK_DEV_BASE "/userdata"
+#define BOOT_BLOCK_DEV              BLOCK_DEV_BASE "/boot"
+
+#define UPDATER_SCRIPT              "META-INF/com/google/android/updater-script"
+#define UPDATE_BINARY               "META-INF/com/google/android/update-binary"
+
+typedef std::unique_ptr<Device, decltype(mb_device_free) *> ScopedDevice;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<archive, decltype(archive_write_free) *> ScopedArchive;
+typedef std::unique_ptr<archive_entry, decltype(archive_entry_free) *>
+        ScopedArchiveEntry;
+typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
+
+class ErrorLogger : public mb::log::BaseLogger
+{
+public:
+    virtual void log(mb::log::LogLevel prio, const char *fmt, va_list ap) override
+    {
+        if (prio == mb::log::LogLevel::Error) {
+            vfprintf(stderr, fmt, ap);
+            fputc('\n', stderr);
+        }
+    }
+};
+
+struct Options
+{
+    unsigned int entries = 1000;
+    uint64_t entry_size = 64 * 1024;
+    unsigned int script_calls = 300;
+    uint64_t boot_size = 16 * MIB;
+    uint64_t system_size = 128 * MIB;
+    unsigned int iterations = 3;
+    std::string tmpdir;
+};
+
+
+// Synthetic data
+
+class RandomStream
+{
+public:
+    explicit RandomStream(uint64_t seed)
+        : _x(seed ? seed : 0x9e3779b97f4a7c15ull)
+    {
+    }
+
+    void fill(unsigned char *buf, size_t size)
+    {
+        // xorshift64 so the inputs are identical across runs
+        for (size_t i = 0; i < size; ++i) {
+            if (i % 8 == 0) {
+                _x ^= _x << 13;
+                _x ^= _x >> 7;
+                _x ^= _x << 17;
+            }
+            buf[i] = static_cast<unsigned char>(_x >> ((i % 8) * 8));
+        }
+    }
+
+private:
+    uint64_t _x;
+};
+
+template<typename WriteFn>
+static bool write_random(uint64_t seed, uint64_t size, WriteFn write_fn)
+{
+    std::vector<unsigned char> buf(std::min<uint64_t>(size, CHUNK_SIZE));
+    RandomStream rs(seed);
+
+    while (size > 0) {
+        size_t n = std::min<uint64_t>(size, buf.size());
+        rs.fill(buf.data(), n);
+        if (!write_fn(buf.data(), n)) {
+            return false;
+        }
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_random_file(const std::string &path, uint64_t seed,
+                              uint64_t size)
+{
+    ScopedFILE fp(fopen(path.c_str(), "wb"), &fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret = write_random(seed, size, [&](const void *buf, size_t n) {
+        return fwrite(buf, 1, n, fp.get()) == n;
+    });
+
+    if (!ret || fclose(fp.release()) != 0) {
+        fprintf(stderr, "%s: Failed to write: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static uint64_t file_size(const std::string &path)
+{
+    struct stat sb;
+    return stat(path.c_str(), &sb) == 0 ? sb.st_size : 0;
+}
+
+static std::string create_updater_script(unsigned int calls)
+{
+    static const char *mount_points[][2] = {
+        { SYSTEM_BLOCK_DEV, "/system" },
+        { CACHE_BLOCK_DEV,  "/cache"  },
+        { DATA_BLOCK_DEV,   "/data"   },
+    };
+
+    std::string script;
+    char buf[512];
+
+    script += "ui_print(\"Installing synthetic benchmark ROM\");\n";
+    script += "show_progress(0.500000, 0);\n";
+
+    for (unsigned int i = 0; i < calls; ++i) {
+        const char *dev = mount_points[i % 3][0];
+        const char *mnt = mount_points[i % 3][1];
+
+        switch (i % 4) {
+        case 0:
+            snprintf(buf, sizeof(buf),
+                     "ifelse(is_mounted(\"%s\"), unmount(\"%s\"));\n",
+                     mnt, mnt);
+            break;
+        case 1:
+            snprintf(buf, sizeof(buf),
+                     "format(\"ext4\", \"EMMC\", \"%s\", \"0\", \"%s\");\n",
+                     dev, mnt);
+            break;
+        case 2:
+            snprintf(buf, sizeof(buf),
+                     "mount(\"ext4\", \"EMMC\", \"%s\", \"%s\", "
+                     "\"max_batch_time=0,commit=1,data=ordered,barrier=1\");\n",
+                     dev, mnt);
+            break;
+        case 3:
+            snprintf(buf, sizeof(buf),
+                     "run_program(\"/sbin/busybox\", \"mount\", \"%s\");\n"
+                     "unmount(\"%s\");\n",
+                     mnt, mnt);
+            break;
+        }
+
+        script += buf;
+    }
+
+    script += "mount(\"ext4\", \"EMMC\", \"" SYSTEM_BLOCK_DEV "\", "
+              "\"/system\");\n";
+    script += "package_extract_dir(\"system\", \"/system\");\n";
+    script += "set_metadata_recursive(\"/system\", \"uid\", 0, \"gid\", 0, "
+              "\"dmode\", 0755, \"fmode\", 0644, "
+              "\"capabilities\", 0x0, \"selabel\", "
+              "\"u:object_r:system_file:s0\");\n";
+    script += "package_extract_file(\"boot.img\", \"" BOOT_BLOCK_DEV "\");\n";
+    script += "unmount(\"/system\");\n";
+
+    return script;
+}
+
+static bool create_boot_image(const std::string &path, uint64_t size)
+{
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw
+            || mb_bi_writer_set_format_android(biw.get()) != MB_BI_OK
+            || mb_bi_writer_open_filename(biw.get(), path.c_str()) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK
+            || mb_bi_header_set_page_size(header, 2048) != MB_BI_OK
+            || mb_bi_header_set_kernel_cmdline(
+                    header, "console=null androidboot.hardware=qcom")
+                    != MB_BI_OK
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        goto error;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(entry);
+        uint64_t entry_size = 0;
+
+        if (type == MB_BI_ENTRY_KERNEL) {
+            entry_size = size / 2;
+        } else if (type == MB_BI_ENTRY_RAMDISK) {
+            entry_size = size - size / 2;
+        }
+
+        if (mb_bi_writer_write_entry(biw.get(), entry) != MB_BI_OK
+                || !write_random(type, entry_size,
+                                 [&](const void *buf, size_t n) {
+                    size_t n_written;
+                    return mb_bi_writer_write_data(biw.get(), buf, n,
+                                                   &n_written) == MB_BI_OK
+                            && n_written == n;
+                })) {
+            goto error;
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        goto error;
+    }
+
+    return true;
+
+error:
+    fprintf(stderr, "%s: Failed to create boot image: %s\n",
+            path.c_str(), mb_bi_writer_error_string(biw.get()));
+    return false;
+}
+
+
+// Flashable zip
+
+static bool zip_add_entry(zipFile zf, const std::string &name,
+                          uint64_t size, uint64_t seed,
+                          const std::string *contents)
+{
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+
+    int ret = zipOpenNewFileInZip2_64(
+        zf,                     // file
+        name.c_str(),           // filename
+        &zi,                    // zip_fileinfo
+        nullptr,                // extrafield_local
+        0,                      // size_extrafield_local
+        nullptr,                // extrafield_global
+        0,                      // size_extrafield_global
+        nullptr,                // comment
+        Z_DEFLATED,             // method
+        Z_DEFAULT_COMPRESSION,  // level
+        0,                      // raw
+        size > UINT32_MAX       // zip64
+    );
+    if (ret != ZIP_OK) {
+        fprintf(stderr, "minizip: Failed to open %s (error code: %d)\n",
+                name.c_str(), ret);
+        return false;
+    }
+
+    bool ok;
+
+    if (contents) {
+        ok = zipWriteInFileInZip(zf, contents->data(), contents->size())
+                == ZIP_OK;
+    } else {
+        ok = write_random(seed, size, [&](const void *buf, size_t n) {
+            return zipWriteInFileInZip(zf, buf, n) == ZIP_OK;
+        });
+    }
+
+    ret = zipCloseFileInZip(zf);
+    if (!ok || ret != ZIP_OK) {
+        fprintf(stderr, "minizip: Failed to write %s\n", name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool zip_add_file(zipFile zf, const std::string &name,
+                         const std::string &path)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), &fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string contents;
+    char buf[10240];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
+        contents.append(buf, n);
+    }
+
+    return zip_add_entry(zf, name, contents.size(), 0, &contents);
+}
+
+static bool create_rom_zip(const Options &opts, const std::string &path,
+                           const std::string &boot_image,
+                           std::unordered_set<std::string> &names)
+{
+    zipFile zf = zipOpen64(path.c_str(), 0);
+    if (!zf) {
+        fprintf(stderr, "%s: Failed to open for writing\n", path.c_str());
+        return false;
+    }
+
+    std::string script = create_updater_script(opts.script_calls);
+    std::string binary("#!/sbin/sh\nexit 0\n");
+    bool ok = true;
+
+    names.insert(UPDATER_SCRIPT);
+    ok = ok && zip_add_entry(zf, UPDATER_SCRIPT, script.size(), 0, &script);
+    names.insert(UPDATE_BINARY);
+    ok = ok && zip_add_entry(zf, UPDATE_BINARY, binary.size(), 0, &binary);
+    names.insert("boot.img");
+    ok = ok && zip_add_file(zf, "boot.img", boot_image);
+
+    for (unsigned int i = 0; ok && i < opts.entries; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "system/app/Bench%05u/Bench%05u.apk",
+                 i, i);
+        names.insert(name);
+        ok = zip_add_entry(zf, name, opts.entry_size, i + 1, nullptr);
+    }
+
+    if (zipClose(zf, nullptr) != ZIP_OK) {
+        ok = false;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: Failed to create zip\n", path.c_str());
+    }
+
+    return ok;
+}
+
+
+// Odin tar.md5
+
+struct TarSpec
+{
+    std::string name;
+    uint64_t size;
+    // Copy contents from this file instead of generating data
+    std::string source;
+};
+
+static bool tar_add(archive *a, const TarSpec &spec)
+{
+    ScopedArchiveEntry entry(archive_entry_new(), &archive_entry_free);
+    if (!entry) {
+        return false;
+    }
+
+    uint64_t size = spec.source.empty() ? spec.size : file_size(spec.source);
+
+    archive_entry_set_pathname(entry.get(), spec.name.c_str());
+    archive_entry_set_filetype(entry.get(), AE_IFREG);
+    archive_entry_set_perm(entry.get(), 0644);
+    archive_entry_set_size(entry.get(), size);
+
+    if (archive_write_header(a, entry.get()) != ARCHIVE_OK) {
+        fprintf(stderr, "libarchive: Failed to write header: %s\n",
+                archive_error_string(a));
+        return false;
+    }
+
+    auto write_fn = [&](const void *buf, size_t n) {
+        return archive_write_data(a, buf, n) == static_cast<la_ssize_t>(n);
+    };
+
+    if (spec.source.empty()) {
+        return write_random(size, size, write_fn);
+    }
+
+    ScopedFILE fp(fopen(spec.source.c_str(), "rb"), &fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                spec.source.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<unsigned char> buf(CHUNK_SIZE);
+    size_t n;
+
+    while ((n = fread(buf.data(), 1, buf.size(), fp.get())) > 0) {
+        if (!write_fn(buf.data(), n)) {
+            return false;
+        }
+    }
+
+    return !ferror(fp.get());
+}
+
+/*!
+ * \brief Create an Odin tar.md5 file
+ *
+ * The MD5 checksum of the tar data is appended in md5sum format, with the
+ * ".md5" suffix removed from the name.
+ */
+static bool create_tar_md5(const std::string &path,
+                           const std::vector<TarSpec> &specs)
+{
+    ScopedArchive a(archive_write_new(), &archive_write_free);
+    if (!a
+            || archive_write_set_format_ustar(a.get()) != ARCHIVE_OK
+            || archive_write_set_bytes_in_last_block(a.get(), 1) != ARCHIVE_OK
+            || archive_write_open_filename(a.get(), path.c_str())
+                    != ARCHIVE_OK) {
+        fprintf(stderr, "%s: Failed to open for writing\n", path.c_str());
+        return false;
+    }
+
+    for (const TarSpec &spec : specs) {
+        if (!tar_add(a.get(), spec)) {
+            return false;
+        }
+    }
+
+    if (archive_write_close(a.get()) != ARCHIVE_OK) {
+        fprintf(stderr, "libarchive: Failed to close: %s\n",
+                archive_error_string(a.get()));
+        return false;
+    }
+
+    // Append checksum
+    ScopedFILE fp(fopen(path.c_str(), "r+b"), &fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<unsigned char> buf(CHUNK_SIZE);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_CTX ctx;
+    size_t n;
+
+    MD5_Init(&ctx);
+    while ((n = fread(buf.data(), 1, buf.size(), fp.get())) > 0) {
+        MD5_Update(&ctx, buf.data(), n);
+    }
+    MD5_Final(digest, &ctx);
+
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    name.erase(name.size() - 4);
+
+    for (unsigned char c : digest) {
+        fprintf(fp.get(), "%02x", c);
+    }
+    fprintf(fp.get(), "  %s\n", name.c_str());
+
+    if (fclose(fp.release()) != 0) {
+        fprintf(stderr, "%s: Failed to write: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool create_odin_tar(const Options &opts, const std::string &dir,
+                            const std::string &path,
+                            const std::string &boot_image,
+                            std::unordered_set<std::string> &names)
+{
+    std::string csc_path = dir + "/CSC_BENCHMARK.tar.md5";
+
+    std::vector<TarSpec> csc{
+        { "cache.img.ext4", opts.system_size / 8, {} },
+        { "hidden.img.ext4", opts.system_size / 8, {} },
+    };
+    std::vector<TarSpec> ap{
+        { "boot.img", 0, boot_image },
+        { "recovery.img", 0, boot_image },
+        { "system.img.ext4", opts.system_size, {} },
+        { "modem.bin", opts.system_size / 4, {} },
+        { "CSC_BENCHMARK.tar.md5", 0, csc_path },
+    };
+
+    for (const TarSpec &spec : csc) {
+        names.insert(spec.name);
+    }
+    for (const TarSpec &spec : ap) {
+        names.insert(spec.name);
+    }
+
+    bool ok = create_tar_md5(csc_path, csc) && create_tar_md5(path, ap);
+    remove(csc_path.c_str());
+    return ok;
+}
+
+
+// Data directory
+
+static bool create_data_dir(const std::string &dir)
+{
+    static const char *binaries[] = {
+        "mbtool_recovery",
+        "file-contexts-tool",
+        "fsck-wrapper",
+        "mbtool",
+        "mount.exfat",
+    };
+
+    std::string arch_dir = dir + "/binaries/android/" DEVICE_ARCH;
+    std::string scripts_dir = dir + "/scripts";
+
+    if (!io::createDirectories(arch_dir)
+            || !io::createDirectories(scripts_dir)) {
+        fprintf(stderr, "%s: Failed to create directories\n", dir.c_str());
+        return false;
+    }
+
+    uint64_t seed = 1;
+
+    for (const char *binary : binaries) {
+        std::string path = arch_dir + "/" + binary;
+        if (!write_random_file(path, seed++, 1 * MIB)
+                || !write_random_file(path + ".sig", seed++, 512)) {
+            return false;
+        }
+    }
+
+    return write_random_file(scripts_dir + "/bb-wrapper.sh", seed++, 4096)
+            && write_random_file(scripts_dir + "/bb-wrapper.sh.sig", seed++,
+                                 512);
+}
+
+static Device * create_device()
+{
+    static const char *codenames[] = { "benchmark", nullptr };
+    static const char *base_dirs[] = { BLOCK_DEV_BASE, nullptr };
+    static const char *system_devs[] = { SYSTEM_BLOCK_DEV, nullptr };
+    static const char *cache_devs[] = { CACHE_BLOCK_DEV, nullptr };
+    static const char *data_devs[] = { DATA_BLOCK_DEV, nullptr };
+    static const char *boot_devs[] = { BOOT_BLOCK_DEV, nullptr };
+
+    Device *device = mb_device_new();
+    if (!device) {
+        return nullptr;
+    }
+
+    if (mb_device_set_id(device, "benchmark") != MB_DEVICE_OK
+            || mb_device_set_codenames(device, codenames) != MB_DEVICE_OK
+            || mb_device_set_name(device, "Benchmark Device") != MB_DEVICE_OK
+            || mb_device_set_architecture(device, DEVICE_ARCH) != MB_DEVICE_OK
+            || mb_device_set_block_dev_base_dirs(device, base_dirs) != MB_DEVICE_OK
+            || mb_device_set_system_block_devs(device, system_devs) != MB_DEVICE_OK
+            || mb_device_set_cache_block_devs(device, cache_devs) != MB_DEVICE_OK
+            || mb_device_set_data_block_devs(device, data_devs) != MB_DEVICE_OK
+            || mb_device_set_boot_block_devs(device, boot_devs) != MB_DEVICE_OK) {
+        mb_device_free(device);
+        return nullptr;
+    }
+
+    return device;
+}
+
+
+// Measurement
+
+enum Phase
+{
+    PHASE_SETUP,
+    PHASE_INPUT,
+    PHASE_SUPPORT_FILES,
+    PHASE_FINALIZE,
+    PHASE_COUNT,
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "setup",
+    "input",
+    "support_files",
+    "finalize",
+};
+
+typedef std::chrono::steady_clock Clock;
+
+struct PhaseTracker
+{
+    const std::unordered_set<std::string> *inputs;
+    Clock::time_point phase_start;
+    Clock::time_point last_callback;
+    bool have_callback;
+    Phase current;
+    uint64_t phases[PHASE_COUNT];
+    uint64_t files;
+
+    void reset(const std::unordered_set<std::string> *names)
+    {
+        inputs = names;
+        phase_start = Clock::now();
+        last_callback = phase_start;
+        have_callback = false;
+        current = PHASE_SETUP;
+        std::fill(std::begin(phases), std::end(phases), 0);
+        files = 0;
+    }
+
+    void add(Phase phase, Clock::time_point from, Clock::time_point to)
+    {
+        phases[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                to - from).count();
+    }
+
+    void callback(const std::string *details)
+    {
+        auto now = Clock::now();
+
+        Phase phase = current == PHASE_SETUP ? PHASE_INPUT : current;
+        if (details) {
+            phase = inputs->find(*details) != inputs->end()
+                    ? PHASE_INPUT : PHASE_SUPPORT_FILES;
+        }
+
+        if (phase != current) {
+            add(current, phase_start, now);
+            current = phase;
+            phase_start = now;
+        }
+
+        last_callback = now;
+        have_callback = true;
+    }
+
+    void finish()
+    {
+        auto now = Clock::now();
+
+        if (have_callback) {
+            add(current, phase_start, last_callback);
+            add(PHASE_FINALIZE, last_callback, now);
+        } else {
+            add(PHASE_SETUP, phase_start, now);
+        }
+    }
+
+    static void progress_cb(uint64_t bytes, uint64_t max_bytes, void *userdata)
+    {
+        (void) bytes;
+        (void) max_bytes;
+        static_cast<PhaseTracker *>(userdata)->callback(nullptr);
+    }
+
+    static void files_cb(uint64_t files, uint64_t max_files, void *userdata)
+    {
+        (void) max_files;
+        PhaseTracker *tracker = static_cast<PhaseTracker *>(userdata);
+        tracker->files = files;
+        tracker->callback(nullptr);
+    }
+
+    static void details_cb(const std::string &details, void *userdata)
+    {
+        static_cast<PhaseTracker *>(userdata)->callback(&details);
+    }
+};
+
+/*!
+ * \brief Reset the peak RSS of the process
+ *
+ * \return Whether the peak RSS was reset. If it could not be reset, the peak
+ *         RSS that is reported is the peak for the whole process.
+ */
+static bool reset_peak_rss()
+{
+    // Supported since Linux 4.0
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (!fp) {
+        return false;
+    }
+
+    bool ret = fputs("5", fp) >= 0;
+    return fclose(fp) == 0 && ret;
+}
+
+static uint64_t peak_rss_kib()
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        char line[256];
+        unsigned long long value;
+
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmHWM: %llu kB", &value) == 1) {
+                fclose(fp);
+                return value;
+            }
+        }
+
+        fclose(fp);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_maxrss;
+    }
+
+    return 0;
+}
+
+struct Run
+{
+    uint64_t total_ns;
+    uint64_t phases[PHASE_COUNT];
+    uint64_t peak_rss_kib;
+    uint64_t files;
+};
+
+struct Result
+{
+    const char *patcher;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+    uint64_t files;
+    unsigned int iterations;
+    uint64_t min_ns;
+    uint64_t median_ns;
+    uint64_t mean_ns;
+    double throughput_mib_s;
+    double files_per_s;
+    uint64_t peak_rss_kib;
+    bool peak_rss_per_run;
+    uint64_t phases[PHASE_COUNT];
+};
+
+static bool run_patcher(mbp::PatcherConfig &pc, Device *device,
+                        const char *id, const std::string &input,
+                        const std::string &output,
+                        const std::unordered_set<std::string> &names,
+                        unsigned int iterations, Result &result)
+{
+    std::vector<Run> runs;
+
+    mbp::FileInfo fi;
+    fi.setDevice(device);
+    fi.setInputPath(input);
+    fi.setOutputPath(output);
+    fi.setRomId("dual");
+
+    result.patcher = id;
+    result.iterations = iterations;
+    result.input_bytes = input.empty() ? 0 : file_size(input);
+    result.peak_rss_per_run = true;
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        mbp::Patcher *patcher = pc.createPatcher(id);
+        if (!patcher) {
+            fprintf(stderr, "%s: Failed to create patcher\n", id);
+            return false;
+        }
+
+        PhaseTracker tracker;
+        Run run;
+
+        if (!reset_peak_rss()) {
+            result.peak_rss_per_run = false;
+        }
+
+        patcher->setFileInfo(&fi);
+
+        tracker.reset(&names);
+        auto start = Clock::now();
+
+        bool ok = patcher->patchFile(&PhaseTracker::progress_cb,
+                                     &PhaseTracker::files_cb,
+                                     &PhaseTracker::details_cb,
+                                     &tracker);
+
+        tracker.finish();
+        auto stop = Clock::now();
+
+        if (!ok) {
+            fprintf(stderr, "%s: Failed to patch file (error code: %d)\n",
+                    id, static_cast<int>(patcher->error()));
+            pc.destroyPatcher(patcher);
+            return false;
+        }
+
+        pc.destroyPatcher(patcher);
+
+        run.total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                stop - start).count();
+        std::copy(std::begin(tracker.phases), std::end(tracker.phases),
+                  std::begin(run.phases));
+        run.peak_rss_kib = peak_rss_kib();
+        run.files = tracker.files;
+        runs.push_back(run);
+    }
+
+    result.output_bytes = file_size(output);
+    remove(output.c_str());
+
+    std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) {
+        return a.total_ns < b.total_ns;
+    });
+
+    const Run &median = runs[runs.size() / 2];
+    uint64_t total = 0;
+
+    result.peak_rss_kib = 0;
+    for (const Run &run : runs) {
+        total += run.total_ns;
+        result.peak_rss_kib = std::max(result.peak_rss_kib, run.peak_rss_kib);
+    }
+
+    result.min_ns = runs.front().total_ns;
+    result.median_ns = median.total_ns;
+    result.mean_ns = total / runs.size();
+    std::copy(std::begin(median.phases), std::end(median.phases),
+              std::begin(result.phases));
+
+    // Patchers that don't report the file count only produce the output
+    result.files = median.files;
+
+    double seconds = static_cast<double>(median.total_ns) / 1e9;
+    uint64_t bytes = result.input_bytes ? result.input_bytes
+            : result.output_bytes;
+
+    result.throughput_mib_s = seconds > 0
+            ? static_cast<double>(bytes) / MIB / seconds : 0.0;
+    result.files_per_s = seconds > 0
+            ? static_cast<double>(result.files) / seconds : 0.0;
+
+    return true;
+}
+
+static void print_result(FILE *fp, const Result &r, bool last)
+{
+    fprintf(fp, "    {\"patcher\": \"%s\", \"input_bytes\": %" PRIu64
+            ", \"output_bytes\": %" PRIu64 ", \"files\": %" PRIu64
+            ", \"iterations\": %u, \"min_ns\": %" PRIu64
+            ", \"median_ns\": %" PRIu64 ", \"mean_ns\": %" PRIu64
+            ", \"throughput_mib_s\": %.2f, \"files_per_s\": %.2f"
+            ", \"peak_rss_kib\": %" PRIu64 ", \"peak_rss_scope\": \"%s\""
+            ", \"phases_ns\": {",
+            r.patcher, r.input_bytes, r.output_bytes, r.files,
+            r.iterations, r.min_ns, r.median_ns, r.mean_ns,
+            r.throughput_mib_s, r.files_per_s, r.peak_rss_kib,
+            r.peak_rss_per_run ? "run" : "process");
+
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        fprintf(fp, "%s\"%s\": %" PRIu64, i == 0 ? "" : ", ",
+                phase_names[i], r.phases[i]);
+    }
+
+    fprintf(fp, "}}%s\n", last ? "" : ",");
+}
+
+
+// Command line
+
+static bool parse_uint(const char *str, uint64_t max, uint64_t &out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 0);
+    if (errno != 0 || *str == '\0' || *end != '\0' || value == 0
+            || value > max) {
+        return false;
+    }
+    out = value;
+    return true;
+}
+
+static void benchmark_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: mbp_benchmarks [OPTION...]\n"
+            "\n"
+            "Options:\n"
+            "  -n, --entries <n>        Number of entries in the ROM zip (default: 1000)\n"
+            "  -e, --entry-size <n>     Size of each entry in bytes (default: 65536)\n"
+            "  -c, --script-calls <n>   Mount/format calls in updater-script (default: 300)\n"
+            "  -b, --boot-size <n>      Boot image payload size in MiB (default: 16)\n"
+            "  -s, --system-size <n>    Odin system image size in MiB (default: 128)\n"
+            "  -i, --iterations <n>     Iterations per patcher (default: 3)\n"
+            "  -d, --tmpdir <dir>       Directory for generated files\n"
+            "  -o, --output <file>      Write JSON results to file\n"
+            "  -h, --help               Display this help message\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    const char *output = nullptr;
+    uint64_t value;
+
+    const char *env_tmpdir = getenv("TMPDIR");
+    opts.tmpdir = env_tmpdir && *env_tmpdir ? env_tmpdir : "/tmp";
+
+    int opt;
+
+    static const char *short_options = "n:e:c:b:s:i:d:o:h";
+
+    static struct option long_options[] = {
+        {"entries",      required_argument, 0, 'n'},
+        {"entry-size",   required_argument, 0, 'e'},
+        {"script-calls", required_argument, 0, 'c'},
+        {"boot-size",    required_argument, 0, 'b'},
+        {"system-size",  required_argument, 0, 's'},
+        {"iterations",   required_argument, 0, 'i'},
+        {"tmpdir",       required_argument, 0, 'd'},
+        {"output",       required_argument, 0, 'o'},
+        {"help",         no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'n':
+            if (!parse_uint(optarg, 1000000, value)) {
+                fprintf(stderr, "Invalid entry count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.entries = value;
+            break;
+
+        case 'e':
+            if (!parse_uint(optarg, UINT64_MAX, value)) {
+                fprintf(stderr, "Invalid entry size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.entry_size = value;
+            break;
+
+        case 'c':
+            if (!parse_uint(optarg, 1000000, value)) {
+                fprintf(stderr, "Invalid call count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.script_calls = value;
+            break;
+
+        case 'b':
+            if (!parse_uint(optarg, 1024, value)) {
+                fprintf(stderr, "Invalid boot image size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.boot_size = value * MIB;
+            break;
+
+        case 's':
+            if (!parse_uint(optarg, 1024 * 1024, value)) {
+                fprintf(stderr, "Invalid system image size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.system_size = value * MIB;
+            break;
+
+        case 'i':
+            if (!parse_uint(optarg, 10000, value)) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            opts.iterations = value;
+            break;
+
+        case 'd':
+            opts.tmpdir = optarg;
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'h':
+            benchmark_usage(stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            benchmark_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc) {
+        benchmark_usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    mb::log::log_set_logger(std::make_shared<ErrorLogger>());
+
+    std::string work_dir = opts.tmpdir + "/mbp_benchmark";
+    std::string data_dir = work_dir + "/data";
+    std::string temp_dir = work_dir + "/tmp";
+    std::string boot_image = work_dir + "/boot.img";
+    std::string rom_zip = work_dir + "/rom.zip";
+    std::string odin_tar = work_dir + "/AP_BENCHMARK.tar.md5";
+    std::string patched = work_dir + "/patched.zip";
+
+    std::unordered_set<std::string> zip_names;
+    std::unordered_set<std::string> tar_names;
+    std::unordered_set<std::string> no_names;
+    std::vector<Result> results;
+    bool ok;
+
+    io::deleteRecursively(work_dir);
+
+    ScopedDevice device(create_device(), &mb_device_free);
+    if (!device) {
+        fprintf(stderr, "Failed to create device\n");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Generating inputs in %s\n", work_dir.c_str());
+
+    ok = io::createDirectories(temp_dir)
+            && create_data_dir(data_dir)
+            && create_boot_image(boot_image, opts.boot_size)
+            && create_rom_zip(opts, rom_zip, boot_image, zip_names)
+            && create_odin_tar(opts, work_dir, odin_tar, boot_image,
+                               tar_names);
+
+    if (ok) {
+        mbp::PatcherConfig pc;
+        pc.setDataDirectory(data_dir);
+        pc.setTempDirectory(temp_dir);
+
+        struct {
+            const char *id;
+            const std::string *input;
+            const std::unordered_set<std::string> *names;
+        } cases[] = {
+            { "MultiBootPatcher", &rom_zip,  &zip_names },
+            { "OdinPatcher",      &odin_tar, &tar_names },
+            { "RamdiskUpdater",   nullptr,   &no_names  },
+        };
+
+        for (auto const &c : cases) {
+            Result r;
+
+            fprintf(stderr, "Running %s\n", c.id);
+
+            if (!run_patcher(pc, device.get(), c.id,
+                             c.input ? *c.input : std::string(), patched,
+                             *c.names, opts.iterations, r)) {
+                ok = false;
+                continue;
+            }
+
+            results.push_back(r);
+        }
+    }
+
+    io::deleteRecursively(work_dir);
+
+    FILE *fp = stdout;
+    if (output) {
+        fp = fopen(output, "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open: %s\n",
+                    output, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schema_version\": %d,\n", BENCHMARK_SCHEMA_VERSION);
+    fprintf(fp, "  \"version\": \"%s\",\n", mb::version());
+    fprintf(fp, "  \"git_version\": \"%s\",\n", mb::git_version());
+    fprintf(fp, "  \"config\": {\"entries\": %u, \"entry_size\": %" PRIu64
+            ", \"script_calls\": %u, \"boot_size\": %" PRIu64
+            ", \"system_size\": %" PRIu64 ", \"iterations\": %u},\n",
+            opts.entries, opts.entry_size, opts.script_calls,
+            opts.boot_size, opts.system_size, opts.iterations);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        print_result(fp, results[i], i == results.size() - 1);
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fp != stdout && fclose(fp) != 0) {
+        fprintf(stderr, "%s: Failed to close: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
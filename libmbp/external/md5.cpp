@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// MD5 as described in RFC 1321. Unlike sha.cpp, whole blocks are processed
+// directly from the input buffer since this is used for hashing multi-gigabyte
+// firmware files.
+
+#include "md5.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#define rol(bits, value) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = rol(s, (a)); \
+    (a) += (b);
+
+extern "C" {
+
+static void MD5_Transform(MD5_CTX* ctx, const uint8_t* p) {
+    uint32_t X[16];
+    uint32_t A, B, C, D;
+    int t;
+
+    for (t = 0; t < 16; ++t) {
+        X[t] = (uint32_t) p[0]
+                | ((uint32_t) p[1] << 8)
+                | ((uint32_t) p[2] << 16)
+                | ((uint32_t) p[3] << 24);
+        p += 4;
+    }
+
+    A = ctx->state[0];
+    B = ctx->state[1];
+    C = ctx->state[2];
+    D = ctx->state[3];
+
+    STEP(F, A, B, C, D, X[ 0], 0xd76aa478,  7)
+    STEP(F, D, A, B, C, X[ 1], 0xe8c7b756, 12)
+    STEP(F, C, D, A, B, X[ 2], 0x242070db, 17)
+    STEP(F, B, C, D, A, X[ 3], 0xc1bdceee, 22)
+    STEP(F, A, B, C, D, X[ 4], 0xf57c0faf,  7)
+    STEP(F, D, A, B, C, X[ 5], 0x4787c62a, 12)
+    STEP(F, C, D, A, B, X[ 6], 0xa8304613, 17)
+    STEP(F, B, C, D, A, X[ 7], 0xfd469501, 22)
+    STEP(F, A, B, C, D, X[ 8], 0x698098d8,  7)
+    STEP(F, D, A, B, C, X[ 9], 0x8b44f7af, 12)
+    STEP(F, C, D, A, B, X[10], 0xffff5bb1, 17)
+    STEP(F, B, C, D, A, X[11], 0x895cd7be, 22)
+    STEP(F, A, B, C, D, X[12], 0x6b901122,  7)
+    STEP(F, D, A, B, C, X[13], 0xfd987193, 12)
+    STEP(F, C, D, A, B, X[14], 0xa679438e, 17)
+    STEP(F, B, C, D, A, X[15], 0x49b40821, 22)
+
+    STEP(G, A, B, C, D, X[ 1], 0xf61e2562,  5)
+    STEP(G, D, A, B, C, X[ 6], 0xc040b340,  9)
+    STEP(G, C, D, A, B, X[11], 0x265e5a51, 14)
+    STEP(G, B, C, D, A, X[ 0], 0xe9b6c7aa, 20)
+    STEP(G, A, B, C, D, X[ 5], 0xd62f105d,  5)
+    STEP(G, D, A, B, C, X[10], 0x02441453,  9)
+    STEP(G, C, D, A, B, X[15], 0xd8a1e681, 14)
+    STEP(G, B, C, D, A, X[ 4], 0xe7d3fbc8, 20)
+    STEP(G, A, B, C, D, X[ 9], 0x21e1cde6,  5)
+    STEP(G, D, A, B, C, X[14], 0xc33707d6,  9)
+    STEP(G, C, D, A, B, X[ 3], 0xf4d50d87, 14)
+    STEP(G, B, C, D, A, X[ 8], 0x455a14ed, 20)
+    STEP(G, A, B, C, D, X[13], 0xa9e3e905,  5)
+    STEP(G, D, A, B, C, X[ 2], 0xfcefa3f8,  9)
+    STEP(G, C, D, A, B, X[ 7], 0x676f02d9, 14)
+    STEP(G, B, C, D, A, X[12], 0x8d2a4c8a, 20)
+
+    STEP(H, A, B, C, D, X[ 5], 0xfffa3942,  4)
+    STEP(H, D, A, B, C, X[ 8], 0x8771f681, 11)
+    STEP(H, C, D, A, B, X[11], 0x6d9d6122, 16)
+    STEP(H, B, C, D, A, X[14], 0xfde5380c, 23)
+    STEP(H, A, B, C, D, X[ 1], 0xa4beea44,  4)
+    STEP(H, D, A, B, C, X[ 4], 0x4bdecfa9, 11)
+    STEP(H, C, D, A, B, X[ 7], 0xf6bb4b60, 16)
+    STEP(H, B, C, D, A, X[10], 0xbebfbc70, 23)
+    STEP(H, A, B, C, D, X[13], 0x289b7ec6,  4)
+    STEP(H, D, A, B, C, X[ 0], 0xeaa127fa, 11)
+    STEP(H, C, D, A, B, X[ 3], 0xd4ef3085, 16)
+    STEP(H, B, C, D, A, X[ 6], 0x04881d05, 23)
+    STEP(H, A, B, C, D, X[ 9], 0xd9d4d039,  4)
+    STEP(H, D, A, B, C, X[12], 0xe6db99e5, 11)
+    STEP(H, C, D, A, B, X[15], 0x1fa27cf8, 16)
+    STEP(H, B, C, D, A, X[ 2], 0xc4ac5665, 23)
+
+    STEP(I, A, B, C, D, X[ 0], 0xf4292244,  6)
+    STEP(I, D, A, B, C, X[ 7], 0x432aff97, 10)
+    STEP(I, C, D, A, B, X[14], 0xab9423a7, 15)
+    STEP(I, B, C, D, A, X[ 5], 0xfc93a039, 21)
+    STEP(I, A, B, C, D, X[12], 0x655b59c3,  6)
+    STEP(I, D, A, B, C, X[ 3], 0x8f0ccc92, 10)
+    STEP(I, C, D, A, B, X[10], 0xffeff47d, 15)
+    STEP(I, B, C, D, A, X[ 1], 0x85845dd1, 21)
+    STEP(I, A, B, C, D, X[ 8], 0x6fa87e4f,  6)
+    STEP(I, D, A, B, C, X[15], 0xfe2ce6e0, 10)
+    STEP(I, C, D, A, B, X[ 6], 0xa3014314, 15)
+    STEP(I, B, C, D, A, X[13], 0x4e0811a1, 21)
+    STEP(I, A, B, C, D, X[ 4], 0xf7537e82,  6)
+    STEP(I, D, A, B, C, X[11], 0xbd3af235, 10)
+    STEP(I, C, D, A, B, X[ 2], 0x2ad7d2bb, 15)
+    STEP(I, B, C, D, A, X[ 9], 0xeb86d391, 21)
+
+    ctx->state[0] += A;
+    ctx->state[1] += B;
+    ctx->state[2] += C;
+    ctx->state[3] += D;
+}
+
+static const HASH_VTAB MD5_VTAB = {
+    MD5_init,
+    MD5_update,
+    MD5_final,
+    MD5_hash,
+    MD5_DIGEST_SIZE
+};
+
+void MD5_init(MD5_CTX* ctx) {
+    ctx->f = &MD5_VTAB;
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+
+void MD5_update(MD5_CTX* ctx, const void* data, int len) {
+    int i = (int) (ctx->count & 63);
+    const uint8_t* p = (const uint8_t*)data;
+
+    ctx->count += len;
+
+    // Fill up partial block
+    if (i > 0) {
+        int n = 64 - i < len ? 64 - i : len;
+        memcpy(ctx->buf + i, p, n);
+        p += n;
+        len -= n;
+        i += n;
+        if (i < 64) {
+            return;
+        }
+        MD5_Transform(ctx, ctx->buf);
+    }
+
+    for (; len >= 64; len -= 64, p += 64) {
+        MD5_Transform(ctx, p);
+    }
+
+    memcpy(ctx->buf, p, len);
+}
+
+
+const uint8_t* MD5_final(MD5_CTX* ctx) {
+    uint8_t *p = ctx->buf;
+    uint64_t cnt = ctx->count * 8;
+    int i;
+
+    MD5_update(ctx, (uint8_t*)"\x80", 1);
+    while ((ctx->count & 63) != 56) {
+        MD5_update(ctx, (uint8_t*)"\0", 1);
+    }
+    for (i = 0; i < 8; ++i) {
+        uint8_t tmp = (uint8_t) (cnt >> (i * 8));
+        MD5_update(ctx, &tmp, 1);
+    }
+
+    for (i = 0; i < 4; i++) {
+        uint32_t tmp = ctx->state[i];
+        *p++ = tmp >> 0;
+        *p++ = tmp >> 8;
+        *p++ = tmp >> 16;
+        *p++ = tmp >> 24;
+    }
+
+    return ctx->buf;
+}
+
+/* Convenience function */
+const uint8_t* MD5_hash(const void* data, int len, uint8_t* digest) {
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    MD5_update(&ctx, data, len);
+    memcpy(digest, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    return digest;
+}
+
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "hash-internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// Same interface as the mincrypt SHA-1 implementation in sha.h
+typedef HASH_CTX MD5_CTX;
+
+void MD5_init(MD5_CTX* ctx);
+void MD5_update(MD5_CTX* ctx, const void* data, int len);
+const uint8_t* MD5_final(MD5_CTX* ctx);
+
+// Convenience method. Returns digest address.
+// NOTE: *digest needs to hold MD5_DIGEST_SIZE bytes.
+const uint8_t* MD5_hash(const void* data, int len, uint8_t* digest);
+
+#define MD5_DIGEST_SIZE 16
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -242,6 +243,9 @@ public:
     std::string unescapedString();
     std::string string();
 
+    static bool unescapedString(const char *data, std::size_t size,
+                                std::string *out);
+
 protected:
     std::string m_str;
     Type m_type;
@@ -265,20 +269,47 @@ private:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/*!
+ * \brief Lightweight token referencing the text of the original script
+ *
+ * Unlike EdifyToken, this does not own any memory. A script is tokenized into
+ * a single contiguous array of these, which is only valid for as long as the
+ * script's buffer is.
+ */
+struct EdifyTokenRef
+{
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    EdifyTokenType type;
+    //! Token text (including quotes for quoted strings and '#' for comments)
+    const char *data;
+    //! Size of token text
+    std::size_t size;
+    //! For parentheses, index of the matching parenthesis or npos
+    std::size_t match;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 class EdifyTokenizer
 {
 public:
     static bool tokenize(const char *data, std::size_t size,
                          std::vector<EdifyToken *> *tokens);
+    static bool tokenize(const char *data, std::size_t size,
+                         std::vector<EdifyTokenRef> *tokens);
     static std::string untokenize(const std::vector<EdifyToken *> &tokens);
     static std::string untokenize(const std::vector<EdifyToken *>::iterator &begin,
                                   const std::vector<EdifyToken *>::iterator &end);
 
     static void dump(const std::vector<EdifyToken *> &tokens);
+    static void dump(const std::vector<EdifyTokenRef> &tokens);
 
 private:
     static bool isValidUnquoted(char c);
 
+    static bool scanToken(const char *data, std::size_t size, std::size_t *pos,
+                          EdifyTokenType *type);
     static bool nextToken(const char *data, std::size_t size, std::size_t *pos,
                           EdifyToken **token);
 
@@ -53,12 +53,26 @@ const std::string StandardPatcher::UpdaterScript
 const std::string StandardPatcher::SystemTransferList
         = "system.transfer.list";
 
-#define MOUNT_FMT \
-        "(run_program(\"/update-binary-tool\", \"mount\", \"%s\") == 0)"
-#define UNMOUNT_FMT \
-        "(run_program(\"/update-binary-tool\", \"unmount\", \"%s\") == 0)"
-#define FORMAT_FMT \
-        "(run_program(\"/update-binary-tool\", \"format\", \"%s\") == 0)"
+#define TOOL_CMD(action, path) \
+        "(run_program(\"/update-binary-tool\", \"" action "\", \"" path "\") == 0)"
+
+#define PARTITION_CMDS(action) \
+        { nullptr, \
+          TOOL_CMD(action, "/system"), \
+          TOOL_CMD(action, "/cache"), \
+          TOOL_CMD(action, "/data") }
+
+enum class Partition
+{
+    None,
+    System,
+    Cache,
+    Data,
+};
+
+static const char * const MountCmds[] = PARTITION_CMDS("mount");
+static const char * const UnmountCmds[] = PARTITION_CMDS("unmount");
+static const char * const FormatCmds[] = PARTITION_CMDS("format");
 
 
 StandardPatcher::StandardPatcher(const PatcherConfig * const pc,
@@ -105,260 +119,124 @@ static bool findItemsInString(const char *haystack,
     return false;
 }
 
-static bool findFunction(const std::vector<EdifyToken *>::iterator begin,
-                         const std::vector<EdifyToken *>::iterator end,
-                         std::vector<EdifyToken *>::iterator *outFuncName,
-                         std::vector<EdifyToken *>::iterator *outLeftParen,
-                         std::vector<EdifyToken *>::iterator *outRightParen)
+static inline const char * cmdFor(const char * const *cmds,
+                                  Partition partition)
 {
-    std::vector<EdifyToken *>::iterator funcName;
-    std::vector<EdifyToken *>::iterator leftParen;
-    std::vector<EdifyToken *>::iterator rightParen;
+    return cmds[static_cast<int>(partition)];
+}
 
-    for (auto it = begin; it != end; ++it) {
-        // Find string representing the function name
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
+/*!
+ * \brief State shared by the function call rewriters
+ */
+struct RewriteContext
+{
+    const char * const *systemDevs;
+    const char * const *cacheDevs;
+    const char * const *dataDevs;
+    // Scratch buffer for token text, reused to avoid allocating for every
+    // string token
+    std::string buf;
+};
 
-        funcName = it;
-
-        bool foundLeftParen = false;
-        bool foundRightParen = false;
-
-        // Barring any whitespace, newlines, or comments, the function name
-        // should be followed by a left parenthesis
-        for (auto it2 = it + 1; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::Whitespace
-                    || (*it2)->type() == EdifyTokenType::Newline
-                    || (*it2)->type() == EdifyTokenType::Comment) {
-                continue;
-            } else if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                foundLeftParen = true;
-                leftParen = it2;
-            }
-            break;
-        }
+/*!
+ * \brief Edify function call rewriter
+ *
+ * \param ctx Rewrite context
+ * \param tokens Token array
+ * \param leftParen Index of the left parenthesis of the function call
+ * \param rightParen Index of the matching right parenthesis
+ *
+ * \return Replacement for the entire function call or nullptr if the function
+ *         call should be kept as is
+ */
+typedef const char * (*RewriteFn)(RewriteContext *ctx,
+                                  const EdifyTokenRef *tokens,
+                                  std::size_t leftParen,
+                                  std::size_t rightParen);
 
-        // If a left parenthesis was not found, then the string token was not
-        // a function name
-        if (!foundLeftParen) {
+/*!
+ * \brief Find partition referenced by the raw text of a string argument
+ *
+ * The first string token that matches any partition determines the result.
+ */
+static Partition findPartitionInArgs(RewriteContext *ctx,
+                                     const EdifyTokenRef *tokens,
+                                     std::size_t leftParen,
+                                     std::size_t rightParen)
+{
+    for (std::size_t i = leftParen + 1; i < rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        // Left for matching right parenthesis
-        std::size_t depth = 0;
-
-        for (auto it2 = leftParen; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                ++depth;
-            } else if ((*it2)->type() == EdifyTokenType::RightParen) {
-                --depth;
-            }
-            if (depth == 0) {
-                foundRightParen = true;
-                rightParen = it2;
-                break;
-            }
-        }
+        const std::string &str = ctx->buf;
+        ctx->buf.assign(tokens[i].data, tokens[i].size);
 
-        // If a right parenthesis was not found, but the function name and left
-        // parenthesis were found, then assume there's a syntax error and bail
-        // out
-        if (!foundRightParen) {
-            return false;
+        if (str.find("/system") != std::string::npos
+                || findItemsInString(str.c_str(), ctx->systemDevs)) {
+            return Partition::System;
+        } else if (str.find("/cache") != std::string::npos
+                || findItemsInString(str.c_str(), ctx->cacheDevs)) {
+            return Partition::Cache;
+        } else if (str.find("/data") != std::string::npos
+                || str.find("/userdata") != std::string::npos
+                || findItemsInString(str.c_str(), ctx->dataDevs)) {
+            return Partition::Data;
         }
-
-        *outFuncName = funcName;
-        *outLeftParen = leftParen;
-        *outRightParen = rightParen;
-
-        return true;
     }
 
-    return false;
+    return Partition::None;
 }
 
 /*!
- * \brief Replace edify function
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token of the replaced function
- * \param leftParen Left parenthesis token of the replaced function
- * \param rightParen Right parenthesis token of the replaced function
- * \param replacement Replacement edify function (in string form)
+ * \brief Rewrite edify mount() command
  *
- * \return New iterator pointing to position *after* the right parenthesis of
- *         the replaced function. Returns tokens->end() if the replacement
- *         string could not be tokenized.
+ * Replaced with the corresponding update-binary-tool command.
  */
-static std::vector<EdifyToken *>::iterator
-replaceFunction(std::vector<EdifyToken *> *tokens,
-                std::vector<EdifyToken *>::iterator funcName,
-                std::vector<EdifyToken *>::iterator leftParen,
-                std::vector<EdifyToken *>::iterator rightParen,
-                const std::string &replacement)
+static const char * rewriteMount(RewriteContext *ctx,
+                                 const EdifyTokenRef *tokens,
+                                 std::size_t leftParen,
+                                 std::size_t rightParen)
 {
-    // Included for completeness' sake
-    (void) leftParen;
-
-    std::vector<EdifyToken *> replacementTokens;
-    bool result = EdifyTokenizer::tokenize(
-            replacement.data(), replacement.size(), &replacementTokens);
-    if (!result) {
-        LOGE("Failed to tokenize replacement function string: %s",
-             replacement.c_str());
-        return tokens->end();
-    }
-
-    // Deallocate replaced tokens
-    for (auto it = funcName; it != rightParen; ++it) {
-        delete *it;
-    }
-    delete *rightParen;
-
-    // Remove replaced tokens
-    auto it = tokens->erase(funcName, rightParen);
-    it = tokens->erase(it);
-
-    // Add replacement tokens
-    it = tokens->insert(it, replacementTokens.begin(), replacementTokens.end());
-
-    // Move iterator to the end of the replaced tokens
-    it += replacementTokens.size();
-
-    return it;
+    return cmdFor(MountCmds, findPartitionInArgs(
+            ctx, tokens, leftParen, rightParen));
 }
 
 /*!
- * \brief Replace edify mount() command
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
+ * \brief Rewrite edify unmount() command
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * Replaced with the corresponding update-binary-tool command.
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyMount(std::vector<EdifyToken *> *tokens,
-                  const std::vector<EdifyToken *>::iterator funcName,
-                  const std::vector<EdifyToken *>::iterator leftParen,
-                  const std::vector<EdifyToken *>::iterator rightParen,
-                  const char * const *systemDevs,
-                  const char * const *cacheDevs,
-                  const char * const *dataDevs)
+static const char * rewriteUnmount(RewriteContext *ctx,
+                                   const EdifyTokenRef *tokens,
+                                   std::size_t leftParen,
+                                   std::size_t rightParen)
 {
-    // For the mount() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
-
-        bool isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str.c_str(), systemDevs);
-        bool isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str.c_str(), cacheDevs);
-        bool isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str.c_str(), dataDevs);
-
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/data"));
-        }
-    }
-    return rightParen + 1;
+    return cmdFor(UnmountCmds, findPartitionInArgs(
+            ctx, tokens, leftParen, rightParen));
 }
 
 /*!
- * \brief Replace edify unmount() command
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
+ * \brief Rewrite edify format() command
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * Replaced with the corresponding update-binary-tool command.
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyUnmount(std::vector<EdifyToken *> *tokens,
-                    const std::vector<EdifyToken *>::iterator funcName,
-                    const std::vector<EdifyToken *>::iterator leftParen,
-                    const std::vector<EdifyToken *>::iterator rightParen,
-                    const char * const *systemDevs,
-                    const char * const *cacheDevs,
-                    const char * const *dataDevs)
+static const char * rewriteFormat(RewriteContext *ctx,
+                                  const EdifyTokenRef *tokens,
+                                  std::size_t leftParen,
+                                  std::size_t rightParen)
 {
-    // For the unmount() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
-
-        bool isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str.c_str(), systemDevs);
-        bool isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str.c_str(), cacheDevs);
-        bool isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str.c_str(), dataDevs);
-
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/data"));
-        }
-    }
-    return rightParen + 1;
+    return cmdFor(FormatCmds, findPartitionInArgs(
+            ctx, tokens, leftParen, rightParen));
 }
 
 /*!
- * \brief Replace edify run_program() command
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \brief Rewrite edify run_program() command
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyRunProgram(std::vector<EdifyToken *> *tokens,
-                       const std::vector<EdifyToken *>::iterator funcName,
-                       const std::vector<EdifyToken *>::iterator leftParen,
-                       const std::vector<EdifyToken *>::iterator rightParen,
-                       const char * const *systemDevs,
-                       const char * const *cacheDevs,
-                       const char * const *dataDevs)
+static const char * rewriteRunProgram(RewriteContext *ctx,
+                                      const EdifyTokenRef *tokens,
+                                      std::size_t leftParen,
+                                      std::size_t rightParen)
 {
     bool foundReboot = false;
     bool foundMount = false;
@@ -369,13 +247,14 @@ replaceEdifyRunProgram(std::vector<EdifyToken *> *tokens,
     bool isCache = false;
     bool isData = false;
 
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t i = leftParen + 1; i < rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescapedString();
+        const std::string &unescaped = ctx->buf;
+        EdifyTokenString::unescapedString(
+                tokens[i].data, tokens[i].size, &ctx->buf);
 
         if (mb_ends_with(unescaped.c_str(), "reboot")) {
             foundReboot = true;
@@ -394,151 +273,198 @@ replaceEdifyRunProgram(std::vector<EdifyToken *> *tokens,
         }
 
         if (unescaped.find("/system") != std::string::npos
-                || findItemsInString(unescaped.c_str(), systemDevs)) {
+                || findItemsInString(unescaped.c_str(), ctx->systemDevs)) {
             isSystem = true;
         }
         if (unescaped.find("/cache") != std::string::npos
-                || findItemsInString(unescaped.c_str(), cacheDevs)) {
+                || findItemsInString(unescaped.c_str(), ctx->cacheDevs)) {
             isCache = true;
         }
         if (unescaped.find("/data") != std::string::npos
                 || unescaped.find("/userdata") != std::string::npos
-                || findItemsInString(unescaped.c_str(), dataDevs)) {
+                || findItemsInString(unescaped.c_str(), ctx->dataDevs)) {
             isData = true;
         }
     }
 
+    Partition partition = isSystem ? Partition::System
+            : isCache ? Partition::Cache
+            : isData ? Partition::Data
+            : Partition::None;
+
     if (foundReboot) {
-        return replaceFunction(tokens, funcName, leftParen, rightParen,
-                               "(ui_print(\"Removed reboot command\") == 0)");
+        return "(ui_print(\"Removed reboot command\") == 0)";
     } else if (foundUmount) {
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/data"));
-        }
+        return cmdFor(UnmountCmds, partition);
     } else if (foundMount) {
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/data"));
-        }
+        return cmdFor(MountCmds, partition);
     } else if (foundFormatSh) {
-        return replaceFunction(tokens, funcName, leftParen, rightParen,
-                               StringUtils::format(FORMAT_FMT, "/system"));
+        return cmdFor(FormatCmds, Partition::System);
     } else if (foundMke2fs) {
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/data"));
-        }
+        return cmdFor(FormatCmds, partition);
     }
 
-    return rightParen + 1;
+    return nullptr;
 }
 
 /*!
- * \brief Replace edify delete_recursive() command
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \brief Rewrite edify delete_recursive() command
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyDeleteRecursive(std::vector<EdifyToken *> *tokens,
-                            const std::vector<EdifyToken *>::iterator funcName,
-                            const std::vector<EdifyToken *>::iterator leftParen,
-                            const std::vector<EdifyToken *>::iterator rightParen)
+static const char * rewriteDeleteRecursive(RewriteContext *ctx,
+                                           const EdifyTokenRef *tokens,
+                                           std::size_t leftParen,
+                                           std::size_t rightParen)
 {
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t i = leftParen + 1; i < rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescapedString();
+        const std::string &unescaped = ctx->buf;
+        EdifyTokenString::unescapedString(
+                tokens[i].data, tokens[i].size, &ctx->buf);
 
         if (unescaped == "/system" || unescaped == "/system/") {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/system"));
+            return cmdFor(FormatCmds, Partition::System);
         } else if (unescaped == "/cache" || unescaped == "/cache/") {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/cache"));
+            return cmdFor(FormatCmds, Partition::Cache);
+        }
+    }
+
+    return nullptr;
+}
+
+struct Rewriter
+{
+    const char *name;
+    RewriteFn fn;
+};
+
+static const Rewriter Rewriters[] = {
+    { "mount",            rewriteMount           },
+    { "unmount",          rewriteUnmount         },
+    { "run_program",      rewriteRunProgram      },
+    { "delete_recursive", rewriteDeleteRecursive },
+    { "format",           rewriteFormat          },
+};
+
+static RewriteFn findRewriter(const std::string &name)
+{
+    for (const Rewriter &r : Rewriters) {
+        if (name == r.name) {
+            return r.fn;
+        }
+    }
+    return nullptr;
+}
+
+/*!
+ * \brief Find left parenthesis following a potential function name
+ *
+ * \return Index of the left parenthesis or EdifyTokenRef::npos if the token at
+ *         \p funcName is not followed by one, barring any whitespace, newlines,
+ *         or comments
+ */
+static std::size_t findLeftParen(const std::vector<EdifyTokenRef> &tokens,
+                                 std::size_t funcName)
+{
+    for (std::size_t i = funcName + 1; i < tokens.size(); ++i) {
+        switch (tokens[i].type) {
+        case EdifyTokenType::Whitespace:
+        case EdifyTokenType::Newline:
+        case EdifyTokenType::Comment:
+            continue;
+        case EdifyTokenType::LeftParen:
+            return i;
+        default:
+            return EdifyTokenRef::npos;
         }
     }
-    return rightParen + 1;
+    return EdifyTokenRef::npos;
 }
 
 /*!
- * \brief Replace edify format() command
+ * \brief Rewrite edify script in a single pass
  *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
+ * Each function call is looked up in the rewriter table. If the rewriter
+ * replaces the call, the entire call (including the arguments) is replaced.
+ * Otherwise, scanning resumes after the call's right parenthesis. Functions
+ * without a rewriter are skipped, but their arguments are still scanned.
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * The replacements are collected first and the output is assembled in a
+ * buffer allocated to the exact output size.
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyFormat(std::vector<EdifyToken *> *tokens,
-                   const std::vector<EdifyToken *>::iterator funcName,
-                   const std::vector<EdifyToken *>::iterator leftParen,
-                   const std::vector<EdifyToken *>::iterator rightParen,
-                   const char * const *systemDevs,
-                   const char * const *cacheDevs,
-                   const char * const *dataDevs)
+static void rewriteScript(const std::string &script,
+                          const std::vector<EdifyTokenRef> &tokens,
+                          RewriteContext *ctx, std::string *out)
 {
-    // For the format() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    struct Edit
+    {
+        std::size_t begin;
+        std::size_t end;
+        const char *replacement;
+        std::size_t replacementSize;
+    };
+
+    std::vector<Edit> edits;
+    std::size_t outSize = script.size();
+
+    for (std::size_t i = 0; i < tokens.size();) {
+        if (tokens[i].type != EdifyTokenType::String) {
+            ++i;
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        std::size_t leftParen = findLeftParen(tokens, i);
+        if (leftParen == EdifyTokenRef::npos) {
+            ++i;
+            continue;
+        }
 
-        bool isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str.c_str(), systemDevs);
-        bool isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str.c_str(), cacheDevs);
-        bool isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str.c_str(), dataDevs);
-
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/data"));
+        std::size_t rightParen = tokens[leftParen].match;
+        if (rightParen == EdifyTokenRef::npos) {
+            // Assume there's a syntax error and leave the rest of the script
+            // alone
+            break;
+        }
+
+        EdifyTokenString::unescapedString(
+                tokens[i].data, tokens[i].size, &ctx->buf);
+        RewriteFn fn = findRewriter(ctx->buf);
+        if (!fn) {
+            ++i;
+            continue;
+        }
+
+        const char *replacement = fn(ctx, tokens.data(), leftParen, rightParen);
+        if (replacement) {
+            Edit edit;
+            edit.begin = tokens[i].data - script.data();
+            edit.end = tokens[rightParen].data + tokens[rightParen].size
+                    - script.data();
+            edit.replacement = replacement;
+            edit.replacementSize = strlen(replacement);
+
+            outSize = outSize - (edit.end - edit.begin) + edit.replacementSize;
+            edits.push_back(edit);
         }
+
+        i = rightParen + 1;
     }
-    return rightParen + 1;
+
+    std::string output;
+    std::size_t pos = 0;
+
+    output.reserve(outSize);
+
+    for (const Edit &edit : edits) {
+        output.append(script, pos, edit.begin - pos);
+        output.append(edit.replacement, edit.replacementSize);
+        pos = edit.end;
+    }
+    output.append(script, pos, std::string::npos);
+
+    out->swap(output);
 }
 
 bool StandardPatcher::patchFiles(const std::string &directory)
@@ -570,7 +496,7 @@ bool StandardPatcher::patchUpdater(const std::string &directory)
         return true;
     }
 
-    std::vector<EdifyToken *> tokens;
+    std::vector<EdifyTokenRef> tokens;
     bool result = EdifyTokenizer::tokenize(
             contents.data(), contents.size(), &tokens);
     if (!result) {
@@ -583,60 +509,16 @@ bool StandardPatcher::patchUpdater(const std::string &directory)
 #endif
 
     Device *device = m_impl->info->device();
-    auto systemDevs = mb_device_system_block_devs(device);
-    auto cacheDevs = mb_device_cache_block_devs(device);
-    auto dataDevs = mb_device_data_block_devs(device);
-
-    std::vector<EdifyToken *>::iterator begin = tokens.begin();
-    std::vector<EdifyToken *>::iterator end;
-
-    // TODO: Catch errors
-    while (true) {
-        end = tokens.end();
-
-        // Need to find:
-        // 1. String containing function name
-        // 2. Left parenthesis for the function
-        // 3. Right parenthesis for the function
-        std::vector<EdifyToken *>::iterator funcName;
-        std::vector<EdifyToken *>::iterator leftParen;
-        std::vector<EdifyToken *>::iterator rightParen;
-
-        if (!findFunction(begin, end, &funcName, &leftParen, &rightParen)) {
-            break;
-        }
 
-        // Tokens (types are checked by findFunction())
-        EdifyTokenString *tFuncName = (EdifyTokenString *)(*funcName);
-
-        if (tFuncName->unescapedString() == "mount") {
-            begin = replaceEdifyMount(&tokens, funcName, leftParen, rightParen,
-                                      systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "unmount") {
-            begin = replaceEdifyUnmount(&tokens, funcName, leftParen, rightParen,
-                                        systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "run_program") {
-            begin = replaceEdifyRunProgram(&tokens, funcName, leftParen, rightParen,
-                                           systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "delete_recursive") {
-            begin = replaceEdifyDeleteRecursive(&tokens, funcName, leftParen, rightParen);
-        } else if (tFuncName->unescapedString() == "format") {
-            begin = replaceEdifyFormat(&tokens, funcName, leftParen, rightParen,
-                                       systemDevs, cacheDevs, dataDevs);
-        } else {
-            begin = funcName + 1;
-        }
-    }
-
-#if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
-#endif
+    RewriteContext ctx;
+    ctx.systemDevs = mb_device_system_block_devs(device);
+    ctx.cacheDevs = mb_device_cache_block_devs(device);
+    ctx.dataDevs = mb_device_data_block_devs(device);
 
-    FileUtils::writeFromString(path, EdifyTokenizer::untokenize(tokens));
+    std::string output;
+    rewriteScript(contents, tokens, &ctx, &output);
 
-    for (EdifyToken *t : tokens) {
-        delete t;
-    }
+    FileUtils::writeFromString(path, output);
 
     return true;
 }
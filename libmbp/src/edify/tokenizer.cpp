@@ -289,51 +289,52 @@ static int hexCharToInt(char c)
     }
 }
 
-bool EdifyTokenString::unescape(const std::string &str, std::string *out)
+static bool unescapeData(const char *data, std::size_t size,
+                         std::string *out)
 {
-    std::string output;
+    out->clear();
 
-    for (std::size_t i = 0; i < str.size();) {
-        char c = str[i];
+    for (std::size_t i = 0; i < size;) {
+        char c = data[i];
 
         if (c == '\\') {
-            if (i == str.size() - 1) {
+            if (i == size - 1) {
                 // Escape character is last character
                 return false;
             }
 
             std::size_t new_i = i + 2;
 
-            if (str[i + 1] == 'a') {
-                output += '\a';
-            } else if (str[i + 1] == 'b') {
-                output += '\b';
-            } else if (str[i + 1] == 'f') {
-                output += '\f';
-            } else if (str[i + 1] == 'n') {
-                output += '\n';
-            } else if (str[i + 1] == 'r') {
-                output += '\r';
-            } else if (str[i + 1] == 't') {
-                output += '\t';
-            } else if (str[i + 1] == 'v') {
-                output += '\v';
-            } else if (str[i + 1] == '\\') {
-                output += '\\';
-            } else if (str[i + 1] == 'x') {
-                if (str.size() - i < 4) {
+            if (data[i + 1] == 'a') {
+                *out += '\a';
+            } else if (data[i + 1] == 'b') {
+                *out += '\b';
+            } else if (data[i + 1] == 'f') {
+                *out += '\f';
+            } else if (data[i + 1] == 'n') {
+                *out += '\n';
+            } else if (data[i + 1] == 'r') {
+                *out += '\r';
+            } else if (data[i + 1] == 't') {
+                *out += '\t';
+            } else if (data[i + 1] == 'v') {
+                *out += '\v';
+            } else if (data[i + 1] == '\\') {
+                *out += '\\';
+            } else if (data[i + 1] == 'x') {
+                if (size - i < 4) {
                     // Need 4 chars: \xYY
                     return false;
                 }
-                int digit1 = hexCharToInt(str[i + 2]);
-                int digit2 = hexCharToInt(str[i + 3]);
+                int digit1 = hexCharToInt(data[i + 2]);
+                int digit2 = hexCharToInt(data[i + 3]);
                 if (digit1 < 0 || digit2 < 0) {
                     // One of the chars is not a valid hex character
                     return false;
                 }
 
                 char val = (digit1 << 4) & digit2;
-                output += val;
+                *out += val;
 
                 new_i += 2;
             } else {
@@ -343,16 +344,55 @@ bool EdifyTokenString::unescape(const std::string &str, std::string *out)
 
             i = new_i;
         } else {
-            output += c;
+            *out += c;
             i += 1;
         }
     }
 
+    return true;
+}
+
+bool EdifyTokenString::unescape(const std::string &str, std::string *out)
+{
+    std::string output;
+
+    if (!unescapeData(str.data(), str.size(), &output)) {
+        return false;
+    }
+
     out->swap(output);
 
     return true;
 }
 
+/*!
+ * \brief Unescape string token text without constructing a token
+ *
+ * This behaves like unescapedString(), but writes the result to \p out so that
+ * the caller can reuse its buffer. Quoted strings are detected by the leading
+ * double quote. If the string cannot be unescaped, \p out is set to an empty
+ * string.
+ *
+ * \return Whether the string was successfully unescaped
+ */
+bool EdifyTokenString::unescapedString(const char *data, std::size_t size,
+                                       std::string *out)
+{
+    bool quoted = size > 0 && data[0] == '"';
+
+    if (!unescapeData(data, size, out)) {
+        out->clear();
+        return false;
+    }
+
+    if (quoted && out->size() >= 2) {
+        out->pop_back();
+        out->erase(out->begin());
+    }
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 EdifyTokenUnknown::EdifyTokenUnknown(char c) : EdifyToken(EdifyTokenType::Unknown), m_char(c)
@@ -375,88 +415,122 @@ bool EdifyTokenizer::isValidUnquoted(char c)
             || c == '.';
 }
 
-bool EdifyTokenizer::nextToken(const char *data, std::size_t size,
-                               std::size_t *pos, EdifyToken **token)
+static inline bool hasPrefix(const char *data, std::size_t size,
+                             std::size_t pos, const char *prefix,
+                             std::size_t prefixSize)
+{
+    return size - pos >= prefixSize
+            && std::memcmp(data + pos, prefix, prefixSize) == 0;
+}
+
+bool EdifyTokenizer::scanToken(const char *data, std::size_t size,
+                               std::size_t *pos, EdifyTokenType *type)
 {
     std::size_t p = *pos;
     assert(p < size);
 
-    if (size - p >= 2 && std::memcmp(data + p, "if", 2) == 0) {
-        *token = new EdifyTokenIf();
-        p += 2;
-    } else if (size - p >= 4 && std::memcmp(data + p, "then", 4) == 0) {
-        *token = new EdifyTokenThen();
-        p += 4;
-    } else if (size - p >= 4 && std::memcmp(data + p, "else", 4) == 0) {
-        *token = new EdifyTokenElse();
-        p += 4;
-    } else if (size - p >= 5 && std::memcmp(data + p, "endif", 5) == 0) {
-        *token = new EdifyTokenEndif();
-        p += 5;
-    } else if (size - p >= 2 && std::memcmp(data + p, "&&", 2) == 0) {
-        *token = new EdifyTokenAnd();
-        p += 2;
-    } else if (size - p >= 2 && std::memcmp(data + p, "||", 2) == 0) {
-        *token = new EdifyTokenOr();
-        p += 2;
-    } else if (size - p >= 2 && std::memcmp(data + p, "==", 2) == 0) {
-        *token = new EdifyTokenEquals();
-        p += 2;
-    } else if (size - p >= 2 && std::memcmp(data + p, "!=", 2) == 0) {
-        *token = new EdifyTokenNotEquals();
-        p += 2;
-    } else if (data[p] == '!') {
-        *token = new EdifyTokenNot();
-        p += 1;
-    } else if (data[p] == '(') {
-        *token = new EdifyTokenLeftParen();
-        p += 1;
-    } else if (data[p] == ')') {
-        *token = new EdifyTokenRightParen();
-        p += 1;
-    } else if (data[p] == ';') {
-        *token = new EdifyTokenSemicolon();
-        p += 1;
-    } else if (data[p] == ',') {
-        *token = new EdifyTokenComma();
-        p += 1;
-    } else if (data[p] == '+') {
-        *token = new EdifyTokenConcat();
-        p += 1;
-    } else if (data[p] == '\n') {
-        *token = new EdifyTokenNewline();
-        p += 1;
-    } else if (data[p] != '\n' && std::isspace(data[p])) {
-        std::string buf;
-        buf += data[p];
+    // Keywords and operators are dispatched on their first character. None of
+    // them share a first character with each other, except for "else" and
+    // "endif" and the "!" and "!=" operators.
+    std::size_t n = 0;
+
+    switch (data[p]) {
+    case 'i':
+        if (hasPrefix(data, size, p, "if", 2)) {
+            *type = EdifyTokenType::If;
+            n = 2;
+        }
+        break;
+    case 't':
+        if (hasPrefix(data, size, p, "then", 4)) {
+            *type = EdifyTokenType::Then;
+            n = 4;
+        }
+        break;
+    case 'e':
+        if (hasPrefix(data, size, p, "else", 4)) {
+            *type = EdifyTokenType::Else;
+            n = 4;
+        } else if (hasPrefix(data, size, p, "endif", 5)) {
+            *type = EdifyTokenType::Endif;
+            n = 5;
+        }
+        break;
+    case '&':
+        if (hasPrefix(data, size, p, "&&", 2)) {
+            *type = EdifyTokenType::And;
+            n = 2;
+        }
+        break;
+    case '|':
+        if (hasPrefix(data, size, p, "||", 2)) {
+            *type = EdifyTokenType::Or;
+            n = 2;
+        }
+        break;
+    case '=':
+        if (hasPrefix(data, size, p, "==", 2)) {
+            *type = EdifyTokenType::Equals;
+            n = 2;
+        }
+        break;
+    case '!':
+        if (hasPrefix(data, size, p, "!=", 2)) {
+            *type = EdifyTokenType::NotEquals;
+            n = 2;
+        } else {
+            *type = EdifyTokenType::Not;
+            n = 1;
+        }
+        break;
+    case '(':
+        *type = EdifyTokenType::LeftParen;
+        n = 1;
+        break;
+    case ')':
+        *type = EdifyTokenType::RightParen;
+        n = 1;
+        break;
+    case ';':
+        *type = EdifyTokenType::Semicolon;
+        n = 1;
+        break;
+    case ',':
+        *type = EdifyTokenType::Comma;
+        n = 1;
+        break;
+    case '+':
+        *type = EdifyTokenType::Concat;
+        n = 1;
+        break;
+    case '\n':
+        *type = EdifyTokenType::Newline;
+        n = 1;
+        break;
+    }
+
+    if (n > 0) {
+        p += n;
+    } else if (std::isspace(data[p])) {
         p += 1;
         while (size - p >= 1 && data[p] != '\n' && std::isspace(data[p])) {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenWhitespace(std::move(buf));
+        *type = EdifyTokenType::Whitespace;
     } else if (data[p] == '#') {
-        std::string buf;
-        // Omit '#' character
         p += 1;
         while (size - p >= 1 && data[p] != '\n') {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenComment(std::move(buf));
+        *type = EdifyTokenType::Comment;
     } else if (isValidUnquoted(data[p])) {
-        std::string buf;
-        buf += data[p];
         p += 1;
         while (size - p >= 1 && isValidUnquoted(data[p])) {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::NotQuoted);
+        *type = EdifyTokenType::String;
     } else if (data[p] == '"') {
         std::size_t curPos = p;
-        std::string buf;
-        buf += data[p];
         p += 1;
         bool escaped = false;
         bool terminated = false;
@@ -464,21 +538,19 @@ bool EdifyTokenizer::nextToken(const char *data, std::size_t size,
             if (data[p] == '\\' || escaped) {
                 escaped = !escaped;
             } else if (!escaped && data[p] == '"') {
-                buf += data[p];
                 p += 1;
                 terminated = true;
                 break;
             }
-            buf += data[p];
             p += 1;
         }
         if (!terminated) {
             LOGE("Unterminated quote at position %" MB_PRIzu, curPos);
             return false;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::AlreadyQuoted);
+        *type = EdifyTokenType::String;
     } else {
-        *token = new EdifyTokenUnknown(data[p]);
+        *type = EdifyTokenType::Unknown;
         p += 1;
     }
 
@@ -487,6 +559,86 @@ bool EdifyTokenizer::nextToken(const char *data, std::size_t size,
     return true;
 }
 
+bool EdifyTokenizer::nextToken(const char *data, std::size_t size,
+                               std::size_t *pos, EdifyToken **token)
+{
+    std::size_t begin = *pos;
+    EdifyTokenType type;
+
+    if (!scanToken(data, size, pos, &type)) {
+        return false;
+    }
+
+    const char *text = data + begin;
+    std::size_t length = *pos - begin;
+
+    switch (type) {
+    case EdifyTokenType::If:
+        *token = new EdifyTokenIf();
+        break;
+    case EdifyTokenType::Then:
+        *token = new EdifyTokenThen();
+        break;
+    case EdifyTokenType::Else:
+        *token = new EdifyTokenElse();
+        break;
+    case EdifyTokenType::Endif:
+        *token = new EdifyTokenEndif();
+        break;
+    case EdifyTokenType::And:
+        *token = new EdifyTokenAnd();
+        break;
+    case EdifyTokenType::Or:
+        *token = new EdifyTokenOr();
+        break;
+    case EdifyTokenType::Equals:
+        *token = new EdifyTokenEquals();
+        break;
+    case EdifyTokenType::NotEquals:
+        *token = new EdifyTokenNotEquals();
+        break;
+    case EdifyTokenType::Not:
+        *token = new EdifyTokenNot();
+        break;
+    case EdifyTokenType::LeftParen:
+        *token = new EdifyTokenLeftParen();
+        break;
+    case EdifyTokenType::RightParen:
+        *token = new EdifyTokenRightParen();
+        break;
+    case EdifyTokenType::Semicolon:
+        *token = new EdifyTokenSemicolon();
+        break;
+    case EdifyTokenType::Comma:
+        *token = new EdifyTokenComma();
+        break;
+    case EdifyTokenType::Concat:
+        *token = new EdifyTokenConcat();
+        break;
+    case EdifyTokenType::Newline:
+        *token = new EdifyTokenNewline();
+        break;
+    case EdifyTokenType::Whitespace:
+        *token = new EdifyTokenWhitespace(std::string(text, length));
+        break;
+    case EdifyTokenType::Comment:
+        // Omit '#' character
+        *token = new EdifyTokenComment(std::string(text + 1, length - 1));
+        break;
+    case EdifyTokenType::String:
+        *token = new EdifyTokenString(std::string(text, length),
+                                      text[0] == '"'
+                                      ? EdifyTokenString::AlreadyQuoted
+                                      : EdifyTokenString::NotQuoted);
+        break;
+    case EdifyTokenType::Unknown:
+        *token = new EdifyTokenUnknown(text[0]);
+        break;
+    }
+
+    return true;
+}
+
 bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
                               std::vector<EdifyToken *> *tokens)
 {
@@ -521,6 +673,54 @@ bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
     return true;
 }
 
+constexpr std::size_t EdifyTokenRef::npos;
+
+/*!
+ * \brief Tokenize script into an array of token references
+ *
+ * All tokens are stored in \p tokens, which is the only allocation made. Each
+ * token refers to its text in \p data, so the script must outlive the tokens.
+ * The parentheses are matched while tokenizing, so callers can find the extent
+ * of a function call without rescanning.
+ */
+bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
+                              std::vector<EdifyTokenRef> *tokens)
+{
+    std::vector<EdifyTokenRef> temp;
+    std::vector<std::size_t> parens;
+    std::size_t pos = 0;
+
+    // Most tokens in real updater-scripts are a handful of bytes long
+    temp.reserve(size / 4 + 1);
+
+    while (pos < size) {
+        EdifyTokenRef token;
+        std::size_t begin = pos;
+
+        if (!scanToken(data, size, &pos, &token.type)) {
+            return false;
+        }
+
+        token.data = data + begin;
+        token.size = pos - begin;
+        token.match = EdifyTokenRef::npos;
+
+        if (token.type == EdifyTokenType::LeftParen) {
+            parens.push_back(temp.size());
+        } else if (token.type == EdifyTokenType::RightParen
+                && !parens.empty()) {
+            token.match = parens.back();
+            temp[parens.back()].match = temp.size();
+            parens.pop_back();
+        }
+
+        temp.push_back(token);
+    }
+
+    tokens->swap(temp);
+    return true;
+}
+
 std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *> &tokens)
 {
     std::string output;
@@ -540,36 +740,49 @@ std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *>::iterator
     return output;
 }
 
-void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
+static const char * tokenTypeName(EdifyTokenType type)
 {
-    const char *tokenName = nullptr;
+    switch (type) {
+    case EdifyTokenType::If:         return "If";
+    case EdifyTokenType::Then:       return "Then";
+    case EdifyTokenType::Else:       return "Else";
+    case EdifyTokenType::Endif:      return "Endif";
+    case EdifyTokenType::And:        return "And";
+    case EdifyTokenType::Or:         return "Or";
+    case EdifyTokenType::Equals:     return "Equals";
+    case EdifyTokenType::NotEquals:  return "NotEquals";
+    case EdifyTokenType::Not:        return "Not";
+    case EdifyTokenType::LeftParen:  return "LeftParen";
+    case EdifyTokenType::RightParen: return "RightParen";
+    case EdifyTokenType::Semicolon:  return "Semicolon";
+    case EdifyTokenType::Comma:      return "Comma";
+    case EdifyTokenType::Concat:     return "Concat";
+    case EdifyTokenType::Newline:    return "Newline";
+    case EdifyTokenType::Whitespace: return "Whitespace";
+    case EdifyTokenType::Comment:    return "Comment";
+    case EdifyTokenType::String:     return "String";
+    case EdifyTokenType::Unknown:    return "Unknown";
+    }
+    return nullptr;
+}
 
+void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
+{
     for (std::size_t i = 0; i < tokens.size(); ++i) {
         EdifyToken *t = tokens[i];
 
-        switch (t->type()) {
-        case EdifyTokenType::If:         tokenName = "If";         break;
-        case EdifyTokenType::Then:       tokenName = "Then";       break;
-        case EdifyTokenType::Else:       tokenName = "Else";       break;
-        case EdifyTokenType::Endif:      tokenName = "Endif";      break;
-        case EdifyTokenType::And:        tokenName = "And";        break;
-        case EdifyTokenType::Or:         tokenName = "Or";         break;
-        case EdifyTokenType::Equals:     tokenName = "Equals";     break;
-        case EdifyTokenType::NotEquals:  tokenName = "NotEquals";  break;
-        case EdifyTokenType::Not:        tokenName = "Not";        break;
-        case EdifyTokenType::LeftParen:  tokenName = "LeftParen";  break;
-        case EdifyTokenType::RightParen: tokenName = "RightParen"; break;
-        case EdifyTokenType::Semicolon:  tokenName = "Semicolon";  break;
-        case EdifyTokenType::Comma:      tokenName = "Comma";      break;
-        case EdifyTokenType::Concat:     tokenName = "Concat";     break;
-        case EdifyTokenType::Newline:    tokenName = "Newline";    break;
-        case EdifyTokenType::Whitespace: tokenName = "Whitespace"; break;
-        case EdifyTokenType::Comment:    tokenName = "Comment";    break;
-        case EdifyTokenType::String:     tokenName = "String";     break;
-        case EdifyTokenType::Unknown:    tokenName = "Unknown";    break;
-        }
+        LOGD("%" MB_PRIzu ": %-20s: %s", i, tokenTypeName(t->type()),
+             t->generate().c_str());
+    }
+}
+
+void EdifyTokenizer::dump(const std::vector<EdifyTokenRef> &tokens)
+{
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        const EdifyTokenRef &t = tokens[i];
 
-        LOGD("%" MB_PRIzu ": %-20s: %s", i, tokenName, t->generate().c_str());
+        LOGD("%" MB_PRIzu ": %-20s: %.*s", i, tokenTypeName(t.type),
+             static_cast<int>(t.size), t.data);
     }
 }
 
@@ -20,10 +20,13 @@
 #include "mbp/patchers/odinpatcher.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <unordered_set>
 
 #include <cassert>
+#include <cctype>
 #include <cinttypes>
 #include <cstring>
 
@@ -37,6 +40,7 @@
 
 #include "mbcommon/file/fd.h"
 #include "mbcommon/file/filename.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/locale.h"
 #include "mbcommon/string.h"
 
@@ -53,6 +57,15 @@
 // minizip
 #include "minizip/zip.h"
 
+// MD5 library
+#include "external/md5.h"
+
+// Odin .tar.md5 files have a line containing the MD5 digest and filename
+// appended to the tar data. The tar data is always a multiple of the block
+// size and the line is always shorter.
+#define TAR_BLOCK_SIZE          512
+#define MD5_HEX_SIZE            (2 * MD5_DIGEST_SIZE)
+
 class ar;
 
 namespace mbp
@@ -60,6 +73,81 @@ namespace mbp
 
 typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedMbFile;
 
+/*! \cond INTERNAL */
+/*!
+ * \brief Compute MD5 digest on a helper thread
+ *
+ * Only one buffer is hashed at a time. update() waits for the previous buffer
+ * to be hashed, so a caller alternating between two buffers can safely reuse a
+ * buffer once update() has been called with the other one.
+ */
+class AsyncMd5
+{
+public:
+    AsyncMd5() : _data(nullptr), _size(0), _stop(false)
+    {
+        MD5_init(&_ctx);
+        _thread = std::thread(&AsyncMd5::run, this);
+    }
+
+    ~AsyncMd5()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        _thread.join();
+    }
+
+    void update(const void *data, size_t size)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return !_data; });
+        _data = data;
+        _size = size;
+        _cv.notify_all();
+    }
+
+    void finish(uint8_t digest[MD5_DIGEST_SIZE])
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return !_data; });
+        memcpy(digest, MD5_final(&_ctx), MD5_DIGEST_SIZE);
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            _cv.wait(lock, [&]{ return _data || _stop; });
+            if (!_data) {
+                break;
+            }
+
+            lock.unlock();
+            MD5_update(&_ctx, _data, static_cast<int>(_size));
+            lock.lock();
+
+            _data = nullptr;
+            _cv.notify_all();
+        }
+    }
+
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    const void *_data;
+    size_t _size;
+    bool _stop;
+    MD5_CTX _ctx;
+};
+/*! \endcond */
+
+struct NestedCtx;
+
 /*! \cond INTERNAL */
 class OdinPatcher::Impl
 {
@@ -75,8 +163,16 @@ public:
 
     ErrorCode error;
 
-    unsigned char laBuf[10240];
+    // Alternated between so the MD5 of one can be computed while the other is
+    // being read
+    unsigned char laBuf[2][10240];
+    unsigned int laBufIndex;
     ScopedMbFile laFile{mb_file_new(), &mb_file_free};
+
+    // .tar.md5 verification
+    std::unique_ptr<AsyncMd5> md5;
+    uint8_t md5Expected[MD5_DIGEST_SIZE];
+    uint64_t md5DataSize;
 #ifdef __ANDROID__
     int fd = -1;
 #endif
@@ -94,6 +190,9 @@ public:
 
     bool patchTar();
 
+    bool readMd5Trailer();
+    bool verifyMd5();
+
     bool processFile(archive *a, archive_entry *entry, bool sparse);
     bool processContents(archive *a, int depth);
     bool openInputArchive();
@@ -104,6 +203,8 @@ public:
     void updateProgress(uint64_t bytes, uint64_t maxBytes);
     void updateDetails(const std::string &msg);
 
+    bool verifyNestedMd5(NestedCtx &ctx, const char *name);
+
     static la_ssize_t laNestedReadCb(archive *a, void *userdata, const void **buffer);
 
     static la_ssize_t laReadCb(archive *a, void *userdata, const void **buffer);
@@ -167,6 +268,7 @@ bool OdinPatcher::patchFile(ProgressUpdatedCallback progressCb,
     m_impl->maxBytes = 0;
 
     bool ret = m_impl->patchTar();
+    m_impl->md5.reset();
 
     m_impl->progressCb = nullptr;
     m_impl->detailsCb = nullptr;
@@ -253,6 +355,10 @@ bool OdinPatcher::Impl::patchTar()
         return false;
     }
 
+    if (!verifyMd5()) {
+        return false;
+    }
+
     std::string archDir(pc->dataDirectory());
     archDir += "/binaries/android/";
     archDir += mb_device_architecture(info->device());
@@ -356,6 +462,165 @@ bool OdinPatcher::Impl::patchTar()
     return true;
 }
 
+/*!
+ * \brief Parse the digest from the line appended to a .tar.md5 file
+ *
+ * \return Whether \p data starts with a hex MD5 digest followed by whitespace
+ */
+static bool parseMd5Line(const char *data, size_t size,
+                         uint8_t digest[MD5_DIGEST_SIZE])
+{
+    if (size <= MD5_HEX_SIZE || !isspace(static_cast<unsigned char>(
+            data[MD5_HEX_SIZE]))) {
+        return false;
+    }
+
+    for (size_t i = 0; i < MD5_HEX_SIZE; ++i) {
+        char c = data[i];
+        int value;
+
+        if (c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value = c - 'A' + 10;
+        } else {
+            return false;
+        }
+
+        if (i % 2 == 0) {
+            digest[i / 2] = value << 4;
+        } else {
+            digest[i / 2] |= value;
+        }
+    }
+
+    return true;
+}
+
+static std::string md5ToHex(const uint8_t digest[MD5_DIGEST_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(MD5_HEX_SIZE);
+
+    for (size_t i = 0; i < MD5_DIGEST_SIZE; ++i) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 0xf];
+    }
+
+    return hex;
+}
+
+/*!
+ * \brief Check if the input file is a .tar.md5 file
+ *
+ * If the input file ends with an MD5 line, the digest is saved and hashing is
+ * enabled in laReadCb(). The file position is left unchanged.
+ */
+bool OdinPatcher::Impl::readMd5Trailer()
+{
+    md5.reset();
+
+    uint64_t currentPos;
+    uint64_t size;
+    char trailer[TAR_BLOCK_SIZE];
+    size_t trailerSize = 0;
+
+    if (mb_file_seek(laFile.get(), 0, SEEK_CUR, &currentPos) != MB_FILE_OK
+            || mb_file_seek(laFile.get(), 0, SEEK_END, &size) != MB_FILE_OK) {
+        LOGE("%s: Failed to seek: %s", info->inputPath().c_str(),
+             mb_file_error_string(laFile.get()));
+        error = ErrorCode::FileSeekError;
+        return false;
+    }
+
+    // Data before the current position won't be read, so it can't be hashed
+    if (currentPos == 0) {
+        trailerSize = size % TAR_BLOCK_SIZE;
+    }
+
+    if (trailerSize > MD5_HEX_SIZE) {
+        size_t n;
+
+        if (mb_file_seek(laFile.get(), size - trailerSize, SEEK_SET, nullptr)
+                != MB_FILE_OK) {
+            LOGE("%s: Failed to seek: %s", info->inputPath().c_str(),
+                 mb_file_error_string(laFile.get()));
+            error = ErrorCode::FileSeekError;
+            return false;
+        }
+
+        if (mb_file_read_fully(laFile.get(), trailer, trailerSize, &n)
+                != MB_FILE_OK || n != trailerSize) {
+            LOGE("%s: Failed to read: %s", info->inputPath().c_str(),
+                 mb_file_error_string(laFile.get()));
+            error = ErrorCode::FileReadError;
+            return false;
+        }
+
+        if (parseMd5Line(trailer, trailerSize, md5Expected)) {
+            LOGD("%s: Found MD5 digest: %s", info->inputPath().c_str(),
+                 md5ToHex(md5Expected).c_str());
+            md5DataSize = size - trailerSize;
+            md5.reset(new AsyncMd5());
+        }
+    }
+
+    if (mb_file_seek(laFile.get(), currentPos, SEEK_SET, nullptr)
+            != MB_FILE_OK) {
+        LOGE("%s: Failed to seek: %s", info->inputPath().c_str(),
+             mb_file_error_string(laFile.get()));
+        error = ErrorCode::FileSeekError;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Finish hashing the input file and compare it to the expected digest
+ */
+bool OdinPatcher::Impl::verifyMd5()
+{
+    if (!md5) {
+        return true;
+    }
+
+    // libarchive stops reading at the end-of-archive marker, so read whatever
+    // remains of the tar data
+    const void *buf;
+    la_ssize_t n = 0;
+
+    while (bytes < md5DataSize && (n = laReadCb(aInput, this, &buf)) > 0) {
+        if (cancelled) return false;
+    }
+
+    if (n < 0) {
+        return false;
+    } else if (bytes < md5DataSize) {
+        LOGE("%s: Unexpected EOF", info->inputPath().c_str());
+        error = ErrorCode::FileReadError;
+        return false;
+    }
+
+    uint8_t digest[MD5_DIGEST_SIZE];
+    md5->finish(digest);
+    md5.reset();
+
+    if (memcmp(digest, md5Expected, MD5_DIGEST_SIZE) != 0) {
+        LOGE("%s: MD5 digest mismatch: expected %s, but got %s",
+             info->inputPath().c_str(), md5ToHex(md5Expected).c_str(),
+             md5ToHex(digest).c_str());
+        error = ErrorCode::ArchiveChecksumError;
+        return false;
+    }
+
+    LOGD("%s: MD5 digest matches", info->inputPath().c_str());
+    return true;
+}
+
 bool OdinPatcher::Impl::processFile(archive *a, archive_entry *entry,
                                     bool sparse)
 {
@@ -453,9 +718,17 @@ struct NestedCtx
 {
     archive *nested;
     archive *parent;
-    char buf[10240];
+    char buf[2][10240];
+    unsigned int bufIndex;
 
-    NestedCtx(archive *a) : nested(archive_read_new()), parent(a)
+    // .tar.md5 verification
+    std::unique_ptr<AsyncMd5> md5;
+    uint64_t offset;
+    uint64_t md5DataSize;
+    std::string trailer;
+
+    NestedCtx(archive *a) : nested(archive_read_new()), parent(a), bufIndex(0),
+        offset(0), md5DataSize(0)
     {
     }
 
@@ -467,6 +740,50 @@ struct NestedCtx
     }
 };
 
+/*!
+ * \brief Finish hashing a nested .tar.md5 file and compare it to its MD5 line
+ *
+ * Nested tarballs without an MD5 line are not checked.
+ */
+bool OdinPatcher::Impl::verifyNestedMd5(NestedCtx &ctx, const char *name)
+{
+    // Read the rest of the tar data and the MD5 line
+    const void *buf;
+    la_ssize_t n;
+
+    while ((n = laNestedReadCb(ctx.nested, &ctx, &buf)) > 0) {
+        if (cancelled) return false;
+    }
+
+    if (n < 0) {
+        LOGE("libarchive: Failed to read %s: %s",
+             name, archive_error_string(ctx.parent));
+        error = ErrorCode::ArchiveReadDataError;
+        return false;
+    }
+
+    uint8_t expected[MD5_DIGEST_SIZE];
+    uint8_t digest[MD5_DIGEST_SIZE];
+
+    ctx.md5->finish(digest);
+    ctx.md5.reset();
+
+    if (!parseMd5Line(ctx.trailer.data(), ctx.trailer.size(), expected)) {
+        LOGW("%s: No MD5 digest found", name);
+        return true;
+    }
+
+    if (memcmp(digest, expected, MD5_DIGEST_SIZE) != 0) {
+        LOGE("%s: MD5 digest mismatch: expected %s, but got %s",
+             name, md5ToHex(expected).c_str(), md5ToHex(digest).c_str());
+        error = ErrorCode::ArchiveChecksumError;
+        return false;
+    }
+
+    LOGD("%s: MD5 digest matches", name);
+    return true;
+}
+
 bool OdinPatcher::Impl::processContents(archive *a, int depth)
 {
     if (depth > 1) {
@@ -518,6 +835,14 @@ bool OdinPatcher::Impl::processContents(archive *a, int depth)
                 return false;
             }
 
+            // The MD5 line is shorter than a tar block, so the tar data ends
+            // at the last block boundary
+            if (archive_entry_size_is_set(entry)) {
+                uint64_t size = archive_entry_size(entry);
+                ctx.md5DataSize = size - size % TAR_BLOCK_SIZE;
+                ctx.md5.reset(new AsyncMd5());
+            }
+
             archive_read_support_format_tar(ctx.nested);
 
             int ret = archive_read_open2(ctx.nested, &ctx, nullptr,
@@ -532,6 +857,10 @@ bool OdinPatcher::Impl::processContents(archive *a, int depth)
             if (!processContents(ctx.nested, depth + 1)) {
                 return false;
             }
+
+            if (ctx.md5 && !verifyNestedMd5(ctx, name)) {
+                return false;
+            }
         } else {
             LOGD("%sSkipping unneeded file: %s", indent(depth), name);
 
@@ -668,9 +997,28 @@ la_ssize_t OdinPatcher::Impl::laNestedReadCb(archive *a, void *userdata,
 
     NestedCtx *ctx = static_cast<NestedCtx *>(userdata);
 
-    *buffer = ctx->buf;
+    char *buf = ctx->buf[ctx->bufIndex];
+    ctx->bufIndex ^= 1;
+    *buffer = buf;
+
+    la_ssize_t n = archive_read_data(ctx->parent, buf, sizeof(ctx->buf[0]));
+
+    if (n > 0 && ctx->md5) {
+        size_t toHash = 0;
+        if (ctx->offset < ctx->md5DataSize) {
+            toHash = std::min<uint64_t>(n, ctx->md5DataSize - ctx->offset);
+            ctx->md5->update(buf, toHash);
+        }
+        // Keep what may be the MD5 line
+        if (toHash < static_cast<size_t>(n)
+                && ctx->trailer.size() < TAR_BLOCK_SIZE) {
+            ctx->trailer.append(buf + toHash, std::min<size_t>(
+                    n - toHash, TAR_BLOCK_SIZE - ctx->trailer.size()));
+        }
+        ctx->offset += n;
+    }
 
-    return archive_read_data(ctx->parent, ctx->buf, sizeof(ctx->buf));
+    return n;
 }
 
 la_ssize_t OdinPatcher::Impl::laReadCb(archive *a, void *userdata,
@@ -678,10 +1026,12 @@ la_ssize_t OdinPatcher::Impl::laReadCb(archive *a, void *userdata,
 {
     (void) a;
     Impl *impl = static_cast<Impl *>(userdata);
-    *buffer = impl->laBuf;
+    unsigned char *buf = impl->laBuf[impl->laBufIndex];
+    impl->laBufIndex ^= 1;
+    *buffer = buf;
     size_t bytesRead;
 
-    if (mb_file_read(impl->laFile.get(), impl->laBuf, sizeof(impl->laBuf),
+    if (mb_file_read(impl->laFile.get(), buf, sizeof(impl->laBuf[0]),
                      &bytesRead) != MB_FILE_OK) {
         LOGE("%s: Failed to read: %s", impl->info->inputPath().c_str(),
              mb_file_error_string(impl->laFile.get()));
@@ -689,6 +1039,13 @@ la_ssize_t OdinPatcher::Impl::laReadCb(archive *a, void *userdata,
         return -1;
     }
 
+    // Hash on the helper thread while libarchive processes the buffer. The
+    // other buffer is no longer in use by either.
+    if (impl->md5 && impl->bytes < impl->md5DataSize) {
+        impl->md5->update(buf, std::min<uint64_t>(
+                bytesRead, impl->md5DataSize - impl->bytes));
+    }
+
     impl->bytes += bytesRead;
     impl->updateProgress(impl->bytes, impl->maxBytes);
     return static_cast<la_ssize_t>(bytesRead);
@@ -700,6 +1057,12 @@ la_int64_t OdinPatcher::Impl::laSkipCb(archive *a, void *userdata,
     (void) a;
     Impl *impl = static_cast<Impl *>(userdata);
 
+    // Skipped data can't be hashed. Returning 0 makes libarchive read it
+    // instead.
+    if (impl->md5) {
+        return 0;
+    }
+
     if (mb_file_seek(impl->laFile.get(), request, SEEK_CUR, nullptr)
             != MB_FILE_OK) {
         LOGE("%s: Failed to seek: %s", impl->info->inputPath().c_str(),
@@ -749,6 +1112,12 @@ int OdinPatcher::Impl::laOpenCb(archive *a, void *userdata)
         return -1;
     }
 
+    impl->laBufIndex = 0;
+
+    if (!impl->readMd5Trailer()) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -45,6 +45,9 @@ MB_EXPORT bool sign_data(BIO *bio_data_in, BIO *bio_sig_out,
                          EVP_PKEY *pkey);
 MB_EXPORT bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
                            EVP_PKEY *pkey, bool *result_out);
+MB_EXPORT bool verify_digest(const unsigned char *digest, size_t digest_size,
+                             const EVP_MD *md_type, BIO *bio_sig_in,
+                             EVP_PKEY *pkey, bool *result_out);
 
 }
 }
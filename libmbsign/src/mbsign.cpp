@@ -616,5 +616,113 @@ error:
     return false;
 }
 
+/*!
+ * \brief Verify signature of a precomputed message digest
+ *
+ * This allows the digest to be computed while the data is being written
+ * elsewhere so that it doesn't need to be read again for verification. The
+ * result is the same as verify_data() with the original data.
+ *
+ * \param digest Message digest of the data
+ * \param digest_size Size of \a digest
+ * \param md_type Digest algorithm used to compute \a digest. The operation
+ *                fails if it does not match the algorithm specified by the
+ *                signature.
+ * \param bio_sig_in Input stream for signature
+ * \param pkey Public key
+ * \param result_out Output pointer for result of verification operation
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_digest(const unsigned char *digest, size_t digest_size,
+                   const EVP_MD *md_type, BIO *bio_sig_in,
+                   EVP_PKEY *pkey, bool *result_out)
+{
+    assert(digest && md_type && bio_sig_in && pkey && result_out);
+
+    SigHeader hdr;
+    const EVP_MD *sig_md_type = nullptr;
+    EVP_PKEY_CTX *pctx = nullptr;
+    unsigned char *sigbuf = nullptr;
+    int siglen;
+    int n;
+
+    // Read header from signature file
+    if (BIO_read(bio_sig_in, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        LOGE("Failed to read header from signature BIO stream");
+        openssl_log_errors();
+        goto error;
+    }
+
+    // Verify header
+    if (memcmp(hdr.magic, MAGIC, MAGIC_SIZE) != 0) {
+        LOGE("Invalid magic in signature file");
+        goto error;
+    }
+
+    // Verify version
+    if (hdr.version == VERSION_1_SHA512_DGST) {
+        sig_md_type = EVP_sha512();
+    } else {
+        LOGE("Invalid version in signature file: %u", hdr.version);
+        goto error;
+    }
+
+    if (EVP_MD_type(md_type) != EVP_MD_type(sig_md_type)
+            || digest_size != (size_t) EVP_MD_size(sig_md_type)) {
+        LOGE("Digest does not match signature's digest algorithm");
+        goto error;
+    }
+
+    siglen = EVP_PKEY_size(pkey);
+    sigbuf = (unsigned char *) OPENSSL_malloc(siglen);
+    if (!sigbuf) {
+        LOGE("Failed to allocate signature buffer");
+        openssl_log_errors();
+        goto error;
+    }
+    siglen = BIO_read(bio_sig_in, sigbuf, siglen);
+    if (siglen <= 0) {
+        LOGE("Failed to read signature BIO stream");
+        openssl_log_errors();
+        goto error;
+    }
+
+    pctx = EVP_PKEY_CTX_new(pkey, nullptr);
+    if (!pctx) {
+        LOGE("Failed to create public key context");
+        openssl_log_errors();
+        goto error;
+    }
+
+    if (EVP_PKEY_verify_init(pctx) <= 0
+            || EVP_PKEY_CTX_set_signature_md(pctx, sig_md_type) <= 0) {
+        LOGE("Failed to set public key context");
+        openssl_log_errors();
+        goto error;
+    }
+
+    n = EVP_PKEY_verify(pctx, sigbuf, siglen, digest, digest_size);
+    if (n == 1) {
+        *result_out = true;
+    } else if (n == 0) {
+        *result_out = false;
+    } else {
+        LOGE("Failed to verify digest");
+        openssl_log_errors();
+        goto error;
+    }
+
+    EVP_PKEY_CTX_free(pctx);
+    OPENSSL_free(sigbuf);
+    return true;
+
+error:
+    EVP_PKEY_CTX_free(pctx);
+    OPENSSL_free(sigbuf);
+    return false;
+}
+
 }
 }
@@ -236,6 +236,64 @@ TEST(SignTest, TestLoadValidPemKeysWithInvalidPassphrase)
     BIO_free(bio);
 }
 
+TEST(SignTest, TestVerifyDigest)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    BIO *bio_data;
+    BIO *bio_sig;
+    const char data[] = "The quick brown fox jumps over the lazy dog";
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    char *sig_data;
+    long sig_size;
+    bool valid;
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+
+    // Sign data
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data(bio_data, bio_sig, private_key));
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+
+    ASSERT_TRUE(EVP_Digest(data, sizeof(data) - 1, digest, &digest_size,
+                           EVP_sha512(), nullptr));
+
+    // Valid digest
+    BIO *bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, digest_size, EVP_sha512(),
+                                        bio_sig_in, public_key, &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+
+    // Modified digest
+    digest[0] ^= 0xff;
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, digest_size, EVP_sha512(),
+                                        bio_sig_in, public_key, &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    // Digest algorithm does not match signature
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_FALSE(mb::sign::verify_digest(digest, 32, EVP_sha256(),
+                                         bio_sig_in, public_key, &valid));
+    BIO_free(bio_sig_in);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    BIO_free(bio_data);
+    BIO_free(bio_sig);
+}
+
 int main(int argc, char *argv[])
 {
     ERR_load_crypto_strings();
@@ -20,8 +20,13 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <cstdint>
+
+#include <sys/types.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -40,6 +45,45 @@ struct exists_info {
     bool exists;
 };
 
+struct zip_entry_info {
+    std::string name;
+    // Offset of the local file header
+    uint64_t offset;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    // "Version made by" field (upper byte is the host system)
+    uint16_t version_made_by;
+    // External file attributes (upper 16 bits are the mode on Unix hosts)
+    uint32_t external_attr;
+    // Position of the central directory record (for unzGoToFilePos64())
+    uint64_t cd_offset;
+    uint64_t cd_index;
+};
+
+/*!
+ * \brief Index of the entries in a zip file
+ *
+ * The index is built from the zip's central directory with minizip, so loading
+ * it does not require reading any of the file data. Entries can then be opened
+ * directly with libarchive_open_zip_entry() or with minizip's
+ * unzGoToFilePos64(). A loaded index can be reused for any number of lookups on
+ * the same zip file.
+ */
+class ZipIndex
+{
+public:
+    bool load(const std::string &filename);
+
+    const std::string & filename() const;
+    const std::vector<zip_entry_info> & entries() const;
+    const zip_entry_info * find(const std::string &name) const;
+
+private:
+    std::string _filename;
+    std::vector<zip_entry_info> _entries;
+    std::unordered_map<std::string, size_t> _map;
+};
+
 enum class compression_type
 {
     NONE,
@@ -62,13 +106,21 @@ bool libarchive_tar_create(const std::string &filename,
                            const std::vector<std::string> &paths,
                            compression_type compression);
 
+mode_t zip_entry_mode(const zip_entry_info &info);
+bool libarchive_open_zip_entry(archive *in, const ZipIndex &index,
+                               const std::string &name,
+                               archive_entry **entry);
+
 bool extract_archive(const std::string &filename, const std::string &target);
 bool extract_files(const std::string &filename, const std::string &target,
-                   const std::vector<std::string> &files);
+                   const std::vector<std::string> &files,
+                   const ZipIndex *index = nullptr);
 bool extract_files2(const std::string &filename,
-                    const std::vector<extract_info> &files);
+                    const std::vector<extract_info> &files,
+                    const ZipIndex *index = nullptr);
 bool archive_exists(const std::string &filename,
-                    std::vector<exists_info> &files);
+                    std::vector<exists_info> &files,
+                    const ZipIndex *index = nullptr);
 
 }
 }
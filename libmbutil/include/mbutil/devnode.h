@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+struct DeviceNode
+{
+    // Path of the node relative to the target root
+    std::string path;
+    // File type and permissions
+    mode_t mode;
+    dev_t rdev;
+    uid_t uid;
+    gid_t gid;
+    // SELinux label (not set if empty)
+    std::string context;
+};
+
+bool device_node_stat(const std::string &path, DeviceNode *node);
+bool device_nodes_stat(const std::vector<std::string> &paths,
+                       std::vector<DeviceNode> *nodes);
+bool create_device_nodes(const std::string &root,
+                         const std::vector<DeviceNode> &nodes);
+
+}
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+// s_state flags
+#define EXT4_STATE_VALID_FS             0x0001
+#define EXT4_STATE_ERROR_FS             0x0002
+#define EXT4_STATE_ORPHAN_FS            0x0004
+
+// s_feature_compat flags
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+
+// s_feature_incompat flags
+#define EXT4_FEATURE_INCOMPAT_RECOVER   0x0004
+
+struct Ext4SuperblockInfo
+{
+    uint16_t state;
+    uint32_t error_count;
+    uint16_t mount_count;
+    int16_t max_mount_count;
+    uint32_t last_mount_time;
+    uint32_t last_write_time;
+    uint32_t last_check_time;
+    uint32_t check_interval;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+};
+
+enum class Ext4Health
+{
+    // Cleanly unmounted and not due for a periodic check
+    CLEAN,
+    // Not cleanly unmounted or mounted right now
+    NOT_CLEAN,
+    // Kernel recorded errors
+    HAS_ERRORS,
+    // Journal has not been replayed
+    NEEDS_RECOVERY,
+    // Mount count or check interval was exceeded
+    CHECK_DUE,
+};
+
+bool ext4_read_superblock(const char *path, Ext4SuperblockInfo *info);
+Ext4Health ext4_get_health(const Ext4SuperblockInfo &info, uint32_t now);
+const char * ext4_health_string(Ext4Health health);
+
+bool ext4_create_image(const std::string &path, uint64_t size,
+                       const std::string &source_dir,
+                       const std::vector<std::string> &exclusions);
+
+}
+}
@@ -20,7 +20,13 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
+#include <cstddef>
+#include <cstdint>
+
+#include <openssl/evp.h>
+#include <openssl/md5.h>
 #include <openssl/sha.h>
 
 namespace mb
@@ -28,6 +34,72 @@ namespace mb
 namespace util
 {
 
+enum HashAlgorithms : int
+{
+    HASH_MD5                 = 0x1,
+    HASH_SHA1                = 0x2,
+    HASH_SHA512              = 0x4,
+    HASH_CRC32               = 0x8
+};
+
+enum HashFlags : int
+{
+    // Map regular files into memory instead of reading them into a buffer
+    HASH_MMAP                = 0x1
+};
+
+struct Digests
+{
+    // Algorithms that were computed (HashAlgorithms)
+    int algorithms;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    unsigned char sha1[SHA_DIGEST_LENGTH];
+    unsigned char sha512[SHA512_DIGEST_LENGTH];
+    uint32_t crc32;
+};
+
+struct hash_file_info
+{
+    std::string path;
+    Digests digests;
+    bool success;
+};
+
+/*!
+ * \brief Compute several digests in a single pass over the data
+ *
+ * Every buffer passed to update() is fed to all of the selected algorithms, so
+ * the data only needs to be read once regardless of how many digests are
+ * needed.
+ */
+class MultiHasher
+{
+public:
+    MultiHasher();
+    ~MultiHasher();
+
+    MultiHasher(const MultiHasher &) = delete;
+    MultiHasher & operator=(const MultiHasher &) = delete;
+
+    bool init(int algorithms);
+    bool update(const void *data, size_t size);
+    bool final(Digests &digests);
+
+private:
+    void reset();
+
+    int _algorithms;
+    EVP_MD_CTX *_md5;
+    EVP_MD_CTX *_sha1;
+    EVP_MD_CTX *_sha512;
+    uint32_t _crc32;
+};
+
+bool hash_fd(int fd, int algorithms, int flags, Digests &digests);
+bool hash_file(const std::string &path, int algorithms, int flags,
+               Digests &digests);
+bool hash_files(std::vector<hash_file_info> &files, int algorithms, int flags);
+
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH]);
 
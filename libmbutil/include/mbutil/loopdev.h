@@ -26,9 +26,20 @@ namespace mb
 namespace util
 {
 
+enum LoopdevFlags : int
+{
+    LOOPDEV_READ_ONLY   = 0x1,
+    // Bypass the page cache for the backing file if the kernel supports it
+    LOOPDEV_DIRECT_IO   = 0x2,
+    // Use the backing device's logical block size instead of 512 bytes. This
+    // allows direct I/O on 4K-sector storage, but the filesystem in the image
+    // must not use a smaller block size.
+    LOOPDEV_BACKING_BLOCK_SIZE = 0x4
+};
+
 std::string loopdev_find_unused(void);
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
-                           uint64_t offset, bool ro);
+                           uint64_t offset, int flags);
 bool loopdev_remove_device(const std::string &loopdev);
 
 }
@@ -20,16 +20,43 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstdint>
 
 namespace mb
 {
 namespace util
 {
 
+struct MountEntry
+{
+    // Mount ID and ID of the parent mount
+    int id;
+    int parent_id;
+    // Device number of the mounted filesystem
+    unsigned int dev_major;
+    unsigned int dev_minor;
+    // Root of the mount within the filesystem
+    std::string root;
+    // Mount point (relative to the process root)
+    std::string target;
+    // Per-mount options
+    std::string vfs_options;
+    std::string fs_type;
+    std::string source;
+    // Per-superblock options
+    std::string fs_options;
+};
+
+bool mount_get_entries(std::vector<MountEntry> *entries);
+bool mount_get_subtree(const std::string &dir,
+                       std::vector<MountEntry> *entries);
+
 bool is_mounted(const std::string &mountpoint);
 bool unmount_all(const std::string &dir);
 bool mount(const char *source, const char *target, const char *fstype,
-           unsigned long mount_flags, const void *data);
+           unsigned long mount_flags, const void *data, int loop_flags = 0);
 bool umount(const char *target);
 
 uint64_t mount_get_total_size(const char *path);
@@ -19,8 +19,14 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include <ctime>
+
+#include <sys/types.h>
 
 #include "mbutil/integer.h"
 #include "mbutil/external/system_properties.h"
@@ -73,10 +79,67 @@ typedef void (*property_list_cb)(const char *key, const char *value,
 int property_list(property_list_cb propfn, void *cookie);
 
 bool get_all_properties(std::unordered_map<std::string, std::string> *map);
+
+/*!
+ * \brief Parsed contents of a property file
+ *
+ * The file is read into memory once and keys are looked up in a hash table
+ * that points into the file buffer. Snapshots are immutable and can be shared
+ * between threads.
+ */
+class PropertiesSnapshot
+{
+public:
+    static std::shared_ptr<const PropertiesSnapshot> load(const std::string &path);
+
+    bool find(const char *key, size_t key_size,
+              const char **value, size_t *value_size) const;
+    bool get(const std::string &key, std::string *out) const;
+    void get_all(std::unordered_map<std::string, std::string> *map) const;
+
+    size_t size() const;
+
+    dev_t dev() const;
+    ino_t ino() const;
+    off_t file_size() const;
+    const struct timespec & mtime() const;
+
+private:
+    struct Entry
+    {
+        size_t key_offset;
+        size_t key_size;
+        size_t value_offset;
+        size_t value_size;
+    };
+
+    PropertiesSnapshot();
+
+    void parse();
+
+    std::vector<char> _buf;
+    std::vector<Entry> _entries;
+    // Index into _entries plus 1 (0 means empty)
+    std::vector<size_t> _table;
+
+    dev_t _dev;
+    ino_t _ino;
+    off_t _size;
+    struct timespec _mtime;
+};
+
+std::shared_ptr<const PropertiesSnapshot>
+file_get_properties_snapshot(const std::string &path);
+void file_clear_properties_cache();
+
 bool file_get_property(const std::string &path,
                        const std::string &key,
                        std::string *out,
                        const std::string &default_value);
+bool file_get_properties(const std::string &path,
+                         const std::vector<std::string> &keys,
+                         std::vector<std::string> *out,
+                         const std::string &default_value);
 bool file_get_all_properties(const std::string &path,
                              std::unordered_map<std::string, std::string> *map);
 bool file_write_properties(const std::string &path,
@@ -22,14 +22,24 @@
 #include <algorithm>
 #include <memory>
 #include <cerrno>
+#include <climits>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/endian.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
 #include "mbutil/path.h"
 
+#include "minizip/ioandroid.h"
+#include "minizip/ioapi_buf.h"
+#include "minizip/unzip.h"
+
 #define LIBARCHIVE_DISK_WRITER_FLAGS \
     ARCHIVE_EXTRACT_TIME \
     | ARCHIVE_EXTRACT_SECURE_SYMLINKS \
@@ -45,6 +55,12 @@
 #define LIBARCHIVE_DISK_READER_FLAGS \
     ARCHIVE_READDISK_MAC_COPYFILE
 
+#define ZIP_LOCAL_HEADER_SIG        0x04034b50
+// Host system for Unix in the "version made by" field
+#define ZIP_HOST_UNIX               3
+
+#define ZIP_ENTRY_READ_SIZE         65536
+
 namespace mb
 {
 namespace util
@@ -566,6 +582,357 @@ bool libarchive_tar_create(const std::string &filename,
     return true;
 }
 
+struct ZipHandle
+{
+    unzFile uf;
+    zlib_filefunc64_def zFunc;
+    ourbuffer_t buf;
+};
+
+// The handle must not be moved after opening since minizip keeps a pointer to
+// the I/O buffer
+static bool open_zip(const std::string &path, ZipHandle *handle)
+{
+    memset(handle, 0, sizeof(*handle));
+
+    fill_android_filefunc64(&handle->buf.filefunc64);
+    fill_buffer_filefunc64(&handle->zFunc, &handle->buf);
+
+    handle->uf = unzOpen2_64(path.c_str(), &handle->zFunc);
+    return handle->uf != nullptr;
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    unsigned char *ptr = static_cast<unsigned char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = pread64(fd, ptr, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EINVAL;
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check that an entry's local file header is where the index says
+ *
+ * minizip accounts for data prepended to the zip (eg. in self-extracting
+ * archives) internally, but does not report it, so such zips can't be opened
+ * by offset.
+ */
+static bool has_local_header(const std::string &filename, uint64_t offset)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    unsigned char sig[4];
+    bool ret = pread_fully(fd, sig, sizeof(sig), offset);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+
+    if (ret) {
+        uint32_t value;
+        memcpy(&value, sig, sizeof(value));
+        if (mb_le32toh(value) != ZIP_LOCAL_HEADER_SIG) {
+            errno = EINVAL;
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Load the central directory of a zip file
+ *
+ * Only the central directory is read. Zip64 archives are supported.
+ *
+ * \return True if the index was loaded. False, with errno set, if the file
+ *         could not be read or is not a valid zip file. Nothing is logged so
+ *         that callers can silently fall back to sequential reading.
+ */
+bool ZipIndex::load(const std::string &filename)
+{
+    _filename.clear();
+    _entries.clear();
+    _map.clear();
+
+    ZipHandle handle;
+    errno = 0;
+    if (!open_zip(filename, &handle)) {
+        if (errno == 0) {
+            errno = EINVAL;
+        }
+        return false;
+    }
+
+    auto close_zip = finally([&]{
+        unzClose(handle.uf);
+    });
+
+    // Zip filenames are limited to 16 bits
+    std::vector<char> name(UINT16_MAX + 1);
+    int ret;
+
+    for (ret = unzGoToFirstFile(handle.uf); ret == UNZ_OK;
+            ret = unzGoToNextFile(handle.uf)) {
+        unz_file_info64 fi;
+        unz64_file_pos pos;
+
+        ret = unzGetCurrentFileInfo64(handle.uf, &fi, name.data(), name.size(),
+                                      nullptr, 0, nullptr, 0);
+        if (ret != UNZ_OK) {
+            break;
+        }
+        ret = unzGetFilePos64(handle.uf, &pos);
+        if (ret != UNZ_OK) {
+            break;
+        }
+
+        zip_entry_info info;
+        info.name = name.data();
+        info.offset = fi.disk_offset;
+        info.compressed_size = fi.compressed_size;
+        info.uncompressed_size = fi.uncompressed_size;
+        info.version_made_by = fi.version;
+        info.external_attr = fi.external_fa;
+        info.cd_offset = pos.pos_in_zip_directory;
+        info.cd_index = pos.num_of_file;
+
+        // Later entries take precedence, like when extracting sequentially
+        _map[info.name] = _entries.size();
+        _entries.push_back(std::move(info));
+    }
+
+    if (ret != UNZ_END_OF_LIST_OF_FILE
+            || (!_entries.empty()
+                    && !has_local_header(filename, _entries[0].offset))) {
+        _entries.clear();
+        _map.clear();
+        if (errno == 0) {
+            errno = EINVAL;
+        }
+        return false;
+    }
+
+    _filename = filename;
+    return true;
+}
+
+const std::string & ZipIndex::filename() const
+{
+    return _filename;
+}
+
+const std::vector<zip_entry_info> & ZipIndex::entries() const
+{
+    return _entries;
+}
+
+/*!
+ * \brief Find entry by name
+ *
+ * \return Entry or nullptr if no entry with the specified name exists
+ */
+const zip_entry_info * ZipIndex::find(const std::string &name) const
+{
+    auto it = _map.find(name);
+    return it == _map.end() ? nullptr : &_entries[it->second];
+}
+
+struct ZipEntryReader
+{
+    int fd;
+    uint64_t offset;
+    std::vector<unsigned char> buf;
+};
+
+static la_ssize_t zip_entry_read_cb(archive *a, void *userdata,
+                                    const void **buf)
+{
+    ZipEntryReader *reader = static_cast<ZipEntryReader *>(userdata);
+
+    ssize_t n;
+    do {
+        n = pread64(reader->fd, reader->buf.data(), reader->buf.size(),
+                    reader->offset);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        archive_set_error(a, errno, "Failed to read zip: %s",
+                          strerror(errno));
+        return -1;
+    }
+
+    reader->offset += n;
+    *buf = reader->buf.data();
+    return n;
+}
+
+static la_int64_t zip_entry_skip_cb(archive *a, void *userdata,
+                                    la_int64_t request)
+{
+    (void) a;
+    ZipEntryReader *reader = static_cast<ZipEntryReader *>(userdata);
+    reader->offset += request;
+    return request;
+}
+
+static int zip_entry_close_cb(archive *a, void *userdata)
+{
+    (void) a;
+    ZipEntryReader *reader = static_cast<ZipEntryReader *>(userdata);
+    close(reader->fd);
+    delete reader;
+    return ARCHIVE_OK;
+}
+
+/*!
+ * \brief Get the mode of a zip entry from its central directory record
+ *
+ * \return File type and permission bits or 0 if the zip was not created on a
+ *         Unix system
+ */
+mode_t zip_entry_mode(const zip_entry_info &info)
+{
+    if ((info.version_made_by >> 8) != ZIP_HOST_UNIX) {
+        return 0;
+    }
+    return (info.external_attr >> 16) & 0xffff;
+}
+
+/*!
+ * \brief Apply the file type and permissions from the central directory
+ *
+ * When libarchive's zip reader does not start at the beginning of a seekable
+ * file, it only sees the local file header, which does not contain the
+ * external file attributes. Without this, every entry would have the default
+ * 0664 permissions and symlinks would be extracted as regular files containing
+ * the link target.
+ */
+static bool apply_zip_entry_mode(archive *in, const zip_entry_info &info,
+                                 archive_entry *entry)
+{
+    mode_t mode = zip_entry_mode(info);
+    if (mode == 0) {
+        return true;
+    }
+
+    mode_t type = mode & S_IFMT;
+    if (type != S_IFREG && type != S_IFDIR && type != S_IFLNK) {
+        type = archive_entry_filetype(entry);
+    }
+
+    if (type == S_IFLNK) {
+        // The link target is stored as the entry's data
+        if (info.uncompressed_size >= PATH_MAX) {
+            LOGE("%s: Symlink target is too long", info.name.c_str());
+            return false;
+        }
+
+        std::string target(info.uncompressed_size, '\0');
+        size_t total = 0;
+
+        while (total < target.size()) {
+            la_ssize_t n = archive_read_data(in, &target[total],
+                                             target.size() - total);
+            if (n <= 0) {
+                LOGE("%s: Failed to read symlink target: %s",
+                     info.name.c_str(), archive_error_string(in));
+                return false;
+            }
+            total += n;
+        }
+
+        archive_entry_set_size(entry, 0);
+        archive_entry_set_symlink(entry, target.c_str());
+    }
+
+    archive_entry_set_mode(entry, type | (mode & 07777));
+
+    return true;
+}
+
+/*!
+ * \brief Open a single zip entry for reading without scanning the zip
+ *
+ * libarchive's zip reader is started directly at the entry's local file
+ * header, so reading the entry works exactly as if it had been reached with
+ * archive_read_next_header(). The mode and symlink target, which are only
+ * stored in the central directory, are set from the index. No further entries
+ * should be read.
+ *
+ * \param in Newly created libarchive reader
+ * \param index Loaded zip index
+ * \param name Name of entry to open
+ * \param[out] entry Header of the entry
+ *
+ * \return Whether the entry was successfully opened
+ */
+bool libarchive_open_zip_entry(archive *in, const ZipIndex &index,
+                               const std::string &name,
+                               archive_entry **entry)
+{
+    const zip_entry_info *info = index.find(name);
+    if (!info) {
+        LOGE("%s: File not found in zip: %s",
+             index.filename().c_str(), name.c_str());
+        return false;
+    }
+
+    archive_read_support_format_zip(in);
+
+    ZipEntryReader *reader = new ZipEntryReader();
+    reader->fd = open(index.filename().c_str(), O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        LOGE("%s: Failed to open archive: %s",
+             index.filename().c_str(), strerror(errno));
+        delete reader;
+        return false;
+    }
+    reader->offset = info->offset;
+    reader->buf.resize(ZIP_ENTRY_READ_SIZE);
+
+    // The reader is freed by the close callback, even if this fails
+    if (archive_read_open2(in, reader, nullptr, &zip_entry_read_cb,
+                           &zip_entry_skip_cb, &zip_entry_close_cb)
+            != ARCHIVE_OK) {
+        LOGE("%s: Failed to open archive: %s",
+             index.filename().c_str(), archive_error_string(in));
+        return false;
+    }
+
+    if (archive_read_next_header(in, entry) != ARCHIVE_OK) {
+        LOGE("%s: Failed to read header for %s: %s",
+             index.filename().c_str(), name.c_str(), archive_error_string(in));
+        return false;
+    }
+
+    const char *path = archive_entry_pathname(*entry);
+    if (!path || name != path) {
+        LOGE("%s: Local header for %s does not match central directory",
+             index.filename().c_str(), name.c_str());
+        return false;
+    }
+
+    return apply_zip_entry_mode(in, *info, *entry);
+}
+
 static bool set_up_input(archive *in, const std::string &filename)
 {
     // Add more as needed
@@ -597,6 +964,48 @@ static void set_up_output(archive *out)
                                    ARCHIVE_EXTRACT_XATTR);
 }
 
+/*!
+ * \brief Get index for a zip file, loading it if one was not provided
+ *
+ * \return \a index, \a local if the central directory could be read, or
+ *         nullptr if the caller should fall back to reading the archive
+ *         sequentially
+ */
+static const ZipIndex * get_zip_index(const std::string &filename,
+                                      const ZipIndex *index, ZipIndex &local)
+{
+    if (index) {
+        return index;
+    } else if (local.load(filename)) {
+        return &local;
+    } else {
+        LOGW("%s: Failed to read zip central directory: %s",
+             filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+}
+
+static bool extract_indexed_entry(const ZipIndex &index, archive *out,
+                                  const std::string &from,
+                                  const std::string &to)
+{
+    autoclose::archive in(archive_read_new(), archive_read_free);
+    if (!in) {
+        LOGE("Out of memory");
+        return false;
+    }
+
+    archive_entry *entry;
+
+    if (!libarchive_open_zip_entry(in.get(), index, from, &entry)) {
+        return false;
+    }
+
+    archive_entry_set_pathname(entry, to.c_str());
+
+    return libarchive_copy_header_and_data(in.get(), out, entry) == ARCHIVE_OK;
+}
+
 bool extract_archive(const std::string &filename, const std::string &target)
 {
     autoclose::archive in(archive_read_new(), archive_read_free);
@@ -653,12 +1062,25 @@ bool extract_archive(const std::string &filename, const std::string &target)
 }
 
 bool extract_files(const std::string &filename, const std::string &target,
-                   const std::vector<std::string> &files)
+                   const std::vector<std::string> &files,
+                   const ZipIndex *index)
 {
     if (files.empty()) {
         return false;
     }
 
+    ZipIndex local_index;
+    index = get_zip_index(filename, index, local_index);
+
+    if (index) {
+        for (const std::string &file : files) {
+            if (!index->find(file)) {
+                LOGE("Not all specified files were extracted");
+                return false;
+            }
+        }
+    }
+
     autoclose::archive in(archive_read_new(), archive_read_free);
     autoclose::archive out(archive_write_disk_new(), archive_write_free);
 
@@ -676,7 +1098,7 @@ bool extract_files(const std::string &filename, const std::string &target,
         return false;
     }
 
-    if (!set_up_input(in.get(), filename)) {
+    if (!index && !set_up_input(in.get(), filename)) {
         return false;
     }
 
@@ -698,6 +1120,16 @@ bool extract_files(const std::string &filename, const std::string &target,
         chdir(cwd.c_str());
     });
 
+    if (index) {
+        for (const std::string &file : files) {
+            if (!extract_indexed_entry(*index, out.get(), file, file)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
         if (std::find(files.begin(), files.end(),
                 archive_entry_pathname(entry)) != files.end()) {
@@ -724,12 +1156,16 @@ bool extract_files(const std::string &filename, const std::string &target,
 }
 
 bool extract_files2(const std::string &filename,
-                    const std::vector<extract_info> &files)
+                    const std::vector<extract_info> &files,
+                    const ZipIndex *index)
 {
     if (files.empty()) {
         return false;
     }
 
+    ZipIndex local_index;
+    index = get_zip_index(filename, index, local_index);
+
     autoclose::archive in(archive_read_new(), archive_read_free);
     autoclose::archive out(archive_write_disk_new(), archive_write_free);
 
@@ -742,6 +1178,25 @@ bool extract_files2(const std::string &filename,
     int ret;
     unsigned int count = 0;
 
+    if (index) {
+        for (const extract_info &info : files) {
+            if (!index->find(info.from)) {
+                LOGE("Not all specified files were extracted");
+                return false;
+            }
+        }
+
+        set_up_output(out.get());
+
+        for (const extract_info &info : files) {
+            if (!extract_indexed_entry(*index, out.get(), info.from, info.to)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     if (!set_up_input(in.get(), filename)) {
         return false;
     }
@@ -779,12 +1234,24 @@ bool extract_files2(const std::string &filename,
 }
 
 bool archive_exists(const std::string &filename,
-                    std::vector<exists_info> &files)
+                    std::vector<exists_info> &files,
+                    const ZipIndex *index)
 {
     if (files.empty()) {
         return false;
     }
 
+    ZipIndex local_index;
+    index = get_zip_index(filename, index, local_index);
+
+    if (index) {
+        for (exists_info &info : files) {
+            info.exists = index->find(info.path) != nullptr;
+        }
+
+        return true;
+    }
+
     autoclose::archive in(archive_read_new(), archive_read_free);
 
     if (!in) {
@@ -19,6 +19,11 @@
 
 #include "mbutil/copy.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
@@ -38,6 +43,8 @@
 // WARNING: Everything operates on paths, so it's subject to race conditions
 // Directory copy operations will not cross mountpoint boundaries
 
+#define MAX_COPY_THREADS        4
+
 namespace mb
 {
 namespace util
@@ -469,6 +476,13 @@ public:
 
     virtual int on_reached_directory_post() override
     {
+        // The directory's files are written later, which may not be possible
+        // once its permissions have been copied
+        if (_copyflags & COPY_PARALLEL) {
+            _deferred_dirs.push_back({ _curr->fts_accpath, _curtgtpath });
+            return Action::FTS_OK;
+        }
+
         if (!cp_attrs()) {
             return Action::FTS_Fail;
         }
@@ -486,6 +500,11 @@ public:
             return Action::FTS_Fail;
         }
 
+        if (_copyflags & COPY_PARALLEL) {
+            _deferred_files.push_back({ _curr->fts_accpath, _curtgtpath });
+            return Action::FTS_OK;
+        }
+
         // Copy file contents
         if (!copy_data(_curr->fts_accpath, _curtgtpath)) {
             char *msg = mb_format("%s: Failed to copy data: %s",
@@ -643,11 +662,88 @@ public:
         return Action::FTS_Skip;
     }
 
+    /*!
+     * \brief Copy the files and directory attributes deferred by COPY_PARALLEL
+     *
+     * The files are copied on a worker pool. The directory attributes are then
+     * copied in the order the directories were visited, which is after all of
+     * their children.
+     */
+    bool copy_deferred()
+    {
+        std::atomic<size_t> next(0);
+        std::atomic<bool> success(true);
+
+        auto worker = [&]{
+            size_t i;
+            while ((i = next++) < _deferred_files.size()) {
+                const CopyPaths &paths = _deferred_files[i];
+
+                if (!copy_data(paths.source, paths.target)) {
+                    LOGW("%s: Failed to copy data: %s",
+                         paths.target.c_str(), strerror(errno));
+                    success = false;
+                    continue;
+                }
+
+                if (!copy_metadata(paths)) {
+                    success = false;
+                }
+            }
+        };
+
+        unsigned int n_threads = std::min<size_t>(std::max(
+                std::thread::hardware_concurrency(), 1u), MAX_COPY_THREADS);
+        n_threads = std::min<size_t>(n_threads, _deferred_files.size());
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < n_threads; ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (std::thread &t : threads) {
+            t.join();
+        }
+
+        for (const CopyPaths &paths : _deferred_dirs) {
+            if (!copy_metadata(paths)) {
+                success = false;
+            }
+        }
+
+        return success;
+    }
+
 private:
+    struct CopyPaths
+    {
+        std::string source;
+        std::string target;
+    };
+
     int _copyflags;
     std::string _target;
     struct stat sb_target;
     std::string _curtgtpath;
+    std::vector<CopyPaths> _deferred_files;
+    std::vector<CopyPaths> _deferred_dirs;
+
+    bool copy_metadata(const CopyPaths &paths)
+    {
+        if ((_copyflags & COPY_ATTRIBUTES)
+                && !copy_stat(paths.source, paths.target)) {
+            LOGW("%s: Failed to copy attributes: %s",
+                 paths.target.c_str(), strerror(errno));
+            return false;
+        }
+        if ((_copyflags & COPY_XATTRS)
+                && !copy_xattrs(paths.source, paths.target)) {
+            LOGW("%s: Failed to copy xattrs: %s",
+                 paths.target.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
 
     bool remove_existing_file()
     {
@@ -707,6 +803,12 @@ bool copy_dir(const std::string &source, const std::string &target, int flags)
     RecursiveCopier copier(source, target, flags);
     bool ret = copier.run();
 
+    // Finish the deferred work even if the traversal failed since copy_dir()
+    // copies as much as possible
+    if (flags & COPY_PARALLEL) {
+        ret = copier.copy_deferred() && ret;
+    }
+
     umask(old_umask);
 
     return ret;
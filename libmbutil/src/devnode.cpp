@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/devnode.h"
+
+#include <unordered_set>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+#include "mbutil/selinux.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Get information needed to recreate a device node
+ *
+ * Symlinks are followed, but \a node->path is set to \a path so that the node
+ * is recreated at the same location as the symlink.
+ *
+ * \return True if \a path refers to a block or character device. False, with
+ *         errno set, if it does not or if it could not be stat'ed.
+ */
+bool device_node_stat(const std::string &path, DeviceNode *node)
+{
+    struct stat sb;
+
+    if (stat(path.c_str(), &sb) < 0) {
+        return false;
+    }
+
+    if (!S_ISBLK(sb.st_mode) && !S_ISCHR(sb.st_mode)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    node->path = path;
+    node->mode = sb.st_mode;
+    node->rdev = sb.st_rdev;
+    node->uid = sb.st_uid;
+    node->gid = sb.st_gid;
+
+    // The recovery may not have SELinux enabled
+    if (!selinux_get_context(path, &node->context)) {
+        node->context.clear();
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get information needed to recreate a list of device nodes
+ *
+ * Paths that don't exist or that aren't device nodes are skipped. Duplicate
+ * paths are only added once.
+ *
+ * \return False if any path could not be stat'ed. \a nodes will still contain
+ *         the nodes that were successfully stat'ed.
+ */
+bool device_nodes_stat(const std::vector<std::string> &paths,
+                       std::vector<DeviceNode> *nodes)
+{
+    std::unordered_set<std::string> seen;
+    DeviceNode node;
+    bool ret = true;
+
+    nodes->reserve(nodes->size() + paths.size());
+
+    for (const std::string &path : paths) {
+        if (!seen.insert(path).second) {
+            continue;
+        }
+
+        if (device_node_stat(path, &node)) {
+            nodes->push_back(std::move(node));
+        } else if (errno != ENOENT) {
+            LOGW("%s: Failed to stat device node: %s",
+                 path.c_str(), strerror(errno));
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+static bool mkdir_parents_at(int dfd, const std::string &path,
+                             std::unordered_set<std::string> &created)
+{
+    for (size_t pos = path.find('/'); pos != std::string::npos;
+            pos = path.find('/', pos + 1)) {
+        if (pos == 0) {
+            continue;
+        }
+
+        std::string dir = path.substr(0, pos);
+        if (created.find(dir) != created.end()) {
+            continue;
+        }
+
+        if (mkdirat(dfd, dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            return false;
+        }
+
+        created.insert(std::move(dir));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create device nodes under a directory
+ *
+ * This is a cheaper alternative to copy_file() for mirroring many device
+ * nodes. Parent directories are created as needed and existing files at the
+ * target paths are replaced. The nodes are all created before any of the
+ * SELinux labels are set.
+ *
+ * \param root Directory in which to create the nodes
+ * \param nodes List of nodes to create
+ *
+ * \return False if any node could not be created. The remaining nodes are still
+ *         created.
+ */
+bool create_device_nodes(const std::string &root,
+                         const std::vector<DeviceNode> &nodes)
+{
+    int dfd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        LOGE("%s: Failed to open directory: %s",
+             root.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_dfd = finally([&]{
+        close(dfd);
+    });
+
+    std::unordered_set<std::string> created_dirs;
+    std::vector<const DeviceNode *> created_nodes;
+    bool ret = true;
+
+    created_nodes.reserve(nodes.size());
+
+    for (const DeviceNode &node : nodes) {
+        // Paths are relative to the root
+        size_t start = node.path.find_first_not_of('/');
+        if (start == std::string::npos) {
+            LOGE("Invalid device node path: %s", node.path.c_str());
+            ret = false;
+            continue;
+        }
+        const char *path = node.path.c_str() + start;
+
+        if (!mkdir_parents_at(dfd, path, created_dirs)) {
+            LOGE("%s: Failed to create parent directories: %s",
+                 path, strerror(errno));
+            ret = false;
+            continue;
+        }
+
+        if (unlinkat(dfd, path, 0) < 0 && errno != ENOENT) {
+            LOGE("%s: Failed to remove existing file: %s",
+                 path, strerror(errno));
+            ret = false;
+            continue;
+        }
+
+        // mknodat() is affected by the umask, so set the mode afterwards
+        if (mknodat(dfd, path, node.mode & (S_IFMT | 0777), node.rdev) < 0
+                || fchownat(dfd, path, node.uid, node.gid,
+                            AT_SYMLINK_NOFOLLOW) < 0
+                || fchmodat(dfd, path, node.mode & 07777, 0) < 0) {
+            LOGE("%s: Failed to create device node: %s",
+                 path, strerror(errno));
+            ret = false;
+            continue;
+        }
+
+        if (!node.context.empty()) {
+            created_nodes.push_back(&node);
+        }
+    }
+
+    for (const DeviceNode *node : created_nodes) {
+        std::string path(root);
+        path += '/';
+        path += node->path.c_str() + node->path.find_first_not_of('/');
+
+        if (!selinux_lset_context(path, node->context)) {
+            LOGE("%s: Failed to set SELinux label to %s: %s",
+                 path.c_str(), node->context.c_str(), strerror(errno));
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+}
+}
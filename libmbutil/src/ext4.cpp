@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/ext4.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mbcommon/endian.h"
+
+#include "mbutil/finally.h"
+
+#define EXT4_SUPERBLOCK_OFFSET          1024
+#define EXT4_SUPERBLOCK_SIZE            1024
+#define EXT4_SUPER_MAGIC                0xef53
+
+// Superblock field offsets
+#define EXT4_SB_MTIME                   0x2c
+#define EXT4_SB_WTIME                   0x30
+#define EXT4_SB_MNT_COUNT               0x34
+#define EXT4_SB_MAX_MNT_COUNT           0x36
+#define EXT4_SB_MAGIC                   0x38
+#define EXT4_SB_STATE                   0x3a
+#define EXT4_SB_LASTCHECK               0x40
+#define EXT4_SB_CHECKINTERVAL           0x44
+#define EXT4_SB_FEATURE_COMPAT          0x5c
+#define EXT4_SB_FEATURE_INCOMPAT        0x60
+#define EXT4_SB_FEATURE_RO_COMPAT       0x64
+#define EXT4_SB_ERROR_COUNT             0x194
+
+namespace mb
+{
+namespace util
+{
+
+static inline uint16_t get_le16(const unsigned char *buf, size_t offset)
+{
+    uint16_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le16toh(value);
+}
+
+static inline uint32_t get_le32(const unsigned char *buf, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le32toh(value);
+}
+
+/*!
+ * \brief Read ext2/3/4 superblock
+ *
+ * Only the superblock is read. Nothing else in the file system is validated.
+ *
+ * \param path Path to image or block device
+ * \param info Pointer to store superblock fields
+ *
+ * \return True if the superblock was read. False with errno set if the file
+ *         could not be read or with errno set to EINVAL if the file does not
+ *         contain an ext2/3/4 file system.
+ */
+bool ext4_read_superblock(const char *path, Ext4SuperblockInfo *info)
+{
+    unsigned char buf[EXT4_SUPERBLOCK_SIZE];
+    size_t total = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    while (total < sizeof(buf)) {
+        ssize_t n = pread(fd, buf + total, sizeof(buf) - total,
+                          EXT4_SUPERBLOCK_OFFSET + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EINVAL;
+            return false;
+        }
+        total += n;
+    }
+
+    if (get_le16(buf, EXT4_SB_MAGIC) != EXT4_SUPER_MAGIC) {
+        errno = EINVAL;
+        return false;
+    }
+
+    info->state = get_le16(buf, EXT4_SB_STATE);
+    info->error_count = get_le32(buf, EXT4_SB_ERROR_COUNT);
+    info->mount_count = get_le16(buf, EXT4_SB_MNT_COUNT);
+    info->max_mount_count =
+            static_cast<int16_t>(get_le16(buf, EXT4_SB_MAX_MNT_COUNT));
+    info->last_mount_time = get_le32(buf, EXT4_SB_MTIME);
+    info->last_write_time = get_le32(buf, EXT4_SB_WTIME);
+    info->last_check_time = get_le32(buf, EXT4_SB_LASTCHECK);
+    info->check_interval = get_le32(buf, EXT4_SB_CHECKINTERVAL);
+    info->feature_compat = get_le32(buf, EXT4_SB_FEATURE_COMPAT);
+    info->feature_incompat = get_le32(buf, EXT4_SB_FEATURE_INCOMPAT);
+    info->feature_ro_compat = get_le32(buf, EXT4_SB_FEATURE_RO_COMPAT);
+
+    return true;
+}
+
+/*!
+ * \brief Determine whether a file system needs to be checked
+ *
+ * This follows the same rules as a non-forced e2fsck run. A file system that
+ * is currently mounted will never be reported as clean.
+ *
+ * \param info Superblock fields from ext4_read_superblock()
+ * \param now Current time in seconds since the epoch (used for the periodic
+ *            check interval)
+ */
+Ext4Health ext4_get_health(const Ext4SuperblockInfo &info, uint32_t now)
+{
+    if ((info.state & EXT4_STATE_ERROR_FS) || info.error_count > 0) {
+        return Ext4Health::HAS_ERRORS;
+    }
+
+    if ((info.feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL)
+            && (info.feature_incompat & EXT4_FEATURE_INCOMPAT_RECOVER)) {
+        return Ext4Health::NEEDS_RECOVERY;
+    }
+
+    if (!(info.state & EXT4_STATE_VALID_FS)
+            || (info.state & EXT4_STATE_ORPHAN_FS)) {
+        return Ext4Health::NOT_CLEAN;
+    }
+
+    if (info.max_mount_count > 0
+            && info.mount_count >= info.max_mount_count) {
+        return Ext4Health::CHECK_DUE;
+    }
+
+    if (info.check_interval > 0 && now >= info.last_check_time
+            && now - info.last_check_time >= info.check_interval) {
+        return Ext4Health::CHECK_DUE;
+    }
+
+    return Ext4Health::CLEAN;
+}
+
+const char * ext4_health_string(Ext4Health health)
+{
+    switch (health) {
+    case Ext4Health::CLEAN:
+        return "clean";
+    case Ext4Health::NOT_CLEAN:
+        return "not cleanly unmounted";
+    case Ext4Health::HAS_ERRORS:
+        return "contains errors";
+    case Ext4Health::NEEDS_RECOVERY:
+        return "needs journal recovery";
+    case Ext4Health::CHECK_DUE:
+        return "periodic check due";
+    }
+    return "unknown";
+}
+
+}
+}
@@ -0,0 +1,1607 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/ext4.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "mbcommon/endian.h"
+#include "mblog/logging.h"
+
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/finally.h"
+
+// Minimal in-process replacement for make_ext4fs. The file system is laid out
+// without flex_bg, uninit_bg, or checksums, so that only the superblocks,
+// group descriptors, bitmaps, root directory, lost+found, and journal
+// superblock need to be written. The inode tables and the journal are left as
+// holes in the sparse image, which read back as zeros.
+//
+// If a source directory is given, its contents are written into the image
+// while the file system is being built. Files are allocated contiguously and
+// all-zero blocks are left as holes.
+
+#define EXT4_BLOCK_SIZE                 4096
+#define EXT4_LOG_BLOCK_SIZE             2
+#define EXT4_BLOCKS_PER_GROUP           (EXT4_BLOCK_SIZE * 8)
+#define EXT4_INODE_SIZE                 256
+#define EXT4_GOOD_OLD_INODE_SIZE        128
+#define EXT4_EXTRA_ISIZE                32
+#define EXT4_INODES_PER_BLOCK           (EXT4_BLOCK_SIZE / EXT4_INODE_SIZE)
+#define EXT4_BYTES_PER_INODE            16384
+#define EXT4_DESC_SIZE                  32
+#define EXT4_MIN_BLOCKS                 2048
+
+#define EXT4_ROOT_INO                   2
+#define EXT4_JOURNAL_INO                8
+#define EXT4_FIRST_INO                  11
+#define EXT4_LOST_FOUND_INO             EXT4_FIRST_INO
+#define EXT4_LOST_FOUND_BLOCKS          4
+
+#define EXT4_SUPER_MAGIC                0xef53
+#define EXT4_OS_LINUX                   0
+#define EXT4_DYNAMIC_REV                1
+#define EXT4_ERRORS_CONTINUE            1
+#define EXT4_DX_HASH_HALF_MD4           1
+#define EXT4_JNL_BACKUP_BLOCKS          1
+
+#define EXT4_FEATURE_COMPAT_EXT_ATTR        0x0008
+#define EXT4_FEATURE_INCOMPAT_FILETYPE      0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS       0x0040
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK    0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE  0x0040
+
+#define EXT4_EXTENTS_FL                 0x80000
+#define EXT4_EXT_MAGIC                  0xf30a
+#define EXT4_EXT_MAX_LEN                32768
+#define EXT4_EXT_NODE_SIZE              12
+#define EXT4_EXT_INODE_ENTRIES          4
+#define EXT4_EXT_LEAF_ENTRIES \
+        ((EXT4_BLOCK_SIZE - EXT4_EXT_NODE_SIZE) / EXT4_EXT_NODE_SIZE)
+
+#define EXT4_LINK_MAX                   65000
+#define EXT4_N_BLOCKS_SIZE              60
+
+#define EXT4_FT_UNKNOWN                 0
+#define EXT4_FT_REG_FILE                1
+#define EXT4_FT_DIR                     2
+#define EXT4_FT_CHRDEV                  3
+#define EXT4_FT_BLKDEV                  4
+#define EXT4_FT_FIFO                    5
+#define EXT4_FT_SOCK                    6
+#define EXT4_FT_SYMLINK                 7
+
+#define EXT4_XATTR_MAGIC                0xea020000
+#define EXT4_XATTR_BLOCK_HEADER_SIZE    32
+#define EXT4_XATTR_ENTRY_SIZE           16
+#define EXT4_XATTR_IBODY_OFFSET \
+        (EXT4_GOOD_OLD_INODE_SIZE + EXT4_EXTRA_ISIZE)
+
+#define JBD2_MAGIC_NUMBER               0xc03b3998
+#define JBD2_SUPERBLOCK_V2              4
+
+// Superblock field offsets
+#define SB_INODES_COUNT                 0x00
+#define SB_BLOCKS_COUNT                 0x04
+#define SB_R_BLOCKS_COUNT               0x08
+#define SB_FREE_BLOCKS_COUNT            0x0c
+#define SB_FREE_INODES_COUNT            0x10
+#define SB_FIRST_DATA_BLOCK             0x14
+#define SB_LOG_BLOCK_SIZE               0x18
+#define SB_LOG_CLUSTER_SIZE             0x1c
+#define SB_BLOCKS_PER_GROUP             0x20
+#define SB_CLUSTERS_PER_GROUP           0x24
+#define SB_INODES_PER_GROUP             0x28
+#define SB_WTIME                        0x30
+#define SB_MAX_MNT_COUNT                0x36
+#define SB_MAGIC                        0x38
+#define SB_STATE                        0x3a
+#define SB_ERRORS                       0x3c
+#define SB_LASTCHECK                    0x40
+#define SB_CREATOR_OS                   0x48
+#define SB_REV_LEVEL                    0x4c
+#define SB_FIRST_INO                    0x54
+#define SB_INODE_SIZE                   0x58
+#define SB_BLOCK_GROUP_NR               0x5a
+#define SB_FEATURE_COMPAT               0x5c
+#define SB_FEATURE_INCOMPAT             0x60
+#define SB_FEATURE_RO_COMPAT            0x64
+#define SB_UUID                         0x68
+#define SB_JOURNAL_INUM                 0xe0
+#define SB_HASH_SEED                    0xec
+#define SB_DEF_HASH_VERSION             0xfc
+#define SB_JNL_BACKUP_TYPE              0xfd
+#define SB_MKFS_TIME                    0x108
+#define SB_JNL_BLOCKS                   0x10c
+#define SB_MIN_EXTRA_ISIZE              0x15c
+#define SB_WANT_EXTRA_ISIZE             0x15e
+
+// Group descriptor field offsets
+#define BG_BLOCK_BITMAP                 0x00
+#define BG_INODE_BITMAP                 0x04
+#define BG_INODE_TABLE                  0x08
+#define BG_FREE_BLOCKS_COUNT            0x0c
+#define BG_FREE_INODES_COUNT            0x0e
+#define BG_USED_DIRS_COUNT              0x10
+
+// Inode field offsets
+#define I_MODE                          0x00
+#define I_UID                           0x02
+#define I_SIZE                          0x04
+#define I_ATIME                         0x08
+#define I_CTIME                         0x0c
+#define I_MTIME                         0x10
+#define I_GID                           0x18
+#define I_LINKS_COUNT                   0x1a
+#define I_BLOCKS                        0x1c
+#define I_FLAGS                         0x20
+#define I_BLOCK                         0x28
+#define I_FILE_ACL                      0x68
+#define I_SIZE_HIGH                     0x6c
+#define I_UID_HIGH                      0x78
+#define I_GID_HIGH                      0x7a
+#define I_EXTRA_ISIZE                   0x80
+#define I_CTIME_EXTRA                   0x84
+#define I_MTIME_EXTRA                   0x88
+#define I_ATIME_EXTRA                   0x8c
+#define I_CRTIME                        0x90
+
+// jbd2 superblock field offsets (big endian)
+#define JSB_MAGIC                       0x00
+#define JSB_BLOCKTYPE                   0x04
+#define JSB_BLOCKSIZE                   0x0c
+#define JSB_MAXLEN                      0x10
+#define JSB_FIRST                       0x14
+#define JSB_SEQUENCE                    0x18
+#define JSB_UUID                        0x30
+#define JSB_NR_USERS                    0x40
+
+namespace mb
+{
+namespace util
+{
+
+static inline void put_le16(unsigned char *buf, size_t offset, uint16_t value)
+{
+    value = mb_htole16(value);
+    memcpy(buf + offset, &value, sizeof(value));
+}
+
+static inline void put_le32(unsigned char *buf, size_t offset, uint32_t value)
+{
+    value = mb_htole32(value);
+    memcpy(buf + offset, &value, sizeof(value));
+}
+
+static inline uint32_t get_le32(const unsigned char *buf, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, buf + offset, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static inline void put_be32(unsigned char *buf, size_t offset, uint32_t value)
+{
+    value = mb_htobe32(value);
+    memcpy(buf + offset, &value, sizeof(value));
+}
+
+static inline bool test_bit(const std::vector<unsigned char> &bitmap,
+                            uint64_t bit)
+{
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void set_bit(std::vector<unsigned char> &bitmap, uint64_t bit)
+{
+    bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t size, uint64_t offset)
+{
+    const unsigned char *ptr = static_cast<const unsigned char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = pwrite64(fd, ptr, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+static ssize_t read_all(int fd, void *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, static_cast<char *>(buf) + total, size - total);
+        if (n == 0) {
+            break;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return n;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+static bool is_zero(const unsigned char *buf, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (buf[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Groups 0, 1, and powers of 3, 5, and 7 contain superblock backups
+static bool group_has_super(uint32_t group)
+{
+    if (group <= 1) {
+        return true;
+    }
+
+    for (uint32_t base : { 3, 5, 7 }) {
+        uint64_t n = base;
+        while (n < group) {
+            n *= base;
+        }
+        if (n == group) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint32_t default_journal_blocks(uint32_t blocks)
+{
+    if (blocks < 32768) {
+        return 1024;
+    } else if (blocks < 256 * 1024) {
+        return 4096;
+    } else if (blocks < 512 * 1024) {
+        return 8192;
+    } else if (blocks < 1024 * 1024) {
+        return 16384;
+    } else {
+        return 32768;
+    }
+}
+
+static uint8_t file_type(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFREG:  return EXT4_FT_REG_FILE;
+    case S_IFDIR:  return EXT4_FT_DIR;
+    case S_IFCHR:  return EXT4_FT_CHRDEV;
+    case S_IFBLK:  return EXT4_FT_BLKDEV;
+    case S_IFIFO:  return EXT4_FT_FIFO;
+    case S_IFSOCK: return EXT4_FT_SOCK;
+    case S_IFLNK:  return EXT4_FT_SYMLINK;
+    default:       return EXT4_FT_UNKNOWN;
+    }
+}
+
+static inline uint32_t time_extra(int64_t sec, long nsec)
+{
+    uint32_t epoch = static_cast<uint32_t>(
+            (sec - static_cast<int32_t>(sec)) >> 32) & 3;
+    return (static_cast<uint32_t>(nsec) << 2) | epoch;
+}
+
+struct Extent
+{
+    uint32_t lblk;
+    uint32_t pblk;
+    uint32_t len;
+};
+
+struct Xattr
+{
+    uint8_t index;
+    std::string name;
+    std::string value;
+};
+
+struct DirEntry
+{
+    uint32_t ino;
+    uint8_t type;
+    std::string name;
+};
+
+struct XattrPrefix
+{
+    const char *prefix;
+    uint8_t index;
+};
+
+static XattrPrefix xattr_prefixes[] = {
+    { "user.",     1 },
+    { "trusted.",  4 },
+    { "security.", 6 },
+    { nullptr,     0 },
+};
+
+static uint32_t xattr_entry_size(const Xattr &xattr)
+{
+    return (EXT4_XATTR_ENTRY_SIZE + xattr.name.size() + 3) & ~3u;
+}
+
+static uint32_t xattr_value_size(const Xattr &xattr)
+{
+    return (xattr.value.size() + 3) & ~3u;
+}
+
+static uint32_t xattr_hash(const Xattr &xattr)
+{
+    uint32_t hash = 0;
+
+    for (unsigned char c : xattr.name) {
+        hash = (hash << 5) ^ (hash >> 27) ^ c;
+    }
+
+    for (size_t i = 0; i < xattr.value.size(); i += 4) {
+        unsigned char word[4] = {};
+        memcpy(word, xattr.value.data() + i,
+               std::min<size_t>(4, xattr.value.size() - i));
+        hash = (hash << 16) ^ (hash >> 16) ^ get_le32(word, 0);
+    }
+
+    return hash;
+}
+
+class Ext4ImageBuilder
+{
+public:
+    Ext4ImageBuilder(int fd) : _fd(fd)
+    {
+    }
+
+    bool init(uint64_t size);
+    bool build(const std::string &source_dir,
+               const std::vector<std::string> &exclusions);
+
+private:
+    int _fd;
+
+    uint32_t _blocks_count;
+    uint32_t _groups;
+    uint32_t _inodes_per_group;
+    uint32_t _inode_table_blocks;
+    uint32_t _gdt_blocks;
+    uint32_t _journal_blocks;
+
+    std::vector<unsigned char> _block_bitmap;
+    std::vector<unsigned char> _inode_bitmap;
+    std::vector<uint16_t> _used_dirs;
+    uint32_t _block_cursor;
+    uint32_t _next_ino;
+
+    unsigned char _uuid[16];
+    uint32_t _hash_seed[4];
+    uint32_t _now;
+    unsigned char _jnl_blocks[EXT4_N_BLOCKS_SIZE];
+    uint64_t _journal_size;
+
+    std::vector<std::string> _exclusions;
+    // (st_dev, st_ino) -> ext4 inode for files with multiple links
+    std::map<std::pair<dev_t, ino_t>, uint32_t> _hardlinks;
+    std::map<uint32_t, uint16_t> _link_counts;
+    std::vector<unsigned char> _buf;
+
+    uint32_t group_first_block(uint32_t group) const
+    {
+        return group * EXT4_BLOCKS_PER_GROUP;
+    }
+
+    uint32_t group_block_count(uint32_t group) const
+    {
+        return std::min<uint32_t>(EXT4_BLOCKS_PER_GROUP,
+                                  _blocks_count - group_first_block(group));
+    }
+
+    uint32_t group_meta_start(uint32_t group) const
+    {
+        return group_first_block(group)
+                + (group_has_super(group) ? 1 + _gdt_blocks : 0);
+    }
+
+    uint32_t block_bitmap_block(uint32_t group) const
+    {
+        return group_meta_start(group);
+    }
+
+    uint32_t inode_bitmap_block(uint32_t group) const
+    {
+        return group_meta_start(group) + 1;
+    }
+
+    uint32_t inode_table_block(uint32_t group) const
+    {
+        return group_meta_start(group) + 2;
+    }
+
+    uint32_t inodes_count() const
+    {
+        return _groups * _inodes_per_group;
+    }
+
+    bool alloc_blocks(uint32_t want, uint32_t *start, uint32_t *len);
+    bool alloc_extents(uint32_t blocks, std::vector<Extent> *extents);
+    bool alloc_inode(bool is_dir, uint32_t *ino);
+
+    bool write_blocks(uint32_t block, const void *data, size_t size);
+    bool write_inode(uint32_t ino, const unsigned char *inode);
+
+    void init_inode(unsigned char *inode, const struct stat &sb);
+    void set_size(unsigned char *inode, uint64_t size);
+    void add_blocks(unsigned char *inode, uint32_t blocks);
+    bool set_extents(unsigned char *inode, const std::vector<Extent> &extents);
+    bool set_xattrs(unsigned char *inode, std::vector<Xattr> xattrs);
+
+    bool write_directory(unsigned char *inode, uint32_t ino, uint32_t parent,
+                         const std::vector<DirEntry> &entries,
+                         uint32_t min_blocks);
+
+    bool create_journal();
+    bool create_lost_found();
+
+    bool read_xattrs(const std::string &path, std::vector<Xattr> *xattrs);
+    bool add_tree(const std::string &path, const struct stat &sb,
+                  uint32_t ino, uint32_t parent, bool is_root);
+    bool add_file(const std::string &path, const struct stat &sb,
+                  unsigned char *inode);
+    bool add_symlink(const std::string &path, const struct stat &sb,
+                     unsigned char *inode);
+    bool add_node(const std::string &path, const struct stat &sb,
+                  uint32_t parent, uint32_t *ino, uint8_t *type,
+                  uint16_t *subdirs);
+
+    bool finish();
+    void fill_superblock(unsigned char *sb, uint32_t group);
+};
+
+bool Ext4ImageBuilder::init(uint64_t size)
+{
+    uint64_t blocks = size / EXT4_BLOCK_SIZE;
+    if (blocks < EXT4_MIN_BLOCKS) {
+        errno = EINVAL;
+        return false;
+    } else if (blocks > UINT32_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+
+    _blocks_count = static_cast<uint32_t>(blocks);
+
+    while (true) {
+        _groups = (_blocks_count + EXT4_BLOCKS_PER_GROUP - 1)
+                / EXT4_BLOCKS_PER_GROUP;
+        _gdt_blocks = (_groups * EXT4_DESC_SIZE + EXT4_BLOCK_SIZE - 1)
+                / EXT4_BLOCK_SIZE;
+
+        uint64_t inodes = static_cast<uint64_t>(_blocks_count)
+                * EXT4_BLOCK_SIZE / EXT4_BYTES_PER_INODE;
+        uint64_t ipg = (inodes + _groups - 1) / _groups;
+        ipg = (ipg + EXT4_INODES_PER_BLOCK - 1) / EXT4_INODES_PER_BLOCK
+                * EXT4_INODES_PER_BLOCK;
+        ipg = std::max<uint64_t>(ipg, EXT4_INODES_PER_BLOCK);
+        ipg = std::min<uint64_t>(ipg, EXT4_BLOCKS_PER_GROUP);
+        _inodes_per_group = static_cast<uint32_t>(ipg);
+        _inode_table_blocks = _inodes_per_group / EXT4_INODES_PER_BLOCK;
+
+        // Drop the last group if it's too small to hold its own metadata and
+        // a reasonable amount of data
+        uint32_t last = _groups - 1;
+        uint32_t overhead = group_meta_start(last) - group_first_block(last)
+                + 2 + _inode_table_blocks;
+        if (_groups > 1 && group_block_count(last) < overhead + 50) {
+            _blocks_count = group_first_block(last);
+            continue;
+        }
+
+        break;
+    }
+
+    _journal_blocks = default_journal_blocks(_blocks_count);
+
+    _block_bitmap.assign(static_cast<size_t>(_groups)
+            * EXT4_BLOCKS_PER_GROUP / 8, 0);
+    _inode_bitmap.assign(static_cast<size_t>(inodes_count() + 7) / 8, 0);
+    _used_dirs.assign(_groups, 0);
+
+    // Reserve metadata blocks
+    for (uint32_t g = 0; g < _groups; ++g) {
+        uint32_t end = inode_table_block(g) + _inode_table_blocks;
+        for (uint32_t b = group_first_block(g); b < end; ++b) {
+            set_bit(_block_bitmap, b);
+        }
+    }
+
+    // Reserve special inodes
+    for (uint32_t ino = 1; ino < EXT4_FIRST_INO; ++ino) {
+        set_bit(_inode_bitmap, ino - 1);
+    }
+
+    _block_cursor = 0;
+    _next_ino = EXT4_FIRST_INO;
+
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t n1 = read_all(fd, _uuid, sizeof(_uuid));
+    ssize_t n2 = read_all(fd, _hash_seed, sizeof(_hash_seed));
+    close(fd);
+    if (n1 != sizeof(_uuid) || n2 != sizeof(_hash_seed)) {
+        errno = EIO;
+        return false;
+    }
+    // Random (version 4) UUID
+    _uuid[6] = (_uuid[6] & 0x0f) | 0x40;
+    _uuid[8] = (_uuid[8] & 0x3f) | 0x80;
+
+    _now = static_cast<uint32_t>(time(nullptr));
+    _buf.resize(256 * EXT4_BLOCK_SIZE);
+
+    return true;
+}
+
+bool Ext4ImageBuilder::alloc_blocks(uint32_t want, uint32_t *start,
+                                    uint32_t *len)
+{
+    while (_block_cursor < _blocks_count
+            && test_bit(_block_bitmap, _block_cursor)) {
+        ++_block_cursor;
+    }
+
+    if (_block_cursor >= _blocks_count) {
+        errno = ENOSPC;
+        return false;
+    }
+
+    *start = _block_cursor;
+    *len = 0;
+
+    while (*len < want && *len < EXT4_EXT_MAX_LEN
+            && _block_cursor < _blocks_count
+            && !test_bit(_block_bitmap, _block_cursor)) {
+        set_bit(_block_bitmap, _block_cursor);
+        ++_block_cursor;
+        ++*len;
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::alloc_extents(uint32_t blocks,
+                                     std::vector<Extent> *extents)
+{
+    uint32_t lblk = 0;
+
+    extents->clear();
+
+    while (lblk < blocks) {
+        Extent extent;
+        if (!alloc_blocks(blocks - lblk, &extent.pblk, &extent.len)) {
+            return false;
+        }
+        extent.lblk = lblk;
+        extents->push_back(extent);
+        lblk += extent.len;
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::alloc_inode(bool is_dir, uint32_t *ino)
+{
+    if (_next_ino > inodes_count()) {
+        errno = ENOSPC;
+        return false;
+    }
+
+    *ino = _next_ino++;
+    set_bit(_inode_bitmap, *ino - 1);
+
+    if (is_dir) {
+        ++_used_dirs[(*ino - 1) / _inodes_per_group];
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::write_blocks(uint32_t block, const void *data,
+                                    size_t size)
+{
+    return pwrite_all(_fd, data, size,
+                      static_cast<uint64_t>(block) * EXT4_BLOCK_SIZE);
+}
+
+bool Ext4ImageBuilder::write_inode(uint32_t ino, const unsigned char *inode)
+{
+    uint32_t group = (ino - 1) / _inodes_per_group;
+    uint32_t index = (ino - 1) % _inodes_per_group;
+    uint64_t offset = static_cast<uint64_t>(inode_table_block(group))
+            * EXT4_BLOCK_SIZE + static_cast<uint64_t>(index) * EXT4_INODE_SIZE;
+
+    return pwrite_all(_fd, inode, EXT4_INODE_SIZE, offset);
+}
+
+void Ext4ImageBuilder::init_inode(unsigned char *inode, const struct stat &sb)
+{
+    memset(inode, 0, EXT4_INODE_SIZE);
+
+    put_le16(inode, I_MODE, static_cast<uint16_t>(sb.st_mode));
+    put_le16(inode, I_UID, static_cast<uint16_t>(sb.st_uid));
+    put_le16(inode, I_UID_HIGH, static_cast<uint16_t>(sb.st_uid >> 16));
+    put_le16(inode, I_GID, static_cast<uint16_t>(sb.st_gid));
+    put_le16(inode, I_GID_HIGH, static_cast<uint16_t>(sb.st_gid >> 16));
+    put_le32(inode, I_ATIME, static_cast<uint32_t>(sb.st_atim.tv_sec));
+    put_le32(inode, I_CTIME, static_cast<uint32_t>(sb.st_ctim.tv_sec));
+    put_le32(inode, I_MTIME, static_cast<uint32_t>(sb.st_mtim.tv_sec));
+    put_le16(inode, I_LINKS_COUNT, 1);
+    put_le16(inode, I_EXTRA_ISIZE, EXT4_EXTRA_ISIZE);
+    put_le32(inode, I_ATIME_EXTRA,
+             time_extra(sb.st_atim.tv_sec, sb.st_atim.tv_nsec));
+    put_le32(inode, I_CTIME_EXTRA,
+             time_extra(sb.st_ctim.tv_sec, sb.st_ctim.tv_nsec));
+    put_le32(inode, I_MTIME_EXTRA,
+             time_extra(sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec));
+    put_le32(inode, I_CRTIME, _now);
+}
+
+void Ext4ImageBuilder::set_size(unsigned char *inode, uint64_t size)
+{
+    put_le32(inode, I_SIZE, static_cast<uint32_t>(size));
+    put_le32(inode, I_SIZE_HIGH, static_cast<uint32_t>(size >> 32));
+}
+
+void Ext4ImageBuilder::add_blocks(unsigned char *inode, uint32_t blocks)
+{
+    uint32_t sectors = get_le32(inode, I_BLOCKS);
+    put_le32(inode, I_BLOCKS, sectors + blocks * (EXT4_BLOCK_SIZE / 512));
+}
+
+static void put_extent_header(unsigned char *buf, uint16_t entries,
+                              uint16_t max, uint16_t depth)
+{
+    put_le16(buf, 0, EXT4_EXT_MAGIC);
+    put_le16(buf, 2, entries);
+    put_le16(buf, 4, max);
+    put_le16(buf, 6, depth);
+    put_le32(buf, 8, 0);
+}
+
+static void put_extent(unsigned char *buf, const Extent &extent)
+{
+    put_le32(buf, 0, extent.lblk);
+    put_le16(buf, 4, static_cast<uint16_t>(extent.len));
+    put_le16(buf, 6, 0);
+    put_le32(buf, 8, extent.pblk);
+}
+
+/*!
+ * \brief Write extent tree for an inode
+ *
+ * Up to 4 extents fit in the inode itself. Otherwise, a tree of depth 1 is
+ * created with up to 4 leaf blocks.
+ */
+bool Ext4ImageBuilder::set_extents(unsigned char *inode,
+                                   const std::vector<Extent> &extents)
+{
+    unsigned char *root = inode + I_BLOCK;
+
+    put_le32(inode, I_FLAGS, get_le32(inode, I_FLAGS) | EXT4_EXTENTS_FL);
+
+    uint32_t data_blocks = 0;
+    for (const Extent &extent : extents) {
+        data_blocks += extent.len;
+    }
+    add_blocks(inode, data_blocks);
+
+    if (extents.size() <= EXT4_EXT_INODE_ENTRIES) {
+        put_extent_header(root, static_cast<uint16_t>(extents.size()),
+                          EXT4_EXT_INODE_ENTRIES, 0);
+        for (size_t i = 0; i < extents.size(); ++i) {
+            put_extent(root + EXT4_EXT_NODE_SIZE * (i + 1), extents[i]);
+        }
+        return true;
+    }
+
+    size_t leaves = (extents.size() + EXT4_EXT_LEAF_ENTRIES - 1)
+            / EXT4_EXT_LEAF_ENTRIES;
+    if (leaves > EXT4_EXT_INODE_ENTRIES) {
+        errno = EFBIG;
+        return false;
+    }
+
+    put_extent_header(root, static_cast<uint16_t>(leaves),
+                      EXT4_EXT_INODE_ENTRIES, 1);
+
+    unsigned char leaf[EXT4_BLOCK_SIZE];
+
+    for (size_t i = 0; i < leaves; ++i) {
+        size_t begin = i * EXT4_EXT_LEAF_ENTRIES;
+        size_t count = std::min<size_t>(EXT4_EXT_LEAF_ENTRIES,
+                                        extents.size() - begin);
+
+        memset(leaf, 0, sizeof(leaf));
+        put_extent_header(leaf, static_cast<uint16_t>(count),
+                          EXT4_EXT_LEAF_ENTRIES, 0);
+        for (size_t j = 0; j < count; ++j) {
+            put_extent(leaf + EXT4_EXT_NODE_SIZE * (j + 1),
+                       extents[begin + j]);
+        }
+
+        uint32_t block;
+        uint32_t len;
+        if (!alloc_blocks(1, &block, &len)
+                || !write_blocks(block, leaf, sizeof(leaf))) {
+            return false;
+        }
+        add_blocks(inode, 1);
+
+        unsigned char *index = root + EXT4_EXT_NODE_SIZE * (i + 1);
+        put_le32(index, 0, extents[begin].lblk);
+        put_le32(index, 4, block);
+        put_le16(index, 8, 0);
+        put_le16(index, 10, 0);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Store extended attributes
+ *
+ * The attributes are stored in the inode body if they fit. Otherwise, they're
+ * all stored in a separate block.
+ */
+bool Ext4ImageBuilder::set_xattrs(unsigned char *inode,
+                                  std::vector<Xattr> xattrs)
+{
+    if (xattrs.empty()) {
+        return true;
+    }
+
+    uint32_t entries_size = 0;
+    uint32_t values_size = 0;
+    for (const Xattr &xattr : xattrs) {
+        entries_size += xattr_entry_size(xattr);
+        values_size += xattr_value_size(xattr);
+    }
+
+    // Magic, entries, and the 4-byte terminator
+    uint32_t ibody_avail = EXT4_INODE_SIZE - EXT4_XATTR_IBODY_OFFSET;
+    bool in_inode = 4 + entries_size + 4 + values_size <= ibody_avail;
+
+    unsigned char block[EXT4_BLOCK_SIZE];
+    unsigned char *base;
+    unsigned char *entry;
+    uint32_t value_end;
+
+    if (in_inode) {
+        put_le32(inode, EXT4_XATTR_IBODY_OFFSET, EXT4_XATTR_MAGIC);
+        // Offsets are relative to the first entry
+        base = inode + EXT4_XATTR_IBODY_OFFSET + 4;
+        entry = base;
+        value_end = ibody_avail - 4;
+    } else {
+        if (EXT4_XATTR_BLOCK_HEADER_SIZE + entries_size + 4 + values_size
+                > EXT4_BLOCK_SIZE) {
+            errno = E2BIG;
+            return false;
+        }
+
+        // Entries in xattr blocks must be sorted
+        std::sort(xattrs.begin(), xattrs.end(),
+                  [](const Xattr &a, const Xattr &b) {
+            if (a.index != b.index) {
+                return a.index < b.index;
+            } else if (a.name.size() != b.name.size()) {
+                return a.name.size() < b.name.size();
+            } else {
+                return a.name < b.name;
+            }
+        });
+
+        memset(block, 0, sizeof(block));
+        base = block;
+        entry = block + EXT4_XATTR_BLOCK_HEADER_SIZE;
+        value_end = EXT4_BLOCK_SIZE;
+    }
+
+    uint32_t block_hash = 0;
+
+    for (const Xattr &xattr : xattrs) {
+        value_end -= xattr_value_size(xattr);
+        memcpy(base + value_end, xattr.value.data(), xattr.value.size());
+
+        uint32_t hash = xattr_hash(xattr);
+        block_hash = (block_hash << 16) ^ (block_hash >> 16) ^ hash;
+
+        entry[0] = static_cast<unsigned char>(xattr.name.size());
+        entry[1] = xattr.index;
+        put_le16(entry, 2, static_cast<uint16_t>(value_end));
+        put_le32(entry, 4, 0);
+        put_le32(entry, 8, static_cast<uint32_t>(xattr.value.size()));
+        put_le32(entry, 12, hash);
+        memcpy(entry + EXT4_XATTR_ENTRY_SIZE, xattr.name.data(),
+               xattr.name.size());
+
+        entry += xattr_entry_size(xattr);
+    }
+
+    if (!in_inode) {
+        put_le32(block, 0, EXT4_XATTR_MAGIC);
+        put_le32(block, 4, 1);
+        put_le32(block, 8, 1);
+        put_le32(block, 12, block_hash);
+
+        uint32_t xattr_block;
+        uint32_t len;
+        if (!alloc_blocks(1, &xattr_block, &len)
+                || !write_blocks(xattr_block, block, sizeof(block))) {
+            return false;
+        }
+
+        put_le32(inode, I_FILE_ACL, xattr_block);
+        add_blocks(inode, 1);
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::write_directory(unsigned char *inode, uint32_t ino,
+                                       uint32_t parent,
+                                       const std::vector<DirEntry> &entries,
+                                       uint32_t min_blocks)
+{
+    std::vector<unsigned char> data(EXT4_BLOCK_SIZE);
+    size_t block_start = 0;
+    size_t pos = 0;
+    size_t last = 0;
+
+    auto add_entry = [&](uint32_t entry_ino, uint8_t type,
+                         const std::string &name) {
+        size_t rec_len = (8 + name.size() + 3) & ~static_cast<size_t>(3);
+
+        if (pos + rec_len > block_start + EXT4_BLOCK_SIZE) {
+            // Extend previous entry to the end of the block
+            put_le16(data.data(), last + 4,
+                     static_cast<uint16_t>(block_start + EXT4_BLOCK_SIZE
+                                           - last));
+            block_start += EXT4_BLOCK_SIZE;
+            pos = block_start;
+            data.resize(data.size() + EXT4_BLOCK_SIZE);
+        }
+
+        unsigned char *ptr = data.data() + pos;
+        put_le32(ptr, 0, entry_ino);
+        put_le16(ptr, 4, static_cast<uint16_t>(rec_len));
+        ptr[6] = static_cast<unsigned char>(name.size());
+        ptr[7] = type;
+        memcpy(ptr + 8, name.data(), name.size());
+
+        last = pos;
+        pos += rec_len;
+    };
+
+    add_entry(ino, EXT4_FT_DIR, ".");
+    add_entry(parent, EXT4_FT_DIR, "..");
+    for (const DirEntry &entry : entries) {
+        add_entry(entry.ino, entry.type, entry.name);
+    }
+
+    put_le16(data.data(), last + 4,
+             static_cast<uint16_t>(block_start + EXT4_BLOCK_SIZE - last));
+
+    // Empty blocks consist of a single unused entry
+    while (data.size() < static_cast<size_t>(min_blocks) * EXT4_BLOCK_SIZE) {
+        size_t offset = data.size();
+        data.resize(offset + EXT4_BLOCK_SIZE);
+        put_le16(data.data(), offset + 4, EXT4_BLOCK_SIZE);
+    }
+
+    uint32_t blocks = data.size() / EXT4_BLOCK_SIZE;
+    std::vector<Extent> extents;
+
+    if (!alloc_extents(blocks, &extents)) {
+        return false;
+    }
+
+    for (const Extent &extent : extents) {
+        if (!write_blocks(extent.pblk,
+                          data.data() + static_cast<size_t>(extent.lblk)
+                                  * EXT4_BLOCK_SIZE,
+                          static_cast<size_t>(extent.len) * EXT4_BLOCK_SIZE)) {
+            return false;
+        }
+    }
+
+    set_size(inode, data.size());
+    return set_extents(inode, extents);
+}
+
+bool Ext4ImageBuilder::create_journal()
+{
+    std::vector<Extent> extents;
+    if (!alloc_extents(_journal_blocks, &extents)) {
+        return false;
+    }
+
+    // Only the journal superblock needs to be written. The journal is empty
+    // (s_start == 0), so the rest of it is never read before being written.
+    unsigned char jsb[EXT4_BLOCK_SIZE] = {};
+    put_be32(jsb, JSB_MAGIC, JBD2_MAGIC_NUMBER);
+    put_be32(jsb, JSB_BLOCKTYPE, JBD2_SUPERBLOCK_V2);
+    put_be32(jsb, JSB_BLOCKSIZE, EXT4_BLOCK_SIZE);
+    put_be32(jsb, JSB_MAXLEN, _journal_blocks);
+    put_be32(jsb, JSB_FIRST, 1);
+    put_be32(jsb, JSB_SEQUENCE, 1);
+    memcpy(jsb + JSB_UUID, _uuid, sizeof(_uuid));
+    put_be32(jsb, JSB_NR_USERS, 1);
+
+    if (!write_blocks(extents[0].pblk, jsb, sizeof(jsb))) {
+        return false;
+    }
+
+    struct stat sb = {};
+    sb.st_mode = S_IFREG | 0600;
+    sb.st_atim.tv_sec = sb.st_ctim.tv_sec = sb.st_mtim.tv_sec = _now;
+
+    unsigned char inode[EXT4_INODE_SIZE];
+    init_inode(inode, sb);
+    _journal_size = static_cast<uint64_t>(_journal_blocks) * EXT4_BLOCK_SIZE;
+    set_size(inode, _journal_size);
+    if (!set_extents(inode, extents)) {
+        return false;
+    }
+
+    // Backup of the journal inode's block map for e2fsck
+    memcpy(_jnl_blocks, inode + I_BLOCK, sizeof(_jnl_blocks));
+
+    return write_inode(EXT4_JOURNAL_INO, inode);
+}
+
+bool Ext4ImageBuilder::create_lost_found()
+{
+    uint32_t ino;
+    if (!alloc_inode(true, &ino)) {
+        return false;
+    }
+
+    struct stat sb = {};
+    sb.st_mode = S_IFDIR | 0700;
+    sb.st_atim.tv_sec = sb.st_ctim.tv_sec = sb.st_mtim.tv_sec = _now;
+
+    unsigned char inode[EXT4_INODE_SIZE];
+    init_inode(inode, sb);
+    put_le16(inode, I_LINKS_COUNT, 2);
+
+    // Preallocate some space so e2fsck doesn't need to when reconnecting
+    // inodes
+    if (!write_directory(inode, ino, EXT4_ROOT_INO, {},
+                         EXT4_LOST_FOUND_BLOCKS)) {
+        return false;
+    }
+
+    return write_inode(ino, inode);
+}
+
+bool Ext4ImageBuilder::read_xattrs(const std::string &path,
+                                   std::vector<Xattr> *xattrs)
+{
+    xattrs->clear();
+
+    ssize_t size = llistxattr(path.c_str(), nullptr, 0);
+    if (size < 0) {
+        return errno == ENOTSUP;
+    } else if (size == 0) {
+        return true;
+    }
+
+    std::vector<char> names(size);
+    size = llistxattr(path.c_str(), names.data(), names.size());
+    if (size < 0) {
+        return false;
+    }
+
+    for (char *name = names.data(); name < names.data() + size;
+            name += strlen(name) + 1) {
+        XattrPrefix *prefix = xattr_prefixes;
+        for (; prefix->prefix; ++prefix) {
+            if (strncmp(name, prefix->prefix, strlen(prefix->prefix)) == 0) {
+                break;
+            }
+        }
+        if (!prefix->prefix) {
+            LOGW("%s: Skipping unsupported xattr: %s", path.c_str(), name);
+            continue;
+        }
+
+        ssize_t value_size = lgetxattr(path.c_str(), name, nullptr, 0);
+        if (value_size < 0) {
+            return false;
+        }
+
+        Xattr xattr;
+        xattr.index = prefix->index;
+        xattr.name = name + strlen(prefix->prefix);
+        xattr.value.resize(value_size);
+
+        value_size = lgetxattr(path.c_str(), name, &xattr.value[0],
+                               xattr.value.size());
+        if (value_size < 0) {
+            return false;
+        }
+        xattr.value.resize(value_size);
+
+        if (xattr.name.size() > 255) {
+            errno = ERANGE;
+            return false;
+        }
+
+        xattrs->push_back(std::move(xattr));
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::add_file(const std::string &path, const struct stat &sb,
+                                unsigned char *inode)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    uint64_t size = sb.st_size;
+    uint64_t blocks = (size + EXT4_BLOCK_SIZE - 1) / EXT4_BLOCK_SIZE;
+    if (blocks > UINT32_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+
+    std::vector<Extent> extents;
+    if (!alloc_extents(static_cast<uint32_t>(blocks), &extents)) {
+        return false;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (const Extent &extent : extents) {
+        uint32_t done = 0;
+
+        while (done < extent.len) {
+            uint32_t count = std::min<uint32_t>(
+                    extent.len - done, _buf.size() / EXT4_BLOCK_SIZE);
+            size_t bytes = static_cast<size_t>(count) * EXT4_BLOCK_SIZE;
+
+            ssize_t n = read_all(fd, _buf.data(), bytes);
+            if (n < 0) {
+                return false;
+            }
+            // If the file shrank, the remainder is left as zeros
+            memset(_buf.data() + n, 0, bytes - n);
+
+            // Only write blocks that contain data
+            uint32_t i = 0;
+            while (i < count) {
+                if (is_zero(_buf.data() + static_cast<size_t>(i)
+                        * EXT4_BLOCK_SIZE, EXT4_BLOCK_SIZE)) {
+                    ++i;
+                    continue;
+                }
+
+                uint32_t run = i + 1;
+                while (run < count && !is_zero(_buf.data()
+                        + static_cast<size_t>(run) * EXT4_BLOCK_SIZE,
+                        EXT4_BLOCK_SIZE)) {
+                    ++run;
+                }
+
+                if (!write_blocks(extent.pblk + done + i,
+                                  _buf.data() + static_cast<size_t>(i)
+                                          * EXT4_BLOCK_SIZE,
+                                  static_cast<size_t>(run - i)
+                                          * EXT4_BLOCK_SIZE)) {
+                    return false;
+                }
+
+                i = run;
+            }
+
+            done += count;
+        }
+    }
+
+    set_size(inode, size);
+    return set_extents(inode, extents);
+}
+
+bool Ext4ImageBuilder::add_symlink(const std::string &path,
+                                   const struct stat &sb,
+                                   unsigned char *inode)
+{
+    char target[EXT4_BLOCK_SIZE];
+
+    ssize_t n = readlink(path.c_str(), target, sizeof(target));
+    if (n < 0) {
+        return false;
+    } else if (n == sizeof(target)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    (void) sb;
+    set_size(inode, n);
+
+    if (n < EXT4_N_BLOCKS_SIZE) {
+        // Fast symlink
+        memcpy(inode + I_BLOCK, target, n);
+        return true;
+    }
+
+    std::vector<Extent> extents;
+    unsigned char block[EXT4_BLOCK_SIZE] = {};
+    memcpy(block, target, n);
+
+    return alloc_extents(1, &extents)
+            && write_blocks(extents[0].pblk, block, sizeof(block))
+            && set_extents(inode, extents);
+}
+
+/*!
+ * \brief Add a file, directory, or special file to the image
+ *
+ * \param[out] ino Inode number of the new (or hard linked) inode
+ * \param[out] type Directory entry file type
+ * \param[in,out] subdirs Incremented if a directory was added
+ */
+bool Ext4ImageBuilder::add_node(const std::string &path, const struct stat &sb,
+                                uint32_t parent, uint32_t *ino, uint8_t *type,
+                                uint16_t *subdirs)
+{
+    *type = file_type(sb.st_mode);
+
+    if (S_ISDIR(sb.st_mode)) {
+        ++*subdirs;
+        return alloc_inode(true, ino)
+                && add_tree(path, sb, *ino, parent, false);
+    }
+
+    // Hard links share the first inode
+    if (!S_ISDIR(sb.st_mode) && sb.st_nlink > 1) {
+        auto key = std::make_pair(sb.st_dev, sb.st_ino);
+        auto it = _hardlinks.find(key);
+        if (it != _hardlinks.end()) {
+            *ino = it->second;
+            ++_link_counts[*ino];
+            return true;
+        }
+    }
+
+    if (!alloc_inode(false, ino)) {
+        return false;
+    }
+
+    unsigned char inode[EXT4_INODE_SIZE];
+    init_inode(inode, sb);
+
+    bool ret;
+
+    if (S_ISREG(sb.st_mode)) {
+        ret = add_file(path, sb, inode);
+    } else if (S_ISLNK(sb.st_mode)) {
+        ret = add_symlink(path, sb, inode);
+    } else {
+        uint32_t major_num = major(sb.st_rdev);
+        uint32_t minor_num = minor(sb.st_rdev);
+
+        if (major_num < 256 && minor_num < 256) {
+            put_le32(inode, I_BLOCK, (major_num << 8) | minor_num);
+        } else {
+            put_le32(inode, I_BLOCK + 4, (minor_num & 0xff) | (major_num << 8)
+                     | ((minor_num & ~0xffu) << 12));
+        }
+        ret = true;
+    }
+
+    std::vector<Xattr> xattrs;
+    if (!ret || !read_xattrs(path, &xattrs) || !set_xattrs(inode, xattrs)
+            || !write_inode(*ino, inode)) {
+        return false;
+    }
+
+    if (sb.st_nlink > 1) {
+        _hardlinks[std::make_pair(sb.st_dev, sb.st_ino)] = *ino;
+        _link_counts[*ino] = 1;
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::add_tree(const std::string &path, const struct stat &sb,
+                                uint32_t ino, uint32_t parent, bool is_root)
+{
+    std::vector<std::string> names;
+    std::vector<DirEntry> entries;
+    uint16_t subdirs = 0;
+
+    if (!path.empty()) {
+        autoclose::dir dp(autoclose::opendir(path.c_str()));
+        if (!dp) {
+            LOGE("%s: Failed to open directory: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+
+        struct dirent *ent;
+        while ((ent = readdir(dp.get()))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            if (is_root && (strcmp(ent->d_name, "lost+found") == 0
+                    || std::find(_exclusions.begin(), _exclusions.end(),
+                                 ent->d_name) != _exclusions.end())) {
+                continue;
+            }
+            names.push_back(ent->d_name);
+        }
+
+        std::sort(names.begin(), names.end());
+    }
+
+    if (is_root) {
+        entries.push_back({ EXT4_LOST_FOUND_INO, EXT4_FT_DIR, "lost+found" });
+        ++subdirs;
+    }
+
+    for (const std::string &name : names) {
+        std::string child = path;
+        child += "/";
+        child += name;
+
+        struct stat child_sb;
+        if (lstat(child.c_str(), &child_sb) < 0) {
+            LOGE("%s: Failed to stat: %s", child.c_str(), strerror(errno));
+            return false;
+        }
+
+        DirEntry entry;
+        entry.name = name;
+
+        if (!add_node(child, child_sb, ino, &entry.ino, &entry.type,
+                      &subdirs)) {
+            if (!S_ISDIR(child_sb.st_mode)) {
+                LOGE("%s: Failed to add to image: %s",
+                     child.c_str(), strerror(errno));
+            }
+            return false;
+        }
+
+        entries.push_back(std::move(entry));
+    }
+
+    unsigned char inode[EXT4_INODE_SIZE];
+    init_inode(inode, sb);
+
+    // With dir_nlink, directories with too many subdirectories have a link
+    // count of 1
+    uint32_t links = 2 + subdirs;
+    put_le16(inode, I_LINKS_COUNT, links >= EXT4_LINK_MAX
+             ? 1 : static_cast<uint16_t>(links));
+
+    std::vector<Xattr> xattrs;
+    if (!path.empty() && !read_xattrs(path, &xattrs)) {
+        LOGE("%s: Failed to read xattrs: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!write_directory(inode, ino, parent, entries, 1)
+            || !set_xattrs(inode, std::move(xattrs))
+            || !write_inode(ino, inode)) {
+        LOGE("%s: Failed to add directory to image: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void Ext4ImageBuilder::fill_superblock(unsigned char *sb, uint32_t group)
+{
+    uint32_t free_blocks = 0;
+    uint32_t free_inodes = 0;
+
+    for (uint32_t b = 0; b < _blocks_count; ++b) {
+        free_blocks += !test_bit(_block_bitmap, b);
+    }
+    for (uint32_t i = 0; i < inodes_count(); ++i) {
+        free_inodes += !test_bit(_inode_bitmap, i);
+    }
+
+    memset(sb, 0, 1024);
+    put_le32(sb, SB_INODES_COUNT, inodes_count());
+    put_le32(sb, SB_BLOCKS_COUNT, _blocks_count);
+    put_le32(sb, SB_R_BLOCKS_COUNT, 0);
+    put_le32(sb, SB_FREE_BLOCKS_COUNT, free_blocks);
+    put_le32(sb, SB_FREE_INODES_COUNT, free_inodes);
+    put_le32(sb, SB_FIRST_DATA_BLOCK, 0);
+    put_le32(sb, SB_LOG_BLOCK_SIZE, EXT4_LOG_BLOCK_SIZE);
+    put_le32(sb, SB_LOG_CLUSTER_SIZE, EXT4_LOG_BLOCK_SIZE);
+    put_le32(sb, SB_BLOCKS_PER_GROUP, EXT4_BLOCKS_PER_GROUP);
+    put_le32(sb, SB_CLUSTERS_PER_GROUP, EXT4_BLOCKS_PER_GROUP);
+    put_le32(sb, SB_INODES_PER_GROUP, _inodes_per_group);
+    put_le32(sb, SB_WTIME, _now);
+    put_le16(sb, SB_MAX_MNT_COUNT, 0xffff);
+    put_le16(sb, SB_MAGIC, EXT4_SUPER_MAGIC);
+    put_le16(sb, SB_STATE, EXT4_STATE_VALID_FS);
+    put_le16(sb, SB_ERRORS, EXT4_ERRORS_CONTINUE);
+    put_le32(sb, SB_LASTCHECK, _now);
+    put_le32(sb, SB_CREATOR_OS, EXT4_OS_LINUX);
+    put_le32(sb, SB_REV_LEVEL, EXT4_DYNAMIC_REV);
+    put_le32(sb, SB_FIRST_INO, EXT4_FIRST_INO);
+    put_le16(sb, SB_INODE_SIZE, EXT4_INODE_SIZE);
+    put_le16(sb, SB_BLOCK_GROUP_NR, static_cast<uint16_t>(group));
+    put_le32(sb, SB_FEATURE_COMPAT, EXT4_FEATURE_COMPAT_HAS_JOURNAL
+             | EXT4_FEATURE_COMPAT_EXT_ATTR);
+    put_le32(sb, SB_FEATURE_INCOMPAT, EXT4_FEATURE_INCOMPAT_FILETYPE
+             | EXT4_FEATURE_INCOMPAT_EXTENTS);
+    put_le32(sb, SB_FEATURE_RO_COMPAT, EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER
+             | EXT4_FEATURE_RO_COMPAT_LARGE_FILE
+             | EXT4_FEATURE_RO_COMPAT_DIR_NLINK
+             | EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE);
+    memcpy(sb + SB_UUID, _uuid, sizeof(_uuid));
+    put_le32(sb, SB_JOURNAL_INUM, EXT4_JOURNAL_INO);
+    for (int i = 0; i < 4; ++i) {
+        put_le32(sb, SB_HASH_SEED + i * 4, _hash_seed[i]);
+    }
+    sb[SB_DEF_HASH_VERSION] = EXT4_DX_HASH_HALF_MD4;
+    sb[SB_JNL_BACKUP_TYPE] = EXT4_JNL_BACKUP_BLOCKS;
+    put_le32(sb, SB_MKFS_TIME, _now);
+    memcpy(sb + SB_JNL_BLOCKS, _jnl_blocks, sizeof(_jnl_blocks));
+    put_le32(sb, SB_JNL_BLOCKS + 15 * 4,
+             static_cast<uint32_t>(_journal_size >> 32));
+    put_le32(sb, SB_JNL_BLOCKS + 16 * 4,
+             static_cast<uint32_t>(_journal_size));
+    put_le16(sb, SB_MIN_EXTRA_ISIZE, EXT4_EXTRA_ISIZE);
+    put_le16(sb, SB_WANT_EXTRA_ISIZE, EXT4_EXTRA_ISIZE);
+}
+
+bool Ext4ImageBuilder::finish()
+{
+    // Fix up link counts of hard linked files
+    for (auto const &item : _link_counts) {
+        if (item.second > 1) {
+            uint32_t group = (item.first - 1) / _inodes_per_group;
+            uint32_t index = (item.first - 1) % _inodes_per_group;
+            uint64_t offset = static_cast<uint64_t>(inode_table_block(group))
+                    * EXT4_BLOCK_SIZE
+                    + static_cast<uint64_t>(index) * EXT4_INODE_SIZE
+                    + I_LINKS_COUNT;
+            unsigned char links[2];
+            put_le16(links, 0, item.second);
+            if (!pwrite_all(_fd, links, sizeof(links), offset)) {
+                return false;
+            }
+        }
+    }
+
+    std::vector<unsigned char> gdt(
+            static_cast<size_t>(_gdt_blocks) * EXT4_BLOCK_SIZE);
+    unsigned char bitmap[EXT4_BLOCK_SIZE];
+
+    for (uint32_t g = 0; g < _groups; ++g) {
+        uint32_t first = group_first_block(g);
+        uint32_t count = group_block_count(g);
+        uint32_t free_blocks = 0;
+        uint32_t free_inodes = 0;
+
+        // Blocks past the end of the file system are marked as used
+        memset(bitmap, 0xff, sizeof(bitmap));
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!test_bit(_block_bitmap, first + i)) {
+                bitmap[i / 8] &= ~(1 << (i % 8));
+                ++free_blocks;
+            }
+        }
+        if (!write_blocks(block_bitmap_block(g), bitmap, sizeof(bitmap))) {
+            return false;
+        }
+
+        // Same for the padding at the end of the inode bitmap
+        memset(bitmap, 0xff, sizeof(bitmap));
+        for (uint32_t i = 0; i < _inodes_per_group; ++i) {
+            if (!test_bit(_inode_bitmap, g * _inodes_per_group + i)) {
+                bitmap[i / 8] &= ~(1 << (i % 8));
+                ++free_inodes;
+            }
+        }
+        if (!write_blocks(inode_bitmap_block(g), bitmap, sizeof(bitmap))) {
+            return false;
+        }
+
+        unsigned char *desc = gdt.data() + g * EXT4_DESC_SIZE;
+        put_le32(desc, BG_BLOCK_BITMAP, block_bitmap_block(g));
+        put_le32(desc, BG_INODE_BITMAP, inode_bitmap_block(g));
+        put_le32(desc, BG_INODE_TABLE, inode_table_block(g));
+        put_le16(desc, BG_FREE_BLOCKS_COUNT, static_cast<uint16_t>(free_blocks));
+        put_le16(desc, BG_FREE_INODES_COUNT, static_cast<uint16_t>(free_inodes));
+        put_le16(desc, BG_USED_DIRS_COUNT, _used_dirs[g]);
+    }
+
+    unsigned char sb[1024];
+
+    for (uint32_t g = 0; g < _groups; ++g) {
+        if (!group_has_super(g)) {
+            continue;
+        }
+
+        uint32_t first = group_first_block(g);
+        fill_superblock(sb, g);
+
+        // The primary superblock is at byte 1024. Backups are at the
+        // beginning of their group's first block.
+        uint64_t offset = g == 0 ? 1024
+                : static_cast<uint64_t>(first) * EXT4_BLOCK_SIZE;
+
+        if (!pwrite_all(_fd, sb, sizeof(sb), offset)
+                || !write_blocks(first + 1, gdt.data(), gdt.size())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Ext4ImageBuilder::build(const std::string &source_dir,
+                             const std::vector<std::string> &exclusions)
+{
+    _exclusions = exclusions;
+
+    if (!create_journal()) {
+        LOGE("Failed to create journal: %s", strerror(errno));
+        return false;
+    }
+
+    if (!create_lost_found()) {
+        LOGE("Failed to create lost+found: %s", strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+
+    if (source_dir.empty()) {
+        memset(&sb, 0, sizeof(sb));
+        sb.st_mode = S_IFDIR | 0755;
+        sb.st_atim.tv_sec = sb.st_ctim.tv_sec = sb.st_mtim.tv_sec = _now;
+    } else if (stat(source_dir.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", source_dir.c_str(), strerror(errno));
+        return false;
+    } else if (!S_ISDIR(sb.st_mode)) {
+        errno = ENOTDIR;
+        return false;
+    }
+
+    if (!add_tree(source_dir, sb, EXT4_ROOT_INO, EXT4_ROOT_INO, true)) {
+        return false;
+    }
+    ++_used_dirs[0];
+
+    if (!finish()) {
+        LOGE("Failed to write file system metadata: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create an ext4 image without using make_ext4fs
+ *
+ * The image is created as a sparse file of \p size bytes. Only the file system
+ * metadata (and the data from \p source_dir, if specified) is written.
+ *
+ * \param path Path of image to create. The file must not already exist.
+ * \param size Size of image in bytes
+ * \param source_dir If not empty, directory whose contents (including
+ *                   ownership, permissions, timestamps, and xattrs) should be
+ *                   copied into the image
+ * \param exclusions Top-level entries in \p source_dir to skip
+ *
+ * \return True if the image was successfully created. Otherwise, false with
+ *         errno set. The partially written image is deleted on failure.
+ */
+bool ext4_create_image(const std::string &path, uint64_t size,
+                       const std::string &source_dir,
+                       const std::vector<std::string> &exclusions)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ret = false;
+
+    auto cleanup = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        if (!ret) {
+            unlink(path.c_str());
+        }
+        errno = saved_errno;
+    });
+
+    std::unique_ptr<Ext4ImageBuilder> builder(new Ext4ImageBuilder(fd));
+
+    if (ftruncate64(fd, size) < 0
+            || !builder->init(size)
+            || !builder->build(source_dir, exclusions)
+            || fsync(fd) < 0) {
+        return false;
+    }
+
+    ret = true;
+    return true;
+}
+
+}
+}
@@ -19,13 +19,34 @@
 
 #include "mbutil/hash.h"
 
-#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 #include <cerrno>
-#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
+#include <zlib.h>
 
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+
+// Size of the buffer used for reading files that are not mmap'd
+#define HASH_BUFFER_SIZE        (1024 * 1024)
+// Alignment of the read buffer
+#define HASH_BUFFER_ALIGNMENT   4096
+
+#define MAX_HASH_THREADS        4
 
 namespace mb
 {
@@ -33,53 +54,389 @@ namespace util
 {
 
 /*!
- * \brief Compute SHA512 hash of a file
+ * \brief Update a CRC32 checksum
  *
- * \param path Path to file
- * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
- *               computed hash value
+ * When the CRC32 extension is available (ARMv8), the checksum is computed with
+ * the CRC32 instructions. They use the same polynomial as zlib's crc32(), so
+ * both code paths produce identical results.
+ */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data,
+                             size_t size)
+{
+#if defined(__ARM_FEATURE_CRC32) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    crc = ~crc;
+
+    for (; size > 0 && ((uintptr_t) data & 7) != 0; ++data, --size) {
+        crc = __crc32b(crc, *data);
+    }
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        crc = __crc32d(crc, value);
+    }
+    for (; size > 0; ++data, --size) {
+        crc = __crc32b(crc, *data);
+    }
+
+    return ~crc;
+#else
+    // zlib's crc32() takes a uInt length
+    while (size > 0) {
+        uInt n = std::min<size_t>(size, UINT_MAX);
+        crc = crc32(crc, data, n);
+        data += n;
+        size -= n;
+    }
+
+    return crc;
+#endif
+}
+
+static bool md_init(EVP_MD_CTX **ctx, const EVP_MD *md)
+{
+    *ctx = EVP_MD_CTX_create();
+    if (!*ctx) {
+        LOGE("openssl: EVP_MD_CTX_create() failed");
+        return false;
+    }
+
+    if (!EVP_DigestInit_ex(*ctx, md, nullptr)) {
+        LOGE("openssl: EVP_DigestInit_ex() failed");
+        return false;
+    }
+
+    return true;
+}
+
+static bool md_final(EVP_MD_CTX *ctx, unsigned char *digest, size_t size)
+{
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    unsigned int buf_size;
+
+    if (!EVP_DigestFinal_ex(ctx, buf, &buf_size) || buf_size != size) {
+        LOGE("openssl: EVP_DigestFinal_ex() failed");
+        return false;
+    }
+
+    memcpy(digest, buf, size);
+    return true;
+}
+
+MultiHasher::MultiHasher()
+    : _algorithms(0)
+    , _md5(nullptr)
+    , _sha1(nullptr)
+    , _sha512(nullptr)
+    , _crc32(0)
+{
+}
+
+MultiHasher::~MultiHasher()
+{
+    reset();
+}
+
+void MultiHasher::reset()
+{
+    if (_md5) {
+        EVP_MD_CTX_destroy(_md5);
+        _md5 = nullptr;
+    }
+    if (_sha1) {
+        EVP_MD_CTX_destroy(_sha1);
+        _sha1 = nullptr;
+    }
+    if (_sha512) {
+        EVP_MD_CTX_destroy(_sha512);
+        _sha512 = nullptr;
+    }
+    _algorithms = 0;
+    _crc32 = 0;
+}
+
+/*!
+ * \brief Start computing a new set of digests
  *
- * \return true on success, false on failure and errno set appropriately
+ * The digests are computed with OpenSSL's EVP interface, which selects the
+ * hardware-accelerated implementation (eg. ARMv8 Crypto Extensions or Intel
+ * SHA extensions) at runtime when the CPU supports it.
+ *
+ * \param algorithms Bitwise-OR'd HashAlgorithms values
+ *
+ * \return Whether the digest contexts were successfully initialized
  */
-bool sha512_hash(const std::string &path,
-                 unsigned char digest[SHA512_DIGEST_LENGTH])
+bool MultiHasher::init(int algorithms)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+    reset();
+
+    if (((algorithms & HASH_MD5) && !md_init(&_md5, EVP_md5()))
+            || ((algorithms & HASH_SHA1) && !md_init(&_sha1, EVP_sha1()))
+            || ((algorithms & HASH_SHA512)
+                    && !md_init(&_sha512, EVP_sha512()))) {
+        reset();
+        return false;
+    }
+
+    _algorithms = algorithms;
+    _crc32 = crc32(0, nullptr, 0);
+
+    return true;
+}
+
+/*!
+ * \brief Add data to all of the selected digests
+ */
+bool MultiHasher::update(const void *data, size_t size)
+{
+    if ((_md5 && !EVP_DigestUpdate(_md5, data, size))
+            || (_sha1 && !EVP_DigestUpdate(_sha1, data, size))
+            || (_sha512 && !EVP_DigestUpdate(_sha512, data, size))) {
+        LOGE("openssl: EVP_DigestUpdate() failed");
+        return false;
+    }
+
+    if (_algorithms & HASH_CRC32) {
+        _crc32 = crc32_update(
+                _crc32, static_cast<const unsigned char *>(data), size);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Finish computing the digests
+ *
+ * Only the fields of \p digests that correspond to the algorithms passed to
+ * init() are written. init() must be called again before the hasher can be
+ * reused.
+ */
+bool MultiHasher::final(Digests &digests)
+{
+    digests.algorithms = _algorithms;
+
+    bool ret = (!_md5 || md_final(_md5, digests.md5, sizeof(digests.md5)))
+            && (!_sha1 || md_final(_sha1, digests.sha1, sizeof(digests.sha1)))
+            && (!_sha512 || md_final(_sha512, digests.sha512,
+                                     sizeof(digests.sha512)));
+
+    if (_algorithms & HASH_CRC32) {
+        digests.crc32 = _crc32;
+    }
+
+    reset();
+
+    return ret;
+}
+
+/*!
+ * \brief Hash a regular file by mapping it into memory
+ *
+ * \return Whether the file was mapped. \p ok is set to the result of hashing
+ *         the mapped data.
+ */
+static bool hash_fd_mmap(int fd, size_t size, MultiHasher &hasher, bool &ok)
+{
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
         return false;
     }
 
-    unsigned char buf[10240];
-    size_t n;
+    madvise(map, size, MADV_SEQUENTIAL);
 
-    SHA512_CTX ctx;
-    if (!SHA512_Init(&ctx)) {
-        LOGE("openssl: SHA512_Init() failed");
+    ok = hasher.update(map, size);
+
+    munmap(map, size);
+
+    return true;
+}
+
+static bool hash_fd_read(int fd, MultiHasher &hasher)
+{
+    void *buf;
+    int ret = posix_memalign(&buf, HASH_BUFFER_ALIGNMENT, HASH_BUFFER_SIZE);
+    if (ret != 0) {
+        errno = ret;
         return false;
     }
 
-    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
-        if (!SHA512_Update(&ctx, buf, n)) {
-            LOGE("openssl: SHA512_Update() failed");
+    auto free_buf = finally([&]{
+        free(buf);
+    });
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (true) {
+        ssize_t n = read(fd, buf, HASH_BUFFER_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return false;
-        }
-        if (n < sizeof(buf)) {
+        } else if (n == 0) {
             break;
         }
+
+        if (!hasher.update(buf, n)) {
+            errno = EIO;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute digests of the data read from a file descriptor
+ *
+ * The data from the current file position to EOF is read once and passed to
+ * all of the selected algorithms. If \p flags contains HASH_MMAP and \p fd
+ * refers to a regular file, the file is mapped into memory instead of being
+ * read. The file must not be truncated while it is mapped. If mapping the file
+ * fails, it is read normally.
+ *
+ * \param fd File descriptor
+ * \param algorithms Bitwise-OR'd HashAlgorithms values
+ * \param flags Bitwise-OR'd HashFlags values
+ * \param digests Output digests
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool hash_fd(int fd, int algorithms, int flags, Digests &digests)
+{
+    MultiHasher hasher;
+    if (!hasher.init(algorithms)) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    bool mapped = false;
+    bool ok = true;
+
+    if (flags & HASH_MMAP) {
+        struct stat sb;
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+
+        // Only whole files are mapped since the offset must be page-aligned
+        if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && offset == 0
+                && sb.st_size > 0
+                && (uint64_t) sb.st_size <= SIZE_MAX) {
+            mapped = hash_fd_mmap(fd, sb.st_size, hasher, ok);
+        }
     }
 
-    if (ferror(fp.get())) {
-        LOGE("%s: Failed to read file", path.c_str());
+    if (!mapped && !hash_fd_read(fd, hasher)) {
+        return false;
+    }
+
+    if (!ok || !hasher.final(digests)) {
         errno = EIO;
         return false;
     }
 
-    if (!SHA512_Final(digest, &ctx)) {
-        LOGE("openssl: SHA512_Final() failed");
+    return true;
+}
+
+/*!
+ * \brief Compute digests of a file
+ *
+ * \sa hash_fd()
+ *
+ * \param path Path to file
+ * \param algorithms Bitwise-OR'd HashAlgorithms values
+ * \param flags Bitwise-OR'd HashFlags values
+ * \param digests Output digests
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool hash_file(const std::string &path, int algorithms, int flags,
+               Digests &digests)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    if (!hash_fd(fd, algorithms, flags, digests)) {
+        LOGE("%s: Failed to hash file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute digests of several files in parallel
+ *
+ * The files are distributed among up to MAX_HASH_THREADS threads. The result
+ * for each file is stored in its hash_file_info::success and
+ * hash_file_info::digests fields.
+ *
+ * \param files Files to hash
+ * \param algorithms Bitwise-OR'd HashAlgorithms values
+ * \param flags Bitwise-OR'd HashFlags values
+ *
+ * \return Whether all of the files were successfully hashed
+ */
+bool hash_files(std::vector<hash_file_info> &files, int algorithms, int flags)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> success(true);
+
+    auto worker = [&]{
+        size_t i;
+        while ((i = next++) < files.size()) {
+            hash_file_info &info = files[i];
+
+            info.success = hash_file(info.path, algorithms, flags,
+                                     info.digests);
+            if (!info.success) {
+                success = false;
+            }
+        }
+    };
+
+    unsigned int n_threads = std::min<size_t>(std::max(
+            std::thread::hardware_concurrency(), 1u), MAX_HASH_THREADS);
+    n_threads = std::min<size_t>(n_threads, files.size());
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    return success;
+}
+
+/*!
+ * \brief Compute SHA512 hash of a file
+ *
+ * \param path Path to file
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool sha512_hash(const std::string &path,
+                 unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    Digests digests;
+
+    if (!hash_file(path, HASH_SHA512, 0, digests)) {
         return false;
     }
 
+    memcpy(digest, digests.sha512, SHA512_DIGEST_LENGTH);
     return true;
 }
 
@@ -25,7 +25,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include <linux/loop.h>
@@ -43,6 +45,21 @@
 
 #define MAX_LOOPDEVS    1024
 
+// Newer ioctls that may not be in the kernel headers we're built against
+#define MB_LOOP_SET_DIRECT_IO   0x4C08  // Linux 4.4
+#define MB_LOOP_SET_BLOCK_SIZE  0x4C09  // Linux 4.14
+#define MB_LOOP_CONFIGURE       0x4C0A  // Linux 5.8
+
+#define MB_LO_FLAGS_DIRECT_IO   16
+
+struct mb_loop_config
+{
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t reserved[8];
+};
+
 
 namespace mb
 {
@@ -169,15 +186,82 @@ std::string loopdev_find_unused(void)
     return result;
 }
 
+/*!
+ * \brief Get logical block size of the block device backing a file
+ *
+ * \return Block size or 0 if it could not be determined (eg. the file is on a
+ *         FUSE or tmpfs filesystem)
+ */
+static uint32_t get_backing_block_size(int fd)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return 0;
+    }
+
+    // Partitions don't have a queue directory, but their parent disks do
+    static const char *fmts[] = {
+        "/sys/dev/block/%u:%u/queue/logical_block_size",
+        "/sys/dev/block/%u:%u/../queue/logical_block_size",
+        nullptr
+    };
+
+    for (auto it = fmts; *it; ++it) {
+        char path[128];
+        snprintf(path, sizeof(path), *it,
+                 major(sb.st_dev), minor(sb.st_dev));
+
+        FILE *fp = fopen(path, "re");
+        if (!fp) {
+            continue;
+        }
+
+        unsigned int size = 0;
+        int n = fscanf(fp, "%u", &size);
+        fclose(fp);
+
+        if (n == 1 && size >= 512 && size <= 4096 && (size & (size - 1)) == 0) {
+            return size;
+        }
+    }
+
+    return 0;
+}
+
+/*!
+ * \brief Associate a file with a loop device
+ *
+ * On Linux 5.8 and newer, the loop device is configured atomically with the
+ * LOOP_CONFIGURE ioctl. Otherwise, the LOOP_SET_FD and LOOP_SET_STATUS64
+ * ioctls are used.
+ *
+ * If \p flags contains LOOPDEV_DIRECT_IO, direct I/O is enabled so that pages
+ * aren't cached both for the image file and for the loop device. If the kernel
+ * or backing filesystem doesn't support direct I/O, or the loop device's block
+ * size is smaller than the backing device's logical block size, the loop device
+ * silently falls back to buffered I/O.
+ *
+ * The loop device's block size is left at 512 bytes unless \p flags contains
+ * LOOPDEV_BACKING_BLOCK_SIZE, in which case it's set to the backing device's
+ * logical block size. That is only safe for images whose filesystem block size
+ * is at least as large.
+ *
+ * \param loopdev Loop device path
+ * \param file Backing file
+ * \param offset Offset of data in the backing file
+ * \param flags \ref LoopdevFlags
+ *
+ * \return True if the loop device was set up. Otherwise, false with errno set.
+ */
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
-                           uint64_t offset, bool ro)
+                           uint64_t offset, int flags)
 {
     int ffd = -1;
     int lfd = -1;
+    bool ro = flags & LOOPDEV_READ_ONLY;
+    bool dio = flags & LOOPDEV_DIRECT_IO;
 
-    struct loop_info64 loopinfo;
-
-    if ((ffd = open(file.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
+    if ((ffd = open(file.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -185,7 +269,7 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(ffd);
     });
 
-    if ((lfd = open(loopdev.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
+    if ((lfd = open(loopdev.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -193,19 +277,53 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(lfd);
     });
 
-    memset(&loopinfo, 0, sizeof(struct loop_info64));
-    strlcpy((char *) loopinfo.lo_file_name, file.c_str(), LO_NAME_SIZE);
-    loopinfo.lo_offset = offset;
+    uint32_t block_size = (flags & LOOPDEV_BACKING_BLOCK_SIZE)
+            ? get_backing_block_size(ffd) : 0;
+
+    struct mb_loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = ffd;
+    config.block_size = block_size;
+    strlcpy((char *) config.info.lo_file_name, file.c_str(), LO_NAME_SIZE);
+    config.info.lo_offset = offset;
+    if (ro) {
+        config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+    }
+    if (dio) {
+        config.info.lo_flags |= MB_LO_FLAGS_DIRECT_IO;
+    }
+
+    if (ioctl(lfd, MB_LOOP_CONFIGURE, &config) == 0) {
+        return true;
+    } else if (errno != EINVAL && errno != ENOTTY) {
+        return false;
+    }
+
+    // Older kernels return EINVAL for unknown loop ioctls. If the block size
+    // was the problem, it'll be ignored below.
+    config.info.lo_flags = 0;
 
     if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
         return false;
     }
 
-    if (ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) < 0) {
+    if (ioctl(lfd, LOOP_SET_STATUS64, &config.info) < 0) {
+        int saved_errno = errno;
         ioctl(lfd, LOOP_CLR_FD, 0);
+        errno = saved_errno;
         return false;
     }
 
+    // Both of these are optional. The block size must be set first since the
+    // kernel won't enable direct I/O if it doesn't match the backing device's
+    // alignment.
+    if (block_size != 0) {
+        ioctl(lfd, MB_LOOP_SET_BLOCK_SIZE, (unsigned long) block_size);
+    }
+    if (dio) {
+        ioctl(lfd, MB_LOOP_SET_DIRECT_IO, 1UL);
+    }
+
     return true;
 }
 
@@ -20,6 +20,8 @@
 #include "mbutil/mount.h"
 
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #include <cerrno>
@@ -27,95 +29,431 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
 #include "mbutil/blkid.h"
 #include "mbutil/directory.h"
 #include "mbutil/loopdev.h"
 #include "mbutil/string.h"
-#include "external/mntent.h"
 
 #define MAX_UNMOUNT_TRIES 5
 
-#define DELETED_SUFFIX "\\040(deleted)"
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MNT_NS_PATH "/proc/self/ns/mnt"
+
+#define DELETED_SUFFIX " (deleted)"
 
 namespace mb
 {
 namespace util
 {
 
+struct MountTable
+{
+    std::vector<MountEntry> entries;
+    // Index of the last (topmost) entry for each mount point
+    std::unordered_map<std::string, size_t> by_target;
+};
+
+/*
+ * The parsed mount table is cached along with an open file descriptor for
+ * /proc/self/mountinfo. The kernel reports POLLPRI (and POLLERR) on that file
+ * descriptor whenever the mount namespace changes, so checking whether the
+ * cached table is still valid only costs a poll() call.
+ *
+ * The file descriptor is bound to the mount namespace and root directory of
+ * the process at the time it was opened, so it is reopened if the process
+ * forks, unshares its mount namespace, or chroots.
+ */
+static std::mutex mount_table_lock;
+static std::shared_ptr<const MountTable> mount_table;
+static int mount_table_fd = -1;
+static pid_t mount_table_pid = 0;
+static ino_t mount_table_ns_ino = 0;
+static dev_t mount_table_root_dev = 0;
+static ino_t mount_table_root_ino = 0;
+
 static std::string get_deleted_mount_path(const std::string &dir)
 {
     struct stat sb;
-    if (lstat(dir.c_str(), &sb) < 0 && errno == ENOENT
-            && mb_ends_with(dir.c_str(), DELETED_SUFFIX)) {
+    if (mb_ends_with(dir.c_str(), DELETED_SUFFIX)
+            && lstat(dir.c_str(), &sb) < 0 && errno == ENOENT) {
         return std::string(dir.begin(), dir.end() - strlen(DELETED_SUFFIX));
     } else {
         return dir;
     }
 }
 
-bool is_mounted(const std::string &mountpoint)
+/*!
+ * \brief Decode octal escapes (eg. "\040" for space) in a mountinfo field
+ */
+static std::string unescape_mount_field(const char *begin, const char *end)
+{
+    std::string result;
+    result.reserve(end - begin);
+
+    while (begin != end) {
+        if (*begin == '\\' && end - begin >= 4
+                && begin[1] >= '0' && begin[1] <= '3'
+                && begin[2] >= '0' && begin[2] <= '7'
+                && begin[3] >= '0' && begin[3] <= '7') {
+            result += static_cast<char>(((begin[1] - '0') << 6)
+                    | ((begin[2] - '0') << 3)
+                    | (begin[3] - '0'));
+            begin += 4;
+        } else {
+            result += *begin++;
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Parse a line from /proc/self/mountinfo
+ *
+ * The format is:
+ *
+ *     <id> <parent id> <major>:<minor> <root> <target> <vfs options>
+ *         [<optional fields>...] - <fs type> <source> <fs options>
+ */
+static bool parse_mountinfo_line(const char *begin, const char *end,
+                                 MountEntry *entry)
 {
-    autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-    if (!fp) {
-        LOGE("Failed to read /proc/mounts: %s", strerror(errno));
+    std::vector<std::pair<const char *, const char *>> fields;
+    size_t separator = 0;
+
+    for (const char *p = begin; p != end;) {
+        while (p != end && *p == ' ') {
+            ++p;
+        }
+        if (p == end) {
+            break;
+        }
+        const char *field_begin = p;
+        while (p != end && *p != ' ') {
+            ++p;
+        }
+        if (p - field_begin == 1 && *field_begin == '-' && separator == 0) {
+            separator = fields.size();
+        }
+        fields.emplace_back(field_begin, p);
+    }
+
+    // Need 6 fields before the separator and 3 after
+    if (separator < 6 || fields.size() < separator + 4) {
         return false;
     }
 
-    bool found = false;
-    struct mntent ent;
-    char buf[1024];
-    std::string mnt_dir;
+    std::string id(fields[0].first, fields[0].second);
+    std::string parent_id(fields[1].first, fields[1].second);
+    std::string dev(fields[2].first, fields[2].second);
+    char *ptr;
 
-    while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-        mnt_dir = get_deleted_mount_path(ent.mnt_dir);
-        if (mountpoint == mnt_dir) {
-            found = true;
+    entry->id = static_cast<int>(strtol(id.c_str(), &ptr, 10));
+    if (*ptr) {
+        return false;
+    }
+    entry->parent_id = static_cast<int>(strtol(parent_id.c_str(), &ptr, 10));
+    if (*ptr) {
+        return false;
+    }
+    if (sscanf(dev.c_str(), "%u:%u",
+               &entry->dev_major, &entry->dev_minor) != 2) {
+        return false;
+    }
+
+    entry->root = unescape_mount_field(fields[3].first, fields[3].second);
+    entry->target = get_deleted_mount_path(
+            unescape_mount_field(fields[4].first, fields[4].second));
+    entry->vfs_options.assign(fields[5].first, fields[5].second);
+    entry->fs_type = unescape_mount_field(fields[separator + 1].first,
+                                          fields[separator + 1].second);
+    entry->source = unescape_mount_field(fields[separator + 2].first,
+                                         fields[separator + 2].second);
+    entry->fs_options.assign(fields[separator + 3].first,
+                             fields[separator + 3].second);
+
+    return true;
+}
+
+static bool read_mount_table(int fd, MountTable *table)
+{
+    std::vector<char> buf(16384);
+    size_t size = 0;
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return false;
+    }
+
+    while (true) {
+        if (size == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+
+        ssize_t n = read(fd, buf.data() + size, buf.size() - size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
             break;
         }
+
+        size += static_cast<size_t>(n);
+    }
+
+    table->entries.clear();
+    table->by_target.clear();
+
+    const char *data = buf.data();
+    const char *data_end = data + size;
+
+    while (data != data_end) {
+        const char *line_end = static_cast<const char *>(
+                memchr(data, '\n', data_end - data));
+        if (!line_end) {
+            line_end = data_end;
+        }
+
+        MountEntry entry;
+        if (parse_mountinfo_line(data, line_end, &entry)) {
+            table->by_target[entry.target] = table->entries.size();
+            table->entries.push_back(std::move(entry));
+        } else if (line_end != data) {
+            LOGW("Ignoring malformed line in %s: %s", MOUNTINFO_PATH,
+                 std::string(data, line_end).c_str());
+        }
+
+        data = line_end == data_end ? line_end : line_end + 1;
+    }
+
+    return true;
+}
+
+static void close_mount_table_fd()
+{
+    if (mount_table_fd >= 0) {
+        close(mount_table_fd);
+        mount_table_fd = -1;
+    }
+    mount_table.reset();
+}
+
+/*!
+ * \brief Get a snapshot of the mount table
+ *
+ * The cached table is returned if the mount namespace has not changed since
+ * it was last read.
+ *
+ * \return Mount table or nullptr if /proc/self/mountinfo cannot be read
+ */
+static std::shared_ptr<const MountTable> get_mount_table()
+{
+    std::lock_guard<std::mutex> lock(mount_table_lock);
+
+    pid_t pid = getpid();
+    struct stat ns_sb;
+    struct stat root_sb;
+
+    // Old kernels do not have /proc/<pid>/ns/mnt. Without it, there's no way
+    // to detect an unshare(), so the table is never reused.
+    bool have_ns = stat(MNT_NS_PATH, &ns_sb) == 0;
+    if (!have_ns) {
+        ns_sb.st_ino = 0;
+    }
+    if (stat("/", &root_sb) < 0) {
+        root_sb.st_dev = 0;
+        root_sb.st_ino = 0;
+    }
+
+    if (mount_table_fd >= 0 && (!have_ns
+            || pid != mount_table_pid
+            || ns_sb.st_ino != mount_table_ns_ino
+            || root_sb.st_dev != mount_table_root_dev
+            || root_sb.st_ino != mount_table_root_ino)) {
+        close_mount_table_fd();
+    }
+
+    if (mount_table_fd < 0) {
+        mount_table_fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+        if (mount_table_fd < 0) {
+            LOGE("Failed to open %s: %s", MOUNTINFO_PATH, strerror(errno));
+            return {};
+        }
+
+        mount_table_pid = pid;
+        mount_table_ns_ino = ns_sb.st_ino;
+        mount_table_root_dev = root_sb.st_dev;
+        mount_table_root_ino = root_sb.st_ino;
+    } else if (mount_table) {
+        struct pollfd pfd;
+        pfd.fd = mount_table_fd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+
+        int ret;
+        do {
+            ret = poll(&pfd, 1, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret == 0 || (ret > 0 && !(pfd.revents
+                & (POLLPRI | POLLERR | POLLNVAL)))) {
+            return mount_table;
+        }
+    }
+
+    auto table = std::make_shared<MountTable>();
+    if (!read_mount_table(mount_table_fd, table.get())) {
+        LOGE("Failed to read %s: %s", MOUNTINFO_PATH, strerror(errno));
+        close_mount_table_fd();
+        return {};
     }
 
-    return found;
+    mount_table = table;
+    return mount_table;
 }
 
+/*!
+ * \brief Get all entries in the mount table
+ *
+ * \param[out] entries Entries in the order listed by the kernel
+ *
+ * \return True if the mount table was successfully read. Otherwise, false.
+ */
+bool mount_get_entries(std::vector<MountEntry> *entries)
+{
+    auto table = get_mount_table();
+    if (!table) {
+        return false;
+    }
+
+    *entries = table->entries;
+    return true;
+}
+
+/*!
+ * \brief Get mount points under a directory in the order they can be unmounted
+ *
+ * Every mount point whose path begins with \a dir is returned. Mounts are
+ * ordered such that each mount comes after all of the mounts stacked on top of
+ * it or nested within it, so unmounting them in order never fails with EBUSY
+ * due to a child mount.
+ *
+ * \param dir Path prefix
+ * \param[out] entries Mount entries in unmount order
+ *
+ * \return True if the mount table was successfully read. Otherwise, false.
+ */
+bool mount_get_subtree(const std::string &dir,
+                       std::vector<MountEntry> *entries)
+{
+    auto table = get_mount_table();
+    if (!table) {
+        return false;
+    }
+
+    const std::vector<MountEntry> &all = table->entries;
+    std::unordered_map<int, size_t> by_id;
+    std::vector<std::vector<size_t>> children(all.size());
+    std::vector<size_t> roots;
+
+    for (size_t i = 0; i < all.size(); ++i) {
+        by_id[all[i].id] = i;
+    }
+    for (size_t i = 0; i < all.size(); ++i) {
+        auto it = by_id.find(all[i].parent_id);
+        if (it == by_id.end() || it->second == i) {
+            roots.push_back(i);
+        } else {
+            children[it->second].push_back(i);
+        }
+    }
+
+    // Post-order traversal. Children are visited in reverse so that later
+    // mounts are unmounted before earlier ones.
+    std::vector<bool> visited(all.size());
+    std::vector<std::pair<size_t, size_t>> stack;
+    entries->clear();
+
+    auto visit = [&](size_t root) {
+        if (visited[root]) {
+            return;
+        }
+        visited[root] = true;
+        stack.emplace_back(root, 0);
+
+        while (!stack.empty()) {
+            size_t index = stack.back().first;
+            size_t &next = stack.back().second;
+            const std::vector<size_t> &list = children[index];
+
+            if (next < list.size()) {
+                size_t child = list[list.size() - 1 - next];
+                ++next;
+                if (!visited[child]) {
+                    visited[child] = true;
+                    stack.emplace_back(child, 0);
+                }
+            } else {
+                if (mb_starts_with(all[index].target.c_str(), dir.c_str())) {
+                    entries->push_back(all[index]);
+                }
+                stack.pop_back();
+            }
+        }
+    };
+
+    for (auto it = roots.rbegin(); it != roots.rend(); ++it) {
+        visit(*it);
+    }
+    // Mounts that are part of a parent ID cycle
+    for (size_t i = all.size(); i-- > 0;) {
+        visit(i);
+    }
+
+    return true;
+}
+
+bool is_mounted(const std::string &mountpoint)
+{
+    auto table = get_mount_table();
+    if (!table) {
+        return false;
+    }
+
+    return table->by_target.find(mountpoint) != table->by_target.end();
+}
+
+static bool umount_source(const char *target, const std::string &source);
+
 bool unmount_all(const std::string &dir)
 {
-    std::vector<std::string> to_unmount;
+    std::vector<MountEntry> to_unmount;
     int failed;
-    struct mntent ent;
-    char buf[1024];
 
     for (int tries = 0; tries < MAX_UNMOUNT_TRIES; ++tries) {
         failed = 0;
-        to_unmount.clear();
 
-        autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-        if (!fp) {
-            LOGE("Failed to read /proc/mounts: %s", strerror(errno));
+        if (!mount_get_subtree(dir, &to_unmount)) {
             return false;
         }
 
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-            std::string mnt_dir = get_deleted_mount_path(ent.mnt_dir);
-            if (mb_starts_with(mnt_dir.c_str(), dir.c_str())) {
-                to_unmount.push_back(std::move(mnt_dir));
-            }
-        }
+        for (const MountEntry &entry : to_unmount) {
+            LOGD("Attempting to unmount %s", entry.target.c_str());
 
-        // Unmount in reverse order
-        for (auto it = to_unmount.rbegin(); it != to_unmount.rend(); ++it) {
-            LOGD("Attempting to unmount %s", it->c_str());
-
-            if (!util::umount(it->c_str())) {
+            if (!umount_source(entry.target.c_str(), entry.source)) {
                 LOGE("%s: Failed to unmount: %s",
-                     it->c_str(), strerror(errno));
+                     entry.target.c_str(), strerror(errno));
                 ++failed;
             }
         }
@@ -132,6 +470,34 @@ bool unmount_all(const std::string &dir)
     return false;
 }
 
+static bool mount_loopdev(const char *source, const char *target,
+                          const char *fstype, unsigned long mount_flags,
+                          const void *data, int loop_flags)
+{
+    std::string loopdev = util::loopdev_find_unused();
+    if (loopdev.empty()) {
+        LOGE("Failed to find unused loop device: %s", strerror(errno));
+        return false;
+    }
+
+    LOGD("Assigning %s to loop device %s", source, loopdev.c_str());
+
+    if (!util::loopdev_set_up_device(loopdev, source, 0, loop_flags)) {
+        LOGE("Failed to set up loop device %s: %s",
+             loopdev.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (::mount(loopdev.c_str(), target, fstype, mount_flags, data) < 0) {
+        int saved_errno = errno;
+        util::loopdev_remove_device(loopdev);
+        errno = saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Mount filesystem
  *
@@ -142,17 +508,25 @@ bool unmount_all(const std::string &dir)
  * device, then the file will be attached to a loop device and the the loop
  * device will be mounted at \a target.
  *
+ * If \a loop_flags requests direct I/O or the backing device's block size and
+ * mounting the loop device fails (eg. because the filesystem's block size is
+ * smaller than the loop device's), the mount is retried with a plain loop
+ * device.
+ *
  * \param source See man mount(2)
  * \param target See man mount(2)
  * \param fstype See man mount(2)
  * \param mount_flags See man mount(2)
  * \param data See man mount(2)
+ * \param loop_flags \ref LoopdevFlags for the loop device, if one is needed.
+ *                   LOOPDEV_READ_ONLY is set automatically if \a mount_flags
+ *                   contains MS_RDONLY.
  *
  * \return True if mount(2) is successful. False if mount(2) is unsuccessful
  *         or loopdev could not be created or associated with the source path.
  */
 bool mount(const char *source, const char *target, const char *fstype,
-           unsigned long mount_flags, const void *data)
+           unsigned long mount_flags, const void *data, int loop_flags)
 {
     bool need_loopdev = false;
     struct stat sb;
@@ -175,27 +549,25 @@ bool mount(const char *source, const char *target, const char *fstype,
     }
 
     if (need_loopdev) {
-        std::string loopdev = util::loopdev_find_unused();
-        if (loopdev.empty()) {
-            LOGE("Failed to find unused loop device: %s", strerror(errno));
-            return false;
+        if (mount_flags & MS_RDONLY) {
+            loop_flags |= util::LOOPDEV_READ_ONLY;
         }
 
-        LOGD("Assigning %s to loop device %s", source, loopdev.c_str());
+        static const int optional_flags =
+                util::LOOPDEV_DIRECT_IO | util::LOOPDEV_BACKING_BLOCK_SIZE;
 
-        if (!util::loopdev_set_up_device(
-                loopdev, source, 0, mount_flags & MS_RDONLY)) {
-            LOGE("Failed to set up loop device %s: %s",
-                 loopdev.c_str(), strerror(errno));
+        if (mount_loopdev(source, target, fstype, mount_flags, data,
+                          loop_flags)) {
+            return true;
+        } else if (!(loop_flags & optional_flags)) {
             return false;
         }
 
-        if (::mount(loopdev.c_str(), target, fstype, mount_flags, data) < 0) {
-            util::loopdev_remove_device(loopdev);
-            return false;
-        }
+        LOGW("%s: Failed to mount with direct I/O loop device, retrying: %s",
+             source, strerror(errno));
 
-        return true;
+        return mount_loopdev(source, target, fstype, mount_flags, data,
+                             loop_flags & ~optional_flags);
     } else {
         return ::mount(source, target, fstype, mount_flags, data) == 0;
     }
@@ -207,7 +579,7 @@ bool mount(const char *source, const char *target, const char *fstype,
  * This function takes the same arguments as umount(2), but returns true on
  * success and false on failure.
  *
- * This function will /proc/mounts for the mountpoint (using an exact string
+ * This function will search the mount table for the mountpoint (using an exact string
  * compare). If the source path of the mountpoint is a block device and the
  * block device is a loop device, then it will be disassociated from the
  * previously attached file. Note that the return value of
@@ -220,23 +592,23 @@ bool mount(const char *source, const char *target, const char *fstype,
  */
 bool umount(const char *target)
 {
-    struct mntent ent;
     std::string source;
-    std::string mnt_dir;
-
-    autoclose::file fp(setmntent("/proc/mounts", "r"), endmntent);
-    if (fp) {
-        char buf[1024];
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-            mnt_dir = get_deleted_mount_path(ent.mnt_dir);
-            if (mnt_dir == target) {
-                source = ent.mnt_fsname;
-            }
+
+    auto table = get_mount_table();
+    if (table) {
+        auto it = table->by_target.find(target);
+        if (it != table->by_target.end()) {
+            source = table->entries[it->second].source;
         }
     } else {
-        LOGW("Failed to read /proc/mounts: %s", strerror(errno));
+        LOGW("Failed to read mount table");
     }
 
+    return umount_source(target, source);
+}
+
+static bool umount_source(const char *target, const std::string &source)
+{
     int ret = ::umount(target);
 
     int saved_errno = errno;
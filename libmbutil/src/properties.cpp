@@ -20,12 +20,16 @@
 #include "mbutil/properties.h"
 
 #include <memory>
+#include <mutex>
 #include <vector>
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
 
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #if __ANDROID_API__ >= 21
 #include <dlfcn.h>
@@ -362,104 +366,378 @@ bool get_all_properties(std::unordered_map<std::string, std::string> *map)
     return true;
 }
 
-bool file_get_property(const std::string &path,
-                       const std::string &key,
-                       std::string *out,
-                       const std::string &default_value)
+// Clear the cache if it ever gets this large
+#define MAX_CACHED_PROPERTY_FILES       16
+
+static std::mutex props_cache_lock;
+static std::unordered_map<std::string, std::shared_ptr<const PropertiesSnapshot>>
+        props_cache;
+
+static size_t hash_key(const char *key, size_t size)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "r"));
-    if (!fp) {
-        return false;
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= static_cast<unsigned char>(key[i]);
+        h *= 16777619u;
     }
+    return h;
+}
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read;
+PropertiesSnapshot::PropertiesSnapshot()
+    : _dev(0), _ino(0), _size(0), _mtime()
+{
+}
 
-    auto free_line = finally([&] {
-        free(line);
+/*!
+ * \brief Read and parse a property file
+ *
+ * This always reads the file. Use file_get_properties_snapshot() to reuse a
+ * previously loaded snapshot if the file has not changed.
+ *
+ * \return Snapshot or nullptr if the file could not be read (with errno set)
+ */
+std::shared_ptr<const PropertiesSnapshot>
+PropertiesSnapshot::load(const std::string &path)
+{
+    std::shared_ptr<PropertiesSnapshot> snapshot(new PropertiesSnapshot());
+    struct stat sb;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
     });
 
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
-        if (line[0] == '\0' || line[0] == '#') {
+    if (fstat(fd, &sb) < 0) {
+        return nullptr;
+    }
+
+    snapshot->_dev = sb.st_dev;
+    snapshot->_ino = sb.st_ino;
+    snapshot->_size = sb.st_size;
+    snapshot->_mtime = sb.st_mtim;
+
+    // The file is copied instead of mapped since property files may be
+    // truncated and rewritten while a snapshot of them is still in use
+    size_t capacity = sb.st_size > 0 ? static_cast<size_t>(sb.st_size) : 4096;
+    size_t n_read = 0;
+    snapshot->_buf.resize(capacity);
+
+    while (true) {
+        if (n_read == snapshot->_buf.size()) {
+            snapshot->_buf.resize(snapshot->_buf.size() * 2);
+        }
+
+        ssize_t n = read(fd, snapshot->_buf.data() + n_read,
+                         snapshot->_buf.size() - n_read);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return nullptr;
+        } else if (n == 0) {
+            break;
+        }
+
+        n_read += static_cast<size_t>(n);
+    }
+
+    snapshot->_buf.resize(n_read);
+    snapshot->parse();
+
+    return snapshot;
+}
+
+void PropertiesSnapshot::parse()
+{
+    const char *data = _buf.data();
+    size_t size = _buf.size();
+    size_t line_start = 0;
+
+    // Empty lines, comments, and lines without an equals sign are ignored
+    while (line_start < size) {
+        const char *newline = static_cast<const char *>(
+                memchr(data + line_start, '\n', size - line_start));
+        size_t line_end = newline
+                ? static_cast<size_t>(newline - data) : size;
+        size_t next = newline ? line_end + 1 : size;
+
+        if (line_end == line_start || data[line_start] == '#') {
             // Skip empty and comment lines
+            line_start = next;
             continue;
         }
 
-        char *equals = strchr(line, '=');
+        const char *equals = static_cast<const char *>(
+                memchr(data + line_start, '=', line_end - line_start));
         if (!equals) {
             // No equals in line
+            line_start = next;
             continue;
         }
 
-        if ((size_t)(equals - line) != key.size()) {
-            // Key is not the same length
-            continue;
-        }
+        Entry entry;
+        entry.key_offset = line_start;
+        entry.key_size = static_cast<size_t>(equals - data) - line_start;
+        entry.value_offset = entry.key_size + line_start + 1;
+        entry.value_size = line_end - entry.value_offset;
+        _entries.push_back(entry);
+
+        line_start = next;
+    }
+
+    size_t table_size = 16;
+    while (table_size < _entries.size() * 2) {
+        table_size *= 2;
+    }
+    _table.assign(table_size, 0);
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        const Entry &entry = _entries[i];
+        size_t slot = hash_key(data + entry.key_offset, entry.key_size)
+                & (table_size - 1);
+
+        for (;; slot = (slot + 1) & (table_size - 1)) {
+            if (_table[slot] == 0) {
+                _table[slot] = i + 1;
+                break;
+            }
 
-        if (mb_starts_with(line, key.c_str())) {
-            // Strip newline
-            if (line[read - 1] == '\n') {
-                line[read - 1] = '\0';
-                --read;
+            // The first occurrence of a key wins
+            const Entry &other = _entries[_table[slot] - 1];
+            if (other.key_size == entry.key_size
+                    && memcmp(data + other.key_offset, data + entry.key_offset,
+                              entry.key_size) == 0) {
+                break;
             }
+        }
+    }
+}
 
-            out->assign(equals + 1);
+/*!
+ * \brief Find property
+ *
+ * \param[in] key Key to look up
+ * \param[in] key_size Size of \p key
+ * \param[out] value Pointer to value in the snapshot (not NULL-terminated)
+ * \param[out] value_size Size of value
+ *
+ * \return Whether the property exists. If there are multiple properties with
+ *         the same key, the first one is returned.
+ */
+bool PropertiesSnapshot::find(const char *key, size_t key_size,
+                              const char **value, size_t *value_size) const
+{
+    const char *data = _buf.data();
+    size_t mask = _table.size() - 1;
+
+    for (size_t slot = hash_key(key, key_size) & mask; _table[slot] != 0;
+            slot = (slot + 1) & mask) {
+        const Entry &entry = _entries[_table[slot] - 1];
+        if (entry.key_size == key_size
+                && memcmp(data + entry.key_offset, key, key_size) == 0) {
+            *value = data + entry.value_offset;
+            *value_size = entry.value_size;
             return true;
         }
     }
 
-    *out = default_value;
-    return true;
+    return false;
 }
 
-bool file_get_all_properties(const std::string &path,
-                             std::unordered_map<std::string, std::string> *map)
+bool PropertiesSnapshot::get(const std::string &key, std::string *out) const
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "r"));
-    if (!fp) {
+    const char *value;
+    size_t value_size;
+
+    if (!find(key.data(), key.size(), &value, &value_size)) {
         return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read;
+    out->assign(value, value_size);
+    return true;
+}
 
-    auto free_line = finally([&] {
-        free(line);
-    });
+/*!
+ * \brief Get all properties
+ *
+ * If there are multiple properties with the same key, the last one is used.
+ */
+void PropertiesSnapshot::get_all(
+        std::unordered_map<std::string, std::string> *map) const
+{
+    const char *data = _buf.data();
+    std::unordered_map<std::string, std::string> temp_map;
 
-    std::unordered_map<std::string, std::string> tempMap;
+    temp_map.reserve(_entries.size());
 
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
-        if (line[0] == '\0' || line[0] == '#') {
-            // Skip empty and comment lines
-            continue;
+    for (const Entry &entry : _entries) {
+        temp_map[std::string(data + entry.key_offset, entry.key_size)].assign(
+                data + entry.value_offset, entry.value_size);
+    }
+
+    map->swap(temp_map);
+}
+
+size_t PropertiesSnapshot::size() const
+{
+    return _entries.size();
+}
+
+dev_t PropertiesSnapshot::dev() const
+{
+    return _dev;
+}
+
+ino_t PropertiesSnapshot::ino() const
+{
+    return _ino;
+}
+
+off_t PropertiesSnapshot::file_size() const
+{
+    return _size;
+}
+
+const struct timespec & PropertiesSnapshot::mtime() const
+{
+    return _mtime;
+}
+
+/*!
+ * \brief Get snapshot of a property file
+ *
+ * Snapshots are cached per path. A cached snapshot is reused as long as the
+ * file's device, inode, size, and modification time have not changed.
+ *
+ * \return Snapshot or nullptr if the file could not be read (with errno set)
+ */
+std::shared_ptr<const PropertiesSnapshot>
+file_get_properties_snapshot(const std::string &path)
+{
+    struct stat sb;
+
+    if (stat(path.c_str(), &sb) < 0) {
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(props_cache_lock);
+
+        auto it = props_cache.find(path);
+        if (it != props_cache.end()) {
+            auto const &snapshot = it->second;
+            if (snapshot->dev() == sb.st_dev
+                    && snapshot->ino() == sb.st_ino
+                    && snapshot->file_size() == sb.st_size
+                    && snapshot->mtime().tv_sec == sb.st_mtim.tv_sec
+                    && snapshot->mtime().tv_nsec == sb.st_mtim.tv_nsec) {
+                return snapshot;
+            }
         }
+    }
 
-        char *equals = strchr(line, '=');
-        if (!equals) {
-            // No equals in line
-            continue;
+    auto snapshot = PropertiesSnapshot::load(path);
+    if (!snapshot) {
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(props_cache_lock);
+
+        if (props_cache.size() >= MAX_CACHED_PROPERTY_FILES) {
+            props_cache.clear();
         }
+        props_cache[path] = snapshot;
+    }
+
+    return snapshot;
+}
 
-        // Strip newline
-        if (line[read - 1] == '\n') {
-            line[read - 1] = '\0';
-            --read;
+/*!
+ * \brief Drop all cached property file snapshots
+ */
+void file_clear_properties_cache()
+{
+    std::lock_guard<std::mutex> lock(props_cache_lock);
+    props_cache.clear();
+}
+
+bool file_get_property(const std::string &path,
+                       const std::string &key,
+                       std::string *out,
+                       const std::string &default_value)
+{
+    auto snapshot = file_get_properties_snapshot(path);
+    if (!snapshot) {
+        return false;
+    }
+
+    if (!snapshot->get(key, out)) {
+        *out = default_value;
+    }
+    return true;
+}
+
+/*!
+ * \brief Get multiple properties from a property file
+ *
+ * \param[in] path Property file
+ * \param[in] keys Keys to look up
+ * \param[out] out Values corresponding to each key in \p keys
+ * \param[in] default_value Value to use for keys that don't exist
+ *
+ * \return Whether the property file could be read
+ */
+bool file_get_properties(const std::string &path,
+                         const std::vector<std::string> &keys,
+                         std::vector<std::string> *out,
+                         const std::string &default_value)
+{
+    auto snapshot = file_get_properties_snapshot(path);
+    if (!snapshot) {
+        return false;
+    }
+
+    std::vector<std::string> values(keys.size());
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!snapshot->get(keys[i], &values[i])) {
+            values[i] = default_value;
         }
+    }
 
-        *equals = '\0';
-        tempMap[line] = equals + 1;
+    out->swap(values);
+    return true;
+}
+
+bool file_get_all_properties(const std::string &path,
+                             std::unordered_map<std::string, std::string> *map)
+{
+    auto snapshot = file_get_properties_snapshot(path);
+    if (!snapshot) {
+        return false;
     }
 
-    map->swap(tempMap);
+    snapshot->get_all(map);
     return true;
 }
 
 bool file_write_properties(const std::string &path,
                            const std::unordered_map<std::string, std::string> &map)
 {
+    {
+        std::lock_guard<std::mutex> lock(props_cache_lock);
+        props_cache.erase(path);
+    }
+
     autoclose::file fp(autoclose::fopen(path.c_str(), "wb"));
     if (!fp) {
         return false;
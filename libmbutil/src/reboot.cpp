@@ -102,6 +102,9 @@ bool reboot_via_syscall(const char *reboot_arg)
     // Reboot to system if arg is null
     int reason = reboot_arg ? ANDROID_RB_RESTART2 : ANDROID_RB_RESTART;
 
+    // Nothing buffered will survive the reboot
+    log::log_flush();
+
     if (android_reboot(reason, reboot_arg) < 0) {
         LOGE("Failed to reboot via syscall: %s", strerror(errno));
         return false;
@@ -122,6 +125,8 @@ bool shutdown_via_init()
 
 bool shutdown_via_syscall()
 {
+    log::log_flush();
+
     if (android_reboot(ANDROID_RB_POWEROFF, nullptr) < 0) {
         LOGE("Failed to shut down via syscall: %s", strerror(errno));
         return false;
@@ -18,20 +18,31 @@
  */
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <cerrno>
 #include <cstdarg>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
 #include <jni.h>
 
+#include <openssl/sha.h>
+
 #include "mbcommon/common.h"
 
 #include "mbbootimg/entry.h"
+#include "mbbootimg/format/android_defs.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
 
@@ -241,57 +252,242 @@ static la_ssize_t laBootImgReadCb(archive *a, void *userdata,
     return static_cast<la_ssize_t>(bytesRead);
 }
 
-JNIEXPORT jstring JNICALL
-CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
+/*
+ * Cache of boot image lookups
+ *
+ * The app calls getBootImageRomId() and bootImagesEqual() for every ROM in its
+ * list, usually on files that have not changed since the last call (eg. the
+ * saved boot images in /data/media/0/MultiBoot/<rom>/). To avoid decompressing
+ * the same ramdisks over and over, the results are cached for the lifetime of
+ * the process. A cached result is only used if the file's identity still
+ * matches: device, inode, size, modification time, and the ID field (usually a
+ * SHA1 digest of the contents) of the Android header, if there is one.
+ */
+
+// Offset of the id field in the Android boot image header
+#define ANDROID_HEADER_ID_OFFSET \
+    (ANDROID_BOOT_MAGIC_SIZE + 10 * sizeof(uint32_t) \
+        + ANDROID_BOOT_NAME_SIZE + ANDROID_BOOT_ARGS_SIZE)
+#define ANDROID_HEADER_ID_SIZE  (8 * sizeof(uint32_t))
+
+// Clear the cache if it ever gets this large
+#define MAX_CACHED_BOOT_IMAGES  64
+
+struct BootImageIdentity
 {
-    (void) clazz;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    bool has_id;
+    unsigned char id[ANDROID_HEADER_ID_SIZE];
+};
 
-    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
-    MbBiHeader *header;
-    MbBiEntry *entry;
-    ScopedArchive a(archive_read_new(), &archive_read_free);
-    archive_entry *aEntry;
-    LaBootImgCtx ctx;
-    int ret;
-    const char *filename;
-    jstring romId = nullptr;
+struct BootImageEntrySummary
+{
+    int type;
+    uint64_t size;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+};
 
-    filename = env->GetStringUTFChars(jfilename, nullptr);
-    if (!filename) {
-        goto done;
+struct BootImageSummary
+{
+    std::shared_ptr<MbBiHeader> header;
+    std::vector<BootImageEntrySummary> entries;
+};
+
+struct BootImageCacheEntry
+{
+    BootImageIdentity identity;
+
+    bool has_rom_id = false;
+    bool rom_id_found;
+    std::string rom_id;
+
+    bool has_summary = false;
+    BootImageSummary summary;
+};
+
+static std::mutex g_cache_lock;
+static std::unordered_map<std::string, BootImageCacheEntry> g_cache;
+
+static bool identitiesEqual(const BootImageIdentity &a,
+                            const BootImageIdentity &b)
+{
+    return a.dev == b.dev
+            && a.ino == b.ino
+            && a.size == b.size
+            && a.mtime_sec == b.mtime_sec
+            && a.mtime_nsec == b.mtime_nsec
+            && a.has_id == b.has_id
+            && (!a.has_id || memcmp(a.id, b.id, sizeof(a.id)) == 0);
+}
+
+static bool getBootImageIdentity(JNIEnv *env, const char *filename,
+                                 BootImageIdentity *identity)
+{
+    unsigned char buf[ANDROID_MAX_HEADER_OFFSET + ANDROID_HEADER_ID_OFFSET
+            + ANDROID_HEADER_ID_SIZE];
+    struct stat sb;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_exception(env, IOException, "%s: Failed to open: %s",
+                        filename, strerror(errno));
+        return false;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        throw_exception(env, IOException, "%s: Failed to stat: %s",
+                        filename, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    do {
+        n = pread(fd, buf, sizeof(buf), 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        throw_exception(env, IOException, "%s: Failed to read: %s",
+                        filename, strerror(errno));
+        close(fd);
+        return false;
     }
 
+    close(fd);
+
+    memset(identity, 0, sizeof(*identity));
+    identity->dev = sb.st_dev;
+    identity->ino = sb.st_ino;
+    identity->size = sb.st_size;
+    identity->mtime_sec = sb.st_mtim.tv_sec;
+    identity->mtime_nsec = sb.st_mtim.tv_nsec;
+
+    // Same search as the Android format reader
+    for (size_t offset = 0; offset <= ANDROID_MAX_HEADER_OFFSET; ++offset) {
+        if (offset + ANDROID_HEADER_ID_OFFSET + ANDROID_HEADER_ID_SIZE
+                > static_cast<size_t>(n)) {
+            break;
+        }
+
+        if (memcmp(buf + offset, ANDROID_BOOT_MAGIC,
+                   ANDROID_BOOT_MAGIC_SIZE) == 0) {
+            identity->has_id = true;
+            memcpy(identity->id, buf + offset + ANDROID_HEADER_ID_OFFSET,
+                   ANDROID_HEADER_ID_SIZE);
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Look up cached entry for a boot image
+ *
+ * \note Must be called with g_cache_lock held
+ *
+ * \return Cache entry if \p identity matches the cached entry. Otherwise, the
+ *         cached entry is reset and returned.
+ */
+static BootImageCacheEntry * getCacheEntry(const std::string &path,
+                                           const BootImageIdentity &identity)
+{
+    auto it = g_cache.find(path);
+    if (it != g_cache.end()) {
+        if (identitiesEqual(it->second.identity, identity)) {
+            return &it->second;
+        }
+        g_cache.erase(it);
+    }
+
+    if (g_cache.size() >= MAX_CACHED_BOOT_IMAGES) {
+        g_cache.clear();
+    }
+
+    BootImageCacheEntry &entry = g_cache[path];
+    entry.identity = identity;
+    return &entry;
+}
+
+static ScopedReader openBootImage(JNIEnv *env, const char *filename,
+                                  MbBiHeader **header)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    int ret;
+
     if (!bir) {
         throw_exception(env, IOException, "Failed to allocate MbBiReader");
-        goto done;
-    } else if (!a) {
-        throw_exception(env, IOException, "Failed to allocate archive");
-        goto done;
+        return bir;
     }
 
-    // Open input boot image
     ret = mb_bi_reader_enable_format_all(bir.get());
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "Failed to enable all boot image formats: %s",
                         mb_bi_reader_error_string(bir.get()));
-        goto done;
+        bir.reset();
+        return bir;
     }
+
     ret = mb_bi_reader_open_filename(bir.get(), filename);
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to open boot image for reading: %s",
                         filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        bir.reset();
+        return bir;
     }
 
-    // Read header
-    ret = mb_bi_reader_read_header(bir.get(), &header);
+    ret = mb_bi_reader_read_header(bir.get(), header);
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to read header: %s",
                         filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        bir.reset();
+        return bir;
+    }
+
+    return bir;
+}
+
+/*!
+ * \brief Find the ROM ID stored in the ramdisk
+ *
+ * The ramdisk is only decompressed up to the end of the romid entry. The data
+ * of every other cpio entry is skipped without being copied out.
+ *
+ * \param[in] env JNI environment
+ * \param[in] filename Boot image path
+ * \param[out] found Whether the ramdisk contains a romid file
+ * \param[out] rom_id ROM ID if \p found is true
+ *
+ * \return Whether the ramdisk was successfully read. If false, an exception
+ *         was thrown.
+ */
+static bool findRomId(JNIEnv *env, const char *filename, bool *found,
+                      std::string *rom_id)
+{
+    ScopedArchive a(archive_read_new(), &archive_read_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    archive_entry *aEntry;
+    LaBootImgCtx ctx;
+    int ret;
+
+    if (!a) {
+        throw_exception(env, IOException, "Failed to allocate archive");
+        return false;
+    }
+
+    // Open input boot image
+    ScopedReader bir = openBootImage(env, filename, &header);
+    if (!bir) {
+        return false;
     }
 
     // Go to ramdisk
@@ -299,12 +495,12 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
     if (ret == MB_BI_EOF) {
         throw_exception(env, IOException,
                         "%s: Boot image is missing ramdisk", filename);
-        goto done;
+        return false;
     } else if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to find ramdisk entry: %s",
                         filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        return false;
     }
 
     // Enable support for common ramdisk formats
@@ -322,7 +518,7 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
         throw_exception(env, IOException,
                         "%s: Failed to open ramdisk: %s",
                         filename, archive_error_string(a.get()));
-        goto done;
+        return false;
     }
 
     while ((ret = archive_read_next_header(a.get(), &aEntry)) == ARCHIVE_OK) {
@@ -330,52 +526,115 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
         if (!path) {
             throw_exception(env, IOException,
                             "%s: Ramdisk entry has no path", filename);
-            goto done;
+            return false;
         }
 
-        if (strcmp(path, "romid") == 0) {
-            char buf[32];
-            char dummy;
-            la_ssize_t n_read;
-
-            n_read = archive_read_data(a.get(), buf, sizeof(buf) - 1);
-            if (n_read < 0) {
+        if (strcmp(path, "romid") != 0) {
+            // Discard the data instead of letting the next
+            // archive_read_next_header() call buffer it
+            if (archive_read_data_skip(a.get()) != ARCHIVE_OK) {
                 throw_exception(env, IOException,
-                                "%s: Failed to read ramdisk entry: %s",
+                                "%s: Failed to skip ramdisk entry: %s",
                                 filename, archive_error_string(a.get()));
-                goto done;
+                return false;
             }
+            continue;
+        }
 
-            // NULL-terminate
-            buf[n_read] = '\0';
+        char buf[32];
+        char dummy;
+        la_ssize_t n_read;
 
-            // Ensure that EOF is reached
-            n_read = archive_read_data(a.get(), &dummy, 1);
-            if (n_read != 0) {
-                throw_exception(env, IOException,
-                                "%s: /romid in ramdisk is too large",
-                                filename);
-                goto done;
-            }
+        n_read = archive_read_data(a.get(), buf, sizeof(buf) - 1);
+        if (n_read < 0) {
+            throw_exception(env, IOException,
+                            "%s: Failed to read ramdisk entry: %s",
+                            filename, archive_error_string(a.get()));
+            return false;
+        }
 
-            romId = env->NewStringUTF(buf);
-            goto done;
+        // NULL-terminate
+        buf[n_read] = '\0';
+
+        // Ensure that EOF is reached
+        n_read = archive_read_data(a.get(), &dummy, 1);
+        if (n_read != 0) {
+            throw_exception(env, IOException,
+                            "%s: /romid in ramdisk is too large",
+                            filename);
+            return false;
         }
+
+        // Stop here. The rest of the ramdisk is never decompressed.
+        *found = true;
+        *rom_id = buf;
+        return true;
     }
 
     if (ret != ARCHIVE_EOF) {
         throw_exception(env, IOException,
                         "%s: Failed to read ramdisk entry header: %s",
                         filename, archive_error_string(a.get()));
+        return false;
+    }
+
+    *found = false;
+    rom_id->clear();
+    return true;
+}
+
+JNIEXPORT jstring JNICALL
+CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
+{
+    (void) clazz;
+
+    const char *filename;
+    BootImageIdentity identity;
+    bool found;
+    std::string romId;
+    jstring result = nullptr;
+
+    filename = env->GetStringUTFChars(jfilename, nullptr);
+    if (!filename) {
+        return nullptr;
+    }
+
+    if (!getBootImageIdentity(env, filename, &identity)) {
         goto done;
     }
 
-done:
-    if (filename) {
-        env->ReleaseStringUTFChars(jfilename, filename);
+    {
+        std::lock_guard<std::mutex> lock(g_cache_lock);
+        BootImageCacheEntry *cached = getCacheEntry(filename, identity);
+        if (cached->has_rom_id) {
+            if (cached->rom_id_found) {
+                result = env->NewStringUTF(cached->rom_id.c_str());
+            }
+            goto done;
+        }
+    }
+
+    // Don't hold the lock while reading the boot image
+    if (!findRomId(env, filename, &found, &romId)) {
+        goto done;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_cache_lock);
+        BootImageCacheEntry *cached = getCacheEntry(filename, identity);
+        cached->has_rom_id = true;
+        cached->rom_id_found = found;
+        cached->rom_id = romId;
     }
 
-    return romId;
+    if (found) {
+        result = env->NewStringUTF(romId.c_str());
+    }
+
+done:
+    env->ReleaseStringUTFChars(jfilename, filename);
+
+    return result;
 }
 
 static bool bootImgHeadersEqual(MbBiHeader *header1, MbBiHeader *header2)
@@ -483,22 +742,191 @@ static bool bootImgHeadersEqual(MbBiHeader *header1, MbBiHeader *header2)
 #undef CHECK_STRING_VALUES
 }
 
+enum class SummaryResult
+{
+    Complete,
+    Mismatch,
+    Error,
+};
+
+static const BootImageEntrySummary *
+findEntrySummary(const BootImageSummary &summary, int type)
+{
+    for (const BootImageEntrySummary &entry : summary.entries) {
+        if (entry.type == type) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+/*!
+ * \brief Read the header fields and the digest of each entry of a boot image
+ *
+ * If \p reference is not null, reading stops as soon as the boot image is
+ * known to differ from \p reference. This happens before any data is read if
+ * the headers or the entry sizes differ.
+ *
+ * \param[in] env JNI environment
+ * \param[in] filename Boot image path
+ * \param[in] reference Summary to compare against (may be null)
+ * \param[out] summary Summary of the boot image. Only valid if
+ *                     SummaryResult::Complete is returned.
+ *
+ * \return
+ *   * SummaryResult::Complete if the entire boot image was read and, if
+ *     \p reference is not null, it matches \p reference
+ *   * SummaryResult::Mismatch if the boot image differs from \p reference
+ *   * SummaryResult::Error if an exception was thrown
+ */
+static SummaryResult readBootImageSummary(JNIEnv *env, const char *filename,
+                                          const BootImageSummary *reference,
+                                          BootImageSummary *summary)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    ScopedReader bir = openBootImage(env, filename, &header);
+    if (!bir) {
+        return SummaryResult::Error;
+    }
+
+    if (reference && !bootImgHeadersEqual(reference->header.get(), header)) {
+        return SummaryResult::Mismatch;
+    }
+
+    summary->header.reset(mb_bi_header_clone(header), &mb_bi_header_free);
+    if (!summary->header) {
+        throw_exception(env, OutOfMemoryError, "Out of memory");
+        return SummaryResult::Error;
+    }
+    summary->entries.clear();
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        BootImageEntrySummary entrySummary;
+        const BootImageEntrySummary *refEntry = nullptr;
+        SHA_CTX shaCtx;
+        char buf[10240];
+        size_t n;
+
+        entrySummary.type = mb_bi_entry_type(entry);
+        entrySummary.size = 0;
+
+        if (reference) {
+            refEntry = findEntrySummary(*reference, entrySummary.type);
+            if (!refEntry) {
+                // Cannot be equal if entry is missing
+                return SummaryResult::Mismatch;
+            }
+
+            if (mb_bi_entry_size_is_set(entry)
+                    && mb_bi_entry_size(entry) != refEntry->size) {
+                return SummaryResult::Mismatch;
+            }
+        }
+
+        SHA1_Init(&shaCtx);
+
+        while ((ret = mb_bi_reader_read_data(
+                bir.get(), buf, sizeof(buf), &n)) == MB_BI_OK) {
+            SHA1_Update(&shaCtx, buf, n);
+            entrySummary.size += n;
+        }
+
+        if (ret != MB_BI_EOF) {
+            throw_exception(env, IOException,
+                            "%s: Failed to read data: %s", filename,
+                            mb_bi_reader_error_string(bir.get()));
+            return SummaryResult::Error;
+        }
+
+        SHA1_Final(entrySummary.digest, &shaCtx);
+
+        if (refEntry && (entrySummary.size != refEntry->size
+                || memcmp(entrySummary.digest, refEntry->digest,
+                          sizeof(entrySummary.digest)) != 0)) {
+            // Data is not equivalent
+            return SummaryResult::Mismatch;
+        }
+
+        summary->entries.push_back(entrySummary);
+    }
+
+    if (ret != MB_BI_EOF) {
+        throw_exception(env, IOException,
+                        "%s: Failed to read entry: %s",
+                        filename, mb_bi_reader_error_string(bir.get()));
+        return SummaryResult::Error;
+    }
+
+    if (reference && reference->entries.size() != summary->entries.size()) {
+        // Too few entries in second image
+        return SummaryResult::Mismatch;
+    }
+
+    return SummaryResult::Complete;
+}
+
+static bool getCachedSummary(const char *filename,
+                             const BootImageIdentity &identity,
+                             BootImageSummary *summary)
+{
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+    BootImageCacheEntry *cached = getCacheEntry(filename, identity);
+    if (cached->has_summary) {
+        *summary = cached->summary;
+        return true;
+    }
+    return false;
+}
+
+static void putCachedSummary(const char *filename,
+                             const BootImageIdentity &identity,
+                             const BootImageSummary &summary)
+{
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+    BootImageCacheEntry *cached = getCacheEntry(filename, identity);
+    cached->has_summary = true;
+    cached->summary = summary;
+}
+
+static bool summariesEqual(const BootImageSummary &summary1,
+                           const BootImageSummary &summary2)
+{
+    if (!bootImgHeadersEqual(summary1.header.get(), summary2.header.get())
+            || summary1.entries.size() != summary2.entries.size()) {
+        return false;
+    }
+
+    for (const BootImageEntrySummary &entry2 : summary2.entries) {
+        const BootImageEntrySummary *entry1 =
+                findEntrySummary(summary1, entry2.type);
+        if (!entry1 || entry1->size != entry2.size
+                || memcmp(entry1->digest, entry2.digest,
+                          sizeof(entry1->digest)) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 JNIEXPORT jboolean JNICALL
 CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
                               jstring jfilename2)
 {
     (void) clazz;
 
-    ScopedReader bir1(mb_bi_reader_new(), &mb_bi_reader_free);
-    ScopedReader bir2(mb_bi_reader_new(), &mb_bi_reader_free);
-    MbBiHeader *header1;
-    MbBiHeader *header2;
-    MbBiEntry *entry1;
-    MbBiEntry *entry2;
-    size_t entries = 0;
-    int ret;
     const char *filename1 = nullptr;
     const char *filename2 = nullptr;
+    BootImageIdentity identity1;
+    BootImageIdentity identity2;
+    BootImageSummary summary1;
+    BootImageSummary summary2;
+    bool cached1;
+    bool cached2;
+    SummaryResult ret;
     jboolean result = false;
 
     filename1 = env->GetStringUTFChars(jfilename1, nullptr);
@@ -510,142 +938,43 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
         goto done;
     }
 
-    if (!bir1 || !bir2) {
-        throw_exception(env, IOException,
-                        "Failed to allocate MbBiReader instances");
+    if (!getBootImageIdentity(env, filename1, &identity1)
+            || !getBootImageIdentity(env, filename2, &identity2)) {
         goto done;
     }
 
-    // Set up reader formats
-    ret = mb_bi_reader_enable_format_all(bir1.get());
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_enable_format_all(bir2.get());
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir2.get()));
-        goto done;
-    }
+    cached1 = getCachedSummary(filename1, identity1, &summary1);
+    cached2 = getCachedSummary(filename2, identity2, &summary2);
 
-    // Open boot images
-    ret = mb_bi_reader_open_filename(bir1.get(), filename1);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open boot image for reading: %s",
-                        filename1, mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_open_filename(bir2.get(), filename2);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open boot image for reading: %s",
-                        filename2, mb_bi_reader_error_string(bir2.get()));
+    if (cached1 && cached2) {
+        result = summariesEqual(summary1, summary2);
         goto done;
     }
 
-    // Read headers
-    ret = mb_bi_reader_read_header(bir1.get(), &header1);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read header: %s",
-                        filename1, mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_read_header(bir2.get(), &header2);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read header: %s",
-                        filename1, mb_bi_reader_error_string(bir2.get()));
-        goto done;
-    }
-
-    // Compare headers
-    if (!bootImgHeadersEqual(header1, header2)) {
-        goto done;
-    }
-
-    // Count entries in first boot image
-    {
-        while ((ret = mb_bi_reader_read_entry(bir1.get(), &entry1))
-                == MB_BI_OK) {
-            ++entries;
-        }
-
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename1, mb_bi_reader_error_string(bir1.get()));
+    // Fully read one of the images so that the other can be compared against
+    // it while it is being read
+    if (!cached1 && !cached2) {
+        ret = readBootImageSummary(env, filename1, nullptr, &summary1);
+        if (ret != SummaryResult::Complete) {
             goto done;
         }
+        putCachedSummary(filename1, identity1, summary1);
+        cached1 = true;
     }
 
-    // Compare each entry in second image to first
-    {
-        while ((ret = mb_bi_reader_read_entry(bir2.get(), &entry2))
-                == MB_BI_OK) {
-            if (entries == 0) {
-                // Too few entries in second image
-                goto done;
-            }
-            --entries;
-
-            // Find the same entry in first image
-            ret = mb_bi_reader_go_to_entry(bir1.get(), &entry1,
-                                           mb_bi_entry_type(entry2));
-            if (ret == MB_BI_EOF) {
-                // Cannot be equal if entry is missing
-                goto done;
-            } else if (ret != MB_BI_OK) {
-                throw_exception(env, IOException,
-                                "%s: Failed to seek to entry: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
-
-            // Compare data
-            char buf1[10240];
-            char buf2[10240];
-            size_t n1;
-            size_t n2;
-
-            while ((ret = mb_bi_reader_read_data(
-                    bir1.get(), buf1, sizeof(buf1), &n1)) == MB_BI_OK) {
-                ret = mb_bi_reader_read_data(bir2.get(), buf2, n1, &n2);
-                if (ret != MB_BI_OK) {
-                    throw_exception(env, IOException,
-                                    "%s: Failed to read data: %s", filename2,
-                                    mb_bi_reader_error_string(bir2.get()));
-                    goto done;
-                }
-
-                if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
-                    // Data is not equivalent
-                    goto done;
-                }
-            }
-
-            if (ret != MB_BI_EOF) {
-                throw_exception(env, IOException,
-                                "%s: Failed to read data: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
+    if (cached1) {
+        ret = readBootImageSummary(env, filename2, &summary1, &summary2);
+        if (ret == SummaryResult::Complete) {
+            putCachedSummary(filename2, identity2, summary2);
         }
-
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename2, mb_bi_reader_error_string(bir2.get()));
-            goto done;
+    } else {
+        ret = readBootImageSummary(env, filename1, &summary2, &summary1);
+        if (ret == SummaryResult::Complete) {
+            putCachedSummary(filename1, identity1, summary1);
         }
     }
 
-    result = true;
+    result = ret == SummaryResult::Complete;
 
 done:
     if (filename1) {
@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks for the minuitwrp raster kernels.
+//
+// Before anything is timed, every implementation supported by the CPU is
+// checked against the portable implementation with random data, span lengths
+// and alignments. The kernels are then timed over a full frame, one row at a
+// time, like graphics.cpp calls them. The "frame" case approximates drawing a
+// typical page: a background fill, a translucent overlay, icons, and text.
+//
+// The results are written as JSON with a fixed key order so that the output
+// of two runs can be diffed directly.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include "raster/raster.h"
+
+#define BENCHMARK_SCHEMA_VERSION    1
+
+#define MAX_IMPLS                   8
+
+// Layout of the synthetic page for the "frame" case
+#define FRAME_ICON_SIZE             96
+#define FRAME_ICON_COUNT            24
+#define FRAME_TEXT_LINES            20
+#define FRAME_TEXT_HEIGHT           40
+
+struct Frame
+{
+    size_t width;
+    size_t height;
+    std::vector<uint32_t> fb32;
+    std::vector<uint16_t> fb16;
+    // Source image and coverage mask with the same size as the frame
+    std::vector<uint32_t> image;
+    std::vector<uint8_t> mask;
+};
+
+struct Result
+{
+    const char *impl;
+    std::string kernel;
+    double best_ms;
+    double mean_ms;
+    double mpixels_per_sec;
+};
+
+typedef std::function<void(const RasterOps *, Frame &)> KernelFn;
+
+struct Kernel
+{
+    const char *name;
+    KernelFn fn;
+};
+
+static void fill_random(void *buf, size_t size, std::mt19937 &rng)
+{
+    unsigned char *p = static_cast<unsigned char *>(buf);
+    for (size_t i = 0; i < size; ++i) {
+        p[i] = static_cast<unsigned char>(rng());
+    }
+}
+
+// Make the alpha channels and mask values interesting. Fully transparent and
+// fully opaque pixels are common in real images and take different paths in
+// some kernels.
+static void shape_alpha(std::vector<uint32_t> &image,
+                        std::vector<uint8_t> &mask, std::mt19937 &rng)
+{
+    for (uint32_t &px : image) {
+        switch (rng() % 4) {
+        case 0:
+            px &= 0x00ffffffu;
+            break;
+        case 1:
+            px |= 0xff000000u;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < mask.size(); ) {
+        // Runs of empty coverage, like the gaps between glyphs
+        size_t run = rng() % 24;
+        uint8_t value = rng() % 2 ? 0 : static_cast<uint8_t>(rng());
+        for (size_t j = 0; j < run && i < mask.size(); ++j, ++i) {
+            mask[i] = value ? static_cast<uint8_t>(rng()) : 0;
+        }
+    }
+}
+
+static std::vector<Kernel> get_kernels()
+{
+    std::vector<Kernel> kernels;
+
+    auto for_each_row = [](Frame &f, const std::function<void(size_t)> &row) {
+        for (size_t y = 0; y < f.height; ++y) {
+            row(y);
+        }
+    };
+
+    kernels.push_back({"fill_32", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->fill_32(&f.fb32[y * f.width], 0xff336699u, f.width);
+        });
+    }});
+    kernels.push_back({"blend_fill_32", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_fill_32(&f.fb32[y * f.width], 0x80336699u, f.width);
+        });
+    }});
+    kernels.push_back({"copy_32", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->copy_32(&f.fb32[y * f.width], &f.image[y * f.width],
+                         f.width, false);
+        });
+    }});
+    kernels.push_back({"copy_32_swap_rb", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->copy_32(&f.fb32[y * f.width], &f.image[y * f.width],
+                         f.width, true);
+        });
+    }});
+    kernels.push_back({"blend_32", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_32(&f.fb32[y * f.width], &f.image[y * f.width],
+                          f.width, false);
+        });
+    }});
+    kernels.push_back({"blend_32_swap_rb", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_32(&f.fb32[y * f.width], &f.image[y * f.width],
+                          f.width, true);
+        });
+    }});
+    kernels.push_back({"blend_mask_32", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_mask_32(&f.fb32[y * f.width], &f.mask[y * f.width],
+                               0xffe0e0e0u, f.width);
+        });
+    }});
+    kernels.push_back({"fill_16", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->fill_16(&f.fb16[y * f.width], 0x3333, f.width);
+        });
+    }});
+    kernels.push_back({"blend_fill_16", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_fill_16(&f.fb16[y * f.width], 0x80336699u, f.width);
+        });
+    }});
+    kernels.push_back({"copy_32_to_16", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->copy_32_to_16(&f.fb16[y * f.width], &f.image[y * f.width],
+                               f.width, false);
+        });
+    }});
+    kernels.push_back({"blend_32_to_16", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_32_to_16(&f.fb16[y * f.width], &f.image[y * f.width],
+                                f.width, false);
+        });
+    }});
+    kernels.push_back({"blend_mask_16", [=](const RasterOps *ops, Frame &f) {
+        for_each_row(f, [&](size_t y) {
+            ops->blend_mask_16(&f.fb16[y * f.width], &f.mask[y * f.width],
+                               0xffe0e0e0u, f.width);
+        });
+    }});
+
+    kernels.push_back({"frame", [](const RasterOps *ops, Frame &f) {
+        // Background
+        for (size_t y = 0; y < f.height; ++y) {
+            ops->fill_32(&f.fb32[y * f.width], 0xff202020u, f.width);
+        }
+
+        // Translucent header covering the top eighth of the screen
+        for (size_t y = 0; y < f.height / 8; ++y) {
+            ops->blend_fill_32(&f.fb32[y * f.width], 0xc0404040u, f.width);
+        }
+
+        // Grid of icons with alpha
+        size_t icon_w = std::min<size_t>(FRAME_ICON_SIZE, f.width);
+        size_t icon_h = std::min<size_t>(FRAME_ICON_SIZE, f.height);
+        size_t per_row = std::max<size_t>(f.width / icon_w, 1);
+        for (size_t i = 0; i < FRAME_ICON_COUNT; ++i) {
+            size_t x = (i % per_row) * icon_w;
+            size_t y = f.height / 8 + (i / per_row) * icon_h;
+            for (size_t row = 0; row < icon_h && y + row < f.height; ++row) {
+                ops->blend_32(&f.fb32[(y + row) * f.width + x],
+                              &f.image[row * f.width], icon_w, false);
+            }
+        }
+
+        // Lines of text over 60% of the width in the bottom half
+        size_t text_w = f.width * 3 / 5;
+        for (size_t line = 0; line < FRAME_TEXT_LINES; ++line) {
+            size_t y = f.height / 2 + line * FRAME_TEXT_HEIGHT;
+            for (size_t row = 0; row < FRAME_TEXT_HEIGHT
+                    && y + row < f.height; ++row) {
+                ops->blend_mask_32(&f.fb32[(y + row) * f.width],
+                                   &f.mask[(line * FRAME_TEXT_HEIGHT + row)
+                                           % f.height * f.width],
+                                   0xffffffffu, text_w);
+            }
+        }
+    }});
+
+    return kernels;
+}
+
+// Compare every kernel of an implementation against the portable kernels.
+// Spans of every length up to 67 pixels (to cover the vector tails) and
+// unaligned starting points are tested.
+static bool verify(const RasterOps *ref, const RasterOps *ops)
+{
+    std::mt19937 rng(1234);
+    const size_t max_len = 67;
+    const size_t pad = 8;
+
+    std::vector<uint32_t> src(max_len + pad);
+    std::vector<uint8_t> mask(max_len + pad);
+    std::vector<uint32_t> dst32(max_len + pad);
+    std::vector<uint16_t> dst16(max_len + pad);
+    std::vector<uint32_t> a32, b32;
+    std::vector<uint16_t> a16, b16;
+
+    for (int round = 0; round < 64; ++round) {
+        fill_random(src.data(), src.size() * sizeof(src[0]), rng);
+        fill_random(mask.data(), mask.size(), rng);
+        fill_random(dst32.data(), dst32.size() * sizeof(dst32[0]), rng);
+        fill_random(dst16.data(), dst16.size() * sizeof(dst16[0]), rng);
+        shape_alpha(src, mask, rng);
+
+        uint32_t color = static_cast<uint32_t>(rng());
+
+        for (size_t len = 0; len <= max_len; ++len) {
+            size_t off = rng() % pad;
+
+#define CHECK_32(fn, ...) \
+            do { \
+                a32 = dst32; \
+                b32 = dst32; \
+                ref->fn(a32.data() + off, __VA_ARGS__); \
+                ops->fn(b32.data() + off, __VA_ARGS__); \
+                if (a32 != b32) { \
+                    fprintf(stderr, "%s: %s differs from %s (length %zu)\n", \
+                            ops->name, #fn, ref->name, len); \
+                    return false; \
+                } \
+            } while (0)
+
+#define CHECK_16(fn, ...) \
+            do { \
+                a16 = dst16; \
+                b16 = dst16; \
+                ref->fn(a16.data() + off, __VA_ARGS__); \
+                ops->fn(b16.data() + off, __VA_ARGS__); \
+                if (a16 != b16) { \
+                    fprintf(stderr, "%s: %s differs from %s (length %zu)\n", \
+                            ops->name, #fn, ref->name, len); \
+                    return false; \
+                } \
+            } while (0)
+
+            CHECK_32(fill_32, color, len);
+            CHECK_32(blend_fill_32, color, len);
+            CHECK_32(copy_32, src.data() + off, len, false);
+            CHECK_32(copy_32, src.data() + off, len, true);
+            CHECK_32(blend_32, src.data() + off, len, false);
+            CHECK_32(blend_32, src.data() + off, len, true);
+            CHECK_32(blend_mask_32, mask.data() + off, color, len);
+            CHECK_16(fill_16, static_cast<uint16_t>(color), len);
+            CHECK_16(blend_fill_16, color, len);
+            CHECK_16(copy_32_to_16, src.data() + off, len, false);
+            CHECK_16(copy_32_to_16, src.data() + off, len, true);
+            CHECK_16(blend_32_to_16, src.data() + off, len, false);
+            CHECK_16(blend_32_to_16, src.data() + off, len, true);
+            CHECK_16(blend_mask_16, mask.data() + off, color, len);
+
+#undef CHECK_32
+#undef CHECK_16
+        }
+    }
+
+    return true;
+}
+
+static Result measure(const RasterOps *ops, const Kernel &kernel, Frame &frame,
+                      unsigned int iterations)
+{
+    typedef std::chrono::steady_clock clock;
+
+    Result r;
+    r.impl = ops->name;
+    r.kernel = kernel.name;
+    r.best_ms = 0;
+    r.mean_ms = 0;
+
+    // Warm up the caches
+    kernel.fn(ops, frame);
+
+    double total_ms = 0;
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        auto start = clock::now();
+        kernel.fn(ops, frame);
+        auto end = clock::now();
+
+        double ms = std::chrono::duration<double, std::milli>(
+                end - start).count();
+        total_ms += ms;
+        if (i == 0 || ms < r.best_ms) {
+            r.best_ms = ms;
+        }
+    }
+
+    r.mean_ms = total_ms / iterations;
+    r.mpixels_per_sec = r.best_ms > 0
+            ? frame.width * frame.height / (r.best_ms * 1000.0) : 0;
+
+    return r;
+}
+
+static void print_result(FILE *fp, const Result &r, bool last)
+{
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"impl\": \"%s\",\n", r.impl);
+    fprintf(fp, "      \"kernel\": \"%s\",\n", r.kernel.c_str());
+    fprintf(fp, "      \"best_ms\": %.4f,\n", r.best_ms);
+    fprintf(fp, "      \"mean_ms\": %.4f,\n", r.mean_ms);
+    fprintf(fp, "      \"mpixels_per_sec\": %.1f\n", r.mpixels_per_sec);
+    fprintf(fp, "    }%s\n", last ? "" : ",");
+}
+
+static bool parse_size(const char *str, size_t *width, size_t *height)
+{
+    char *end;
+    errno = 0;
+    unsigned long w = strtoul(str, &end, 10);
+    if (errno != 0 || *end != 'x' || w == 0 || w > 16384) {
+        return false;
+    }
+    unsigned long h = strtoul(end + 1, &end, 10);
+    if (errno != 0 || *end != '\0' || h == 0 || h > 16384) {
+        return false;
+    }
+    *width = w;
+    *height = h;
+    return true;
+}
+
+static void benchmark_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: mbbootui_benchmarks [OPTION...]\n"
+            "\n"
+            "Options:\n"
+            "  -s, --size <W>x<H>       Frame size (default: 1080x1920)\n"
+            "  -k, --kernels <list>     Kernels to benchmark (default: all)\n"
+            "  -i, --iterations <n>     Timed iterations per case "
+            "(default: 20)\n"
+            "  -o, --output <file>      Write JSON results to file\n"
+            "  -h, --help               Display this help message\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t width = 1080;
+    size_t height = 1920;
+    std::vector<std::string> kernel_names;
+    unsigned int iterations = 20;
+    const char *output = nullptr;
+
+    int opt;
+
+    static const char *short_options = "s:k:i:o:h";
+
+    static struct option long_options[] = {
+        {"size",       required_argument, 0, 's'},
+        {"kernels",    required_argument, 0, 'k'},
+        {"iterations", required_argument, 0, 'i'},
+        {"output",     required_argument, 0, 'o'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 's':
+            if (!parse_size(optarg, &width, &height)) {
+                fprintf(stderr, "Invalid frame size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'k': {
+            std::string list(optarg);
+            size_t begin = 0;
+            while (begin <= list.size()) {
+                size_t end = list.find(',', begin);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                if (end > begin) {
+                    kernel_names.push_back(list.substr(begin, end - begin));
+                }
+                begin = end + 1;
+            }
+            break;
+        }
+
+        case 'i': {
+            char *end;
+            unsigned long value = strtoul(optarg, &end, 10);
+            if (*end != '\0' || value == 0 || value > 10000) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            iterations = value;
+            break;
+        }
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'h':
+            benchmark_usage(stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            benchmark_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc) {
+        benchmark_usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Kernel> kernels = get_kernels();
+
+    for (const std::string &name : kernel_names) {
+        if (std::find_if(kernels.begin(), kernels.end(),
+                [&](const Kernel &k) { return name == k.name; })
+                == kernels.end()) {
+            fprintf(stderr, "Invalid kernel: %s\n", name.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    const RasterOps *impls[MAX_IMPLS];
+    size_t n_impls = raster_get_all_ops(impls, MAX_IMPLS);
+
+    for (size_t i = 1; i < n_impls; ++i) {
+        fprintf(stderr, "Verifying %s kernels\n", impls[i]->name);
+        if (!verify(impls[0], impls[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::mt19937 rng(5678);
+    Frame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.fb32.resize(width * height);
+    frame.fb16.resize(width * height);
+    frame.image.resize(width * height);
+    frame.mask.resize(width * height);
+    fill_random(frame.image.data(), frame.image.size() * sizeof(uint32_t), rng);
+    fill_random(frame.mask.data(), frame.mask.size(), rng);
+    shape_alpha(frame.image, frame.mask, rng);
+
+    std::vector<Result> results;
+
+    for (size_t i = 0; i < n_impls; ++i) {
+        for (const Kernel &kernel : kernels) {
+            if (!kernel_names.empty()
+                    && std::find(kernel_names.begin(), kernel_names.end(),
+                                 kernel.name) == kernel_names.end()) {
+                continue;
+            }
+
+            fprintf(stderr, "Benchmarking %s %s\n",
+                    impls[i]->name, kernel.name);
+            results.push_back(measure(impls[i], kernel, frame, iterations));
+        }
+    }
+
+    FILE *fp = stdout;
+    if (output) {
+        fp = fopen(output, "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open: %s\n",
+                    output, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schema_version\": %d,\n", BENCHMARK_SCHEMA_VERSION);
+    fprintf(fp, "  \"selected_impl\": \"%s\",\n", raster_get_ops()->name);
+    fprintf(fp, "  \"width\": %zu,\n", width);
+    fprintf(fp, "  \"height\": %zu,\n", height);
+    fprintf(fp, "  \"iterations\": %u,\n", iterations);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        print_result(fp, results[i], i == results.size() - 1);
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    if (fp != stdout && fclose(fp) != 0) {
+        fprintf(stderr, "%s: Failed to close: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -114,6 +114,8 @@ extern const char *tw_resource_path;
 extern const char *tw_settings_path;
 extern const char *tw_screenshots_path;
 extern const char *tw_theme_zip_path;
+// Directory for pre-rasterized glyph atlases (disabled if null or empty)
+extern const char *tw_font_cache_path;
 
 // TODO: Make TW_USE_KEY_CODE_TOUCH_SYNC an option
 
@@ -111,3 +111,9 @@ int GUIAnimation::Update()
     }
     return 0;
 }
+
+bool GUIAnimation::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    GetRenderPos(x, y, w, h);
+    return true;
+}
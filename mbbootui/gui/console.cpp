@@ -300,13 +300,20 @@ int GUIConsole::Update()
 
     if (mUpdate) {
         mUpdate = 0;
-        if (Render() == 0) {
-            return 2;
-        }
+        return 2;
     }
     return 0;
 }
 
+bool GUIConsole::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    // The slideout button is drawn outside of the console area
+    if (mSlideout) {
+        return false;
+    }
+    return GUIScrollList::GetDirtyRect(x, y, w, h);
+}
+
 // IsInRegion - Checks if the request is handled by this object
 //  Return 1 if this object handles the request, 0 if not
 int GUIConsole::IsInRegion(int x, int y)
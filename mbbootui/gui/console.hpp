@@ -34,6 +34,8 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update();
 
+    virtual bool GetDirtyRect(int& x, int& y, int& w, int& h);
+
     // IsInRegion - Checks if the request is handled by this object
     //  Return 1 if this object handles the request, 0 if not
     virtual int IsInRegion(int x, int y);
@@ -19,6 +19,7 @@
 #include "gui/gui.h"
 
 #include <atomic>
+#include <vector>
 
 #include <linux/input.h>
 #include <unistd.h>
@@ -67,7 +68,7 @@ static int gRecorder = -1;
 
 void gr_write_frame_to_file(int fd);
 
-void flip()
+static void record_frame()
 {
     if (gRecorder != -1) {
         timespec time;
@@ -75,9 +76,20 @@ void flip()
         write(gRecorder, &time, sizeof(timespec));
         gr_write_frame_to_file(gRecorder);
     }
+}
+
+void flip()
+{
+    record_frame();
     gr_flip();
 }
 
+static void flip_rects(const std::vector<GRRect>& rects)
+{
+    record_frame();
+    gr_flip_rects(rects.data(), rects.size());
+}
+
 void rapidxml::parse_error_handler(const char *what, void *where)
 {
     fprintf(stderr, "Parser error: %s\n", what);
@@ -421,6 +433,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
     int input_timeout_ms = 0;
     int idle_frames = 0;
+    std::vector<GRRect> dirty_rects;
 
     for (;;) {
         loopTimer(input_timeout_ms);
@@ -448,31 +461,54 @@ static int runPages(const char *page_name, const int stop_on_page_done)
             // due to possible animation objects, we need to delay activating the input timeout
             input_timeout_ms = idle_frames > 15 ? 1000 : 0;
 
+            // Only redraw the changed regions if the backend allows it
+            bool partial = ret > 0 && PageManager::GetDirtyRects(&dirty_rects);
+
 #ifndef PRINT_RENDER_TIME
             if (ret > 1) {
-                PageManager::Render();
+                if (partial) {
+                    PageManager::RenderRects(dirty_rects);
+                } else {
+                    PageManager::Render();
+                }
             }
 
             if (ret > 0) {
-                flip();
+                if (partial) {
+                    flip_rects(dirty_rects);
+                } else {
+                    flip();
+                }
             }
 #else
             if (ret > 1) {
                 timespec start, end;
                 int64_t render_t, flip_t;
                 clock_gettime(CLOCK_MONOTONIC, &start);
-                PageManager::Render();
+                if (partial) {
+                    PageManager::RenderRects(dirty_rects);
+                } else {
+                    PageManager::Render();
+                }
                 clock_gettime(CLOCK_MONOTONIC, &end);
                 render_t = mb::util::timespec_diff_ms(start, end);
 
-                flip();
+                if (partial) {
+                    flip_rects(dirty_rects);
+                } else {
+                    flip();
+                }
                 clock_gettime(CLOCK_MONOTONIC, &start);
                 flip_t = mb::util::timespec_diff_ms(end, start);
 
                 LOGI("Render(): %" PRId64 " ms, flip(): %" PRId64 " ms, total: %" PRId64 " ms",
                      render_t, flip_t, render_t + flip_t);
             } else if (ret > 0) {
-                flip();
+                if (partial) {
+                    flip_rects(dirty_rects);
+                } else {
+                    flip();
+                }
             }
 #endif
         } else {
@@ -345,6 +345,12 @@ int GUIInput::Update()
     return ret;
 }
 
+bool GUIInput::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    GetRenderPos(x, y, w, h);
+    return true;
+}
+
 int GUIInput::GetSelection(int x, int y)
 {
     if (x < mRenderX || x - mRenderX > mRenderW || y < mRenderY || y - mRenderY > mRenderH) {
@@ -39,6 +39,8 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update();
 
+    virtual bool GetDirtyRect(int& x, int& y, int& w, int& h);
+
     // Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
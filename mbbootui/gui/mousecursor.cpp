@@ -1,5 +1,7 @@
 #include "gui/mousecursor.hpp"
 
+#include <climits>
+
 MouseCursor::MouseCursor(int resX, int resY)
 {
     ResetData(resX, resY);
@@ -17,6 +19,7 @@ void MouseCursor::ResetData(int resX, int resY)
     m_speedMultiplier = 2.5f;
     m_image = nullptr;
     m_present = false;
+    m_drawn = false;
 
     ConvertStrToColor("red", &m_color);
 
@@ -55,9 +58,16 @@ void MouseCursor::LoadData(xml_node<>* node)
 int MouseCursor::Render()
 {
     if (!m_present) {
+        m_drawn = false;
         return 0;
     }
 
+    m_drawn = true;
+    m_drawnX = mRenderX;
+    m_drawnY = mRenderY;
+    m_drawnW = mRenderW;
+    m_drawnH = mRenderH;
+
     if (m_image) {
         gr_blit(m_image->GetResource(), 0, 0, mRenderW, mRenderH, mRenderX, mRenderY);
     } else {
@@ -93,6 +103,32 @@ int MouseCursor::SetRenderPos(int x, int y, int w, int h)
     return RenderObject::SetRenderPos(x, y, w, h);
 }
 
+bool MouseCursor::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    // Both the old and new positions of the cursor need to be redrawn
+    int x1 = m_present ? mRenderX : INT_MAX;
+    int y1 = m_present ? mRenderY : INT_MAX;
+    int x2 = m_present ? mRenderX + mRenderW : INT_MIN;
+    int y2 = m_present ? mRenderY + mRenderH : INT_MIN;
+
+    if (m_drawn) {
+        x1 = std::min(x1, m_drawnX);
+        y1 = std::min(y1, m_drawnY);
+        x2 = std::max(x2, m_drawnX + m_drawnW);
+        y2 = std::max(y2, m_drawnY + m_drawnH);
+    }
+
+    if (x1 >= x2 || y1 >= y2) {
+        x = y = w = h = 0;
+    } else {
+        x = x1;
+        y = y1;
+        w = x2 - x1;
+        h = y2 - y1;
+    }
+    return true;
+}
+
 void MouseCursor::Move(int deltaX, int deltaY)
 {
     if (deltaX != 0) {
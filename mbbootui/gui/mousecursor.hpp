@@ -29,6 +29,7 @@ public:
     virtual int Render();
     virtual int Update();
     virtual int SetRenderPos(int x, int y, int w = 0, int h = 0);
+    virtual bool GetDirtyRect(int& x, int& y, int& w, int& h);
 
     void Move(int deltaX, int deltaY);
     void GetPos(int& x, int& y);
@@ -43,4 +44,10 @@ private:
     COLOR m_color;
     ImageResource *m_image;
     bool m_present;
+    // Area covered by the cursor when it was last rendered
+    bool m_drawn;
+    int m_drawnX;
+    int m_drawnY;
+    int m_drawnW;
+    int m_drawnH;
 };
@@ -50,6 +50,16 @@ public:
         return 0;
     }
 
+    // GetDirtyRect - Returns the area that needs to be redrawn after Update()
+    // returned >0. Only this area is redrawn if the backend supports partial
+    // updates.
+    //  Return true if the area is known, false if the full screen must be redrawn
+    virtual bool GetDirtyRect(int& x __unused, int& y __unused,
+                              int& w __unused, int& h __unused)
+    {
+        return false;
+    }
+
     // GetRenderPos - Returns the current position of the object
     virtual int GetRenderPos(int& x, int& y, int& w, int& h)
     {
@@ -80,6 +80,8 @@ PageSet* PageManager::mCurrentSet;
 MouseCursor *PageManager::mMouseCursor = nullptr;
 HardwareKeyboard *PageManager::mHardwareKeyboard = nullptr;
 bool PageManager::mReloadTheme = false;
+std::vector<GRRect> PageManager::mDirtyRects;
+bool PageManager::mDirtyAll = false;
 std::string PageManager::mStartPage = "main";
 std::vector<language_struct> Language_List;
 
@@ -530,8 +532,15 @@ int Page::Update()
         int ret = (*iter)->Update();
         if (ret < 0) {
             LOGE("An update request has failed.");
-        } else if (ret > retCode) {
-            retCode = ret;
+        } else {
+            // Objects returning 1 have drawn themselves in Update(), so their
+            // area must still be flipped
+            if (ret > 0) {
+                PageManager::AddDirtyRect(*iter);
+            }
+            if (ret > retCode) {
+                retCode = ret;
+            }
         }
     }
 
@@ -1642,10 +1651,16 @@ int PageManager::Update()
         return -2;
     }
 
+    mDirtyRects.clear();
+    mDirtyAll = false;
+
     int res = (mCurrentSet ? mCurrentSet->Update() : -1);
 
     if (mMouseCursor) {
         int c_res = mMouseCursor->Update();
+        if (c_res > 0) {
+            AddDirtyRect(mMouseCursor);
+        }
         if (c_res > res) {
             res = c_res;
         }
@@ -1653,6 +1668,133 @@ int PageManager::Update()
     return res;
 }
 
+void PageManager::AddDirtyRect(RenderObject* object)
+{
+    GRRect rect;
+
+    if (mDirtyAll) {
+        return;
+    }
+
+    if (!object->GetDirtyRect(rect.x, rect.y, rect.w, rect.h)) {
+        mDirtyAll = true;
+        mDirtyRects.clear();
+        return;
+    }
+
+    if (rect.w > 0 && rect.h > 0) {
+        mDirtyRects.push_back(rect);
+    }
+}
+
+static bool rects_touch(const GRRect& a, const GRRect& b)
+{
+    return a.x <= b.x + b.w && b.x <= a.x + a.w
+            && a.y <= b.y + b.h && b.y <= a.y + a.h;
+}
+
+static void rect_union(GRRect* a, const GRRect& b)
+{
+    int x2 = std::max(a->x + a->w, b.x + b.w);
+    int y2 = std::max(a->y + a->h, b.y + b.h);
+    a->x = std::min(a->x, b.x);
+    a->y = std::min(a->y, b.y);
+    a->w = x2 - a->x;
+    a->h = y2 - a->y;
+}
+
+// Get the regions of the screen that need to be redrawn after the last
+// Update(). The regions do not overlap. Returns false if the whole screen
+// should be redrawn instead, including when no regions were reported.
+bool PageManager::GetDirtyRects(std::vector<GRRect>* rects)
+{
+    // Merging is quadratic, so give up on very busy frames
+    static const size_t max_rects = 8;
+
+    if (mDirtyAll || gr_buffer_age() != 1) {
+        return false;
+    }
+
+    int fb_w = gr_fb_width();
+    int fb_h = gr_fb_height();
+
+    rects->clear();
+
+    for (const GRRect& r : mDirtyRects) {
+        GRRect clipped;
+        clipped.x = std::max(r.x, 0);
+        clipped.y = std::max(r.y, 0);
+        clipped.w = std::min(r.x + r.w, fb_w) - clipped.x;
+        clipped.h = std::min(r.y + r.h, fb_h) - clipped.y;
+        if (clipped.w > 0 && clipped.h > 0) {
+            rects->push_back(clipped);
+        }
+    }
+
+    if (rects->empty()) {
+        return false;
+    }
+
+    // Merge touching regions until none of them overlap
+    bool merged;
+    do {
+        merged = false;
+        for (size_t i = 0; i < rects->size() && !merged; ++i) {
+            for (size_t j = i + 1; j < rects->size(); ++j) {
+                if (rects_touch((*rects)[i], (*rects)[j])) {
+                    rect_union(&(*rects)[i], (*rects)[j]);
+                    rects->erase(rects->begin() + j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    } while (merged);
+
+    if (rects->size() > max_rects) {
+        GRRect bounds = (*rects)[0];
+        for (size_t i = 1; i < rects->size(); ++i) {
+            rect_union(&bounds, (*rects)[i]);
+        }
+        rects->assign(1, bounds);
+    }
+
+    // Redrawing most of the screen piecewise is slower than a full redraw
+    int64_t area = 0;
+    for (const GRRect& r : *rects) {
+        area += (int64_t) r.w * r.h;
+    }
+    if (area * 4 > (int64_t) fb_w * fb_h * 3) {
+        return false;
+    }
+
+    return true;
+}
+
+// Redraw only the given regions of the screen
+int PageManager::RenderRects(const std::vector<GRRect>& rects)
+{
+    if (blankTimer.isScreenOff()) {
+        return 0;
+    }
+
+    int res = 0;
+
+    for (const GRRect& r : rects) {
+        gr_damage_clip(&r);
+        res = (mCurrentSet ? mCurrentSet->Render() : -1);
+        if (mMouseCursor) {
+            mMouseCursor->Render();
+        }
+        if (res < 0) {
+            break;
+        }
+    }
+
+    gr_damage_clip(nullptr);
+    return res;
+}
+
 int PageManager::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
     return (mCurrentSet ? mCurrentSet->NotifyTouch(state, x, y) : -1);
@@ -7,6 +7,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include "minuitwrp/minui.h"
 #include "minzip/Zip.h"
 
 #include "gui/gui.hpp"
@@ -174,6 +175,9 @@ public:
     // These are routing routines
     static int Render();
     static int Update();
+    static void AddDirtyRect(RenderObject* object);
+    static bool GetDirtyRects(std::vector<GRRect>* rects);
+    static int RenderRects(const std::vector<GRRect>& rects);
     static int NotifyTouch(TOUCH_STATE state, int x, int y);
     static int NotifyKey(int key, bool down);
     static int NotifyCharInput(int ch);
@@ -200,6 +204,9 @@ protected:
     static bool mReloadTheme;
     static std::string mStartPage;
     static LoadingContext* currentLoadingContext;
+    // Regions changed by the last Update()
+    static std::vector<GRRect> mDirtyRects;
+    static bool mDirtyAll;
 };
 
 #endif  // _PAGES_HEADER_HPP
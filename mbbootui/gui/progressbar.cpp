@@ -140,12 +140,15 @@ int GUIProgressBar::Update()
 
     mLastPos = pos;
 
-    if (RenderInternal() != 0) {
-        return -1;
-    }
     return 2;
 }
 
+bool GUIProgressBar::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    GetRenderPos(x, y, w, h);
+    return true;
+}
+
 int GUIProgressBar::NotifyVarChange(const std::string& varName,
                                     const std::string& value)
 {
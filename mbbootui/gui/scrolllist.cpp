@@ -401,6 +401,12 @@ int GUIScrollList::Update()
     return 0;
 }
 
+bool GUIScrollList::GetDirtyRect(int& x, int& y, int& w, int& h)
+{
+    GetRenderPos(x, y, w, h);
+    return true;
+}
+
 size_t GUIScrollList::HitTestItem(int x __unused, int y)
 {
     // We only care about y position
@@ -61,6 +61,7 @@
 #define MBBOOTUI_LOG_PATH           MBBOOTUI_BASE_PATH "/exec.log"
 #define MBBOOTUI_SCREENSHOTS_PATH   MBBOOTUI_BASE_PATH "/screenshots";
 #define MBBOOTUI_SETTINGS_PATH      MBBOOTUI_BASE_PATH "/settings.bin"
+#define MBBOOTUI_FONT_CACHE_PATH    MBBOOTUI_BASE_PATH "/fontcache"
 
 #define MBBOOTUI_RUNTIME_PATH       "/mbbootui"
 #define MBBOOTUI_THEME_PATH         MBBOOTUI_RUNTIME_PATH "/theme"
@@ -402,6 +403,7 @@ static void log_startup()
     LOGV("- tw_settings_path:             %s", tw_settings_path);
     LOGV("- tw_screenshots_path:          %s", tw_screenshots_path);
     LOGV("- tw_theme_zip_path:            %s", tw_theme_zip_path);
+    LOGV("- tw_font_cache_path:           %s", tw_font_cache_path);
 
     if (tw_graphics_backends_length > 0) {
         LOGV("- tw_graphics_backends:         (%zu backends)", tw_graphics_backends_length);
@@ -485,6 +487,7 @@ int main(int argc, char *argv[])
     tw_resource_path = MBBOOTUI_THEME_PATH;
     tw_settings_path = MBBOOTUI_SETTINGS_PATH;
     tw_screenshots_path = MBBOOTUI_SCREENSHOTS_PATH;
+    tw_font_cache_path = MBBOOTUI_FONT_CACHE_PATH;
     // Disallow custom themes, which could manipulate variables in such as way
     // as to execute malicious code
     tw_theme_zip_path = "";
@@ -567,6 +570,9 @@ int main(int argc, char *argv[])
     // Save settings
     DataManager::Flush();
 
+    // Save rasterized glyphs so that the next boot can skip FreeType
+    gr_ttf_saveCaches();
+
     if (args.size() > 0) {
         if (args[0] == "reboot") {
             std::string reboot_arg;
@@ -17,6 +17,8 @@
 #include "backend/backend.h"
 #include "backend/backend.gen.h"
 
+#include <algorithm>
+
 #include <cstring>
 
 struct backend
@@ -59,4 +61,60 @@ backend_init_fn get_backend(const char *name)
     return fn;
 }
 
+bool backend_clamp_rect(const GRSurface *surface, const GRRect *rect,
+                        GRRect *out)
+{
+    int x1 = std::max(rect->x, 0);
+    int y1 = std::max(rect->y, 0);
+    int x2 = std::min(rect->x + rect->w, surface->width);
+    int y2 = std::min(rect->y + rect->h, surface->height);
+
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
+
+    out->x = x1;
+    out->y = y1;
+    out->w = x2 - x1;
+    out->h = y2 - y1;
+    return true;
+}
+
+void backend_copy_rects(unsigned char *dst, int dst_row_bytes,
+                        const GRSurface *src, const GRRect *rects, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        GRRect r;
+        if (!backend_clamp_rect(src, &rects[i], &r)) {
+            continue;
+        }
+
+        size_t offset = r.x * src->pixel_bytes;
+        size_t size = r.w * src->pixel_bytes;
+
+        for (int y = r.y; y < r.y + r.h; ++y) {
+            memcpy(dst + y * dst_row_bytes + offset,
+                   src->data + y * src->row_bytes + offset, size);
+        }
+    }
+}
+
+// Swap the red and blue channels of 32bpp pixels
+void backend_swap_rb_rects(GRSurface *surface, const GRRect *rects, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        GRRect r;
+        if (!backend_clamp_rect(surface, &rects[i], &r)) {
+            continue;
+        }
+
+        for (int y = r.y; y < r.y + r.h; ++y) {
+            unsigned char *px = surface->data + y * surface->row_bytes + r.x * 4;
+            for (int x = 0; x < r.w; ++x, px += 4) {
+                std::swap(px[0], px[2]);
+            }
+        }
+    }
+}
+
 }
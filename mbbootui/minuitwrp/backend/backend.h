@@ -24,4 +24,11 @@ typedef struct minui_backend * (*backend_init_fn)();
 
 backend_init_fn get_backend(const char *name);
 
+// Helpers for backends that implement flip_rects()
+bool backend_clamp_rect(const GRSurface *surface, const GRRect *rect,
+                        GRRect *out);
+void backend_copy_rects(unsigned char *dst, int dst_row_bytes,
+                        const GRSurface *src, const GRRect *rects, int count);
+void backend_swap_rb_rects(GRSurface *surface, const GRRect *rects, int count);
+
 }
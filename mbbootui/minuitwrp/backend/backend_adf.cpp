@@ -55,6 +55,9 @@ struct adf_pdata
 };
 
 static GRSurface* adf_flip(minui_backend *backend);
+static GRSurface* adf_flip_rects(minui_backend *backend, const GRRect *rects,
+                                 int count);
+static int adf_buffer_age(minui_backend *backend);
 static void adf_blank(minui_backend *backend, bool blank);
 
 static int adf_surface_init(adf_pdata *pdata, drm_mode_modeinfo *mode, adf_surface_pdata *surf)
@@ -258,6 +261,36 @@ static GRSurface* adf_flip(minui_backend *backend)
     return &pdata->surfaces[pdata->current_surface].base;
 }
 
+static GRSurface* adf_flip_rects(minui_backend *backend, const GRRect *rects,
+                                 int count)
+{
+    adf_pdata *pdata = (adf_pdata *)backend;
+
+    if (pdata->n_surfaces != 1) {
+        return adf_flip(backend);
+    }
+
+    adf_surface_pdata *surf = &pdata->surfaces[0];
+
+    backend_copy_rects(surf->adf_data, surf->pitch, &surf->base, rects, count);
+    int fence_fd = adf_interface_simple_post(pdata->intf_fd, pdata->eng_id,
+            surf->base.width, surf->base.height, pdata->format, surf->fd,
+            surf->offset, surf->pitch, -1);
+    if (fence_fd >= 0) {
+        close(fence_fd);
+    }
+
+    return &surf->base;
+}
+
+static int adf_buffer_age(minui_backend *backend)
+{
+    adf_pdata *pdata = (adf_pdata *)backend;
+
+    // With multiple surfaces, the next surface contains an older frame
+    return pdata->n_surfaces == 1 ? 1 : 0;
+}
+
 static void adf_blank(minui_backend *backend, bool blank)
 {
     adf_pdata *pdata = (adf_pdata *)backend;
@@ -298,5 +331,7 @@ extern "C" struct minui_backend * BACKEND_FUNCTION(adf)()
     pdata->base.flip = adf_flip;
     pdata->base.blank = adf_blank;
     pdata->base.exit = adf_exit;
+    pdata->base.flip_rects = adf_flip_rects;
+    pdata->base.buffer_age = adf_buffer_age;
     return &pdata->base;
 }
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <vector>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,8 @@
 
 static GRSurface* fbdev_init(minui_backend*);
 static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip_rects(minui_backend*, const GRRect*, int);
+static int fbdev_buffer_age(minui_backend*);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -47,6 +51,11 @@ static bool double_buffered;
 static GRSurface* gr_draw = nullptr;
 static int displayed_buffer;
 
+// Regions updated by the previous flip. When double buffered, the buffer being
+// flipped to is missing both these and the current frame's updates.
+static std::vector<GRRect> prev_rects;
+static bool prev_full = true;
+
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
 static __u32 smem_len;
@@ -56,6 +65,8 @@ static minui_backend my_backend = {
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+    .flip_rects = fbdev_flip_rects,
+    .buffer_age = fbdev_buffer_age,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(fbdev)()
@@ -323,9 +334,57 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused)
             set_displayed_framebuffer(1-displayed_buffer);
         }
     }
+
+    prev_full = true;
+    prev_rects.clear();
+
+    return gr_draw;
+}
+
+static GRSurface* fbdev_flip_rects(minui_backend* backend,
+                                   const GRRect* rects, int count)
+{
+    if (tw_flags & TW_FLAG_BOARD_HAS_FLIPPED_SCREEN) {
+        return fbdev_flip(backend);
+    }
+
+    if (double_buffered && prev_full) {
+        // The back buffer predates the last full flip, so copy everything
+        // once. After that, it only lags behind by this frame's rects.
+        fbdev_flip(backend);
+        prev_full = false;
+        prev_rects.assign(rects, rects + count);
+        return gr_draw;
+    }
+
+    if (tw_pixel_format == TW_PXFMT_BGRA_8888) {
+        backend_swap_rb_rects(gr_draw, rects, count);
+    }
+
+    if (double_buffered) {
+        unsigned char *dst = gr_framebuffer[1-displayed_buffer].data;
+        backend_copy_rects(dst, gr_framebuffer[0].row_bytes, gr_draw,
+                           prev_rects.data(), prev_rects.size());
+        backend_copy_rects(dst, gr_framebuffer[0].row_bytes, gr_draw,
+                           rects, count);
+        set_displayed_framebuffer(1-displayed_buffer);
+    } else {
+        backend_copy_rects(gr_framebuffer[0].data, gr_framebuffer[0].row_bytes,
+                           gr_draw, rects, count);
+    }
+
+    prev_full = false;
+    prev_rects.assign(rects, rects + count);
+
     return gr_draw;
 }
 
+static int fbdev_buffer_age(minui_backend* backend __unused)
+{
+    // Drawing always happens in the same in-memory surface
+    return 1;
+}
+
 static void fbdev_exit(minui_backend* backend __unused)
 {
     close(fb_fd);
@@ -48,6 +48,8 @@
 
 static GRSurface* overlay_init(minui_backend*);
 static GRSurface* overlay_flip(minui_backend*);
+static GRSurface* overlay_flip_rects(minui_backend*, const GRRect*, int);
+static int overlay_buffer_age(minui_backend*);
 static void overlay_blank(minui_backend*, bool);
 static void overlay_exit(minui_backend*);
 
@@ -100,6 +102,8 @@ static minui_backend my_backend = {
     .flip = overlay_flip,
     .blank = overlay_blank,
     .exit = overlay_exit,
+    .flip_rects = overlay_flip_rects,
+    .buffer_age = overlay_buffer_age,
 };
 
 bool target_has_overlay(char *version)
@@ -434,7 +438,21 @@ int allocate_overlay(int fd, GRSurface gr_fb)
     return 0;
 }
 
-int overlay_display_frame(int fd, void* data, size_t size)
+// Copy the regions of the drawing surface that changed (or the entire frame if
+// rects is null) to the overlay buffer
+static void overlay_copy_frame(void* data, size_t size,
+                               const GRRect* rects, int count)
+{
+    if (rects) {
+        backend_copy_rects(mem_info.mem_buf, gr_draw->row_bytes, gr_draw,
+                           rects, count);
+    } else {
+        memcpy(mem_info.mem_buf, data, size);
+    }
+}
+
+int overlay_display_frame(int fd, void* data, size_t size,
+                          const GRRect* rects, int count)
 {
     int ret = 0;
     struct msmfb_overlay_data ovdataL, ovdataR;
@@ -446,7 +464,7 @@ int overlay_display_frame(int fd, void* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        overlay_copy_frame(data, size, rects, count);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -467,7 +485,7 @@ int overlay_display_frame(int fd, void* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        overlay_copy_frame(data, size, rects, count);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -523,10 +541,27 @@ static GRSurface* overlay_flip(minui_backend* backend __unused)
         }
     }
     // Copy from the in-memory surface to the framebuffer.
-    overlay_display_frame(fb_fd, gr_draw->data, frame_size);
+    overlay_display_frame(fb_fd, gr_draw->data, frame_size, nullptr, 0);
     return gr_draw;
 }
 
+static GRSurface* overlay_flip_rects(minui_backend* backend __unused,
+                                     const GRRect* rects, int count)
+{
+    if (tw_pixel_format == TW_PXFMT_BGRA_8888) {
+        backend_swap_rb_rects(gr_draw, rects, count);
+    }
+    overlay_display_frame(fb_fd, gr_draw->data, frame_size, rects, count);
+    return gr_draw;
+}
+
+static int overlay_buffer_age(minui_backend* backend __unused)
+{
+    // Drawing always happens in the same in-memory surface and the overlay
+    // buffer is only ever updated from it
+    return 1;
+}
+
 int free_overlay(int fd)
 {
     int ret = 0;
@@ -688,6 +723,18 @@ static GRSurface* overlay_flip(minui_backend* backend __unused)
     return nullptr;
 }
 
+static GRSurface* overlay_flip_rects(minui_backend* backend __unused,
+                                     const GRRect* rects __unused,
+                                     int count __unused)
+{
+    return nullptr;
+}
+
+static int overlay_buffer_age(minui_backend* backend __unused)
+{
+    return 0;
+}
+
 static GRSurface* overlay_init(minui_backend* backend __unused)
 {
     return nullptr;
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +40,7 @@
 #include "minui.h"
 #include "graphics.h"
 #include "gui/placement.h"
+#include "raster/raster.h"
 
 struct GRFont
 {
@@ -71,6 +74,26 @@ static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
 
+// Region being redrawn. All drawing is clipped to it.
+static GRRect gr_damage_rect;
+static bool gr_has_damage_rect = false;
+
+// Fills, opaque and alpha blits, and text are drawn with the raster kernels
+// when the surface formats are supported. Everything else goes through
+// pixelflinger. The pixelflinger scissor and color state is mirrored here.
+static const RasterOps *gr_raster = nullptr;
+static GRRect gr_scissor_rect;
+static bool gr_scissor_enabled = false;
+static unsigned char gr_color_rgba[4] = { 255, 255, 255, 255 };
+
+enum class RasterFormat
+{
+    NONE,
+    RGBA,
+    BGRA,
+    RGB_565,
+};
+
 #if 0 // unused
 static bool outside(int x, int y)
 {
@@ -136,15 +159,53 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
 void gr_clip(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+
+    if (gr_has_damage_rect) {
+        int x2 = std::min(x + w, gr_damage_rect.x + gr_damage_rect.w);
+        int y2 = std::min(y + h, gr_damage_rect.y + gr_damage_rect.h);
+        x = std::max(x, gr_damage_rect.x);
+        y = std::max(y, gr_damage_rect.y);
+        w = std::max(x2 - x, 0);
+        h = std::max(y2 - y, 0);
+    }
+
     gl->scissor(gl, x, y, w, h);
     gl->enable(gl, GGL_SCISSOR_TEST);
+
+    gr_scissor_rect = { x, y, w, h };
+    gr_scissor_enabled = true;
 }
 
 void gr_noclip()
 {
     GGLContext *gl = gr_context;
+
+    if (gr_has_damage_rect) {
+        gl->scissor(gl, gr_damage_rect.x, gr_damage_rect.y,
+                    gr_damage_rect.w, gr_damage_rect.h);
+        gl->enable(gl, GGL_SCISSOR_TEST);
+        gr_scissor_rect = gr_damage_rect;
+        gr_scissor_enabled = true;
+        return;
+    }
+
     gl->scissor(gl, 0, 0, gr_fb_width(), gr_fb_height());
     gl->disable(gl, GGL_SCISSOR_TEST);
+    gr_scissor_enabled = false;
+}
+
+// Restrict all drawing, including drawing clipped with gr_clip(), to a
+// region of the screen. Pass nullptr to remove the restriction.
+void gr_damage_clip(const GRRect *rect)
+{
+    if (rect) {
+        gr_damage_rect = *rect;
+        gr_has_damage_rect = true;
+    } else {
+        gr_has_damage_rect = false;
+    }
+
+    gr_noclip();
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -207,6 +268,7 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
         color[1] = ((g << 8) | g) + 1;
         color[2] = ((r << 8) | b) + 1;
         color[3] = ((a << 8) | a) + 1;
+        std::swap(r, b);
     } else {
         color[0] = ((r << 8) | r) + 1;
         color[1] = ((g << 8) | g) + 1;
@@ -215,9 +277,205 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     }
     gl->color4xv(gl, color);
 
+    gr_color_rgba[0] = r;
+    gr_color_rgba[1] = g;
+    gr_color_rgba[2] = b;
+    gr_color_rgba[3] = a;
+
     gr_is_curr_clr_opaque = (a == 255);
 }
 
+static RasterFormat gr_raster_format(int format)
+{
+    switch (format) {
+    case GGL_PIXEL_FORMAT_RGBA_8888:
+    case GGL_PIXEL_FORMAT_RGBX_8888:
+        return RasterFormat::RGBA;
+    case GGL_PIXEL_FORMAT_BGRA_8888:
+        return RasterFormat::BGRA;
+    case GGL_PIXEL_FORMAT_RGB_565:
+        return RasterFormat::RGB_565;
+    default:
+        return RasterFormat::NONE;
+    }
+}
+
+// Clip a rectangle to the drawing surface and the scissor rectangle, like
+// pixelflinger does. Returns false if nothing is left to draw.
+static bool gr_raster_clip(int *x, int *y, int *w, int *h)
+{
+    int x1 = std::max(*x, 0);
+    int y1 = std::max(*y, 0);
+    int x2 = std::min(*x + *w, static_cast<int>(gr_mem_surface.width));
+    int y2 = std::min(*y + *h, static_cast<int>(gr_mem_surface.height));
+
+    if (gr_scissor_enabled) {
+        x1 = std::max(x1, gr_scissor_rect.x);
+        y1 = std::max(y1, gr_scissor_rect.y);
+        x2 = std::min(x2, gr_scissor_rect.x + gr_scissor_rect.w);
+        y2 = std::min(y2, gr_scissor_rect.y + gr_scissor_rect.h);
+    }
+
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
+
+    *x = x1;
+    *y = y1;
+    *w = x2 - x1;
+    *h = y2 - y1;
+    return true;
+}
+
+// Current color in the byte order of 32-bit pixels of the given format. The
+// RGB_565 kernels take RGBA.
+static uint32_t gr_raster_color(RasterFormat format)
+{
+    uint32_t r = gr_color_rgba[0];
+    uint32_t g = gr_color_rgba[1];
+    uint32_t b = gr_color_rgba[2];
+    uint32_t a = gr_color_rgba[3];
+
+    if (format == RasterFormat::BGRA) {
+        std::swap(r, b);
+    }
+
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+static unsigned char * gr_raster_pixel(int x, int y)
+{
+    int bytes = gr_mem_surface.format == GGL_PIXEL_FORMAT_RGB_565 ? 2 : 4;
+    return gr_mem_surface.data
+            + (static_cast<size_t>(y) * gr_mem_surface.stride + x) * bytes;
+}
+
+static bool gr_raster_fill(int x, int y, int w, int h)
+{
+    RasterFormat format = gr_raster_format(gr_mem_surface.format);
+    if (!gr_raster || format == RasterFormat::NONE) {
+        return false;
+    }
+
+    if (!gr_raster_clip(&x, &y, &w, &h)) {
+        return true;
+    }
+
+    bool opaque = gr_color_rgba[3] == 255;
+    uint32_t color = gr_raster_color(format);
+
+    for (int row = y; row < y + h; ++row) {
+        void *dst = gr_raster_pixel(x, row);
+
+        if (format == RasterFormat::RGB_565) {
+            uint16_t *dst16 = static_cast<uint16_t *>(dst);
+            if (opaque) {
+                gr_raster->fill_16(dst16, raster_pack_565(color), w);
+            } else {
+                gr_raster->blend_fill_16(dst16, color, w);
+            }
+        } else {
+            uint32_t *dst32 = static_cast<uint32_t *>(dst);
+            if (opaque) {
+                gr_raster->fill_32(dst32, color, w);
+            } else {
+                gr_raster->blend_fill_32(dst32, color, w);
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool gr_raster_blit(const GGLSurface *surface, int sx, int sy, int w,
+                           int h, int dx, int dy)
+{
+    RasterFormat format = gr_raster_format(gr_mem_surface.format);
+    RasterFormat src_format = gr_raster_format(surface->format);
+    if (!gr_raster || format == RasterFormat::NONE
+            || src_format == RasterFormat::NONE
+            || src_format == RasterFormat::RGB_565) {
+        return false;
+    }
+
+    int x = dx;
+    int y = dy;
+    if (!gr_raster_clip(&x, &y, &w, &h)) {
+        return true;
+    }
+    sx += x - dx;
+    sy += y - dy;
+
+    // pixelflinger repeats the texture when reading outside of it
+    if (sx < 0 || sy < 0 || sx + w > static_cast<int>(surface->width)
+            || sy + h > static_cast<int>(surface->height)) {
+        return false;
+    }
+
+    bool blend = surface->format != GGL_PIXEL_FORMAT_RGBX_8888;
+    bool swap_rb = (src_format == RasterFormat::BGRA)
+            != (format == RasterFormat::BGRA);
+
+    for (int row = 0; row < h; ++row) {
+        void *dst = gr_raster_pixel(x, y + row);
+        const uint32_t *src = reinterpret_cast<const uint32_t *>(surface->data)
+                + static_cast<size_t>(sy + row) * surface->stride + sx;
+
+        if (format == RasterFormat::RGB_565) {
+            uint16_t *dst16 = static_cast<uint16_t *>(dst);
+            if (blend) {
+                gr_raster->blend_32_to_16(dst16, src, w, swap_rb);
+            } else {
+                gr_raster->copy_32_to_16(dst16, src, w, swap_rb);
+            }
+        } else {
+            uint32_t *dst32 = static_cast<uint32_t *>(dst);
+            if (blend) {
+                gr_raster->blend_32(dst32, src, w, swap_rb);
+            } else {
+                gr_raster->copy_32(dst32, src, w, swap_rb);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool gr_raster_mask(const unsigned char *mask, int mask_stride, int x, int y,
+                    int w, int h)
+{
+    RasterFormat format = gr_raster_format(gr_mem_surface.format);
+    if (!gr_raster || format == RasterFormat::NONE) {
+        return false;
+    }
+
+    int cx = x;
+    int cy = y;
+    if (!gr_raster_clip(&cx, &cy, &w, &h)) {
+        return true;
+    }
+    mask += static_cast<size_t>(cy - y) * mask_stride + (cx - x);
+
+    // Like an alpha-only texture in pixelflinger, the color's alpha is not
+    // used
+    uint32_t color = gr_raster_color(format);
+
+    for (int row = 0; row < h; ++row) {
+        void *dst = gr_raster_pixel(cx, cy + row);
+        const uint8_t *src = mask + static_cast<size_t>(row) * mask_stride;
+
+        if (format == RasterFormat::RGB_565) {
+            gr_raster->blend_mask_16(static_cast<uint16_t *>(dst), src,
+                                     color, w);
+        } else {
+            gr_raster->blend_mask_32(static_cast<uint32_t *>(dst), src,
+                                     color, w);
+        }
+    }
+
+    return true;
+}
+
 void gr_clear()
 {
     if (gr_draw->pixel_bytes == 2) {
@@ -229,15 +487,12 @@ void gr_clear()
     if (gr_current_r == gr_current_g && gr_current_r == gr_current_b) {
         memset(gr_draw->data, gr_current_r, gr_draw->height * gr_draw->row_bytes);
     } else {
-        unsigned char* px = gr_draw->data;
+        uint32_t color = gr_current_r | (gr_current_g << 8)
+                | (gr_current_b << 16) | (0xffu << 24);
         for (int y = 0; y < gr_draw->height; ++y) {
-            for (int x = 0; x < gr_draw->width; ++x) {
-                *px++ = gr_current_r;
-                *px++ = gr_current_g;
-                *px++ = gr_current_b;
-                px++;
-            }
-            px += gr_draw->row_bytes - (gr_draw->width * gr_draw->pixel_bytes);
+            gr_raster->fill_32(reinterpret_cast<uint32_t *>(
+                    gr_draw->data + y * gr_draw->row_bytes),
+                    color, gr_draw->width);
         }
     }
 }
@@ -246,6 +501,10 @@ void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
 
+    if (gr_raster_fill(x, y, w, h)) {
+        return;
+    }
+
     if (gr_is_curr_clr_opaque) {
         gl->disable(gl, GGL_BLEND);
     }
@@ -266,6 +525,10 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     GGLContext *gl = gr_context;
     GGLSurface *surface = (GGLSurface*)source;
 
+    if (gr_raster_blit(surface, sx, sy, w, h, dx, dy)) {
+        return;
+    }
+
     if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
         gl->disable(gl, GGL_BLEND);
     }
@@ -309,6 +572,28 @@ void gr_flip()
     gr_context->colorBuffer(gr_context, &gr_mem_surface);
 }
 
+// Like gr_flip(), but only the given regions have been redrawn since the
+// previous frame. This is only valid if gr_buffer_age() returned 1.
+void gr_flip_rects(const GRRect *rects, int count)
+{
+    if (!gr_backend->flip_rects) {
+        gr_flip();
+        return;
+    }
+
+    gr_draw = gr_backend->flip_rects(gr_backend, rects, count);
+    gr_mem_surface.data = (GGLubyte*)gr_draw->data;
+    gr_context->colorBuffer(gr_context, &gr_mem_surface);
+}
+
+int gr_buffer_age(void)
+{
+    if (!gr_backend->buffer_age) {
+        return 0;
+    }
+    return gr_backend->buffer_age(gr_backend);
+}
+
 static void get_memory_surface(GGLSurface* ms)
 {
     ms->version = sizeof(*ms);
@@ -362,6 +647,9 @@ int gr_init(void)
     overscan_offset_x = gr_draw->width * tw_overscan_percent / 100;
     overscan_offset_y = gr_draw->height * tw_overscan_percent / 100;
 
+    gr_raster = raster_get_ops();
+    printf("Using %s raster kernels\n", gr_raster->name);
+
     // Set up pixelflinger
     get_memory_surface(&gr_mem_surface);
     gglInit(&gr_context);
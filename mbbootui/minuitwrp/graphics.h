@@ -35,6 +35,22 @@ struct minui_backend
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Optional. Like flip(), but only the given regions of the drawing
+    // surface have changed since the previous flip. The regions never
+    // overlap.
+    GRSurface* (*flip_rects)(minui_backend*, const GRRect*, int);
+
+    // Optional. Returns 1 if the surface returned by flip() still contains
+    // the previous frame, which makes partial redraws possible. Returns 0 if
+    // the contents are unknown.
+    int (*buffer_age)(minui_backend*);
 };
 
+// Draw an 8-bit coverage mask (eg. rendered text) at (x, y) in the current
+// color without going through pixelflinger. Returns false if the drawing
+// surface's format is not supported.
+bool gr_raster_mask(const unsigned char *mask, int mask_stride, int x, int y,
+                    int w, int h);
+
 #endif
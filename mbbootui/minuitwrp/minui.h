@@ -39,6 +39,14 @@ struct GRSurface
 typedef void* gr_surface;
 typedef unsigned short gr_pixel;
 
+struct GRRect
+{
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
 #define FONT_TYPE_TWRP 0
 #define FONT_TYPE_TTF  1
 
@@ -49,11 +57,14 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+void gr_flip_rects(const struct GRRect *rects, int count);
+int gr_buffer_age(void);
 void gr_fb_blank(bool blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
+void gr_damage_clip(const struct GRRect *rect);
 void gr_fill(int x, int y, int w, int h);
 void gr_line(int x0, int y0, int x1, int y1, int width);
 gr_surface gr_render_circle(int radius, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -70,6 +81,7 @@ int gr_ttf_measureEx(const char *s, void *font);
 int gr_ttf_maxExW(const char *s, void *font, int max_width);
 int gr_ttf_getMaxFontHeight(void *font);
 void gr_ttf_dump_stats(void);
+void gr_ttf_saveCaches(void);
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(gr_surface surface);
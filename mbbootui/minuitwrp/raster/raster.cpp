@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "raster/raster.h"
+
+#include <string.h>
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Portable kernels
+
+static void generic_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void generic_blend_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    uint32_t a = color >> 24;
+
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = raster_blend_px(color, dst[i], a);
+    }
+}
+
+static void generic_copy_32(uint32_t *dst, const uint32_t *src, size_t n,
+                            bool swap_rb)
+{
+    if (!swap_rb) {
+        memcpy(dst, src, n * sizeof(uint32_t));
+        return;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = raster_swap_rb(src[i]);
+    }
+}
+
+static void generic_blend_32(uint32_t *dst, const uint32_t *src, size_t n,
+                             bool swap_rb)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t px = swap_rb ? raster_swap_rb(src[i]) : src[i];
+        dst[i] = raster_blend_px(px, dst[i], px >> 24);
+    }
+}
+
+static void generic_blend_mask_32(uint32_t *dst, const uint8_t *mask,
+                                  uint32_t color, size_t n)
+{
+    color &= 0xffffffu;
+
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t a = mask[i];
+        if (a != 0) {
+            dst[i] = raster_blend_px(color | (a << 24), dst[i], a);
+        }
+    }
+}
+
+static void generic_fill_16(uint16_t *dst, uint16_t color, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void generic_blend_fill_16(uint16_t *dst, uint32_t color, size_t n)
+{
+    uint32_t a = color >> 24;
+
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = raster_pack_565(raster_blend_px(
+                color, raster_unpack_565(dst[i]), a));
+    }
+}
+
+static void generic_copy_32_to_16(uint16_t *dst, const uint32_t *src,
+                                  size_t n, bool swap_rb)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t px = swap_rb ? raster_swap_rb(src[i]) : src[i];
+        dst[i] = raster_pack_565(px);
+    }
+}
+
+static void generic_blend_32_to_16(uint16_t *dst, const uint32_t *src,
+                                   size_t n, bool swap_rb)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t px = swap_rb ? raster_swap_rb(src[i]) : src[i];
+        dst[i] = raster_pack_565(raster_blend_px(
+                px, raster_unpack_565(dst[i]), px >> 24));
+    }
+}
+
+static void generic_blend_mask_16(uint16_t *dst, const uint8_t *mask,
+                                  uint32_t color, size_t n)
+{
+    color &= 0xffffffu;
+
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t a = mask[i];
+        if (a != 0) {
+            dst[i] = raster_pack_565(raster_blend_px(
+                    color | (a << 24), raster_unpack_565(dst[i]), a));
+        }
+    }
+}
+
+void raster_init_generic(RasterOps *ops)
+{
+    ops->name = "generic";
+    ops->fill_32 = generic_fill_32;
+    ops->blend_fill_32 = generic_blend_fill_32;
+    ops->copy_32 = generic_copy_32;
+    ops->blend_32 = generic_blend_32;
+    ops->blend_mask_32 = generic_blend_mask_32;
+    ops->fill_16 = generic_fill_16;
+    ops->blend_fill_16 = generic_blend_fill_16;
+    ops->copy_32_to_16 = generic_copy_32_to_16;
+    ops->blend_32_to_16 = generic_blend_32_to_16;
+    ops->blend_mask_16 = generic_blend_mask_16;
+}
+
+// Dispatch
+
+#define MAX_IMPLS 4
+
+typedef void (*RasterInitFn)(RasterOps *ops);
+
+#if defined(__i386__) || defined(__x86_64__)
+static bool cpu_has_sse2()
+{
+#if defined(__x86_64__)
+    // Part of the baseline instruction set
+    return true;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+static bool cpu_has_neon()
+{
+#if defined(__aarch64__)
+    // Mandatory on ARMv8
+    return true;
+#elif defined(HWCAP_NEON)
+    return getauxval(AT_HWCAP) & HWCAP_NEON;
+#else
+    return false;
+#endif
+}
+#endif
+
+struct RasterImpls
+{
+    RasterOps ops[MAX_IMPLS];
+    size_t count;
+};
+
+static RasterImpls probe_impls()
+{
+    RasterImpls impls;
+    RasterInitFn chain[MAX_IMPLS];
+    size_t n = 0;
+
+    impls.count = 0;
+
+    chain[n++] = raster_init_generic;
+#if defined(__i386__) || defined(__x86_64__)
+    if (cpu_has_sse2()) {
+        chain[n++] = raster_init_sse2;
+        if (cpu_has_avx2()) {
+            chain[n++] = raster_init_avx2;
+        }
+    }
+#endif
+#if defined(__arm__) || defined(__aarch64__)
+    if (cpu_has_neon()) {
+        chain[n++] = raster_init_neon;
+    }
+#endif
+
+    // Each implementation builds on top of the previous one
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0) {
+            impls.ops[i] = impls.ops[i - 1];
+        }
+        chain[i](&impls.ops[i]);
+        ++impls.count;
+    }
+
+    return impls;
+}
+
+static const RasterImpls & get_impls()
+{
+    static const RasterImpls impls = probe_impls();
+    return impls;
+}
+
+const RasterOps * raster_get_ops()
+{
+    const RasterImpls &impls = get_impls();
+    return &impls.ops[impls.count - 1];
+}
+
+size_t raster_get_all_ops(const RasterOps **ops, size_t max)
+{
+    const RasterImpls &impls = get_impls();
+    size_t i;
+
+    for (i = 0; i < impls.count && i < max; ++i) {
+        ops[i] = &impls.ops[i];
+    }
+
+    return i;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Span kernels for drawing into the in-memory surface without going through
+// pixelflinger. Every kernel operates on a single row of n pixels.
+//
+// 32-bit pixels are in memory byte order (eg. R, G, B, A for RGBA_8888) with
+// the alpha channel in the last byte. Blending is SRC_ALPHA,
+// ONE_MINUS_SRC_ALPHA on all four channels, matching how pixelflinger is
+// configured in gr_init(). "swap_rb" swaps the first and third byte of each
+// source pixel, which converts between RGBA and BGRA.
+//
+// All implementations produce bit-identical output.
+struct RasterOps
+{
+    // Name of the implementation, for logging
+    const char *name;
+
+    // dst[i] = color
+    void (*fill_32)(uint32_t *dst, uint32_t color, size_t n);
+    // dst[i] = blend(color, dst[i])
+    void (*blend_fill_32)(uint32_t *dst, uint32_t color, size_t n);
+    // dst[i] = src[i]
+    void (*copy_32)(uint32_t *dst, const uint32_t *src, size_t n,
+                    bool swap_rb);
+    // dst[i] = blend(src[i], dst[i])
+    void (*blend_32)(uint32_t *dst, const uint32_t *src, size_t n,
+                     bool swap_rb);
+    // dst[i] = blend(color with alpha mask[i], dst[i])
+    void (*blend_mask_32)(uint32_t *dst, const uint8_t *mask, uint32_t color,
+                          size_t n);
+
+    // Same as above, but for RGB_565 destinations. Except for fill_16(),
+    // which takes an already packed color, sources are in the 32-bit format
+    // and are converted when the pixel is written.
+    void (*fill_16)(uint16_t *dst, uint16_t color, size_t n);
+    void (*blend_fill_16)(uint16_t *dst, uint32_t color, size_t n);
+    void (*copy_32_to_16)(uint16_t *dst, const uint32_t *src, size_t n,
+                          bool swap_rb);
+    void (*blend_32_to_16)(uint16_t *dst, const uint32_t *src, size_t n,
+                           bool swap_rb);
+    void (*blend_mask_16)(uint16_t *dst, const uint8_t *mask, uint32_t color,
+                          size_t n);
+};
+
+// Get the fastest implementation supported by the CPU. The CPU is only
+// probed the first time this is called.
+const RasterOps * raster_get_ops();
+
+// Get all implementations supported by the CPU, starting with the portable
+// one. Used for benchmarking and for checking that the implementations
+// agree.
+size_t raster_get_all_ops(const RasterOps **ops, size_t max);
+
+// Implementations. Each one starts from the portable kernels and replaces the
+// ones it has a faster version of.
+void raster_init_generic(RasterOps *ops);
+#if defined(__i386__) || defined(__x86_64__)
+void raster_init_sse2(RasterOps *ops);
+void raster_init_avx2(RasterOps *ops);
+#endif
+#if defined(__arm__) || defined(__aarch64__)
+void raster_init_neon(RasterOps *ops);
+#endif
+
+// Helpers shared by all implementations
+
+// Exact round(t / 255) for t <= 255 * 255
+static inline uint32_t raster_div255(uint32_t t)
+{
+    return (t + ((t + 128) >> 8) + 128) >> 8;
+}
+
+static inline uint32_t raster_swap_rb(uint32_t px)
+{
+    return (px & 0xff00ff00u) | ((px >> 16) & 0xffu) | ((px & 0xffu) << 16);
+}
+
+static inline uint32_t raster_blend_px(uint32_t src, uint32_t dst, uint32_t a)
+{
+    uint32_t ia = 255 - a;
+    uint32_t out = 0;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t s = (src >> shift) & 0xff;
+        uint32_t d = (dst >> shift) & 0xff;
+        out |= raster_div255(s * a + d * ia) << shift;
+    }
+
+    return out;
+}
+
+static inline uint16_t raster_pack_565(uint32_t px)
+{
+    return static_cast<uint16_t>(((px & 0xf8) << 8)
+            | ((px >> 5) & 0x7e0) | ((px >> 19) & 0x1f));
+}
+
+static inline uint32_t raster_unpack_565(uint16_t px)
+{
+    uint32_t r = (px >> 11) & 0x1f;
+    uint32_t g = (px >> 5) & 0x3f;
+    uint32_t b = px & 0x1f;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+
+    return 0xff000000u | (b << 16) | (g << 8) | r;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "raster/raster.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <string.h>
+
+#include <immintrin.h>
+
+// AVX2 kernels. Same as the SSE2 kernels, but with 8 pixels per iteration.
+// The unpack and pack instructions operate within each 128-bit lane, so
+// widening and narrowing preserve the pixel order. Only used for host builds
+// and x86 devices that support it.
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i div255_epu16(__m256i t128)
+{
+    return _mm256_srli_epi16(
+            _mm256_add_epi16(t128, _mm256_srli_epi16(t128, 8)), 8);
+}
+
+AVX2 static inline __m256i alpha_epu16(__m256i px)
+{
+    px = _mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm256_shufflehi_epi16(px, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+AVX2 static inline __m256i swap_rb_epu16(__m256i px)
+{
+    px = _mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 0, 1, 2));
+    return _mm256_shufflehi_epi16(px, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+AVX2 static inline __m256i blend_epu16(__m256i s, __m256i d, __m256i a)
+{
+    const __m256i v255 = _mm256_set1_epi16(255);
+    const __m256i v128 = _mm256_set1_epi16(128);
+
+    __m256i t = _mm256_add_epi16(
+            _mm256_mullo_epi16(s, a),
+            _mm256_mullo_epi16(d, _mm256_sub_epi16(v255, a)));
+    return div255_epu16(_mm256_add_epi16(t, v128));
+}
+
+AVX2 static void avx2_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    const __m256i c = _mm256_set1_epi32(static_cast<int>(color));
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), c);
+    }
+    for (; i < n; ++i) {
+        dst[i] = color;
+    }
+}
+
+AVX2 static void avx2_blend_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t a = color >> 24;
+    size_t i = 0;
+
+    const __m256i c = _mm256_unpacklo_epi8(
+            _mm256_set1_epi32(static_cast<int>(color)), zero);
+    const __m256i sa = _mm256_add_epi16(
+            _mm256_mullo_epi16(c, _mm256_set1_epi16(static_cast<short>(a))),
+            _mm256_set1_epi16(128));
+    const __m256i ia = _mm256_set1_epi16(static_cast<short>(255 - a));
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i *>(dst + i));
+        __m256i lo = _mm256_unpacklo_epi8(d, zero);
+        __m256i hi = _mm256_unpackhi_epi8(d, zero);
+
+        lo = div255_epu16(_mm256_add_epi16(_mm256_mullo_epi16(lo, ia), sa));
+        hi = div255_epu16(_mm256_add_epi16(_mm256_mullo_epi16(hi, ia), sa));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    for (; i < n; ++i) {
+        dst[i] = raster_blend_px(color, dst[i], a);
+    }
+}
+
+AVX2 static void avx2_copy_32(uint32_t *dst, const uint32_t *src, size_t n,
+                              bool swap_rb)
+{
+    const __m256i ga_mask = _mm256_set1_epi32(static_cast<int>(0xff00ff00u));
+    const __m256i lo_mask = _mm256_set1_epi32(0xff);
+    size_t i = 0;
+
+    if (!swap_rb) {
+        memcpy(dst, src, n * sizeof(uint32_t));
+        return;
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(src + i));
+        __m256i ga = _mm256_and_si256(s, ga_mask);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(s, 16), lo_mask);
+        __m256i b = _mm256_slli_epi32(_mm256_and_si256(s, lo_mask), 16);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_or_si256(ga, _mm256_or_si256(r, b)));
+    }
+    for (; i < n; ++i) {
+        dst[i] = raster_swap_rb(src[i]);
+    }
+}
+
+AVX2 static void avx2_blend_32(uint32_t *dst, const uint32_t *src, size_t n,
+                               bool swap_rb)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(src + i));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i *>(dst + i));
+
+        __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+        __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+        if (swap_rb) {
+            s_lo = swap_rb_epu16(s_lo);
+            s_hi = swap_rb_epu16(s_hi);
+        }
+
+        __m256i lo = blend_epu16(s_lo, _mm256_unpacklo_epi8(d, zero),
+                                 alpha_epu16(s_lo));
+        __m256i hi = blend_epu16(s_hi, _mm256_unpackhi_epi8(d, zero),
+                                 alpha_epu16(s_hi));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    for (; i < n; ++i) {
+        uint32_t px = swap_rb ? raster_swap_rb(src[i]) : src[i];
+        dst[i] = raster_blend_px(px, dst[i], px >> 24);
+    }
+}
+
+AVX2 static void avx2_blend_mask_32(uint32_t *dst, const uint8_t *mask,
+                                    uint32_t color, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rgb_mask = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1,
+                                              0, -1, -1, -1, 0, -1, -1, -1);
+    size_t i = 0;
+
+    color &= 0xffffffu;
+
+    const __m256i c = _mm256_and_si256(_mm256_unpacklo_epi8(
+            _mm256_set1_epi32(static_cast<int>(color)), zero), rgb_mask);
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t m8;
+        memcpy(&m8, mask + i, sizeof(m8));
+        if (m8 == 0) {
+            continue;
+        }
+
+        // One 32-bit value per pixel, duplicated into both 16-bit halves.
+        // Pixels 0-3 end up in the low lane and 4-7 in the high lane, like
+        // the unpacked destination pixels.
+        __m256i m = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(mask + i)));
+        m = _mm256_or_si256(m, _mm256_slli_epi32(m, 16));
+        __m256i a_lo = _mm256_unpacklo_epi32(m, m);
+        __m256i a_hi = _mm256_unpackhi_epi32(m, m);
+
+        __m256i s_lo = _mm256_or_si256(c, _mm256_andnot_si256(rgb_mask, a_lo));
+        __m256i s_hi = _mm256_or_si256(c, _mm256_andnot_si256(rgb_mask, a_hi));
+
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i *>(dst + i));
+        __m256i lo = blend_epu16(s_lo, _mm256_unpacklo_epi8(d, zero), a_lo);
+        __m256i hi = blend_epu16(s_hi, _mm256_unpackhi_epi8(d, zero), a_hi);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    for (; i < n; ++i) {
+        uint32_t a = mask[i];
+        if (a != 0) {
+            dst[i] = raster_blend_px(color | (a << 24), dst[i], a);
+        }
+    }
+}
+
+void raster_init_avx2(RasterOps *ops)
+{
+    ops->name = "avx2";
+    ops->fill_32 = avx2_fill_32;
+    ops->blend_fill_32 = avx2_blend_fill_32;
+    ops->copy_32 = avx2_copy_32;
+    ops->blend_32 = avx2_blend_32;
+    ops->blend_mask_32 = avx2_blend_mask_32;
+}
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "raster/raster.h"
+
+#if defined(__arm__) || defined(__aarch64__)
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <string.h>
+
+#include <arm_neon.h>
+
+// NEON kernels. 8 pixels are processed per iteration. vld4/vst4 split the
+// pixels into one vector per channel, so no shuffling is needed to get at the
+// alpha channel.
+
+// (t + ((t + 128) >> 8) + 128) >> 8, same as raster_div255()
+static inline uint8x8_t div255_u16(uint16x8_t t)
+{
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static inline uint8x8_t blend_u8(uint8x8_t s, uint8x8_t d, uint8x8_t a)
+{
+    uint16x8_t t = vmull_u8(s, a);
+    t = vmlal_u8(t, d, vmvn_u8(a));
+    return div255_u16(t);
+}
+
+static void neon_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    const uint32x4_t c = vdupq_n_u32(color);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        vst1q_u32(dst + i, c);
+        vst1q_u32(dst + i + 4, c);
+    }
+    for (; i < n; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void neon_blend_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    const uint8x8_t a = vdup_n_u8(color >> 24);
+    uint8x8_t s[4];
+    size_t i = 0;
+
+    for (int c = 0; c < 4; ++c) {
+        s[c] = vdup_n_u8((color >> (c * 8)) & 0xff);
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+        d.val[0] = blend_u8(s[0], d.val[0], a);
+        d.val[1] = blend_u8(s[1], d.val[1], a);
+        d.val[2] = blend_u8(s[2], d.val[2], a);
+        d.val[3] = blend_u8(s[3], d.val[3], a);
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+    for (; i < n; ++i) {
+        dst[i] = raster_blend_px(color, dst[i], color >> 24);
+    }
+}
+
+static void neon_copy_32(uint32_t *dst, const uint32_t *src, size_t n,
+                         bool swap_rb)
+{
+    size_t i = 0;
+
+    if (!swap_rb) {
+        memcpy(dst, src, n * sizeof(uint32_t));
+        return;
+    }
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t s = vld4q_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint8x16_t tmp = s.val[0];
+        s.val[0] = s.val[2];
+        s.val[2] = tmp;
+        vst4q_u8(reinterpret_cast<uint8_t *>(dst + i), s);
+    }
+    for (; i < n; ++i) {
+        dst[i] = raster_swap_rb(src[i]);
+    }
+}
+
+static void neon_blend_32(uint32_t *dst, const uint32_t *src, size_t n,
+                          bool swap_rb)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+        if (swap_rb) {
+            uint8x8_t tmp = s.val[0];
+            s.val[0] = s.val[2];
+            s.val[2] = tmp;
+        }
+        uint8x8_t a = s.val[3];
+        d.val[0] = blend_u8(s.val[0], d.val[0], a);
+        d.val[1] = blend_u8(s.val[1], d.val[1], a);
+        d.val[2] = blend_u8(s.val[2], d.val[2], a);
+        d.val[3] = blend_u8(s.val[3], d.val[3], a);
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+    for (; i < n; ++i) {
+        uint32_t px = swap_rb ? raster_swap_rb(src[i]) : src[i];
+        dst[i] = raster_blend_px(px, dst[i], px >> 24);
+    }
+}
+
+static void neon_blend_mask_32(uint32_t *dst, const uint8_t *mask,
+                               uint32_t color, size_t n)
+{
+    uint8x8_t s[3];
+    size_t i = 0;
+
+    color &= 0xffffffu;
+
+    for (int c = 0; c < 3; ++c) {
+        s[c] = vdup_n_u8((color >> (c * 8)) & 0xff);
+    }
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t m8;
+        memcpy(&m8, mask + i, sizeof(m8));
+        if (m8 == 0) {
+            continue;
+        }
+
+        // The source alpha is the mask value
+        uint8x8_t a = vld1_u8(mask + i);
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+        d.val[0] = blend_u8(s[0], d.val[0], a);
+        d.val[1] = blend_u8(s[1], d.val[1], a);
+        d.val[2] = blend_u8(s[2], d.val[2], a);
+        d.val[3] = blend_u8(a, d.val[3], a);
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+    for (; i < n; ++i) {
+        uint32_t a = mask[i];
+        if (a != 0) {
+            dst[i] = raster_blend_px(color | (a << 24), dst[i], a);
+        }
+    }
+}
+
+void raster_init_neon(RasterOps *ops)
+{
+    ops->name = "neon";
+    ops->fill_32 = neon_fill_32;
+    ops->blend_fill_32 = neon_blend_fill_32;
+    ops->copy_32 = neon_copy_32;
+    ops->blend_32 = neon_blend_32;
+    ops->blend_mask_32 = neon_blend_mask_32;
+}
+
+#else
+
+// The compiler was not allowed to emit NEON instructions for this file
+void raster_init_neon(RasterOps *ops)
+{
+    (void) ops;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "raster/raster.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <string.h>
+
+#include <emmintrin.h>
+
+// SSE2 kernels. 4 pixels are processed per iteration. For blending, each
+// half of the vector is widened to 16-bit channels, so that
+// s * a + d * (255 - a) + 128 fits in a lane.
+
+#define SSE2 __attribute__((target("sse2")))
+
+// ((t + 128) + ((t + 128) >> 8)) >> 8, where t128 already includes the +128
+SSE2 static inline __m128i div255_epu16(__m128i t128)
+{
+    return _mm_srli_epi16(_mm_add_epi16(t128, _mm_srli_epi16(t128, 8)), 8);
+}
+
+// Broadcast the alpha channel of each pixel to all of its channels
+SSE2 static inline __m128i alpha_epu16(__m128i px)
+{
+    px = _mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_shufflehi_epi16(px, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+SSE2 static inline __m128i swap_rb_epu16(__m128i px)
+{
+    px = _mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 0, 1, 2));
+    return _mm_shufflehi_epi16(px, _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+SSE2 static inline __m128i swap_rb_epu32(__m128i px)
+{
+    const __m128i ga_mask = _mm_set1_epi32(static_cast<int>(0xff00ff00u));
+    const __m128i lo_mask = _mm_set1_epi32(0xff);
+
+    __m128i ga = _mm_and_si128(px, ga_mask);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(px, 16), lo_mask);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(px, lo_mask), 16);
+    return _mm_or_si128(ga, _mm_or_si128(r, b));
+}
+
+// Blend 2 widened pixels
+SSE2 static inline __m128i blend_epu16(__m128i s, __m128i d, __m128i a)
+{
+    const __m128i v255 = _mm_set1_epi16(255);
+    const __m128i v128 = _mm_set1_epi16(128);
+
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a),
+                              _mm_mullo_epi16(d, _mm_sub_epi16(v255, a)));
+    return div255_epu16(_mm_add_epi16(t, v128));
+}
+
+SSE2 static void sse2_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    const __m128i c = _mm_set1_epi32(static_cast<int>(color));
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), c);
+    }
+    for (; i < n; ++i) {
+        dst[i] = color;
+    }
+}
+
+SSE2 static void sse2_blend_fill_32(uint32_t *dst, uint32_t color, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const uint32_t a = color >> 24;
+    size_t i = 0;
+
+    // s * a + 128 and 255 - a are the same for every pixel
+    const __m128i c = _mm_unpacklo_epi8(
+            _mm_set1_epi32(static_cast<int>(color)), zero);
+    const __m128i sa = _mm_add_epi16(
+            _mm_mullo_epi16(c, _mm_set1_epi16(static_cast<short>(a))),
+            _mm_set1_epi16(128));
+    const __m128i ia = _mm_set1_epi16(static_cast<short>(255 - a));
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+        __m128i lo = _mm_unpacklo_epi8(d, zero);
+        __m128i hi = _mm_unpackhi_epi8(d, zero);
+
+        lo = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(lo, ia), sa));
+        hi = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(hi, ia), sa));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+    for (; i < n; ++i) {
+        dst[i] = raster_blend_px(color, dst[i], a);
+    }
+}
+
+SSE2 static void sse2_copy_32(uint32_t *dst, const uint32_t *src, size_t n,
+                              bool swap_rb)
+{
+    size_t i = 0;
+
+    if (!swap_rb) {
+        memcpy(dst, src, n * sizeof(uint32_t));
+        return;
+    }
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         swap_rb_epu32(s));
+    }
+    for (; i < n; ++i) {
+        dst[i] = raster_swap_rb(src[i]);
+    }
+}
+
+SSE2 static void sse2_blend_32(uint32_t *dst, const uint32_t *src, size_t n,
+                               bool swap_rb)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        if (swap_rb) {
+            s_lo = swap_rb_epu16(s_lo);
+            s_hi = swap_rb_epu16(s_hi);
+        }
+
+        __m128i lo = blend_epu16(s_lo, _mm_unpacklo_epi8(d, zero),
+                                 alpha_epu16(s_lo));
+        __m128i hi = blend_epu16(s_hi, _mm_unpackhi_epi8(d, zero),
+                                 alpha_epu16(s_hi));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+    for (; i < n; ++i) {
+        uint32_t px = swap_rb ? raster_swap_rb(src[i]) : src[i];
+        dst[i] = raster_blend_px(px, dst[i], px >> 24);
+    }
+}
+
+SSE2 static void sse2_blend_mask_32(uint32_t *dst, const uint8_t *mask,
+                                    uint32_t color, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb_mask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    size_t i = 0;
+
+    color &= 0xffffffu;
+
+    const __m128i c = _mm_and_si128(_mm_unpacklo_epi8(
+            _mm_set1_epi32(static_cast<int>(color)), zero), rgb_mask);
+
+    for (; i + 4 <= n; i += 4) {
+        uint32_t m4;
+        memcpy(&m4, mask + i, sizeof(m4));
+        if (m4 == 0) {
+            continue;
+        }
+
+        // Widen the 4 mask values to one 16-bit value per channel
+        __m128i m = _mm_unpacklo_epi8(
+                _mm_cvtsi32_si128(static_cast<int>(m4)), zero);
+        m = _mm_unpacklo_epi16(m, m);
+        __m128i a_lo = _mm_unpacklo_epi32(m, m);
+        __m128i a_hi = _mm_unpackhi_epi32(m, m);
+
+        // The source alpha is the mask value
+        __m128i s_lo = _mm_or_si128(c, _mm_andnot_si128(rgb_mask, a_lo));
+        __m128i s_hi = _mm_or_si128(c, _mm_andnot_si128(rgb_mask, a_hi));
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+        __m128i lo = blend_epu16(s_lo, _mm_unpacklo_epi8(d, zero), a_lo);
+        __m128i hi = blend_epu16(s_hi, _mm_unpackhi_epi8(d, zero), a_hi);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+    for (; i < n; ++i) {
+        uint32_t a = mask[i];
+        if (a != 0) {
+            dst[i] = raster_blend_px(color | (a << 24), dst[i], a);
+        }
+    }
+}
+
+void raster_init_sse2(RasterOps *ops)
+{
+    ops->name = "sse2";
+    ops->fill_32 = sse2_fill_32;
+    ops->blend_fill_32 = sse2_blend_fill_32;
+    ops->copy_32 = sse2_copy_32;
+    ops->blend_32 = sse2_blend_32;
+    ops->blend_mask_32 = sse2_blend_mask_32;
+}
+
+#endif
@@ -3,9 +3,14 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include "minui.h"
+#include "graphics.h"
+
+#include "config/config.hpp"
 
 #include <cutils/hashmap.h>
 #include <ft2build.h>
@@ -18,6 +23,19 @@
 #define STRING_CACHE_MAX_ENTRIES 400
 #define STRING_CACHE_TRUNCATE_ENTRIES 150
 
+// The atlas is a single A_8 texture per font. Glyphs are packed into rows
+// ("shelves") and the texture grows downwards when it runs out of space.
+#define ATLAS_MIN_WIDTH 256
+#define ATLAS_MAX_WIDTH 2048
+#define ATLAS_MIN_HEIGHT 64
+#define ATLAS_MAX_HEIGHT 4096
+#define ATLAS_PADDING 1
+
+#define FONT_CACHE_MAGIC "MBTTFAT"
+#define FONT_CACHE_VERSION 1
+#define FONT_CACHE_FT_VERSION \
+    ((FREETYPE_MAJOR << 16) | (FREETYPE_MINOR << 8) | FREETYPE_PATCH)
+
 typedef struct
 {
     int size;
@@ -25,6 +43,59 @@ typedef struct
     char *path;
 } TrueTypeFontKey;
 
+// Location of a rendered glyph in the atlas and its metrics. This is also the
+// on-disk format of the glyph table in the cache file.
+typedef struct
+{
+    uint32_t char_index;
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    int16_t left;
+    int16_t top;
+    int32_t advance;
+} AtlasGlyph;
+
+typedef struct
+{
+    // Glyph bitmaps. stride is always equal to width.
+    GGLSurface surface;
+    // Packing state
+    int shelf_x;
+    int shelf_y;
+    int shelf_height;
+    // Glyph metrics table
+    AtlasGlyph *glyphs;
+    size_t glyphs_len;
+    size_t glyphs_cap;
+    // Maps FreeType glyph index -> glyphs index (or -1 if not rendered yet)
+    int32_t *lookup;
+    size_t lookup_len;
+    // Whether the atlas has glyphs that are not in the cache file
+    bool dirty;
+} GlyphAtlas;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t ft_version;
+    uint32_t file_hash;
+    uint32_t file_size;
+    int32_t size;
+    int32_t dpi;
+    int32_t max_height;
+    int32_t base;
+    uint32_t num_glyphs;
+    uint32_t atlas_width;
+    uint32_t atlas_rows;
+    uint32_t shelf_x;
+    uint32_t shelf_y;
+    uint32_t shelf_height;
+    uint32_t glyph_count;
+} FontCacheHeader;
+
 typedef struct
 {
     int type;
@@ -34,7 +105,12 @@ typedef struct
     int max_height;
     int base;
     FT_Face face;
-    Hashmap *glyph_cache;
+    // FreeType reads the font from memory so that the file is only read once
+    // for both hashing and loading
+    void *file_data;
+    size_t file_size;
+    uint32_t file_hash;
+    GlyphAtlas atlas;
     Hashmap *string_cache;
     struct StringCacheEntry *string_cache_head;
     struct StringCacheEntry *string_cache_tail;
@@ -42,22 +118,26 @@ typedef struct
     TrueTypeFontKey *key;
 } TrueTypeFont;
 
-typedef struct
-{
-    FT_BBox bbox;
-    FT_BitmapGlyph glyph;
-} TrueTypeCacheEntry;
-
 typedef struct
 {
     char *text;
     int max_width;
 } StringCacheKey;
 
+typedef struct
+{
+    int32_t glyph; // index into the atlas glyph table
+    int x;         // pen position
+} StringCacheGlyph;
+
+// Strings are cached as a list of atlas glyphs and are drawn by blitting each
+// glyph from the atlas
 struct StringCacheEntry
 {
-    GGLSurface surface;
+    int width;
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
+    StringCacheGlyph *glyphs;
+    int glyphs_len;
     StringCacheKey *key;
     struct StringCacheEntry *prev;
     struct StringCacheEntry *next;
@@ -178,11 +258,351 @@ static int gr_ttf_font_cache_hash(void *key)
     return hash;
 }
 
+static bool gr_ttf_read_file(const char *path, void **data_out, size_t *size_out)
+{
+    struct stat sb;
+    uint8_t *data;
+    size_t pos = 0;
+    ssize_t n;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &sb) < 0 || sb.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    data = (uint8_t *)malloc(sb.st_size);
+    if (!data) {
+        close(fd);
+        return false;
+    }
+
+    while (pos < (size_t) sb.st_size) {
+        n = read(fd, data + pos, sb.st_size - pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            free(data);
+            close(fd);
+            return false;
+        }
+        pos += n;
+    }
+
+    close(fd);
+
+    *data_out = data;
+    *size_out = pos;
+    return true;
+}
+
+static bool gr_ttf_write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *ptr = (const uint8_t *)data;
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool gr_ttf_atlas_init(GlyphAtlas *atlas, int width, int height, size_t num_glyphs)
+{
+    memset(atlas, 0, sizeof(GlyphAtlas));
+
+    atlas->surface.data = (GGLubyte *)calloc((size_t) width * height, 1);
+    atlas->lookup = (int32_t *)malloc(MAX(num_glyphs, 1) * sizeof(int32_t));
+    if (!atlas->surface.data || !atlas->lookup) {
+        free(atlas->surface.data);
+        free(atlas->lookup);
+        return false;
+    }
+
+    for (size_t i = 0; i < num_glyphs; ++i) {
+        atlas->lookup[i] = -1;
+    }
+    atlas->lookup_len = num_glyphs;
+
+    atlas->surface.version = sizeof(atlas->surface);
+    atlas->surface.width = width;
+    atlas->surface.height = height;
+    atlas->surface.stride = width;
+    atlas->surface.format = GGL_PIXEL_FORMAT_A_8;
+
+    return true;
+}
+
+static void gr_ttf_atlas_free(GlyphAtlas *atlas)
+{
+    free(atlas->surface.data);
+    free(atlas->glyphs);
+    free(atlas->lookup);
+    memset(atlas, 0, sizeof(GlyphAtlas));
+}
+
+// Find space for a w x h bitmap, growing the texture if needed
+static bool gr_ttf_atlas_reserve(GlyphAtlas *atlas, int w, int h, int *x_out, int *y_out)
+{
+    int atlas_w = atlas->surface.width;
+
+    if (w + ATLAS_PADDING > atlas_w) {
+        return false;
+    }
+
+    // Start a new shelf if the glyph doesn't fit in the current one
+    if (atlas->shelf_x + w + ATLAS_PADDING > atlas_w) {
+        atlas->shelf_y += atlas->shelf_height;
+        atlas->shelf_x = 0;
+        atlas->shelf_height = 0;
+    }
+
+    int needed = atlas->shelf_y + h + ATLAS_PADDING;
+    if (needed > (int) atlas->surface.height) {
+        int new_h = atlas->surface.height;
+        while (new_h < needed) {
+            new_h *= 2;
+        }
+        if (new_h > ATLAS_MAX_HEIGHT) {
+            return false;
+        }
+
+        GGLubyte *data = (GGLubyte *)realloc(atlas->surface.data, (size_t) atlas_w * new_h);
+        if (!data) {
+            return false;
+        }
+        memset(data + (size_t) atlas_w * atlas->surface.height, 0,
+               (size_t) atlas_w * (new_h - atlas->surface.height));
+
+        atlas->surface.data = data;
+        atlas->surface.height = new_h;
+    }
+
+    *x_out = atlas->shelf_x;
+    *y_out = atlas->shelf_y;
+
+    atlas->shelf_x += w + ATLAS_PADDING;
+    atlas->shelf_height = MAX(atlas->shelf_height, h + ATLAS_PADDING);
+    return true;
+}
+
+static int32_t gr_ttf_atlas_append(GlyphAtlas *atlas, const AtlasGlyph *glyph)
+{
+    if (atlas->glyphs_len == atlas->glyphs_cap) {
+        size_t new_cap = MAX(atlas->glyphs_cap * 2, 64);
+        AtlasGlyph *glyphs = (AtlasGlyph *)realloc(atlas->glyphs, new_cap * sizeof(AtlasGlyph));
+        if (!glyphs) {
+            return -1;
+        }
+        atlas->glyphs = glyphs;
+        atlas->glyphs_cap = new_cap;
+    }
+
+    int32_t index = atlas->glyphs_len++;
+    atlas->glyphs[index] = *glyph;
+    atlas->lookup[glyph->char_index] = index;
+    return index;
+}
+
+// Rows of the atlas that contain glyphs
+static int gr_ttf_atlas_rows(const GlyphAtlas *atlas)
+{
+    return atlas->shelf_y + atlas->shelf_height;
+}
+
+static bool gr_ttf_cache_path(TrueTypeFont *font, char *buf, size_t size)
+{
+    if (!tw_font_cache_path || !*tw_font_cache_path) {
+        return false;
+    }
+
+    int n = snprintf(buf, size, "%s/%08x-%d-%d.atlas", tw_font_cache_path,
+                     font->file_hash, font->size, font->dpi);
+    return n > 0 && (size_t) n < size;
+}
+
+// Load pre-rasterized glyphs from the cache file. The atlas is left empty if
+// the cache file is missing, stale or invalid.
+static bool gr_ttf_cache_load(TrueTypeFont *font)
+{
+    char path[PATH_MAX];
+    void *data;
+    size_t size;
+    FontCacheHeader header;
+    const AtlasGlyph *glyphs;
+    const uint8_t *bitmap;
+    GlyphAtlas *atlas = &font->atlas;
+    size_t num_glyphs = font->face->num_glyphs;
+
+    if (!gr_ttf_cache_path(font, path, sizeof(path))
+            || !gr_ttf_read_file(path, &data, &size)) {
+        return false;
+    }
+
+    if (size < sizeof(header)) {
+        goto invalid;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, FONT_CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != FONT_CACHE_VERSION
+            || header.ft_version != FONT_CACHE_FT_VERSION
+            || header.file_hash != font->file_hash
+            || header.file_size != font->file_size
+            || header.size != font->size
+            || header.dpi != font->dpi
+            || header.num_glyphs != num_glyphs
+            || header.atlas_width == 0
+            || header.atlas_width > ATLAS_MAX_WIDTH
+            || header.atlas_rows > ATLAS_MAX_HEIGHT
+            || header.shelf_x > header.atlas_width
+            || header.shelf_y + header.shelf_height != header.atlas_rows
+            || header.glyph_count > num_glyphs
+            || size != sizeof(header)
+                    + header.glyph_count * sizeof(AtlasGlyph)
+                    + (size_t) header.atlas_width * header.atlas_rows) {
+        goto invalid;
+    }
+
+    glyphs = (const AtlasGlyph *)((const uint8_t *)data + sizeof(header));
+    bitmap = (const uint8_t *)(glyphs + header.glyph_count);
+
+    {
+        int height = ATLAS_MIN_HEIGHT;
+        while (height < (int) header.atlas_rows + ATLAS_PADDING) {
+            height *= 2;
+        }
+
+        gr_ttf_atlas_free(atlas);
+        if (!gr_ttf_atlas_init(atlas, header.atlas_width, height, num_glyphs)) {
+            free(data);
+            return false;
+        }
+    }
+
+    memcpy(atlas->surface.data, bitmap, (size_t) header.atlas_width * header.atlas_rows);
+    atlas->shelf_x = header.shelf_x;
+    atlas->shelf_y = header.shelf_y;
+    atlas->shelf_height = header.shelf_height;
+
+    for (uint32_t i = 0; i < header.glyph_count; ++i) {
+        const AtlasGlyph *g = &glyphs[i];
+
+        if (g->char_index >= num_glyphs
+                || atlas->lookup[g->char_index] >= 0
+                || g->x + g->width > header.atlas_width
+                || g->y + g->height > header.atlas_rows
+                || gr_ttf_atlas_append(atlas, g) < 0) {
+            // Start over with an empty atlas
+            gr_ttf_atlas_free(atlas);
+            gr_ttf_atlas_init(atlas, header.atlas_width, ATLAS_MIN_HEIGHT, num_glyphs);
+            goto invalid;
+        }
+    }
+
+    font->max_height = header.max_height;
+    font->base = header.base;
+
+    free(data);
+    return true;
+
+invalid:
+    fprintf(stderr, "Ignoring invalid font cache %s\n", path);
+    free(data);
+    return false;
+}
+
+static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f);
+
+static bool gr_ttf_cache_save(TrueTypeFont *font)
+{
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 4];
+    FontCacheHeader header;
+    GlyphAtlas *atlas = &font->atlas;
+    int fd;
+    bool ok;
+
+    if (!atlas->dirty || !gr_ttf_cache_path(font, path, sizeof(path))) {
+        return false;
+    }
+
+    // Store the font height too so that it doesn't need to be measured from
+    // the glyph outlines on the next boot
+    if (font->max_height == -1) {
+        gr_ttf_calcMaxFontHeight(font);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FONT_CACHE_MAGIC, sizeof(header.magic));
+    header.version = FONT_CACHE_VERSION;
+    header.ft_version = FONT_CACHE_FT_VERSION;
+    header.file_hash = font->file_hash;
+    header.file_size = font->file_size;
+    header.size = font->size;
+    header.dpi = font->dpi;
+    header.max_height = font->max_height;
+    header.base = font->base;
+    header.num_glyphs = atlas->lookup_len;
+    header.atlas_width = atlas->surface.width;
+    header.atlas_rows = gr_ttf_atlas_rows(atlas);
+    header.shelf_x = atlas->shelf_x;
+    header.shelf_y = atlas->shelf_y;
+    header.shelf_height = atlas->shelf_height;
+    header.glyph_count = atlas->glyphs_len;
+
+    if (mkdir(tw_font_cache_path, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: Failed to create directory: %s\n",
+                tw_font_cache_path, strerror(errno));
+        return false;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                tmp_path, strerror(errno));
+        return false;
+    }
+
+    ok = gr_ttf_write_all(fd, &header, sizeof(header))
+            && gr_ttf_write_all(fd, atlas->glyphs, atlas->glyphs_len * sizeof(AtlasGlyph))
+            && gr_ttf_write_all(fd, atlas->surface.data,
+                                (size_t) header.atlas_width * header.atlas_rows);
+    ok = close(fd) == 0 && ok;
+
+    if (!ok || rename(tmp_path, path) < 0) {
+        fprintf(stderr, "%s: Failed to write font cache: %s\n",
+                path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+
+    atlas->dirty = false;
+    return true;
+}
+
 void *gr_ttf_loadFont(const char *filename, int size, int dpi)
 {
     int error;
     TrueTypeFont *res = nullptr;
     TrueTypeFontKey *key = nullptr;
+    void *file_data = nullptr;
+    size_t file_size = 0;
+    int atlas_w, ppem;
 
     pthread_mutex_lock(&font_data.mutex);
 
@@ -208,10 +628,17 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
         }
     }
 
+    if (!gr_ttf_read_file(filename, &file_data, &file_size)) {
+        fprintf(stderr, "Failed to read truetype font %s: %s\n", filename, strerror(errno));
+        goto exit;
+    }
+
     FT_Face face;
-    error = FT_New_Face(font_data.ft_library, filename, 0, &face);
+    error = FT_New_Memory_Face(font_data.ft_library, (const FT_Byte *)file_data,
+                               file_size, 0, &face);
     if (error) {
         fprintf(stderr, "Failed to load truetype face %s: %d\n", filename, error);
+        free(file_data);
         goto exit;
     }
 
@@ -219,22 +646,46 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
     if (error) {
          fprintf(stderr, "Failed to set truetype face size to %d, dpi %d: %d\n", size, dpi, error);
          FT_Done_Face(face);
+         free(file_data);
          goto exit;
     }
 
+    // Make the atlas wide enough for a few glyphs per shelf. The char size
+    // is in 1/64th points, so the size is in 1/4th points.
+    ppem = size * dpi / (4 * 72);
+    atlas_w = ATLAS_MIN_WIDTH;
+    while (atlas_w < ppem * 8 && atlas_w < ATLAS_MAX_WIDTH) {
+        atlas_w *= 2;
+    }
+
     res = (TrueTypeFont *)malloc(sizeof(TrueTypeFont));
     memset(res, 0, sizeof(TrueTypeFont));
     res->type = FONT_TYPE_TTF;
     res->size = size;
     res->dpi = dpi;
     res->face = face;
+    res->file_data = file_data;
+    res->file_size = file_size;
+    res->file_hash = fnv_hash(file_data, file_size);
     res->max_height = -1;
     res->base = -1;
     res->refcount = 1;
-    res->glyph_cache = hashmapCreate(32, hashmapIntHash, hashmapIntEquals);
+    if (!gr_ttf_atlas_init(&res->atlas, atlas_w, ATLAS_MIN_HEIGHT, face->num_glyphs)) {
+        fprintf(stderr, "Failed to allocate glyph atlas for %s\n", filename);
+        FT_Done_Face(face);
+        free(file_data);
+        free(res);
+        res = nullptr;
+        goto exit;
+    }
     res->string_cache = hashmapCreate(128, gr_ttf_string_cache_hash, gr_ttf_string_cache_equals);
     pthread_mutex_init(&res->mutex, 0);
 
+    if (gr_ttf_cache_load(res)) {
+        printf("Loaded %zu cached glyphs for %s (size %d, dpi %d)\n",
+               res->atlas.glyphs_len, filename, size, dpi);
+    }
+
     if (!font_data.fonts) {
         font_data.fonts = hashmapCreate(4, gr_ttf_font_cache_hash, gr_ttf_font_cache_equals);
     }
@@ -271,15 +722,6 @@ void *gr_ttf_scaleFont(void *font, int max_width, int measured_width)
     return gr_ttf_loadFont(file, new_size, dpi);
 }
 
-static bool gr_ttf_freeFontCache(void *key, void *value, void *context __unused)
-{
-    TrueTypeCacheEntry *e = (TrueTypeCacheEntry *)value;
-    FT_Done_Glyph((FT_Glyph)e->glyph);
-    free(e);
-    free(key);
-    return true;
-}
-
 static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unused)
 {
     StringCacheKey *k = (StringCacheKey *)key;
@@ -287,7 +729,7 @@ static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unuse
     free(k);
 
     StringCacheEntry *e = (StringCacheEntry *)value;
-    free(e->surface.data);
+    free(e->glyphs);
     free(e);
     return true;
 }
@@ -306,14 +748,16 @@ void gr_ttf_freeFont(void *font)
             font_data.fonts = nullptr;
         }
 
+        gr_ttf_cache_save(d);
+
         free(d->key->path);
         free(d->key);
 
         FT_Done_Face(d->face);
+        free(d->file_data);
         hashmapForEach(d->string_cache, gr_ttf_freeStringCache, nullptr);
         hashmapFree(d->string_cache);
-        hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, nullptr);
-        hashmapFree(d->glyph_cache);
+        gr_ttf_atlas_free(&d->atlas);
         pthread_mutex_destroy(&d->mutex);
         free(d);
     }
@@ -321,67 +765,71 @@ void gr_ttf_freeFont(void *font)
     pthread_mutex_unlock(&font_data.mutex);
 }
 
-static TrueTypeCacheEntry *gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_index)
+static int32_t gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_index)
 {
-    return (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
+    if (char_index < 0 || (size_t) char_index >= font->atlas.lookup_len) {
+        return -1;
+    }
+    return font->atlas.lookup[char_index];
 }
 
-static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
+// Returns the index of the glyph in the atlas, rendering it if needed.
+// Pointers into the glyph table are invalidated when a glyph is added.
+static int32_t gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
 {
-    TrueTypeCacheEntry *res = (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
-    if (!res) {
-        int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
-        if (error) {
-            fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
-            return nullptr;
+    int32_t res = gr_ttf_glyph_cache_peek(font, char_index);
+    if (res < 0) {
+        if (char_index < 0 || (size_t) char_index >= font->atlas.lookup_len) {
+            return -1;
         }
 
-        FT_BitmapGlyph glyph;
-        error = FT_Get_Glyph(font->face->glyph, (FT_Glyph*)&glyph);
+        int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
         if (error) {
-            fprintf(stderr, "Failed to copy glyph %d: %d\n", char_index, error);
-            return nullptr;
+            fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
+            return -1;
         }
 
-        res = (TrueTypeCacheEntry *)malloc(sizeof(TrueTypeCacheEntry));
-        memset(res, 0, sizeof(TrueTypeCacheEntry));
-        res->glyph = glyph;
-        FT_Glyph_Get_CBox((FT_Glyph)glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
-
-        int *key = (int *)malloc(sizeof(int));
-        *key = char_index;
-
-        hashmapPut(font->glyph_cache, key, res);
-    }
-
-    return res;
-}
+        FT_GlyphSlot slot = font->face->glyph;
+        AtlasGlyph g;
+        memset(&g, 0, sizeof(g));
+        g.char_index = char_index;
+        g.left = slot->bitmap_left;
+        g.top = slot->bitmap_top;
+        g.advance = slot->advance.x >> 6;
+
+        if (slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
+            // Keep the metrics so that the text layout stays the same
+            fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", slot->bitmap.pixel_mode);
+        } else if (slot->bitmap.width > 0 && slot->bitmap.rows > 0) {
+            int x, y;
+            if (!gr_ttf_atlas_reserve(&font->atlas, slot->bitmap.width,
+                                      slot->bitmap.rows, &x, &y)) {
+                fprintf(stderr, "No space in glyph atlas for glyph %d\n", char_index);
+                return -1;
+            }
 
-static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
-{
-    unsigned y;
-    uint8_t *src_itr = glyph->bitmap.buffer;
-    uint8_t *dest_itr = dest->data;
+            g.x = x;
+            g.y = y;
+            g.width = slot->bitmap.width;
+            g.height = slot->bitmap.rows;
 
-    if (glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
-        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-        return -1;
-    }
+            const uint8_t *src_itr = slot->bitmap.buffer;
+            uint8_t *dest_itr = font->atlas.surface.data + y * font->atlas.surface.stride + x;
 
-    dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
+            for (unsigned row = 0; row < slot->bitmap.rows; ++row) {
+                memcpy(dest_itr, src_itr, slot->bitmap.width);
+                src_itr += slot->bitmap.pitch;
+                dest_itr += font->atlas.surface.stride;
+            }
+        }
 
-    // FIXME: if glyph->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if (dest_itr < dest->data) {
-        dest_itr = dest->data;
+        res = gr_ttf_atlas_append(&font->atlas, &g);
+        if (res >= 0) {
+            font->atlas.dirty = true;
+        }
     }
 
-    for (y = 0; y < glyph->bitmap.rows; ++y) {
-        memcpy(dest_itr, src_itr, glyph->bitmap.width);
-        src_itr += glyph->bitmap.pitch;
-        dest_itr += dest->stride;
-    }
-    return 0;
+    return res;
 }
 
 static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
@@ -389,10 +837,10 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     char c;
     int char_idx;
     int error;
+    int32_t ent;
     FT_Glyph glyph;
     FT_BBox bbox;
     FT_BBox bbox_glyph;
-    TrueTypeCacheEntry *ent;
 
     bbox.yMin = bbox_glyph.yMin = LONG_MAX;
     bbox.yMax = bbox_glyph.yMax = LONG_MIN;
@@ -400,9 +848,10 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     for (c = '!'; c <= '~'; ++c) {
         char_idx = FT_Get_Char_Index(f->face, c);
         ent = gr_ttf_glyph_cache_peek(f, char_idx);
-        if (ent) {
-            bbox.yMin = MIN(bbox.yMin, ent->bbox.yMin);
-            bbox.yMax = MAX(bbox.yMax, ent->bbox.yMax);
+        if (ent >= 0) {
+            const AtlasGlyph *g = &f->atlas.glyphs[ent];
+            bbox.yMin = MIN(bbox.yMin, g->top - g->height);
+            bbox.yMax = MAX(bbox.yMax, g->top);
         } else {
             error = FT_Load_Glyph(f->face, char_idx, 0);
             if (error) {
@@ -436,22 +885,23 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
 }
 
 // returns number of bytes from const char *text rendered to fit max_width, not number of UTF8 characters!
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+static int gr_ttf_layout_text(TrueTypeFont *font, StringCacheEntry *entry, const char *text, int max_width)
 {
     TrueTypeFont *f = font;
-    TrueTypeCacheEntry *ent;
+    int32_t ent;
     int bytes_rendered = 0, total_w = 0;
     int utf_bytes = 0;
     unsigned int unicode = 0;
     int i, x, diff, char_idx, prev_idx = 0;
-    int height;
     FT_Vector delta;
-    uint8_t *data = nullptr;
     const char *text_itr = text;
     int *char_idxs;
+    int32_t *glyph_idxs;
     int char_idxs_len = 0;
+    size_t text_len = strlen(text);
 
-    char_idxs = (int *) malloc(strlen(text) * sizeof(int));
+    char_idxs = (int *) malloc(MAX(text_len, 1) * sizeof(int));
+    glyph_idxs = (int32_t *) malloc(MAX(text_len, 1) * sizeof(int32_t));
 
     while (*text_itr) {
         utf_bytes = utf8_to_unicode(text_itr, &unicode);
@@ -462,8 +912,9 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
         char_idxs[char_idxs_len] = char_idx;
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if (ent) {
-            diff = ent->glyph->root.advance.x >> 16;
+        glyph_idxs[char_idxs_len] = ent;
+        if (ent >= 0) {
+            diff = f->atlas.glyphs[ent].advance;
 
             if (FT_HAS_KERNING(f->face) && prev_idx && char_idx) {
                 FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
@@ -486,23 +937,16 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
 
     if (font->max_height == -1) {
         free(char_idxs);
+        free(glyph_idxs);
         return -1;
     }
 
-    height = font->max_height;
-
-    data = (uint8_t *) malloc(total_w*height);
-    memset(data, 0, total_w*height);
+    entry->width = total_w;
+    entry->glyphs = (StringCacheGlyph *) malloc(MAX(char_idxs_len, 1) * sizeof(StringCacheGlyph));
+    entry->glyphs_len = 0;
     x = 0;
     prev_idx = 0;
 
-    surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (GGLubyte*)data;
-    surface->format = GGL_PIXEL_FORMAT_A_8;
-
     for (i = 0; i < char_idxs_len; ++i) {
         char_idx = char_idxs[i];
         if (FT_HAS_KERNING(f->face) && prev_idx && char_idx) {
@@ -510,16 +954,25 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
             x += delta.x >> 6;
         }
 
-        ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if (ent) {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-            x += ent->glyph->root.advance.x >> 16;
+        ent = glyph_idxs[i];
+        if (ent >= 0) {
+            const AtlasGlyph *g = &f->atlas.glyphs[ent];
+
+            // Glyphs without a bitmap (eg. spaces) only move the pen
+            if (g->width > 0 && g->height > 0) {
+                entry->glyphs[entry->glyphs_len].glyph = ent;
+                entry->glyphs[entry->glyphs_len].x = x;
+                ++entry->glyphs_len;
+            }
+
+            x += g->advance;
         }
 
         prev_idx = char_idx;
     }
 
     free(char_idxs);
+    free(glyph_idxs);
     return bytes_rendered;
 }
 
@@ -545,12 +998,11 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
     if (!res) {
         res = (StringCacheEntry *)malloc(sizeof(StringCacheEntry));
         memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
+        res->rendered_bytes = gr_ttf_layout_text(font, res, text, max_width);
         if (res->rendered_bytes < 0) {
             free(res);
             return nullptr;
         }
-
         StringCacheKey *new_key = (StringCacheKey *)malloc(sizeof(StringCacheKey));
         memset(new_key, 0, sizeof(StringCacheKey));
         new_key->max_width = max_width;
@@ -612,7 +1064,7 @@ int gr_ttf_measureEx(const char *s, void *font)
     pthread_mutex_lock(&f->mutex);
     StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
     if (e) {
-        res = e->surface.width;
+        res = e->width;
     }
     pthread_mutex_unlock(&f->mutex);
 
@@ -622,7 +1074,7 @@ int gr_ttf_measureEx(const char *s, void *font)
 int gr_ttf_maxExW(const char *s, void *font, int max_width)
 {
     TrueTypeFont *f = (TrueTypeFont *)font;
-    TrueTypeCacheEntry *ent;
+    int32_t ent;
     int max_bytes = 0, total_w = 0;
     int utf_bytes, prev_utf_bytes = 0;
     unsigned int unicode = 0;
@@ -657,11 +1109,11 @@ int gr_ttf_maxExW(const char *s, void *font, int max_width)
         prev_utf_bytes = utf_bytes;
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if (!ent) {
+        if (ent < 0) {
             continue;
         }
 
-        total_w += ent->glyph->root.advance.x >> 16;
+        total_w += f->atlas.glyphs[ent].advance;
         max_bytes += utf_bytes;
     }
     pthread_mutex_unlock(&f->mutex);
@@ -672,6 +1124,8 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
 {
     GGLContext *gl = (GGLContext *)context;
     TrueTypeFont *font = (TrueTypeFont *)pFont;
+    GlyphAtlas *atlas = &font->atlas;
+    bool texture_bound = false;
 
     // not actualy max width, but max_width + x
     if (max_width != -1) {
@@ -689,7 +1143,8 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         return -1;
     }
 
-    int y_bottom = y + e->surface.height;
+    int x_right = x + e->width;
+    int y_bottom = y + font->max_height;
     int res = e->rendered_bytes;
 
     if (max_height != -1 && max_height < y_bottom) {
@@ -700,15 +1155,53 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         }
     }
 
-    gl->bindTexture(gl, &e->surface);
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    for (int i = 0; i < e->glyphs_len; ++i) {
+        const AtlasGlyph *g = &atlas->glyphs[e->glyphs[i].glyph];
+        int src_x = g->x;
+        int src_y = g->y;
+        int dst_x = x + e->glyphs[i].x + g->left;
+        int dst_y = y + font->base - g->top;
+        int w = g->width;
+        int h = g->height;
+
+        // Clip to the string's bounding box
+        if (dst_x < x) {
+            src_x += x - dst_x;
+            w -= x - dst_x;
+            dst_x = x;
+        }
+        if (dst_y < y) {
+            src_y += y - dst_y;
+            h -= y - dst_y;
+            dst_y = y;
+        }
+        w = MIN(w, x_right - dst_x);
+        h = MIN(h, y_bottom - dst_y);
+        if (w <= 0 || h <= 0) {
+            continue;
+        }
+
+        const GGLubyte *mask = atlas->surface.data + src_y * atlas->surface.stride + src_x;
+        if (gr_raster_mask(mask, atlas->surface.stride, dst_x, dst_y, w, h)) {
+            continue;
+        }
 
-    gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, -x, -y);
-    gl->recti(gl, x, y, x + e->surface.width, y_bottom);
-    gl->disable(gl, GGL_TEXTURE_2D);
+        if (!texture_bound) {
+            gl->bindTexture(gl, &atlas->surface);
+            gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+            gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+            gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+            gl->enable(gl, GGL_TEXTURE_2D);
+            texture_bound = true;
+        }
+
+        gl->texCoord2i(gl, src_x - dst_x, src_y - dst_y);
+        gl->recti(gl, dst_x, dst_y, dst_x + w, dst_y + h);
+    }
+
+    if (texture_bound) {
+        gl->disable(gl, GGL_TEXTURE_2D);
+    }
 
     pthread_mutex_unlock(&font->mutex);
     return res;
@@ -730,11 +1223,42 @@ int gr_ttf_getMaxFontHeight(void *font)
     return res;
 }
 
+static bool gr_ttf_save_font_cache(void *key __unused, void *value, void *context)
+{
+    TrueTypeFont *f = (TrueTypeFont *)value;
+    int *saved = (int *)context;
+
+    pthread_mutex_lock(&f->mutex);
+    if (gr_ttf_cache_save(f)) {
+        ++*saved;
+    }
+    pthread_mutex_unlock(&f->mutex);
+
+    return true;
+}
+
+void gr_ttf_saveCaches(void)
+{
+    int saved = 0;
+
+    pthread_mutex_lock(&font_data.mutex);
+
+    if (font_data.fonts) {
+        hashmapForEach(font_data.fonts, gr_ttf_save_font_cache, &saved);
+    }
+
+    pthread_mutex_unlock(&font_data.mutex);
+
+    if (saved > 0) {
+        printf("Saved glyph atlases for %d fonts\n", saved);
+    }
+}
+
 static bool gr_ttf_dump_stats_count_string_cache(void *key __unused, void *value, void *context)
 {
     int *string_cache_size = (int *) context;
     StringCacheEntry *e = (StringCacheEntry *) value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
+    *string_cache_size += e->glyphs_len*sizeof(StringCacheGlyph) + sizeof(StringCacheEntry);
     return true;
 }
 
@@ -753,11 +1277,12 @@ static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
            "    refcount: %d\n"
            "    max_height: %d\n"
            "    base: %d\n"
-           "    glyph_cache: %zu entries\n"
+           "    glyph_atlas: %zu glyphs (%dx%d, %.2f kB)\n"
            "    string_cache: %zu entries (%.2f kB)\n",
            k->path, k->size, k->dpi,
            f->refcount, f->max_height, f->base,
-           hashmapSize(f->glyph_cache),
+           f->atlas.glyphs_len, f->atlas.surface.width, f->atlas.surface.height,
+           ((double)f->atlas.surface.width*f->atlas.surface.height)/1024,
            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
 
     pthread_mutex_unlock(&f->mutex);
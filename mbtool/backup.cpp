@@ -43,6 +43,7 @@
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/selinux.h"
@@ -225,9 +226,11 @@ static bool backup_image(const std::string &output_file,
         return false;
     }
 
-    fsck_ext4_image(image);
+    fsck_ext4_image(image, FsckPolicy::IF_NEEDED);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", MS_RDONLY, "")) {
+    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", MS_RDONLY, "",
+                     util::LOOPDEV_DIRECT_IO
+                     | util::LOOPDEV_BACKING_BLOCK_SIZE)) {
         LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
              strerror(errno));
         return false;
@@ -277,9 +280,11 @@ static bool restore_image(const std::string &input_file,
         return false;
     }
 
-    fsck_ext4_image(image);
+    fsck_ext4_image(image, FsckPolicy::IF_NEEDED);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", 0, "")) {
+    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", 0, "",
+                     util::LOOPDEV_DIRECT_IO
+                     | util::LOOPDEV_BACKING_BLOCK_SIZE)) {
         LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
              strerror(errno));
         return false;
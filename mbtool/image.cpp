@@ -22,11 +22,13 @@
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/command.h"
 #include "mbutil/directory.h"
+#include "mbutil/ext4.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/string.h"
@@ -42,7 +44,19 @@ static void output_cb(const char *line, bool error, void *userdata)
     LOGV("%s: %s", args[0], line);
 }
 
-CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
+/*!
+ * \brief Create a new sparse ext4 image
+ *
+ * \param path Image file path
+ * \param size Size of image in bytes
+ * \param source_dir If not empty, populate the image with the contents of this
+ *                   directory
+ * \param exclusions Top-level entries in \p source_dir that should not be
+ *                   copied
+ */
+CreateImageResult create_ext4_image(const std::string &path, uint64_t size,
+                                    const std::string &source_dir,
+                                    const std::vector<std::string> &exclusions)
 {
     // Ensure we have enough space since we're creating a sparse file that may
     // get bigger
@@ -60,18 +74,17 @@ CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
             LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
             return CreateImageResult::FAILED;
         } else {
-            char size_str[64];
-            snprintf(size_str, sizeof(size_str), "%" PRIu64, size);
-
-            LOGD("%s: Creating new %s ext4 image", path.c_str(), size_str);
+            LOGD("%s: Creating new %" PRIu64 " byte ext4 image",
+                 path.c_str(), size);
+            if (!source_dir.empty()) {
+                LOGD("%s: Populating image from %s",
+                     path.c_str(), source_dir.c_str());
+            }
 
             // Create new image
-            const char *argv[] =
-                    { "make_ext4fs", "-l", size_str, path.c_str(), nullptr };
-            int ret = util::run_command(argv[0], argv, nullptr, nullptr,
-                                        &output_cb, argv);
-            if (ret < 0 || WEXITSTATUS(ret) != 0) {
-                LOGE("%s: Failed to create image", path.c_str());
+            if (!util::ext4_create_image(path, size, source_dir, exclusions)) {
+                LOGE("%s: Failed to create image: %s",
+                     path.c_str(), strerror(errno));
                 return CreateImageResult::FAILED;
             }
             return CreateImageResult::SUCCEEDED;
@@ -82,9 +95,40 @@ CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
     return CreateImageResult::IMAGE_EXISTS;
 }
 
-bool fsck_ext4_image(const std::string &image)
+bool fsck_ext4_image(const std::string &image, FsckPolicy policy)
 {
-    const char *argv[] = { "e2fsck", "-f", "-y", image.c_str(), nullptr };
+    bool force = true;
+
+    if (policy == FsckPolicy::IF_NEEDED) {
+        util::Ext4SuperblockInfo info;
+
+        if (!util::ext4_read_superblock(image.c_str(), &info)) {
+            LOGW("%s: Failed to read ext4 superblock: %s",
+                 image.c_str(), strerror(errno));
+        } else {
+            util::Ext4Health health = util::ext4_get_health(
+                    info, static_cast<uint32_t>(time(nullptr)));
+
+            if (health == util::Ext4Health::CLEAN) {
+                LOGD("%s: File system is clean; skipping e2fsck",
+                     image.c_str());
+                return true;
+            }
+
+            LOGD("%s: File system %s; running e2fsck", image.c_str(),
+                 util::ext4_health_string(health));
+
+            // e2fsck will do a full check on its own if the file system is not
+            // clean. If only the journal needs to be replayed, this avoids
+            // checking the whole image.
+            force = false;
+        }
+    }
+
+    const char *argv_force[] = { "e2fsck", "-f", "-y", image.c_str(), nullptr };
+    const char *argv_normal[] = { "e2fsck", "-y", image.c_str(), nullptr };
+    const char **argv = force ? argv_force : argv_normal;
+
     int ret = util::run_command(argv[0], argv, nullptr, nullptr,
                                 &output_cb, argv);
     if (ret < 0 || (WEXITSTATUS(ret) != 0 && WEXITSTATUS(ret) != 1)) {
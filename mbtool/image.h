@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #define DEFAULT_IMAGE_SIZE ((uint64_t) 4 * 1024 * 1024 * 1024)
 
@@ -34,7 +35,19 @@ enum class CreateImageResult
     FAILED
 };
 
-CreateImageResult create_ext4_image(const std::string &path, uint64_t size);
-bool fsck_ext4_image(const std::string &image);
+enum class FsckPolicy
+{
+    // Always run a full forced check
+    FORCE,
+    // Skip the check if the superblock says the file system was cleanly
+    // unmounted. Otherwise, let e2fsck decide what needs to be checked.
+    IF_NEEDED,
+};
+
+CreateImageResult create_ext4_image(const std::string &path, uint64_t size,
+                                    const std::string &source_dir = std::string(),
+                                    const std::vector<std::string> &exclusions = {});
+bool fsck_ext4_image(const std::string &image,
+                     FsckPolicy policy = FsckPolicy::FORCE);
 
 }
\ No newline at end of file
@@ -44,6 +44,7 @@
 #include "mbcommon/version.h"
 #include "mbdevice/json.h"
 #include "mbdevice/validate.h"
+#include "mblog/async_logger.h"
 #include "mblog/kmsg_logger.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/dir.h"
@@ -944,11 +945,14 @@ static bool disable_spota()
 {
     static const char *spota_dir = "/data/security/spota";
 
-    std::unordered_map<std::string, std::string> props;
-    util::file_get_all_properties("/system/build.prop", &props);
+    std::vector<std::string> props;
+    util::file_get_properties("/system/build.prop",
+                              { "ro.product.manufacturer", "ro.product.brand" },
+                              &props, "");
 
-    if (strcasecmp(props["ro.product.manufacturer"].c_str(), "samsung") != 0
-            && strcasecmp(props["ro.product.brand"].c_str(), "samsung") != 0) {
+    if (props.size() != 2
+            || (strcasecmp(props[0].c_str(), "samsung") != 0
+                    && strcasecmp(props[1].c_str(), "samsung") != 0)) {
         // Not a Samsung device
         LOGV("Not mounting empty tmpfs over: %s", spota_dir);
         return true;
@@ -1213,8 +1217,14 @@ int init_main(int argc, char *argv[])
     // Redirect std{in,out,err} to /dev/null
     open_devnull_stdio();
 
-    // Log to kmsg
-    log::log_set_logger(std::make_shared<log::KmsgLogger>(true));
+    // Log to kmsg. Writes to /dev/kmsg are slow, so move them off of the
+    // critical path of the boot process. If mbtool crashes, the queued
+    // messages are written directly to a separate kmsg fd, which is never
+    // closed.
+    int crash_kmsg_fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
+    log::log_set_logger(std::make_shared<log::AsyncLogger>(
+            std::make_shared<log::KmsgLogger>(true),
+            ASYNC_LOG_DEFAULT_SLOTS, crash_kmsg_fd));
     if (klogctl(KLOG_CONSOLE_LEVEL, nullptr, 7) < 0) {
         LOGE("Failed to set loglevel: %s", strerror(errno));
     }
@@ -1371,6 +1381,7 @@ int init_main(int argc, char *argv[])
 
     // Start real init
     LOGD("Launching real init ...");
+    log::log_flush();
     execlp("/init", "/init", nullptr);
     LOGE("Failed to exec real init: %s", strerror(errno));
     critical_failure();
@@ -18,6 +18,7 @@
 #include "initwrapper/cutils/uevent.h"
 
 #include <cerrno>
+#include <cstring>
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -47,6 +48,44 @@ ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length
     return uevent_kernel_recv(socket, buffer, length, true, uid);
 }
 
+/*
+ * Returns true if the message described by hdr came from the kernel and should
+ * be processed
+ */
+static bool uevent_check_sender(struct msghdr *hdr, bool require_group,
+                                uid_t *uid)
+{
+    struct sockaddr_nl *addr = (struct sockaddr_nl *) hdr->msg_name;
+    struct cmsghdr *cmsg;
+    struct ucred *cred;
+
+    *uid = -1;
+
+    cmsg = CMSG_FIRSTHDR(hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+        // Ignoring netlink message with no sender credentials
+        return false;
+    }
+
+    cred = (struct ucred *) CMSG_DATA(cmsg);
+    *uid = cred->uid;
+    if (cred->uid != 0) {
+        // Ignoring netlink message from non-root user
+        return false;
+    }
+
+    if (addr->nl_pid != 0) {
+        // Ignore non-kernel
+        return false;
+    }
+    if (require_group && addr->nl_groups == 0) {
+        // Ignore unicast messages when requested
+        return false;
+    }
+
+    return true;
+}
+
 ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid)
 {
     struct iovec iov = { buffer, length };
@@ -68,38 +107,68 @@ ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require
         return n;
     }
 
-    struct cmsghdr *cmsg;
-    struct ucred *cred;
+    if (!uevent_check_sender(&hdr, require_group, uid)) {
+        // Clear residual potentially malicious data
+        bzero(buffer, length);
+        errno = EIO;
+        return -1;
+    }
 
-    cmsg = CMSG_FIRSTHDR(&hdr);
-    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
-        // Ignoring netlink message with no sender credentials
-        goto out;
+    return n;
+}
+
+/*
+ * Receive up to count messages with a single recvmmsg() call. Message i is
+ * stored at buffer + i * stride and its size is stored in sizes[i]. Messages
+ * that did not come from the kernel (see uevent_kernel_recv()) are cleared and
+ * have their size set to -1.
+ *
+ * Returns the number of messages received or -1 if recvmmsg() fails.
+ */
+int uevent_kernel_multicast_recv_batch(int socket, void *buffer, size_t stride,
+                                       size_t length, size_t count,
+                                       ssize_t *sizes)
+{
+    struct mmsghdr msgs[UEVENT_MAX_BATCH];
+    struct iovec iovs[UEVENT_MAX_BATCH];
+    struct sockaddr_nl addrs[UEVENT_MAX_BATCH];
+    char controls[UEVENT_MAX_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+
+    if (count > UEVENT_MAX_BATCH) {
+        count = UEVENT_MAX_BATCH;
     }
 
-    cred = (struct ucred *) CMSG_DATA(cmsg);
-    *uid = cred->uid;
-    if (cred->uid != 0) {
-        // Ignoring netlink message from non-root user
-        goto out;
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i].iov_base = (char *) buffer + i * stride;
+        iovs[i].iov_len = length;
+
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
     }
 
-    if (addr.nl_pid != 0) {
-        // Ignore non-kernel
-        goto out;
+    int n = recvmmsg(socket, msgs, count, 0, nullptr);
+    if (n <= 0) {
+        return n;
     }
-    if (require_group && addr.nl_groups == 0) {
-        // Ignore unicast messages when requested
-        goto out;
+
+    for (int i = 0; i < n; ++i) {
+        uid_t uid;
+
+        if (uevent_check_sender(&msgs[i].msg_hdr, true, &uid)) {
+            sizes[i] = msgs[i].msg_len;
+        } else {
+            // Clear residual potentially malicious data
+            bzero(iovs[i].iov_base, length);
+            sizes[i] = -1;
+        }
     }
 
     return n;
-
-out:
-    // Clear residual potentially malicious data
-    bzero(buffer, length);
-    errno = EIO;
-    return -1;
 }
 
 int uevent_open_socket(int buf_sz, bool passcred)
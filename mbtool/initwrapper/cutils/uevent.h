@@ -19,7 +19,12 @@
 
 #include <sys/types.h>
 
+#define UEVENT_MAX_BATCH 64
+
 int uevent_open_socket(int buf_sz, bool passcred);
 ssize_t uevent_kernel_multicast_recv(int socket, void *buffer, size_t length);
 ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length, uid_t *uid);
-ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
\ No newline at end of file
+ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
+int uevent_kernel_multicast_recv_batch(int socket, void *buffer, size_t stride,
+                                       size_t length, size_t count,
+                                       ssize_t *sizes);
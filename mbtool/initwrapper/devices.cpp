@@ -17,8 +17,14 @@
 
 #include "initwrapper/devices.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <unordered_set>
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -45,6 +51,16 @@
 
 #define UEVENT_LOGGING 0
 
+// Number of messages to receive per recvmmsg() call
+#define UEVENT_BATCH_SIZE 32
+
+// Size of the uevent socket's receive buffer. This needs to be large enough to
+// hold all of the events generated while the coldboot threads are poking
+// uevent files faster than the events are processed.
+#define UEVENT_SOCKET_BUF_SIZE (2 * 1024 * 1024)
+
+#define MAX_COLDBOOT_THREADS 4
+
 static char bootdevice[PROP_VALUE_MAX];
 static int device_fd = -1;
 static int pipe_fd[2];
@@ -73,8 +89,22 @@ struct platform_node {
 static std::vector<platform_node> platform_names;
 
 static std::unordered_map<std::string, BlockDevInfo> block_dev_mappings;
+// Copy of block_dev_mappings returned by get_block_dev_mappings(). Reset when
+// block_dev_mappings changes.
+static std::shared_ptr<const std::unordered_map<std::string, BlockDevInfo>>
+        block_dev_mappings_snapshot;
 static std::mutex block_dev_mappings_guard;
 
+// Device nodes and symlinks that have already been created. Coldboot can
+// generate several add events for the same device, so these are used to avoid
+// recreating the same nodes and links. Only accessed from the thread that is
+// handling uevents.
+static std::unordered_map<std::string, dev_t> created_nodes;
+static std::unordered_map<std::string, std::string> created_links;
+
+// Whether the uevent socket's receive buffer overflowed
+static std::atomic<bool> uevent_overrun(false);
+
 static mode_t get_device_perm(const char *path,
                               const std::vector<std::string> &links,
                               unsigned *uid, unsigned *gid)
@@ -106,6 +136,12 @@ static void make_device(const char *path,
     mode = get_device_perm(path, links, &uid, &gid) | (block ? S_IFBLK : S_IFCHR);
 
     dev = makedev(major, minor);
+
+    auto it = created_nodes.find(path);
+    if (it != created_nodes.end() && it->second == dev) {
+        return;
+    }
+
     // Temporarily change egid to avoid race condition setting the gid of the
     // device node. Unforunately changing the euid would prevent creation of
     // some device nodes, so the uid has to be set with chown() and is still
@@ -117,6 +153,22 @@ static void make_device(const char *path,
         chown(path, uid, -1);
         setegid(0);
     }
+
+    created_nodes[path] = dev;
+}
+
+static void make_link(const char *oldpath, const char *newpath)
+{
+    auto it = created_links.find(newpath);
+    if (it != created_links.end() && it->second == oldpath) {
+        return;
+    }
+
+    if (!dry_run) {
+        make_link_init(oldpath, newpath);
+    }
+
+    created_links[newpath] = oldpath;
 }
 
 static void add_platform_device(const char *path)
@@ -455,9 +507,7 @@ static std::vector<std::string> get_block_device_symlinks(struct uevent *uevent)
 
         if (!pdevs.empty() && bootdevice[0] != '\0'
                 && strstr(device.c_str(), bootdevice)) {
-            if (!dry_run) {
-                make_link_init(link_path, "/dev/block/bootdevice");
-            }
+            make_link(link_path, "/dev/block/bootdevice");
             is_bootdevice = true;
         } else {
             is_bootdevice = false;
@@ -526,9 +576,7 @@ static void handle_device(const char *action, const char *devpath,
     if (strcmp(action, "add") == 0) {
         make_device(devpath, path, block, major, minor, links);
         for (const std::string &link : links) {
-            if (!dry_run) {
-                make_link_init(devpath, link.c_str());
-            }
+            make_link(devpath, link.c_str());
         }
     }
 
@@ -537,10 +585,12 @@ static void handle_device(const char *action, const char *devpath,
             if (!dry_run) {
                 remove_link(devpath, link.c_str());
             }
+            created_links.erase(link);
         }
         if (!dry_run) {
             unlink(devpath);
         }
+        created_nodes.erase(devpath);
     }
 }
 
@@ -618,11 +668,15 @@ static void handle_block_device_event(struct uevent *uevent)
         }
 
         std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.emplace(
-                std::make_pair(uevent->path, std::move(info)));
+        if (block_dev_mappings.emplace(
+                std::make_pair(uevent->path, std::move(info))).second) {
+            block_dev_mappings_snapshot.reset();
+        }
     } else if (strcmp(uevent->action, "remove") == 0) {
         std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.erase(uevent->path);
+        if (block_dev_mappings.erase(uevent->path) > 0) {
+            block_dev_mappings_snapshot.reset();
+        }
     }
 }
 
@@ -765,26 +819,45 @@ static void handle_device_event(struct uevent *uevent)
 #define UEVENT_MSG_LEN  2048
 void handle_device_fd()
 {
-    char msg[UEVENT_MSG_LEN + 2];
-    int n;
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-        if (n >= UEVENT_MSG_LEN) {
-            // overflow -- discard
+    // Only one thread handles uevents at a time
+    static char msgs[UEVENT_BATCH_SIZE][UEVENT_MSG_LEN + 2];
+    ssize_t sizes[UEVENT_BATCH_SIZE];
+    int count;
+
+    while (true) {
+        count = uevent_kernel_multicast_recv_batch(
+                device_fd, msgs, sizeof(msgs[0]), UEVENT_MSG_LEN,
+                UEVENT_BATCH_SIZE, sizes);
+        if (count < 0 && errno == ENOBUFS) {
+            // Some events were dropped, but the socket is still usable
+            uevent_overrun = true;
             continue;
+        } else if (count <= 0) {
+            break;
         }
 
-        msg[n] = '\0';
-        msg[n + 1] = '\0';
+        for (int i = 0; i < count; ++i) {
+            char *msg = msgs[i];
+            ssize_t n = sizes[i];
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+            if (n <= 0 || n >= UEVENT_MSG_LEN) {
+                // Invalid sender or overflow -- discard
+                continue;
+            }
 
-        if (uevent.path && strstr(uevent.path, "sec-battery")) {
-            // sec-battery causes boot delays on the Galaxy S4
-            continue;
-        }
+            msg[n] = '\0';
+            msg[n + 1] = '\0';
+
+            struct uevent uevent;
+            parse_event(msg, &uevent);
 
-        handle_device_event(&uevent);
+            if (uevent.path && strstr(uevent.path, "sec-battery")) {
+                // sec-battery causes boot delays on the Galaxy S4
+                continue;
+            }
+
+            handle_device_event(&uevent);
+        }
     }
 }
 
@@ -805,7 +878,7 @@ static void do_coldboot(DIR *d)
 
     dfd = dirfd(d);
 
-    fd = openat(dfd, "uevent", O_WRONLY);
+    fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
     if (fd >= 0) {
         write(fd, "add\n", 4);
         close(fd);
@@ -819,7 +892,7 @@ static void do_coldboot(DIR *d)
             continue;
         }
 
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY);
+        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
         if (fd < 0) {
             continue;
         }
@@ -843,6 +916,122 @@ static void coldboot(const char *path)
     }
 }
 
+/*
+ * Parallel coldboot
+ *
+ * Several threads walk the /sys trees and poke the uevent files while the
+ * calling thread drains and handles the events. Writing to a uevent file
+ * queues the event on the netlink socket before write() returns and a
+ * directory's subdirectories are only queued for walking after its own
+ * uevent file has been poked. Thus, the event for a device is always handled
+ * before the events for its children (eg. a platform device before its block
+ * devices), just like with the serial walk.
+ */
+
+struct ColdbootQueue
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> dirs;
+    // Number of threads currently walking a directory
+    unsigned int busy = 0;
+};
+
+static void coldboot_worker(ColdbootQueue *queue)
+{
+    std::vector<std::string> subdirs;
+
+    while (true) {
+        std::string dir;
+
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->cv.wait(lock, [&]{
+                return !queue->dirs.empty() || queue->busy == 0;
+            });
+            if (queue->dirs.empty()) {
+                // Nothing left to walk and no other thread can add more
+                return;
+            }
+            dir = std::move(queue->dirs.back());
+            queue->dirs.pop_back();
+            ++queue->busy;
+        }
+
+        subdirs.clear();
+
+        int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            int fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                write(fd, "add\n", 4);
+                close(fd);
+            }
+
+            DIR *d = fdopendir(dfd);
+            if (d) {
+                struct dirent *de;
+                while ((de = readdir(d))) {
+                    if (de->d_type == DT_DIR && de->d_name[0] != '.') {
+                        subdirs.push_back(dir + "/" + de->d_name);
+                    }
+                }
+                closedir(d);
+            } else {
+                close(dfd);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            // Push in reverse so that entries are walked in readdir() order
+            queue->dirs.insert(queue->dirs.end(),
+                               std::make_move_iterator(subdirs.rbegin()),
+                               std::make_move_iterator(subdirs.rend()));
+            --queue->busy;
+        }
+        queue->cv.notify_all();
+    }
+}
+
+static void parallel_coldboot(const std::vector<const char *> &paths,
+                              unsigned int num_threads)
+{
+    ColdbootQueue queue;
+    std::atomic<unsigned int> running(num_threads);
+    std::vector<std::thread> threads;
+
+    // Walked in the order given
+    for (auto it = paths.rbegin(); it != paths.rend(); ++it) {
+        queue.dirs.push_back(*it);
+    }
+
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]{
+            coldboot_worker(&queue);
+            --running;
+        });
+    }
+
+    struct pollfd pfd;
+    pfd.fd = device_fd;
+    pfd.events = POLLIN;
+
+    while (running > 0) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 10) > 0 && (pfd.revents & POLLIN)) {
+            handle_device_fd();
+        }
+    }
+
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    // All events have been queued by now
+    handle_device_fd();
+}
+
 void * device_thread(void *)
 {
     struct pollfd fds[2];
@@ -880,17 +1069,37 @@ void device_init(bool dry_run_)
         strlcpy(bootdevice, value.c_str(), sizeof(bootdevice));
     }
 
-    // Is 256K enough? udev uses 16MB!
-    device_fd = uevent_open_socket(256 * 1024, true);
+    // udev uses 16MB!
+    device_fd = uevent_open_socket(UEVENT_SOCKET_BUF_SIZE, true);
     if (device_fd < 0) {
         return;
     }
 
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
-    coldboot("/sys/class");
-    coldboot("/sys/block");
-    coldboot("/sys/devices");
+    unsigned int num_threads = std::min<unsigned int>(
+            std::thread::hardware_concurrency(), MAX_COLDBOOT_THREADS);
+
+    uevent_overrun = false;
+
+    if (num_threads > 1) {
+        parallel_coldboot({ "/sys/class", "/sys/block", "/sys/devices" },
+                          num_threads);
+    }
+
+    if (num_threads <= 1 || uevent_overrun) {
+        if (uevent_overrun) {
+            LOGW("uevent socket overrun during parallel coldboot; "
+                 "retrying serially");
+        }
+
+        coldboot("/sys/class");
+        coldboot("/sys/block");
+        coldboot("/sys/devices");
+    }
+
+    // Build the block device index before anything asks for it
+    get_block_dev_mappings();
 
     run_thread = true;
     pipe(pipe_fd);
@@ -915,8 +1124,14 @@ int get_device_fd()
     return device_fd;
 }
 
-std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings()
+std::shared_ptr<const std::unordered_map<std::string, BlockDevInfo>>
+get_block_dev_mappings()
 {
     std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-    return block_dev_mappings;
+    if (!block_dev_mappings_snapshot) {
+        block_dev_mappings_snapshot = std::make_shared<
+                const std::unordered_map<std::string, BlockDevInfo>>(
+                        block_dev_mappings);
+    }
+    return block_dev_mappings_snapshot;
 }
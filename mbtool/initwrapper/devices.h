@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 
@@ -36,4 +37,5 @@ void device_init(bool dry_run);
 void device_close();
 int get_device_fd();
 
-std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings();
+std::shared_ptr<const std::unordered_map<std::string, BlockDevInfo>>
+get_block_dev_mappings();
@@ -60,6 +60,7 @@
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
 #include "mbutil/delete.h"
+#include "mbutil/devnode.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
@@ -161,15 +162,6 @@ static int log_umount(const char *target)
     return ret;
 }
 
-static int log_mknod(const char *pathname, mode_t mode, dev_t dev)
-{
-    int ret = mknod(pathname, mode, dev);
-    if (ret < 0) {
-        LOGE("Failed to create special file %s: %s", pathname, strerror(errno));
-    }
-    return ret;
-}
-
 static bool log_is_mounted(const std::string &mountpoint)
 {
     bool ret = util::is_mounted(mountpoint);
@@ -347,30 +339,30 @@ bool Installer::create_chroot()
     remove(in_chroot("/sbin/reboot").c_str());
 
     // Don't create unnecessary special files in /dev to avoid install scripts
-    // from overwriting partitions
-    if (log_mknod(in_chroot("/dev/console").c_str(), S_IFCHR | 0644, makedev(5, 1)) < 0
-            || log_mknod(in_chroot("/dev/null").c_str(), S_IFCHR | 0644, makedev(1, 3)) < 0
-            || log_mknod(in_chroot("/dev/ptmx").c_str(), S_IFCHR | 0644, makedev(5, 2)) < 0
-            || log_mknod(in_chroot("/dev/random").c_str(), S_IFCHR | 0644, makedev(1, 8)) < 0
-            || log_mknod(in_chroot("/dev/tty").c_str(), S_IFCHR | 0644, makedev(5, 0)) < 0
-            || log_mknod(in_chroot("/dev/urandom").c_str(), S_IFCHR | 0644, makedev(1, 9)) < 0
-            || log_mknod(in_chroot("/dev/zero").c_str(), S_IFCHR | 0644, makedev(1, 5)) < 0
-            || log_mknod(in_chroot("/dev/loop-control").c_str(), S_IFCHR | 0644, makedev(10, 237)) < 0
-            || log_mknod(in_chroot("/dev/fuse").c_str(), S_IFCHR | 0644, makedev(10, 229))) {
-        return false;
-    }
+    // from overwriting partitions. A few loopback devices are also created
+    // since some installers expect them to exist, but don't create them. They
+    // are not necessary for mbtool to work.
+    std::vector<util::DeviceNode> nodes{
+        { "/dev/console",      S_IFCHR | 0644, makedev(5, 1),    0, 0, {} },
+        { "/dev/null",         S_IFCHR | 0644, makedev(1, 3),    0, 0, {} },
+        { "/dev/ptmx",         S_IFCHR | 0644, makedev(5, 2),    0, 0, {} },
+        { "/dev/random",       S_IFCHR | 0644, makedev(1, 8),    0, 0, {} },
+        { "/dev/tty",          S_IFCHR | 0644, makedev(5, 0),    0, 0, {} },
+        { "/dev/urandom",      S_IFCHR | 0644, makedev(1, 9),    0, 0, {} },
+        { "/dev/zero",         S_IFCHR | 0644, makedev(1, 5),    0, 0, {} },
+        { "/dev/loop-control", S_IFCHR | 0644, makedev(10, 237), 0, 0, {} },
+        { "/dev/fuse",         S_IFCHR | 0644, makedev(10, 229), 0, 0, {} },
+        { "/dev/block/loop0",  S_IFBLK | 0644, makedev(7, 0),    0, 0, {} },
+        { "/dev/block/loop1",  S_IFBLK | 0644, makedev(7, 1),    0, 0, {} },
+        { "/dev/block/loop2",  S_IFBLK | 0644, makedev(7, 2),    0, 0, {} },
+        { "/dev/block/loop3",  S_IFBLK | 0644, makedev(7, 3),    0, 0, {} },
+        { "/dev/block/loop4",  S_IFBLK | 0644, makedev(7, 4),    0, 0, {} },
+        { "/dev/block/loop5",  S_IFBLK | 0644, makedev(7, 5),    0, 0, {} },
+        { "/dev/block/loop6",  S_IFBLK | 0644, makedev(7, 6),    0, 0, {} },
+        { "/dev/block/loop7",  S_IFBLK | 0644, makedev(7, 7),    0, 0, {} },
+    };
 
-    // Create a few loopback devices since some installers expect them to exist,
-    // but don't create them. They are not necessary for mbtool to work.
-    if (log_mkdir(in_chroot("/dev/block").c_str(), 0755) < 0
-            || log_mknod(in_chroot("/dev/block/loop0").c_str(), S_IFBLK | 0644, makedev(7, 0)) < 0
-            || log_mknod(in_chroot("/dev/block/loop1").c_str(), S_IFBLK | 0644, makedev(7, 1)) < 0
-            || log_mknod(in_chroot("/dev/block/loop2").c_str(), S_IFBLK | 0644, makedev(7, 2)) < 0
-            || log_mknod(in_chroot("/dev/block/loop3").c_str(), S_IFBLK | 0644, makedev(7, 3)) < 0
-            || log_mknod(in_chroot("/dev/block/loop4").c_str(), S_IFBLK | 0644, makedev(7, 4)) < 0
-            || log_mknod(in_chroot("/dev/block/loop5").c_str(), S_IFBLK | 0644, makedev(7, 5)) < 0
-            || log_mknod(in_chroot("/dev/block/loop6").c_str(), S_IFBLK | 0644, makedev(7, 6)) < 0
-            || log_mknod(in_chroot("/dev/block/loop7").c_str(), S_IFBLK | 0644, makedev(7, 7)) < 0) {
+    if (!util::create_device_nodes(_chroot, nodes)) {
         return false;
     }
 
@@ -416,22 +408,9 @@ bool Installer::destroy_chroot() const
         dp.reset();
     }
 
-    log_umount(in_chroot("/system").c_str());
-    log_umount(in_chroot("/cache").c_str());
-    log_umount(in_chroot("/data").c_str());
-    log_umount(in_chroot("/efs").c_str());
-
-    log_umount(in_chroot("/dev/pts").c_str());
-    log_umount(in_chroot("/dev").c_str());
-    log_umount(in_chroot("/proc").c_str());
-    log_umount(in_chroot("/sys/fs/selinux").c_str());
-    log_umount(in_chroot("/sys").c_str());
-    log_umount(in_chroot("/tmp").c_str());
-    log_umount(in_chroot("/sbin").c_str());
-
-    log_umount(_chroot.c_str());
-
-    // Unmount everything previously mounted in the chroot
+    // Unmount everything mounted in the chroot. The mount points are ordered
+    // using the mount tree, so nested mounts (eg. /dev/pts) are always
+    // unmounted before their parents.
     if (!util::unmount_all(_chroot)) {
         LOGE("Failed to unmount previous mount points in %s", _chroot.c_str());
         return false;
@@ -515,8 +494,11 @@ bool Installer::mount_efs() const
             "/dev/block/bootdevice/by-name/EFS",
         };
 
+        util::DeviceNode node;
+
         for (auto const &dev : efs_devs) {
-            if (!dev.empty() && stat(dev.c_str(), &sb) == 0
+            if (!dev.empty() && util::device_node_stat(dev, &node)
+                    && S_ISBLK(node.mode)
                     && log_mount(dev.c_str(), in_chroot("/efs").c_str(),
                                  "ext4", MS_RDONLY, "") == 0) {
                 return true;
@@ -534,74 +516,83 @@ bool Installer::mount_efs() const
  */
 bool Installer::extract_multiboot_files()
 {
-    std::vector<util::extract_info> files{
+    // Files with compute_digest set are verified against the ".sig" file
+    // extracted next to them
+    std::vector<ZipExtractInfo> files{
         {
             "META-INF/com/google/android/update-binary.orig",
-            _temp + "/updater"
+            _temp + "/updater",
+            false, {}
         },
         {
             "META-INF/com/google/android/update-binary",
-            _temp + "/mbtool"
+            _temp + "/mbtool",
+            true, {}
         },
         {
             "META-INF/com/google/android/update-binary.sig",
-            _temp + "/mbtool.sig"
+            _temp + "/mbtool.sig",
+            false, {}
         },
         {
             "multiboot/bb-wrapper.sh",
-            _temp + "/bb-wrapper.sh"
+            _temp + "/bb-wrapper.sh",
+            true, {}
         },
         {
             "multiboot/bb-wrapper.sh.sig",
-            _temp + "/bb-wrapper.sh.sig"
+            _temp + "/bb-wrapper.sh.sig",
+            false, {}
         },
         {
             "multiboot/device.json",
-            _temp + "/device.json"
+            _temp + "/device.json",
+            false, {}
         },
         {
             "multiboot/info.prop",
-            _temp + "/info.prop"
+            _temp + "/info.prop",
+            false, {}
         },
     };
 
     std::vector<std::string> binaries{
         "file-contexts-tool",
-        "file-contexts-tool.sig",
         "fsck-wrapper",
-        "fsck-wrapper.sig",
         "mbtool",
-        "mbtool.sig",
         "mount.exfat",
-        "mount.exfat.sig",
     };
 
     for (auto const &binary : binaries) {
         files.push_back({
             "multiboot/binaries/" + binary,
-            _temp + "/binaries/" + binary
+            _temp + "/binaries/" + binary,
+            true, {}
+        });
+        files.push_back({
+            "multiboot/binaries/" + binary + ".sig",
+            _temp + "/binaries/" + binary + ".sig",
+            false, {}
         });
     }
 
-    if (!util::extract_files2(_zip_file, files)) {
+    // The signatures are checked against the digests computed during
+    // extraction, so the files don't need to be read again
+    if (!InstallerUtil::extract_zip_files(_zip_file, files)) {
         LOGE("Failed to extract all multiboot files");
         return false;
     }
 
-    std::vector<std::string> sigcheck{
-        _temp + "/mbtool",
-        _temp + "/bb-wrapper.sh",
-        _temp + "/binaries/file-contexts-tool",
-        _temp + "/binaries/fsck-wrapper",
-        _temp + "/binaries/mbtool",
-        _temp + "/binaries/mount.exfat",
-    };
+    for (auto const &item : files) {
+        if (!item.compute_digest) {
+            continue;
+        }
 
-    for (auto const &item : sigcheck) {
-        SigVerifyResult result =
-                verify_signature(item.c_str(), (item + ".sig").c_str());
+        SigVerifyResult result = verify_signature_digest(
+                item.digest.data(), item.digest.size(), EVP_sha512(),
+                (item.to + ".sig").c_str());
         if (result != SigVerifyResult::VALID) {
-            LOGE("%s: Signature verification failed", item.c_str());
+            LOGE("%s: Signature verification failed", item.to.c_str());
             return false;
         }
     }
@@ -639,8 +630,11 @@ bool Installer::set_up_busybox_wrapper()
  * \brief Create temporary ext4 image
  *
  * \param path Image file path
+ * \param source_dir If not empty, copy the contents of this /system directory
+ *                   (excluding multiboot files) into the new image
  */
-bool Installer::create_image(const std::string &path, uint64_t size)
+bool Installer::create_image(const std::string &path, uint64_t size,
+                             const std::string &source_dir)
 {
     if (!util::mkdir_parent(path, S_IRWXU)) {
         LOGE("%s: Failed to create parent directory: %s",
@@ -648,7 +642,7 @@ bool Installer::create_image(const std::string &path, uint64_t size)
         return false;
     }
 
-    auto result = create_ext4_image(path, size);
+    auto result = create_ext4_image(path, size, source_dir, { "multiboot" });
     if (result == CreateImageResult::NOT_ENOUGH_SPACE) {
         uint64_t avail = util::mount_get_avail_size(util::dir_name(path).c_str());
         display_msg(std::string());
@@ -692,7 +686,12 @@ bool Installer::system_image_copy(const std::string &source,
         return false;
     }
 
-    if (!util::mount(image.c_str(), temp_mnt.c_str(), "auto", 0, "")) {
+    // The image normally has the 4K blocks from create_image(), but the ROM's
+    // installer may have reformatted it. util::mount() retries without direct
+    // I/O if the block size doesn't fit.
+    if (!util::mount(image.c_str(), temp_mnt.c_str(), "auto", 0, "",
+                     util::LOOPDEV_DIRECT_IO
+                     | util::LOOPDEV_BACKING_BLOCK_SIZE)) {
         LOGE("Failed to mount %s: %s", source.c_str(), strerror(errno));
         return false;
     }
@@ -755,7 +754,8 @@ bool Installer::mount_dir_or_image(const std::string &source,
             LOGE("Failed to find unused loop device: %s", strerror(errno));
             return false;
         }
-        if (!util::loopdev_set_up_device(loopdev, source, 0, false)) {
+        if (!util::loopdev_set_up_device(loopdev, source, 0,
+                                         util::LOOPDEV_DIRECT_IO)) {
             LOGE("Failed to attach %s to %s: %s",
                  loopdev.c_str(), source.c_str(), strerror(errno));
             return false;
@@ -1477,23 +1477,16 @@ Installer::ProceedState Installer::install_stage_check_device()
     devs.insert(devs.end(), recovery_devs.begin(), recovery_devs.end());
     devs.insert(devs.end(), extra_devs.begin(), extra_devs.end());
 
-    // Copy block devices to the chroot
-    for (auto const &dev : devs) {
-        std::string dev_path(in_chroot(dev));
+    // Copy block devices to the chroot. Symlinks are followed just in case the
+    // symlink source isn't in the list.
+    std::vector<util::DeviceNode> nodes;
+    util::device_nodes_stat(devs, &nodes);
 
-        if (!util::mkdir_parent(dev_path, 0755)) {
-            LOGW("Failed to create parent directory of %s",
-                 dev_path.c_str());
-        }
-
-        // Follow symlinks just in case the symlink source isn't in the list
-        if (!util::copy_file(dev, dev_path, util::COPY_ATTRIBUTES
-                                          | util::COPY_XATTRS
-                                          | util::COPY_FOLLOW_SYMLINKS)) {
-            LOGW("Failed to copy %s. Continuing anyway", dev.c_str());
-        } else {
-            LOGD("Copied %s to the chroot", dev.c_str());
-        }
+    if (!util::create_device_nodes(_chroot, nodes)) {
+        LOGW("Failed to copy some block devices. Continuing anyway");
+    }
+    for (auto const &node : nodes) {
+        LOGD("Copied %s to the chroot", node.path.c_str());
     }
 
     // Symlink CHROOT_SYSTEM_LOOP_DEV to system block devs
@@ -1682,7 +1675,24 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
         _temp_image_path += "/.system.img.tmp";
         remove(_temp_image_path.c_str());
 
-        if (!create_image(_temp_image_path, system_size)) {
+        // The current /system files are written into the image while it is
+        // being created, so it never needs to be mounted for copying
+        std::string source_dir;
+        if (_copy_to_temp_image) {
+            display_msg("Copying system to temporary image");
+            source_dir = _system_path;
+
+            // The directory does not exist yet on a fresh install
+            struct stat sb;
+            if (stat(source_dir.c_str(), &sb) < 0
+                    && !util::mkdir_recursive(source_dir, 0755)) {
+                LOGE("Failed to create %s: %s",
+                     source_dir.c_str(), strerror(errno));
+                return ProceedState::Fail;
+            }
+        }
+
+        if (!create_image(_temp_image_path, system_size, source_dir)) {
             display_msg("Failed to create temporary image %s",
                         _temp_image_path.c_str());
 
@@ -1696,7 +1706,7 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
                 _temp_image_path += "/.system.img.tmp";
                 remove(_temp_image_path.c_str());
 
-                if (!create_image(_temp_image_path, system_size)) {
+                if (!create_image(_temp_image_path, system_size, source_dir)) {
                     return ProceedState::Fail;
                 }
             } else {
@@ -1704,17 +1714,6 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
             }
         }
 
-        if (_copy_to_temp_image) {
-            display_msg("Copying system to temporary image");
-
-            // Copy current /system files to the image
-            if (!system_image_copy(_system_path, _temp_image_path, false)) {
-                display_msg("Failed to copy %s to %s",
-                            _system_path.c_str(), _temp_image_path.c_str());
-                return ProceedState::Fail;
-            }
-        }
-
         system_is_image = true;
         system_path = _temp_image_path;
     }
@@ -1840,7 +1839,7 @@ Installer::ProceedState Installer::install_stage_unmount_filesystems()
 
     if (_rom->system_is_image) {
         // Run file system checks
-        if (!fsck_ext4_image(_system_path)) {
+        if (!fsck_ext4_image(_system_path, FsckPolicy::IF_NEEDED)) {
             display_msg("Failed to run e2fsck on image");
         }
     } else {
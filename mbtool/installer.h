@@ -123,7 +123,8 @@ private:
 
     bool extract_multiboot_files();
     bool set_up_busybox_wrapper();
-    bool create_image(const std::string &path, uint64_t size);
+    bool create_image(const std::string &path, uint64_t size,
+                      const std::string &source_dir = std::string());
     bool system_image_copy(const std::string &source,
                            const std::string &image, bool reverse);
     bool mount_dir_or_image(const std::string &source,
@@ -19,14 +19,19 @@
 
 #include "installer_util.h"
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <thread>
 
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -43,10 +48,17 @@
 
 #include "mblog/logging.h"
 
+#include "mbutil/archive.h"
 #include "mbutil/delete.h"
+#include "mbutil/directory.h"
 #include "mbutil/finally.h"
+#include "mbutil/hash.h"
 #include "mbutil/path.h"
 
+#include "minizip/ioandroid.h"
+#include "minizip/ioapi_buf.h"
+#include "minizip/unzip.h"
+
 #include "bootimg_util.h"
 #include "multiboot.h"
 
@@ -57,6 +69,12 @@ typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedMbFile;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
 
+#define MAX_EXTRACT_THREADS     4
+#define EXTRACT_BUF_SIZE        (64 * 1024)
+
+// Host system in the upper byte of "version made by"
+#define ZIP_HOST_UNIX           3
+
 namespace mb
 {
 
@@ -686,6 +704,283 @@ bool InstallerUtil::replace_file(const std::string &replace,
     return true;
 }
 
+struct ZipHandle
+{
+    unzFile uf;
+    zlib_filefunc64_def zFunc;
+    ourbuffer_t buf;
+};
+
+// The handle must not be moved after opening since minizip keeps a pointer to
+// the I/O buffer
+static bool open_zip(const std::string &path, ZipHandle *handle)
+{
+    memset(handle, 0, sizeof(*handle));
+
+    fill_android_filefunc64(&handle->buf.filefunc64);
+    fill_buffer_filefunc64(&handle->zFunc, &handle->buf);
+
+    handle->uf = unzOpen2_64(path.c_str(), &handle->zFunc);
+    return handle->uf != nullptr;
+}
+
+static bool write_fully(int fd, const unsigned char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*!
+ * \brief Extract the current file in the zip, hashing the data if requested
+ */
+static bool extract_current_file(unzFile uf, ZipExtractInfo &info,
+                                 std::vector<unsigned char> &buf)
+{
+    unz_file_info64 fi;
+    int ret = unzGetCurrentFileInfo64(uf, &fi, nullptr, 0, nullptr, 0,
+                                      nullptr, 0);
+    if (ret != UNZ_OK) {
+        LOGE("%s: Failed to get file metadata (error code: %d)",
+             info.from.c_str(), ret);
+        return false;
+    }
+
+    // Same default permissions as libarchive when the zip was not created on
+    // a Unix system
+    mode_t mode = 0664;
+    if ((fi.version >> 8) == ZIP_HOST_UNIX && ((fi.external_fa >> 16) & 0777)) {
+        mode = (fi.external_fa >> 16) & 07777;
+    }
+
+    if (!util::mkdir_parent(info.to, 0755)) {
+        LOGE("%s: Failed to create parent directory: %s",
+             info.to.c_str(), strerror(errno));
+        return false;
+    }
+
+    int fd = open(info.to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             info.to.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        if (fd >= 0) {
+            close(fd);
+        }
+    });
+
+    util::MultiHasher hasher;
+
+    if (info.compute_digest && !hasher.init(util::HASH_SHA512)) {
+        LOGE("%s: Failed to initialize digest", info.from.c_str());
+        return false;
+    }
+
+    ret = unzOpenCurrentFile(uf);
+    if (ret != UNZ_OK) {
+        LOGE("%s: Failed to open file in zip (error code: %d)",
+             info.from.c_str(), ret);
+        return false;
+    }
+
+    int n;
+    while ((n = unzReadCurrentFile(uf, buf.data(), buf.size())) > 0) {
+        if (info.compute_digest && !hasher.update(buf.data(), n)) {
+            LOGE("%s: Failed to update digest", info.from.c_str());
+            unzCloseCurrentFile(uf);
+            return false;
+        }
+        if (!write_fully(fd, buf.data(), n)) {
+            LOGE("%s: Failed to write file: %s",
+                 info.to.c_str(), strerror(errno));
+            unzCloseCurrentFile(uf);
+            return false;
+        }
+    }
+
+    // Also verifies the CRC32 checksum
+    ret = unzCloseCurrentFile(uf);
+    if (n != 0 || ret != UNZ_OK) {
+        LOGE("%s: Failed to extract file (error code: %d)",
+             info.from.c_str(), n != 0 ? n : ret);
+        return false;
+    }
+
+    if (fchmod(fd, mode) < 0) {
+        LOGE("%s: Failed to chmod: %s", info.to.c_str(), strerror(errno));
+        return false;
+    }
+
+    int fd_copy = fd;
+    fd = -1;
+    if (close(fd_copy) < 0) {
+        LOGE("%s: Failed to close file: %s", info.to.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (info.compute_digest) {
+        util::Digests digests;
+        if (!hasher.final(digests)) {
+            LOGE("%s: Failed to finalize digest", info.from.c_str());
+            return false;
+        }
+        info.digest.assign(digests.sha512,
+                           digests.sha512 + sizeof(digests.sha512));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract files with util::extract_files2() and hash them afterwards
+ *
+ * Used for zips that util::ZipIndex can't load, such as those with data
+ * prepended to the first entry.
+ */
+static bool extract_zip_files_sequential(const std::string &zip_file,
+                                         std::vector<ZipExtractInfo> &files)
+{
+    std::vector<util::extract_info> infos;
+    infos.reserve(files.size());
+
+    for (auto const &info : files) {
+        infos.push_back({ info.from, info.to });
+    }
+
+    if (!util::extract_files2(zip_file, infos)) {
+        return false;
+    }
+
+    for (ZipExtractInfo &info : files) {
+        if (!info.compute_digest) {
+            continue;
+        }
+
+        util::Digests digests;
+        if (!util::hash_file(info.to, util::HASH_SHA512, 0, digests)) {
+            LOGE("%s: Failed to compute digest: %s",
+                 info.to.c_str(), strerror(errno));
+            return false;
+        }
+
+        info.digest.assign(digests.sha512,
+                           digests.sha512 + sizeof(digests.sha512));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract files from a zip in parallel
+ *
+ * The entries are looked up in a util::ZipIndex of the zip's central
+ * directory, so the compressed data of other files is never read. The files are then
+ * extracted concurrently, each thread using its own zip handle. If
+ * ZipExtractInfo::compute_digest is set, the SHA-512 digest of the data is
+ * computed while it's being written so that the signature can be verified
+ * without reading the file again. Zips that can't be indexed are extracted
+ * sequentially instead.
+ *
+ * \param zip_file Path to zip file
+ * \param files Files to extract. The digest fields are filled in on success.
+ *
+ * \return Whether all files were successfully extracted
+ */
+bool InstallerUtil::extract_zip_files(const std::string &zip_file,
+                                      std::vector<ZipExtractInfo> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    util::ZipIndex index;
+    if (!index.load(zip_file)) {
+        LOGW("%s: Failed to read central directory: %s",
+             zip_file.c_str(), strerror(errno));
+        LOGW("Falling back to sequential extraction");
+        return extract_zip_files_sequential(zip_file, files);
+    }
+
+    std::vector<unz64_file_pos> positions(files.size());
+    bool missing = false;
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        const util::zip_entry_info *entry = index.find(files[i].from);
+        if (!entry) {
+            LOGE("%s: File not found in zip", files[i].from.c_str());
+            missing = true;
+            continue;
+        }
+
+        positions[i].pos_in_zip_directory = entry->cd_offset;
+        positions[i].num_of_file = entry->cd_index;
+    }
+
+    if (missing) {
+        LOGE("Not all specified files were extracted");
+        return false;
+    }
+
+    unsigned int num_threads = std::min<unsigned int>(
+            std::thread::hardware_concurrency(), MAX_EXTRACT_THREADS);
+    num_threads = std::max<unsigned int>(std::min<size_t>(
+            num_threads, files.size()), 1);
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]{
+        ZipHandle handle;
+        if (!open_zip(zip_file, &handle)) {
+            LOGE("%s: Failed to open zip", zip_file.c_str());
+            failed = true;
+            return;
+        }
+
+        auto close_zip = util::finally([&]{
+            unzClose(handle.uf);
+        });
+
+        std::vector<unsigned char> buf(EXTRACT_BUF_SIZE);
+        size_t i;
+
+        while (!failed && (i = next++) < files.size()) {
+            int ret = unzGoToFilePos64(handle.uf, &positions[i]);
+            if (ret != UNZ_OK) {
+                LOGE("%s: Failed to seek to file (error code: %d)",
+                     files[i].from.c_str(), ret);
+                failed = true;
+            } else if (!extract_current_file(handle.uf, files[i], buf)) {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    return !failed;
+}
+
 bool InstallerUtil::copy_file_to_file(MbFile *fin, MbFile *fout,
                                       uint64_t to_copy)
 {
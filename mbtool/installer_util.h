@@ -31,6 +31,18 @@ struct MbFile;
 namespace mb
 {
 
+struct ZipExtractInfo
+{
+    // Path in zip
+    std::string from;
+    // Target path
+    std::string to;
+    // Whether to compute the SHA-512 digest of the data while extracting
+    bool compute_digest;
+    // SHA-512 digest of the extracted data (if compute_digest is true)
+    std::vector<unsigned char> digest;
+};
+
 class InstallerUtil
 {
 public:
@@ -58,6 +70,9 @@ public:
     static bool replace_file(const std::string &replace,
                              const std::string &with);
 
+    static bool extract_zip_files(const std::string &zip_file,
+                                  std::vector<ZipExtractInfo> &files);
+
 private:
     static bool copy_file_to_file(MbFile *fin, MbFile *fout, uint64_t to_copy);
     static bool copy_file_to_file_eof(MbFile *fin, MbFile *fout);
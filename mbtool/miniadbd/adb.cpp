@@ -62,11 +62,29 @@ void fatal_errno(const char *fmt, ...)
     exit(-1);
 }
 
+#define APACKET_POOL_MAX 16
+
+static pthread_mutex_t apacket_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static apacket *apacket_pool = nullptr;
+static size_t apacket_pool_size = 0;
+
 apacket* get_apacket(void)
 {
-    apacket* p = reinterpret_cast<apacket*>(malloc(sizeof(apacket)));
+    apacket* p;
+
+    pthread_mutex_lock(&apacket_pool_lock);
+    p = apacket_pool;
+    if (p) {
+        apacket_pool = p->next;
+        --apacket_pool_size;
+    }
+    pthread_mutex_unlock(&apacket_pool_lock);
+
     if (p == nullptr) {
-      fatal("failed to allocate an apacket");
+        p = reinterpret_cast<apacket*>(malloc(sizeof(apacket)));
+        if (p == nullptr) {
+          fatal("failed to allocate an apacket");
+        }
     }
 
     memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
@@ -75,6 +93,15 @@ apacket* get_apacket(void)
 
 void put_apacket(apacket *p)
 {
+    pthread_mutex_lock(&apacket_pool_lock);
+    if (apacket_pool_size < APACKET_POOL_MAX) {
+        p->next = apacket_pool;
+        apacket_pool = p;
+        ++apacket_pool_size;
+        p = nullptr;
+    }
+    pthread_mutex_unlock(&apacket_pool_lock);
+
     free(p);
 }
 
@@ -183,8 +210,8 @@ void send_connect(atransport *t)
     ADB_LOGD(ADB_CONN, "Calling send_connect");
     apacket *cp = get_apacket();
     cp->msg.command = A_CNXN;
-    cp->msg.arg0 = A_VERSION;
-    cp->msg.arg1 = MAX_PAYLOAD;
+    cp->msg.arg0 = t->protocol_version;
+    cp->msg.arg1 = t->get_max_payload();
     cp->msg.data_length = fill_connect_data((char *)cp->data,
                                             sizeof(cp->data));
     send_packet(cp, t);
@@ -267,6 +294,7 @@ void handle_packet(apacket *p, atransport *t)
             handle_offline(t);
         }
 
+        t->update_version(p->msg.arg0, p->msg.arg1);
         parse_banner(reinterpret_cast<const char*>(p->data), t);
 
         handle_online(t);
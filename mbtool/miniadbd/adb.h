@@ -19,7 +19,12 @@
 
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+// Hosts that don't advertise a larger payload size in their CONNECT message
+// only accept the original 4KiB packets. Newer hosts accept up to 256KiB,
+// which cuts the number of WRITE/OKAY round trips during large transfers.
+#define MAX_PAYLOAD_V1 (4 * 1024)
+#define MAX_PAYLOAD_V2 (256 * 1024)
+#define MAX_PAYLOAD MAX_PAYLOAD_V2
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -29,7 +34,10 @@
 #define A_WRTE 0x45545257
 
 // ADB protocol version.
-#define A_VERSION 0x01000000
+#define A_VERSION_MIN 0x01000000
+// Hosts with this version or newer don't verify or compute data checksums
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+#define A_VERSION 0x01000001
 
 struct atransport;
 struct usb_handle;
@@ -195,7 +203,13 @@ struct atransport
     void *key;
     unsigned char token[TOKEN_SIZE];
 
+        /* negotiated with the host in the CONNECT message */
+    unsigned protocol_version;
+    size_t max_payload;
+
     const char* connection_state_name() const;
+    void update_version(unsigned version, size_t payload);
+    size_t get_max_payload() const;
 };
 
 
@@ -245,7 +259,10 @@ void init_usb_transport(atransport *t, usb_handle *usb, int state);
 
 int service_to_fd(const char *name);
 
-/* packet allocator */
+/* packet allocator
+** packets are large enough for MAX_PAYLOAD, so a few freed packets are kept
+** around to avoid repeatedly mapping and unmapping memory
+*/
 apacket *get_apacket(void);
 void put_apacket(apacket *p);
 
@@ -154,12 +154,196 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
+/* Large transfers are double-buffered so that disk I/O happens on a helper
+** thread while the service thread is moving the previous chunk through the
+** socket (and vice versa). The producer fills free buffers and the consumer
+** drains filled buffers in order.
+*/
+#define SYNC_NUM_BUFFERS 2
+
+struct sync_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buffers[SYNC_NUM_BUFFERS];
+    unsigned lengths[SYNC_NUM_BUFFERS];
+    unsigned head;
+    unsigned count;
+        /* set by the producer when there's no more data */
+    bool finished;
+        /* set by either side to make the other one give up */
+    bool aborted;
+        /* errno of the helper thread's failed I/O operation */
+    int error;
+    int fd;
+    pthread_t thread;
+};
+
+static bool sync_pipeline_init(sync_pipeline *sp, int fd)
+{
+    memset(sp, 0, sizeof(*sp));
+    sp->fd = fd;
+
+    for (int i = 0; i < SYNC_NUM_BUFFERS; ++i) {
+        sp->buffers[i] = reinterpret_cast<char*>(malloc(SYNC_DATA_MAX));
+        if (!sp->buffers[i]) {
+            for (int j = 0; j < i; ++j) {
+                free(sp->buffers[j]);
+            }
+            return false;
+        }
+    }
+
+    pthread_mutex_init(&sp->lock, nullptr);
+    pthread_cond_init(&sp->cond, nullptr);
+    return true;
+}
+
+static void sync_pipeline_destroy(sync_pipeline *sp)
+{
+    pthread_cond_destroy(&sp->cond);
+    pthread_mutex_destroy(&sp->lock);
+    for (int i = 0; i < SYNC_NUM_BUFFERS; ++i) {
+        free(sp->buffers[i]);
+    }
+}
+
+/* Producer: wait for an empty buffer. Returns NULL if the consumer gave up. */
+static char *sync_pipeline_get_free(sync_pipeline *sp)
+{
+    char *buf = nullptr;
+
+    pthread_mutex_lock(&sp->lock);
+    while (!sp->aborted && sp->count == SYNC_NUM_BUFFERS) {
+        pthread_cond_wait(&sp->cond, &sp->lock);
+    }
+    if (!sp->aborted) {
+        buf = sp->buffers[(sp->head + sp->count) % SYNC_NUM_BUFFERS];
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    return buf;
+}
+
+/* Producer: queue the buffer returned by sync_pipeline_get_free() */
+static void sync_pipeline_put(sync_pipeline *sp, unsigned len)
+{
+    pthread_mutex_lock(&sp->lock);
+    sp->lengths[(sp->head + sp->count) % SYNC_NUM_BUFFERS] = len;
+    ++sp->count;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/* Consumer: wait for the next filled buffer. Returns NULL once all data has
+** been consumed or if the producer gave up.
+*/
+static char *sync_pipeline_get_full(sync_pipeline *sp, unsigned *len)
+{
+    char *buf = nullptr;
+
+    pthread_mutex_lock(&sp->lock);
+    while (!sp->aborted && !sp->finished && sp->count == 0) {
+        pthread_cond_wait(&sp->cond, &sp->lock);
+    }
+    if (!sp->aborted && sp->count > 0) {
+        buf = sp->buffers[sp->head];
+        *len = sp->lengths[sp->head];
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    return buf;
+}
+
+/* Consumer: return the buffer from sync_pipeline_get_full() */
+static void sync_pipeline_release(sync_pipeline *sp)
+{
+    pthread_mutex_lock(&sp->lock);
+    sp->head = (sp->head + 1) % SYNC_NUM_BUFFERS;
+    --sp->count;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+static void sync_pipeline_finish(sync_pipeline *sp)
+{
+    pthread_mutex_lock(&sp->lock);
+    sp->finished = true;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+static void sync_pipeline_abort(sync_pipeline *sp, int error)
+{
+    pthread_mutex_lock(&sp->lock);
+    sp->aborted = true;
+    if (error && !sp->error) {
+        sp->error = error;
+    }
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/* Helper thread for do_recv(): read the file into the pipeline */
+static void *sync_file_reader(void *arg)
+{
+    sync_pipeline *sp = reinterpret_cast<sync_pipeline*>(arg);
+    char *buf;
+    int r;
+
+    while ((buf = sync_pipeline_get_free(sp))) {
+        r = adb_read(sp->fd, buf, SYNC_DATA_MAX);
+        if (r < 0) {
+            sync_pipeline_abort(sp, errno);
+            break;
+        } else if (r == 0) {
+            sync_pipeline_finish(sp);
+            break;
+        }
+        sync_pipeline_put(sp, r);
+    }
+
+    return nullptr;
+}
+
+/* Helper thread for handle_send_file(): write the pipeline to the file */
+static void *sync_file_writer(void *arg)
+{
+    sync_pipeline *sp = reinterpret_cast<sync_pipeline*>(arg);
+    char *buf;
+    unsigned len;
+
+    while ((buf = sync_pipeline_get_full(sp, &len))) {
+        if (!WriteFdExactly(sp->fd, buf, len)) {
+            sync_pipeline_abort(sp, errno ? errno : EIO);
+            break;
+        }
+        sync_pipeline_release(sp);
+    }
+
+    return nullptr;
+}
+
+static bool sync_pipeline_start(sync_pipeline *sp, adb_thread_func_t func)
+{
+    // Not detached since the caller needs to wait for the I/O to complete
+    errno = pthread_create(&sp->thread, nullptr, func, sp);
+    return errno == 0;
+}
+
+static void sync_pipeline_join(sync_pipeline *sp)
+{
+    pthread_join(sp->thread, nullptr);
+}
+
 static int handle_send_file(int s, char *path, uid_t uid,
         gid_t gid, mode_t mode, char *buffer, bool do_unlink)
 {
     syncmsg msg;
     unsigned int timestamp = 0;
     int fd;
+    sync_pipeline sp;
+    bool pipelined = false;
 
     fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
     if (fd < 0 && errno == ENOENT) {
@@ -190,10 +374,20 @@ static int handle_send_file(int s, char *path, uid_t uid,
          * by all filesystems. b/12441485
          */
         fchmod(fd, mode);
+
+        // Fall back to writing from this thread if the helper thread can't
+        // be started
+        if (sync_pipeline_init(&sp, fd)) {
+            pipelined = sync_pipeline_start(&sp, sync_file_writer);
+            if (!pipelined) {
+                sync_pipeline_destroy(&sp);
+            }
+        }
     }
 
     for (;;) {
         unsigned int len;
+        char *data = buffer;
 
         if (!ReadFdExactly(s, &msg.data, sizeof(msg.data)))
             goto fail;
@@ -211,13 +405,33 @@ static int handle_send_file(int s, char *path, uid_t uid,
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if (!ReadFdExactly(s, buffer, len))
+
+        if (pipelined) {
+            data = sync_pipeline_get_free(&sp);
+            if (!data) {
+                // The writer failed. Keep reading the remaining data, like
+                // below, but into the regular buffer.
+                data = buffer;
+            }
+        }
+
+        if (!ReadFdExactly(s, data, len))
             goto fail;
 
         if (fd < 0)
             continue;
-        if (!WriteFdExactly(fd, buffer, len)) {
+        if (pipelined && data != buffer) {
+            sync_pipeline_put(&sp, len);
+            continue;
+        }
+        if (pipelined || !WriteFdExactly(fd, buffer, len)) {
             int saved_errno = errno;
+            if (pipelined) {
+                sync_pipeline_join(&sp);
+                saved_errno = sp.error;
+                sync_pipeline_destroy(&sp);
+                pipelined = false;
+            }
             close(fd);
             if (do_unlink) unlink(path);
             fd = -1;
@@ -226,6 +440,23 @@ static int handle_send_file(int s, char *path, uid_t uid,
         }
     }
 
+    if (pipelined) {
+        // Wait for the remaining data to be written
+        sync_pipeline_finish(&sp);
+        sync_pipeline_join(&sp);
+        int error = sp.error;
+        sync_pipeline_destroy(&sp);
+        pipelined = false;
+
+        if (error) {
+            close(fd);
+            if (do_unlink) unlink(path);
+            fd = -1;
+            errno = error;
+            if (fail_errno(s)) return -1;
+        }
+    }
+
     if (fd >= 0) {
         struct utimbuf u;
         close(fd);
@@ -242,6 +473,11 @@ static int handle_send_file(int s, char *path, uid_t uid,
     return 0;
 
 fail:
+    if (pipelined) {
+        sync_pipeline_abort(&sp, 0);
+        sync_pipeline_join(&sp);
+        sync_pipeline_destroy(&sp);
+    }
     if (fd >= 0)
         close(fd);
     if (do_unlink) unlink(path);
@@ -344,6 +580,50 @@ static int do_send(int s, char *path, char *buffer)
     return handle_send_file(s, path, uid, gid, mode, buffer, do_unlink);
 }
 
+static int send_recv_done(int s)
+{
+    syncmsg msg;
+
+    msg.data.id = ID_DONE;
+    msg.data.size = 0;
+    return WriteFdExactly(s, &msg.data, sizeof(msg.data)) ? 0 : -1;
+}
+
+static int do_recv_pipelined(int s, int fd, sync_pipeline *sp)
+{
+    syncmsg msg;
+    char *buf;
+    unsigned len;
+    int ret = 0;
+
+    msg.data.id = ID_DATA;
+
+    while ((buf = sync_pipeline_get_full(sp, &len))) {
+        msg.data.size = htoll(len);
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))
+                || !WriteFdExactly(s, buf, len)) {
+            sync_pipeline_abort(sp, 0);
+            ret = -1;
+            break;
+        }
+        sync_pipeline_release(sp);
+    }
+
+    sync_pipeline_join(sp);
+    int error = sp->error;
+    sync_pipeline_destroy(sp);
+    close(fd);
+
+    if (ret < 0) {
+        return ret;
+    } else if (error) {
+        errno = error;
+        return fail_errno(s);
+    }
+
+    return send_recv_done(s);
+}
+
 static int do_recv(int s, const char *path, char *buffer)
 {
     syncmsg msg;
@@ -355,7 +635,19 @@ static int do_recv(int s, const char *path, char *buffer)
         return 0;
     }
 
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
     msg.data.id = ID_DATA;
+
+    sync_pipeline sp;
+    if (sync_pipeline_init(&sp, fd)) {
+        if (sync_pipeline_start(&sp, sync_file_reader)) {
+            return do_recv_pipelined(s, fd, &sp);
+        }
+        sync_pipeline_destroy(&sp);
+    }
+
+    // Fall back to reading from this thread
     for (;;) {
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if (r <= 0) {
@@ -375,13 +667,7 @@ static int do_recv(int s, const char *path, char *buffer)
 
     close(fd);
 
-    msg.data.id = ID_DONE;
-    msg.data.size = 0;
-    if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))) {
-        return -1;
-    }
-
-    return 0;
+    return send_recv_done(s);
 }
 
 void file_sync_service(int fd, void *cookie)
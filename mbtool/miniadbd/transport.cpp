@@ -17,6 +17,7 @@
 #include "sysdeps.h"
 #include "transport.h"
 
+#include <algorithm>
 #include <cstring>
 
 #include "adb_log.h"
@@ -207,13 +208,20 @@ void send_packet(apacket *p, atransport *t)
 
     p->msg.magic = p->msg.command ^ 0xffffffff;
 
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
-    sum = 0;
-    while (count-- > 0) {
-        sum += *x++;
+    // The checksum is never verified by newer hosts. CONNECT packets still
+    // need one since the host's version isn't known yet.
+    if (t && t->protocol_version >= A_VERSION_SKIP_CHECKSUM
+            && p->msg.command != A_CNXN) {
+        p->msg.data_check = 0;
+    } else {
+        count = p->msg.data_length;
+        x = (unsigned char *) p->data;
+        sum = 0;
+        while (count-- > 0) {
+            sum += *x++;
+        }
+        p->msg.data_check = sum;
     }
-    p->msg.data_check = sum;
 
     print_packet("send", p);
 
@@ -618,6 +626,19 @@ const char* atransport::connection_state_name() const {
     }
 }
 
+void atransport::update_version(unsigned version, size_t payload)
+{
+    protocol_version = std::min(version, static_cast<unsigned>(A_VERSION));
+    max_payload = std::min(payload, static_cast<size_t>(MAX_PAYLOAD));
+    ADB_LOGD(ADB_TSPT, "%s: protocol version 0x%08x, max payload %zu",
+             serial ? serial : "", protocol_version, max_payload);
+}
+
+size_t atransport::get_max_payload() const
+{
+    return max_payload;
+}
+
 void register_usb_transport(usb_handle *usb, const char *serial, const char *devpath, unsigned writeable)
 {
     atransport *t = reinterpret_cast<atransport*>(calloc(1, sizeof(atransport)));
@@ -625,6 +646,8 @@ void register_usb_transport(usb_handle *usb, const char *serial, const char *dev
     ADB_LOGD(ADB_TSPT, "transport: %p init'ing for usb_handle %p (sn='%s')",
              t, usb, serial ? serial : "");
     init_usb_transport(t, usb, (writeable ? CS_OFFLINE : CS_NOPERM));
+    t->protocol_version = A_VERSION_MIN;
+    t->max_payload = MAX_PAYLOAD_V1;
     if (serial) {
         t->serial = strdup(serial);
     }
@@ -657,27 +680,35 @@ void unregister_usb_transport(usb_handle *usb)
     pthread_mutex_unlock(&transport_lock);
 }
 
-int check_header(apacket *p)
+int check_header(apacket *p, atransport *t)
 {
     if (p->msg.magic != (p->msg.command ^ 0xffffffff)) {
         ADB_LOGE(ADB_TSPT, "check_header(): invalid magic");
         return -1;
     }
 
-    if (p->msg.data_length > MAX_PAYLOAD) {
-        ADB_LOGE(ADB_TSPT, "check_header(): %d > MAX_PAYLOAD",
-                 p->msg.data_length);
+    // CONNECT packets are allowed to be larger than the current limit since
+    // the limit is only known once the host's CONNECT packet is received
+    size_t max_payload = p->msg.command == A_CNXN
+            ? MAX_PAYLOAD : t->get_max_payload();
+    if (p->msg.data_length > max_payload) {
+        ADB_LOGE(ADB_TSPT, "check_header(): %u > %zu",
+                 p->msg.data_length, max_payload);
         return -1;
     }
 
     return 0;
 }
 
-int check_data(apacket *p)
+int check_data(apacket *p, atransport *t)
 {
     unsigned count, sum;
     unsigned char *x;
 
+    if (t->protocol_version >= A_VERSION_SKIP_CHECKSUM) {
+        return 0;
+    }
+
     count = p->msg.data_length;
     x = p->data;
     sum = 0;
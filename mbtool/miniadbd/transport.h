@@ -46,8 +46,8 @@ void register_usb_transport(usb_handle* h, const char* serial,
 /* this should only be used for transports with connection_state == CS_NOPERM */
 void unregister_usb_transport(usb_handle* usb);
 
-int check_header(apacket* p);
-int check_data(apacket* p);
+int check_header(apacket* p, atransport* t);
+int check_data(apacket* p, atransport* t);
 
 void send_packet(apacket* p, atransport* t);
 
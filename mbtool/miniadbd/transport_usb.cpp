@@ -26,7 +26,7 @@ static int remote_read(apacket *p, atransport *t)
         return -1;
     }
 
-    if (check_header(p)) {
+    if (check_header(p, t)) {
         ADB_LOGE(ADB_TSPT, "remote usb: check_header failed");
         return -1;
     }
@@ -38,7 +38,7 @@ static int remote_read(apacket *p, atransport *t)
         }
     }
 
-    if (check_data(p)) {
+    if (check_data(p, t)) {
         ADB_LOGE(ADB_TSPT, "remote usb: check_data failed");
         return -1;
     }
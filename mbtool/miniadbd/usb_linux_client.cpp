@@ -16,6 +16,7 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
 #include <cstring>
 
 #include <sys/ioctl.h>
@@ -30,6 +31,13 @@
 #define MAX_PACKET_SIZE_HS      512
 #define MAX_PACKET_SIZE_SS      1024
 
+// With large payloads, individual reads and writes to the endpoints are
+// capped. Some kernels fail writes larger than 16KiB and reads need a
+// physically contiguous kernel buffer, which may not be available for large
+// sizes due to fragmentation.
+#define USB_FFS_MAX_WRITE       (16 * 1024)
+#define USB_FFS_MAX_READ        (16 * 1024)
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
@@ -440,7 +448,8 @@ static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_write(bulk_in, buf + count, length - count);
+        ret = adb_write(bulk_in, buf + count,
+                        std::min<size_t>(length - count, USB_FFS_MAX_WRITE));
         if (ret < 0) {
             if (errno != EINTR)
                 return ret;
@@ -472,7 +481,8 @@ static int bulk_read(int bulk_out, uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_read(bulk_out, buf + count, length - count);
+        ret = adb_read(bulk_out, buf + count,
+                       std::min<size_t>(length - count, USB_FFS_MAX_READ));
         if (ret < 0) {
             if (errno != EINTR) {
                 ADB_LOGE(ADB_USB,
@@ -48,6 +48,7 @@
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fstab.h"
+#include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
@@ -530,7 +531,7 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
             for (const std::string &pattern : patterns) {
                 LOGD("Matching devices against pattern: %s", pattern.c_str());
 
-                for (auto const &pair : devices_map) {
+                for (auto const &pair : *devices_map) {
                     const BlockDevInfo &info = pair.second;
 
                     if (path_matches(pair.first.c_str(), pattern.c_str())) {
@@ -591,7 +592,10 @@ static bool mount_target(const char *source, const char *target, bool bind)
     if (bind) {
         ret = util::mount(source, target, "", MS_BIND, "");
     } else {
-        ret = util::mount(source, target, "auto", 0, "");
+        // Image-backed ROMs are mounted here at every boot. util::mount()
+        // falls back to buffered I/O if direct I/O isn't usable.
+        ret = util::mount(source, target, "auto", 0, "",
+                          util::LOOPDEV_DIRECT_IO);
     }
 
     if (!ret) {
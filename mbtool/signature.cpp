@@ -19,6 +19,8 @@
 
 #include "signature.h"
 
+#include <functional>
+
 #include <cstdlib>
 #include <cstring>
 
@@ -30,6 +32,7 @@
 #include <mblog/logging.h>
 #include <mbsign/mbsign.h>
 #include <mbutil/finally.h>
+#include <mbutil/hash.h>
 
 #include "validcerts.h"
 
@@ -93,43 +96,12 @@ static void openssl_log_errors()
     ERR_print_errors_cb(&log_callback, nullptr);
 }
 
-static SigVerifyResult verify_signature_with_key(const char *path,
-                                                 const char *sig_path,
-                                                 EVP_PKEY *public_key)
-{
-    bool ret = false;
-    bool valid;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_in = nullptr;
-
-    bio_data_in = BIO_new_file(path, "rb");
-    if (!bio_data_in) {
-        LOGE("%s: Failed to open input file", path);
-        openssl_log_errors();
-        goto error;
-    }
-    bio_sig_in = BIO_new_file(sig_path, "rb");
-    if (!bio_sig_in) {
-        LOGE("%s: Failed to open signature file", sig_path);
-        openssl_log_errors();
-        goto error;
-    }
-
-    ret = mb::sign::verify_data(bio_data_in, bio_sig_in, public_key, &valid);
-
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
-
-    return ret ? (valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID)
-            : SigVerifyResult::FAILURE;
-
-error:
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
-    return SigVerifyResult::FAILURE;
-}
-
-SigVerifyResult verify_signature(const char *path, const char *sig_path)
+/*!
+ * \brief Run verification function with the public key of each valid
+ *        certificate until the signature is found to be valid
+ */
+static SigVerifyResult verify_with_valid_certs(
+        const std::function<SigVerifyResult(EVP_PKEY *)> &verify_fn)
 {
     for (const std::string &hex_der : valid_certs) {
         std::string der;
@@ -176,8 +148,7 @@ SigVerifyResult verify_signature(const char *path, const char *sig_path)
             return SigVerifyResult::FAILURE;
         }
 
-        SigVerifyResult result =
-                verify_signature_with_key(path, sig_path, public_key);
+        SigVerifyResult result = verify_fn(public_key);
         if (result == SigVerifyResult::INVALID) {
             // Keep trying ...
             continue;
@@ -189,6 +160,61 @@ SigVerifyResult verify_signature(const char *path, const char *sig_path)
     return SigVerifyResult::INVALID;
 }
 
+/*!
+ * \brief Verify signature of data that was already hashed
+ *
+ * \param digest Message digest of the data
+ * \param digest_size Size of \p digest
+ * \param md_type Digest algorithm used to compute \p digest
+ * \param sig_path Path to signature file
+ */
+SigVerifyResult verify_signature_digest(const unsigned char *digest,
+                                        size_t digest_size,
+                                        const EVP_MD *md_type,
+                                        const char *sig_path)
+{
+    return verify_with_valid_certs([&](EVP_PKEY *public_key)
+            -> SigVerifyResult {
+        BIO *bio_sig_in = BIO_new_file(sig_path, "rb");
+        if (!bio_sig_in) {
+            LOGE("%s: Failed to open signature file", sig_path);
+            openssl_log_errors();
+            return SigVerifyResult::FAILURE;
+        }
+
+        bool valid;
+        bool ret = mb::sign::verify_digest(digest, digest_size, md_type,
+                                           bio_sig_in, public_key, &valid);
+
+        BIO_free(bio_sig_in);
+
+        return ret ? (valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID)
+                : SigVerifyResult::FAILURE;
+    });
+}
+
+/*!
+ * \brief Verify signature of a file
+ *
+ * The file is hashed once and the digest is checked against each valid
+ * certificate, so the file is not reread for every certificate.
+ *
+ * \param path Path to file
+ * \param sig_path Path to signature file
+ */
+SigVerifyResult verify_signature(const char *path, const char *sig_path)
+{
+    mb::util::Digests digests;
+
+    if (!mb::util::hash_file(path, mb::util::HASH_SHA512, mb::util::HASH_MMAP,
+                             digests)) {
+        return SigVerifyResult::FAILURE;
+    }
+
+    return verify_signature_digest(digests.sha512, sizeof(digests.sha512),
+                                   EVP_sha512(), sig_path);
+}
+
 static void sigverify_usage(FILE *stream)
 {
     fprintf(stream,
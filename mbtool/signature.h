@@ -19,6 +19,10 @@
 
 #pragma once
 
+#include <cstddef>
+
+#include <openssl/evp.h>
+
 namespace mb
 {
 
@@ -30,6 +34,10 @@ enum SigVerifyResult
 };
 
 SigVerifyResult verify_signature(const char *path, const char *sig_path);
+SigVerifyResult verify_signature_digest(const unsigned char *digest,
+                                        size_t digest_size,
+                                        const EVP_MD *md_type,
+                                        const char *sig_path);
 
 int sigverify_main(int argc, char *argv[]);
 
@@ -21,6 +21,7 @@
 
 #include <algorithm>
 
+#include <cerrno>
 #include <cstring>
 
 #include <fcntl.h>
@@ -32,6 +33,7 @@
 
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mbdevice/db.h"
 #include "mbdevice/device.h"
 #include "mbdevice/validate.h"
 #include "mbdevice/json.h"
@@ -57,6 +59,33 @@ namespace mb
 
 const char *devices_file = nullptr;
 
+static Device * get_device_from_db(MbDeviceDb *db,
+                                   const char *prop_product_device,
+                                   const char *prop_build_product)
+{
+    for (const char *codename : { prop_product_device, prop_build_product }) {
+        Device *device = mb_device_db_find_by_codename(db, codename);
+        if (!device) {
+            if (errno != ENOENT) {
+                LOGE("Failed to read device database: %s", strerror(errno));
+                return nullptr;
+            }
+            continue;
+        }
+
+        if (mb_device_validate(device) != 0) {
+            LOGW("Skipping invalid device");
+            mb_device_free(device);
+            continue;
+        }
+
+        return device;
+    }
+
+    LOGE("Unknown device: %s", prop_product_device);
+    return nullptr;
+}
+
 static Device * get_device(const char *path)
 {
     char prop_product_device[PROP_VALUE_MAX];
@@ -68,6 +97,19 @@ static Device * get_device(const char *path)
     LOGD("ro.product.device = %s", prop_product_device);
     LOGD("ro.build.product = %s", prop_build_product);
 
+    // Prefer the binary database, which only needs to decode the matching
+    // device. Fall back to parsing the file as JSON.
+    MbDeviceDb *db = mb_device_db_open(path);
+    if (db) {
+        Device *device = get_device_from_db(
+                db, prop_product_device, prop_build_product);
+        mb_device_db_free(db);
+        return device;
+    } else if (errno != EINVAL) {
+        LOGE("%s: Failed to open file: %s", path, strerror(errno));
+        return nullptr;
+    }
+
     std::vector<unsigned char> contents;
     if (!util::file_read_all(path, &contents)) {
         LOGE("%s: Failed to read file: %s", path, strerror(errno));
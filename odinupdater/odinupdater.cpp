@@ -17,6 +17,14 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <cerrno>
@@ -30,6 +38,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+// libmbcommon
+#include "mbcommon/string.h"
+
 // libmbsparse
 #include "mbsparse/sparse.h"
 
@@ -38,10 +49,13 @@
 #include "mbdevice/validate.h"
 
 // libmbutil
+#include "mbutil/archive.h"
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
+#include "mbutil/directory.h"
 #include "mbutil/finally.h"
 #include "mbutil/mount.h"
+#include "mbutil/path.h"
 #include "mbutil/properties.h"
 
 // minizip
@@ -66,13 +80,26 @@
 
 #define EFS_SALES_CODE_FILE     "/efs/imei/mps_code.dat"
 
+#define MAX_CSC_THREADS         4
+
+// Images are flashed through a queue of this many buffers
+#define FLASH_BUFFER_SIZE       (2 * 1024 * 1024)
+#define FLASH_BUFFER_COUNT      4
+#define FLASH_BUFFER_ALIGNMENT  4096
+
 #define PROP_SYSTEM_DEV         "system"
 #define PROP_BOOT_DEV           "boot"
 
 static int interface;
 static int output_fd;
+// Keeps messages from the flashing threads from interleaving
+static std::mutex output_mutex;
 static const char *zip_file;
 
+static mb::util::ZipIndex zip_index;
+static bool zip_index_loaded = false;
+static bool zip_index_attempted = false;
+
 static char sales_code[10];
 static std::string system_block_dev;
 static std::string boot_block_dev;
@@ -83,6 +110,8 @@ void ui_print(const char *fmt, ...)
     va_list ap;
     va_list copy;
 
+    std::lock_guard<std::mutex> lock(output_mutex);
+
     va_start(ap, fmt);
 
     dprintf(output_fd, "ui_print ");
@@ -102,12 +131,14 @@ void ui_print(const char *fmt, ...)
 
 void set_progress(double frac)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     dprintf(output_fd, "set_progress %f\n", frac);
 }
 
 MB_PRINTF(1, 2)
 void error(const char *fmt, ...)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -118,6 +149,7 @@ void error(const char *fmt, ...)
 MB_PRINTF(1, 2)
 void info(const char *fmt, ...)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     va_list ap;
     va_start(ap, fmt);
     vprintf(fmt, ap);
@@ -199,6 +231,42 @@ static bool la_skip_to(archive *a, const char *filename, archive_entry **entry)
     return false;
 }
 
+/*!
+ * \brief Open a zip entry for reading
+ *
+ * The zip's central directory is read once and then used to jump directly to
+ * the requested entry. If the central directory cannot be read, the zip is
+ * read sequentially until the entry is found.
+ */
+static bool la_open_zip_entry(archive *a, const char *filename,
+                              archive_entry **entry)
+{
+    if (!zip_index_attempted) {
+        zip_index_attempted = true;
+        zip_index_loaded = zip_index.load(zip_file);
+        if (!zip_index_loaded) {
+            info("%s: Failed to read central directory: %s",
+                 zip_file, strerror(errno));
+        }
+    }
+
+    if (!zip_index_loaded) {
+        return la_open_zip(a, zip_file) && la_skip_to(a, filename, entry);
+    }
+
+    if (!zip_index.find(filename)) {
+        error("libarchive: Failed to find %s in zip", filename);
+        return false;
+    }
+
+    if (!mb::util::libarchive_open_zip_entry(a, zip_index, filename, entry)) {
+        error("libarchive: Failed to open %s in zip", filename);
+        return false;
+    }
+
+    return true;
+}
+
 static bool load_sales_code()
 {
     int fd = open64(EFS_SALES_CODE_FILE, O_RDONLY | O_CLOEXEC);
@@ -249,12 +317,8 @@ static bool load_block_devs()
             archive_read_free(a);
         });
 
-        if (!la_open_zip(a, zip_file)) {
-            return false;
-        }
-
         archive_entry *entry;
-        if (!la_skip_to(a, DEVICE_JSON_FILE, &entry)) {
+        if (!la_open_zip_entry(a, DEVICE_JSON_FILE, &entry)) {
             return false;
         }
 
@@ -356,181 +420,314 @@ static bool cb_zip_read(void *buf, uint64_t size, uint64_t *bytes_read,
     return true;
 }
 
+typedef std::function<bool(char *buf, size_t size, size_t *bytes_read)>
+        FlashReadCallback;
+
+struct FlashBuffer
+{
+    char *data;
+    size_t size;
+};
+
+/*!
+ * \brief Write a stream to a file or block device
+ *
+ * \p read_cb is called on the current thread to fill buffers, which are written
+ * to \p out_filename on a separate thread. Decompression and writing therefore
+ * happen concurrently, with at most FLASH_BUFFER_COUNT buffers in flight.
+ * Progress is reported from the writer thread.
+ *
+ * Block devices are written with O_DIRECT so that large images don't fill up
+ * the page cache.
+ *
+ * \param out_filename Output path
+ * \param max_bytes Expected size (for progress reporting only)
+ * \param read_cb Callback to fill a buffer. Buffers must be filled completely,
+ *                except at EOF, which is indicated by a partial or empty
+ *                buffer.
+ */
+static bool write_pipelined(const char *out_filename, uint64_t max_bytes,
+                            const FlashReadCallback &read_cb)
+{
+    struct stat sb;
+    bool is_blkdev = stat(out_filename, &sb) == 0 && S_ISBLK(sb.st_mode);
+    bool direct = is_blkdev;
+    int flags = O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE;
+
+    int fd = open64(out_filename, flags | (direct ? O_DIRECT : 0), 0600);
+    if (fd < 0 && direct && errno == EINVAL) {
+        direct = false;
+        fd = open64(out_filename, flags, 0600);
+    }
+    if (fd < 0) {
+        error("%s: Failed to open: %s", out_filename, strerror(errno));
+        return false;
+    }
+
+    auto close_fd = mb::util::finally([&]{
+        close(fd);
+    });
+
+    std::vector<FlashBuffer> buffers(FLASH_BUFFER_COUNT);
+    std::deque<FlashBuffer *> free_queue;
+    std::deque<FlashBuffer *> full_queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    bool failed = false;
+
+    auto free_buffers = mb::util::finally([&]{
+        for (FlashBuffer &buffer : buffers) {
+            free(buffer.data);
+        }
+    });
+
+    for (FlashBuffer &buffer : buffers) {
+        void *data;
+        int ret = posix_memalign(&data, FLASH_BUFFER_ALIGNMENT,
+                                 FLASH_BUFFER_SIZE);
+        if (ret != 0) {
+            error("Failed to allocate buffer: %s", strerror(ret));
+            return false;
+        }
+        buffer.data = static_cast<char *>(data);
+        buffer.size = 0;
+        free_queue.push_back(&buffer);
+    }
+
+    auto writer = [&]{
+        uint64_t cur_bytes = 0;
+        uint64_t old_bytes = 0;
+
+        while (true) {
+            FlashBuffer *buffer;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{
+                    return !full_queue.empty() || done || failed;
+                });
+                if (full_queue.empty() || failed) {
+                    break;
+                }
+                buffer = full_queue.front();
+                full_queue.pop_front();
+            }
+
+            // The last buffer may not be a multiple of the block size
+            if (direct && buffer->size % FLASH_BUFFER_ALIGNMENT != 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = false;
+            }
+
+            char *out_ptr = buffer->data;
+            size_t n = buffer->size;
+            bool ok = true;
+
+            while (n > 0) {
+                ssize_t nwritten = write(fd, out_ptr, n);
+                if (nwritten < 0 && errno == EINVAL && direct) {
+                    // Not supported after all
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                    direct = false;
+                    continue;
+                } else if (nwritten < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    error("%s: Failed to write: %s",
+                          out_filename, strerror(errno));
+                    ok = false;
+                    break;
+                }
+
+                n -= nwritten;
+                out_ptr += nwritten;
+                cur_bytes += nwritten;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_queue.push_back(buffer);
+                if (!ok) {
+                    failed = true;
+                }
+            }
+            cv.notify_all();
+
+            if (!ok) {
+                break;
+            }
+
+            // Rate limit: update progress only after difference exceeds 0.1%
+            if (max_bytes > 0) {
+                double old_ratio = (double) old_bytes / max_bytes;
+                double new_ratio = (double) cur_bytes / max_bytes;
+                if (new_ratio - old_ratio >= 0.001) {
+                    set_progress(new_ratio);
+                    old_bytes = cur_bytes;
+                }
+            }
+        }
+    };
+
+    set_progress(0);
+
+    std::thread writer_thread(writer);
+    bool read_ok = true;
+
+    while (true) {
+        FlashBuffer *buffer;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]{ return !free_queue.empty() || failed; });
+            if (failed) {
+                break;
+            }
+            buffer = free_queue.front();
+            free_queue.pop_front();
+        }
+
+        size_t n;
+        if (!read_cb(buffer->data, FLASH_BUFFER_SIZE, &n)) {
+            read_ok = false;
+            break;
+        }
+
+        buffer->size = n;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (n > 0) {
+                full_queue.push_back(buffer);
+            } else {
+                free_queue.push_back(buffer);
+            }
+        }
+        cv.notify_all();
+
+        if (n < FLASH_BUFFER_SIZE) {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        if (!read_ok) {
+            failed = true;
+        }
+    }
+    cv.notify_all();
+
+    writer_thread.join();
+
+    if (failed) {
+        return false;
+    }
+
+    // Make sure the data actually reaches the device
+    if (is_blkdev && fsync(fd) < 0) {
+        error("%s: Failed to sync: %s", out_filename, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 #if DEBUG_SKIP_FLASH_SYSTEM
 MB_UNUSED
 #endif
 static bool extract_sparse_file(const char *zip_filename,
                                 const char *out_filename)
 {
-    struct SparseCtx *ctx;
-    char buf[10240];
-    uint64_t n;
-    bool sparse_ret;
-    int fd;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = 0;
-    uint64_t old_bytes = 0;
-    double old_ratio;
-    double new_ratio;
-
     archive *a = archive_read_new();
     if (!a) {
         error("Out of memory");
-        goto error;
+        return false;
     }
 
-    if (!la_open_zip(a, zip_file)) {
-        goto error_la_allocated;
-    }
+    auto free_archive = mb::util::finally([&]{
+        archive_read_free(a);
+    });
 
     archive_entry *entry;
-    if (!la_skip_to(a, zip_filename, &entry)) {
-        goto error_la_allocated;
+    if (!la_open_zip_entry(a, zip_filename, &entry)) {
+        return false;
     }
 
-    ctx = sparseCtxNew();
+    SparseCtx *ctx = sparseCtxNew();
     if (!ctx) {
         error("Out of memory");
-        goto error_la_allocated;
+        return false;
     }
 
+    auto free_ctx = mb::util::finally([&]{
+        sparseCtxFree(ctx);
+    });
+
     if (!sparseOpen(ctx, nullptr, nullptr, &cb_zip_read, nullptr, nullptr, a)) {
         error("Failed to open sparse file");
-        goto error_sparse_allocated;
-    }
-
-    fd = open64(out_filename,
-                O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE, 0600);
-    if (fd < 0) {
-        error("%s: Failed to open: %s", out_filename, strerror(errno));
-        goto error_sparse_allocated;
+        return false;
     }
 
+    uint64_t max_bytes = 0;
     sparseSize(ctx, &max_bytes);
 
-    set_progress(0);
-
-    while ((sparse_ret = sparseRead(ctx, buf, sizeof(buf), &n)) && n > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        old_ratio = (double) old_bytes / max_bytes;
-        new_ratio = (double) cur_bytes / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
-        }
+    return write_pipelined(out_filename, max_bytes,
+                           [&](char *buf, size_t size, size_t *bytes_read) {
+        size_t total = 0;
+        uint64_t n;
 
-        char *out_ptr = buf;
-        ssize_t nwritten;
-
-        do {
-            if ((nwritten = write(fd, out_ptr, n)) < 0) {
-                error("%s: Failed to write: %s",
-                      out_filename, strerror(errno));
-                goto error_fd_opened;
+        while (total < size) {
+            if (!sparseRead(ctx, buf + total, size - total, &n)) {
+                error("Failed to read sparse file %s", zip_filename);
+                return false;
+            } else if (n == 0) {
+                break;
             }
+            total += n;
+        }
 
-            n -= nwritten;
-            out_ptr += nwritten;
-            cur_bytes += nwritten;
-        } while (n > 0);
-    }
-    if (!sparse_ret) {
-        error("Failed to read sparse file %s", zip_filename);
-        goto error_fd_opened;
-    }
-
-    close(fd);
-    sparseCtxFree(ctx);
-    archive_read_free(a);
-    return true;
-
-error_fd_opened:
-    close(fd);
-error_sparse_allocated:
-    sparseCtxFree(ctx);
-error_la_allocated:
-    archive_read_free(a);
-error:
-    return false;
+        *bytes_read = total;
+        return true;
+    });
 }
 
 static bool extract_raw_file(const char *zip_filename,
                              const char *out_filename)
 {
-    char buf[10240];
-    la_ssize_t n;
-    int fd;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = 0;
-    uint64_t old_bytes = 0;
-    double old_ratio;
-    double new_ratio;
-
     archive *a = archive_read_new();
     if (!a) {
         error("Out of memory");
-        goto error;
+        return false;
     }
 
-    if (!la_open_zip(a, zip_file)) {
-        goto error_la_allocated;
-    }
+    auto free_archive = mb::util::finally([&]{
+        archive_read_free(a);
+    });
 
     archive_entry *entry;
-    if (!la_skip_to(a, zip_filename, &entry)) {
-        goto error_la_allocated;
+    if (!la_open_zip_entry(a, zip_filename, &entry)) {
+        return false;
     }
 
-    max_bytes = archive_entry_size(entry);
+    uint64_t max_bytes = archive_entry_size(entry);
 
-    fd = open64(out_filename,
-                O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE, 0600);
-    if (fd < 0) {
-        error("%s: Failed to open: %s", out_filename, strerror(errno));
-        goto error_la_allocated;
-    }
+    return write_pipelined(out_filename, max_bytes,
+                           [&](char *buf, size_t size, size_t *bytes_read) {
+        uint64_t n;
 
-    set_progress(0);
-
-    while ((n = archive_read_data(a, buf, sizeof(buf))) > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        old_ratio = (double) old_bytes / max_bytes;
-        new_ratio = (double) cur_bytes / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
+        if (!cb_zip_read(buf, size, &n, a)) {
+            error("libarchive: %s: Failed to read %s",
+                  zip_file, zip_filename);
+            return false;
         }
 
-        char *out_ptr = buf;
-        ssize_t nwritten;
-
-        do {
-            if ((nwritten = write(fd, out_ptr, n)) < 0) {
-                error("%s: Failed to write: %s",
-                      out_filename, strerror(errno));
-                goto error_fd_opened;
-            }
-
-            n -= nwritten;
-            out_ptr += nwritten;
-        } while (n > 0);
-    }
-    if (n != 0) {
-        error("libarchive: %s: Failed to read %s: %s",
-              zip_file, zip_filename, archive_error_string(a));
-        goto error_fd_opened;
-    }
-
-    close(fd);
-    archive_read_free(a);
-    return true;
-
-error_fd_opened:
-    close(fd);
-error_la_allocated:
-    archive_read_free(a);
-error:
-    return false;
+        *bytes_read = n;
+        return true;
+    });
 }
 
 static bool copy_dir_if_exists(const char *source_dir,
@@ -556,7 +753,8 @@ static bool copy_dir_if_exists(const char *source_dir,
     bool ret = mb::util::copy_dir(source_dir, target_dir,
                                   mb::util::COPY_ATTRIBUTES
                                 | mb::util::COPY_XATTRS
-                                | mb::util::COPY_EXCLUDE_TOP_LEVEL);
+                                | mb::util::COPY_EXCLUDE_TOP_LEVEL
+                                | mb::util::COPY_PARALLEL);
     if (!ret) {
         error("Failed to copy %s to %s: %s",
               source_dir, target_dir, strerror(errno));
@@ -601,7 +799,22 @@ static bool apply_multi_csc()
     return true;
 }
 
-static bool flash_csc_zip()
+static void set_up_csc_writer(archive *out)
+{
+    archive_write_disk_set_standard_lookup(out);
+    archive_write_disk_set_options(out, ARCHIVE_EXTRACT_TIME
+                                      | ARCHIVE_EXTRACT_SECURE_SYMLINKS
+                                      | ARCHIVE_EXTRACT_SECURE_NODOTDOT
+                                      | ARCHIVE_EXTRACT_OWNER
+                                      | ARCHIVE_EXTRACT_PERM
+                                      | ARCHIVE_EXTRACT_ACL
+                                      | ARCHIVE_EXTRACT_XATTR
+                                      | ARCHIVE_EXTRACT_FFLAGS
+                                      | ARCHIVE_EXTRACT_MAC_METADATA
+                                      | ARCHIVE_EXTRACT_SPARSE);
+}
+
+static bool flash_csc_zip_sequential()
 {
     archive *matcher;
     archive *in;
@@ -634,17 +847,7 @@ static bool flash_csc_zip()
     archive_read_support_format_zip(in);
 
     // Set up disk writer parameters
-    archive_write_disk_set_standard_lookup(out);
-    archive_write_disk_set_options(out, ARCHIVE_EXTRACT_TIME
-                                      | ARCHIVE_EXTRACT_SECURE_SYMLINKS
-                                      | ARCHIVE_EXTRACT_SECURE_NODOTDOT
-                                      | ARCHIVE_EXTRACT_OWNER
-                                      | ARCHIVE_EXTRACT_PERM
-                                      | ARCHIVE_EXTRACT_ACL
-                                      | ARCHIVE_EXTRACT_XATTR
-                                      | ARCHIVE_EXTRACT_FFLAGS
-                                      | ARCHIVE_EXTRACT_MAC_METADATA
-                                      | ARCHIVE_EXTRACT_SPARSE);
+    set_up_csc_writer(out);
 
     if (archive_read_open_filename(in, TEMP_CSC_ZIP_FILE, 10240)
             != ARCHIVE_OK) {
@@ -713,6 +916,208 @@ error:
     return false;
 }
 
+/*!
+ * \brief Extract the CSC zip's system files on multiple threads
+ *
+ * Directories are created first on a single disk writer. Regular files are
+ * then extracted by a pool of workers, each with its own disk writer, using the
+ * zip index to open entries directly. Symlinks are created afterwards on the
+ * directory writer so that a link never redirects a path that another worker
+ * is writing to. The directory writer is closed last so that libarchive sets
+ * the directories' permissions and timestamps after their contents have been
+ * written.
+ */
+static bool flash_csc_zip_parallel(const mb::util::ZipIndex &index)
+{
+    std::vector<const mb::util::zip_entry_info *> dirs;
+    std::vector<const mb::util::zip_entry_info *> files;
+    std::vector<const mb::util::zip_entry_info *> links;
+    std::unordered_set<std::string> parents;
+
+    for (auto const &entry : index.entries()) {
+        const char *path = entry.name.c_str();
+
+        // Only process system/* paths from zip
+        if (!mb_starts_with(path, "system/")) {
+            info("Skipping %s", path);
+            continue;
+        }
+
+        // Only the last of any duplicate entries is extracted
+        if (index.find(entry.name) != &entry) {
+            continue;
+        }
+
+        // The mode from the central directory is 0 if the zip was not created
+        // on a Unix system
+        mode_t mode = mb::util::zip_entry_mode(entry);
+
+        if (mb_ends_with(path, "/") || S_ISDIR(mode)) {
+            dirs.push_back(&entry);
+        } else if (S_ISLNK(mode)) {
+            links.push_back(&entry);
+            parents.insert(mb::util::dir_name(entry.name));
+        } else {
+            files.push_back(&entry);
+            parents.insert(mb::util::dir_name(entry.name));
+        }
+    }
+
+    // Parent directories sort before their children
+    std::sort(dirs.begin(), dirs.end(),
+              [](const mb::util::zip_entry_info *a,
+                 const mb::util::zip_entry_info *b) {
+        return a->name < b->name;
+    });
+
+    archive *dir_out = archive_write_disk_new();
+    if (!dir_out) {
+        error("libarchive: Out of memory when creating disk writer");
+        return false;
+    }
+
+    auto free_dir_out = mb::util::finally([&]{
+        archive_write_free(dir_out);
+    });
+
+    set_up_csc_writer(dir_out);
+
+    // Serializes output from the workers
+    std::mutex log_mutex;
+
+    auto extract_entry = [&](const mb::util::zip_entry_info *zip_entry,
+                             archive *out) {
+        archive *in = archive_read_new();
+        if (!in) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            error("libarchive: Out of memory when creating archive reader");
+            return false;
+        }
+
+        auto free_in = mb::util::finally([&]{
+            archive_read_free(in);
+        });
+
+        archive_entry *entry;
+        if (!mb::util::libarchive_open_zip_entry(in, index, zip_entry->name,
+                                                 &entry)) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            error("libarchive: %s: Failed to open %s",
+                  TEMP_CSC_ZIP_FILE, zip_entry->name.c_str());
+            return false;
+        }
+
+        if (archive_read_extract2(in, entry, out) != ARCHIVE_OK) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            error("%s: %s", zip_entry->name.c_str(), archive_error_string(in));
+            return false;
+        }
+
+        return true;
+    };
+
+    for (const mb::util::zip_entry_info *entry : dirs) {
+        info("Extracting %s", entry->name.c_str());
+
+        if (!extract_entry(entry, dir_out)) {
+            return false;
+        }
+    }
+
+    // Directories that only exist implicitly in the zip
+    for (const std::string &parent : parents) {
+        if (!mb::util::mkdir_recursive(parent, 0755)) {
+            error("%s: Failed to create directory: %s",
+                  parent.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]{
+        archive *out = archive_write_disk_new();
+        if (!out) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            error("libarchive: Out of memory when creating disk writer");
+            failed = true;
+            return;
+        }
+
+        set_up_csc_writer(out);
+
+        size_t i;
+        while (!failed && (i = next++) < files.size()) {
+            {
+                std::lock_guard<std::mutex> lock(log_mutex);
+                info("Extracting %s", files[i]->name.c_str());
+            }
+
+            if (!extract_entry(files[i], out)) {
+                failed = true;
+            }
+        }
+
+        if (archive_write_close(out) != ARCHIVE_OK) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            error("libarchive: Failed to close disk writer: %s",
+                  archive_error_string(out));
+            failed = true;
+        }
+
+        archive_write_free(out);
+    };
+
+    unsigned int n_threads = std::min<size_t>(std::max(
+            std::thread::hardware_concurrency(), 1u), MAX_CSC_THREADS);
+    n_threads = std::max<size_t>(std::min<size_t>(n_threads, files.size()), 1);
+
+    info("Extracting %zu files using %u threads", files.size(), n_threads);
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    if (failed) {
+        return false;
+    }
+
+    for (const mb::util::zip_entry_info *entry : links) {
+        info("Extracting %s", entry->name.c_str());
+
+        if (!extract_entry(entry, dir_out)) {
+            return false;
+        }
+    }
+
+    if (archive_write_close(dir_out) != ARCHIVE_OK) {
+        error("libarchive: Failed to close disk writer: %s",
+              archive_error_string(dir_out));
+        return false;
+    }
+
+    return true;
+}
+
+static bool flash_csc_zip()
+{
+    mb::util::ZipIndex index;
+
+    if (!index.load(TEMP_CSC_ZIP_FILE)) {
+        info("%s: Failed to read central directory: %s",
+             TEMP_CSC_ZIP_FILE, strerror(errno));
+        return flash_csc_zip_sequential();
+    }
+
+    return flash_csc_zip_parallel(index);
+}
+
 static bool flash_csc()
 {
     int status;